@@ -0,0 +1,17 @@
+#!/bin/sh
+# Create the compressed samples used by the bled benchmarks from the raw corpora
+# that 'rufus --bench=DIR' writes to DIR when some of the samples are missing.
+# Usage: mksamples.sh DIR
+
+DIR=${1:-.}
+for f in "$DIR"/*.bin; do
+  [ -f "$f" ] || { echo "No corpus found in '$DIR' - run 'rufus --bench=$DIR' first"; exit 1; }
+  s="${f%.bin}"
+  gzip -6 -n -c "$f" > "$s.gz"
+  bzip2 -9 -c "$f" > "$s.bz2"
+  lzma -6 -c "$f" > "$s.lzma"
+  # The embedded xz decoder only supports CRC32 integrity checks
+  xz -6 --check=crc32 -c "$f" > "$s.xz"
+  zstd -q -3 -c "$f" > "$s.zst"
+  rm "$f"
+done
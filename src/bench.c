@@ -0,0 +1,730 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Codec, hash and CRC benchmarks
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Memory leaks detection - define _CRTDBG_MAP_ALLOC as preprocessor macro */
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <inttypes.h>
+#include <intrin.h>
+
+#include "rufus.h"
+#include "missing.h"
+#include "msapi_utf8.h"
+#include "transcode.h"
+
+#include "wimlib.h"
+#include "bled/bled.h"
+
+/*
+ * The benchmarks run the same entry points as the ones production code uses, on
+ * deterministic corpora, and report the throughput of each codec/path/corpus
+ * combination along with the number of TSC ticks per byte, when available.
+ * The results are also written to <dir>\results.txt, in the same format as the
+ * <dir>\baseline.txt they are compared against, so that a new baseline can be
+ * recorded by copying the former over the latter.
+ *
+ * Since bled has no compressors, the compressed samples it decodes must be produced
+ * from the raw corpora, which get written to <dir>\<corpus>.bin whenever a sample is
+ * missing, by running res/bench/mksamples.sh (which requires gzip, bzip2, lzma, xz
+ * and zstd), then running the benchmarks again.
+ *
+ * Results without a baseline entry, and baseline entries without a result, count as
+ * failures, so that a regression check can't silently end up comparing nothing.
+ */
+
+#define BENCH_CORPUS_SIZE       (4 * MB)
+#define BENCH_CHUNK_SIZE        (64 * KB)	// Same as the buffer size used by HashThread()
+#define BENCH_MIN_RUNS          3
+#define BENCH_MAX_RUNS          1000
+#define BENCH_MIN_TIME          500		// in ms
+#define BENCH_MAX_RESULTS       256
+#define BENCH_DEFAULT_TOLERANCE 10.0	// in percent
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define BENCH_HAS_TSC
+#endif
+#if defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM64) || defined(__i386__) || defined(__x86_64__) || defined(__aarch64__)
+#define BENCH_HAS_WIMLIB_DISPATCH
+// From wimlib/cpu_features.h, which we can't include as it requires the wimlib config
+extern uint32_t cpu_features;
+#endif
+
+// From bled/libbb.h and ext2fs/ext2fs.h, which we don't want to pull in here
+extern uint32_t* crc32_filltable(uint32_t* crc_table, int endian);
+extern uint32_t crc32_le(uint32_t crc, unsigned char const* p, size_t len, uint32_t* crc32table_le);
+extern uint32_t ext2fs_crc32c_le(uint32_t crc, unsigned char const* p, size_t len);
+
+extern BOOL cpu_has_sha1_accel, cpu_has_sha256_accel;
+
+typedef struct {
+	char name[64];
+	double mbps;
+	double cpb;
+	BOOL compared;
+} bench_result;
+
+typedef struct {
+	const uint8_t* src;
+	size_t src_len;
+	uint8_t* dst;
+	size_t dst_len;
+	int type;
+	// wimlib chunks
+	uint32_t num_chunks;
+	uint32_t chunk_size;
+	uint8_t** chunk;
+	uint32_t* chunk_len;
+	struct wimlib_decompressor* decompressor;
+	uint32_t* crc_table;
+} bench_ctx;
+
+typedef BOOL (*bench_fn)(bench_ctx* ctx);
+
+static const char* hash_bench_name[HASH_MAX] = { "md5", "sha1", "sha256", "sha512" };
+static const struct {
+	const char* name;
+	const char* ext;
+	int type;
+} bled_codec[] = {
+	{ "gzip", "gz", BLED_COMPRESSION_GZIP },
+	{ "bzip2", "bz2", BLED_COMPRESSION_BZIP2 },
+	{ "lzma", "lzma", BLED_COMPRESSION_LZMA },
+	{ "xz", "xz", BLED_COMPRESSION_XZ },
+	{ "zstd", "zst", BLED_COMPRESSION_ZSTD },
+};
+static const struct {
+	const char* name;
+	enum wimlib_compression_type ctype;
+	uint32_t chunk_size;	// Default WIM chunk size for each compression type
+	BOOL has_dispatch;
+} wim_codec[] = {
+	{ "xpress", WIMLIB_COMPRESSION_TYPE_XPRESS, 32 * KB, FALSE },
+	{ "lzx", WIMLIB_COMPRESSION_TYPE_LZX, 32 * KB, FALSE },
+	{ "lzms", WIMLIB_COMPRESSION_TYPE_LZMS, 1 * MB, TRUE },
+};
+static const char* bench_words[] = {
+	"the", "of", "and", "to", "a", "in", "is", "it", "you", "that", "he", "was", "for", "on",
+	"are", "with", "as", "his", "they", "be", "at", "one", "have", "this", "from", "or", "had",
+	"by", "not", "but", "what", "some", "we", "can", "out", "other", "were", "all", "there",
+	"when", "up", "use", "your", "how", "said", "each", "which", "their", "time", "will",
+	"drive", "partition", "boot", "image", "sector", "volume", "install", "kernel", "loader",
+	"device", "format", "system", "update", "version",
+};
+// Common x86 instruction patterns, used to make the binary corpus look like code
+static const struct {
+	uint8_t len;
+	uint8_t imm;	// Size of the immediate that follows
+	uint8_t op[5];
+} bench_opcodes[] = {
+	{ 3, 0, { 0x48, 0x8b, 0x45 } }, { 3, 0, { 0x48, 0x89, 0x45 } }, { 1, 4, { 0xe8 } },
+	{ 5, 0, { 0x0f, 0x1f, 0x44, 0x00, 0x00 } }, { 1, 0, { 0xc3 } }, { 1, 0, { 0x55 } },
+	{ 3, 1, { 0x48, 0x83, 0xec } }, { 3, 1, { 0x48, 0x83, 0xc4 } }, { 2, 0, { 0x31, 0xc0 } },
+	{ 2, 1, { 0x74, 0x00 } }, { 2, 4, { 0x0f, 0x84 } }, { 3, 0, { 0x48, 0x85, 0xc0 } },
+	{ 1, 4, { 0xb8 } }, { 3, 0, { 0x48, 0x8d, 0x4c } }, { 2, 0, { 0xff, 0xd0 } }, { 1, 0, { 0xcc } },
+};
+
+static bench_result results[BENCH_MAX_RESULTS];
+static int num_results;
+
+/* xorshift64*, so that the corpora are the same on every platform and compiler */
+static __inline uint64_t bench_rand(uint64_t* state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static size_t gen_text(uint8_t* buf, size_t len, uint64_t* state)
+{
+	size_t i = 0, n;
+	uint64_t r;
+	BOOL capitalize = TRUE;
+	const char* w;
+
+	while (i < len) {
+		r = bench_rand(state);
+		// Skew the distribution towards the first words, as in natural language
+		w = bench_words[(r & 0xffff) % (1 + ((r >> 16) & 0xffff) % ARRAYSIZE(bench_words))];
+		n = min(strlen(w), len - i);
+		memcpy(&buf[i], w, n);
+		if (capitalize)
+			buf[i] = (uint8_t)toupper(buf[i]);
+		i += n;
+		capitalize = FALSE;
+		if (i >= len)
+			break;
+		switch ((r >> 32) % 16) {
+		case 0:
+			buf[i++] = '.';
+			capitalize = TRUE;
+			break;
+		case 1:
+			buf[i++] = ',';
+			break;
+		case 2:
+			if ((r >> 40) % 4 == 0) {
+				buf[i++] = '.';
+				if (i < len)
+					buf[i++] = '\n';
+				capitalize = TRUE;
+				continue;
+			}
+			break;
+		}
+		if (i < len)
+			buf[i++] = ' ';
+	}
+	return len;
+}
+
+static size_t gen_binary(uint8_t* buf, size_t len, uint64_t* state)
+{
+	size_t i = 0, j, k;
+	uint64_t r;
+
+	while (i < len) {
+		r = bench_rand(state);
+		if (((r & 0xff) < 8) && (i + 4 <= len)) {
+			// Relocation or import table: increasing 32-bit values
+			uint32_t v = (uint32_t)(r >> 32) & 0x00fffff0;
+			for (k = 0; (k < 64) && (i + 4 <= len); k++, i += 4) {
+				v += (uint32_t)((bench_rand(state) & 0x3f) + 4);
+				memcpy(&buf[i], &v, 4);
+			}
+			continue;
+		}
+		j = (r >> 8) % ARRAYSIZE(bench_opcodes);
+		for (k = 0; (k < bench_opcodes[j].len) && (i < len); k++)
+			buf[i++] = bench_opcodes[j].op[k];
+		// Immediates and displacements tend to be small values
+		for (k = 0; (k < bench_opcodes[j].imm) && (i < len); k++)
+			buf[i++] = ((k == 0) || (((r >> 24) & 0x07) == 0)) ? (uint8_t)(r >> (16 + 8 * k)) : 0;
+		if (((r >> 56) & 0x07) == 0 && (i < len))
+			buf[i++] = (uint8_t)(r >> 48);
+	}
+	return len;
+}
+
+static size_t gen_random(uint8_t* buf, size_t len, uint64_t* state)
+{
+	size_t i;
+	uint64_t r;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		r = bench_rand(state);
+		memcpy(&buf[i], &r, 8);
+	}
+	for (r = bench_rand(state); i < len; i++, r >>= 8)
+		buf[i] = (uint8_t)r;
+	return len;
+}
+
+/* A sparse image, mostly made of zeroes, with a few data sectors here and there */
+static size_t gen_zero(uint8_t* buf, size_t len, uint64_t* state)
+{
+	size_t i;
+
+	memset(buf, 0, len);
+	for (i = 0; i + 512 <= len; i += 512) {
+		if ((bench_rand(state) & 0x0f) == 0)
+			gen_random(&buf[i], 512, state);
+	}
+	return len;
+}
+
+/* An ISO-like image: a system area, a volume descriptor and a set of sector aligned files */
+static size_t gen_iso(uint8_t* buf, size_t len, uint64_t* state)
+{
+	size_t i = 16 * 2048, n;
+	uint64_t r;
+
+	memset(buf, 0, len);
+	if (len < i + 2048)
+		return gen_random(buf, len, state);
+	buf[i] = 0x01;
+	memcpy(&buf[i + 1], "CD001", 5);
+	buf[i + 6] = 0x01;
+	memcpy(&buf[i + 40], "BENCH_ISO", 9);
+	i += 2048;
+	while (i < len) {
+		r = bench_rand(state);
+		n = min((size_t)((r & 0xff) + 1) * 2048 - ((r >> 8) & 0x7ff), len - i);
+		switch ((r >> 24) % 20) {
+		case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7: case 8: case 9:
+			// Already compressed content (squashfs, .cab, .wim, ...)
+			gen_random(&buf[i], n, state);
+			break;
+		case 10: case 11: case 12: case 13: case 14:
+			gen_text(&buf[i], n, state);
+			break;
+		case 15: case 16: case 17:
+			gen_binary(&buf[i], n, state);
+			break;
+		default:
+			break;
+		}
+		// Files are padded to the next sector
+		i += (n + 2047) & ~(size_t)2047;
+	}
+	return len;
+}
+
+static const struct {
+	const char* name;
+	size_t (*generate)(uint8_t* buf, size_t len, uint64_t* state);
+} corpus_generator[] = {
+	{ "text", gen_text },
+	{ "binary", gen_binary },
+	{ "zero", gen_zero },
+	{ "iso", gen_iso },
+};
+
+static __inline uint64_t bench_cycles(void)
+{
+#if defined(BENCH_HAS_TSC)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Run 'fn' repeatedly, for at least BENCH_MIN_TIME ms and BENCH_MIN_RUNS runs, and
+ * record the best run. Note that the TSC runs at a constant rate on modern CPUs, so
+ * the "cycles" are reference cycles, which only match core cycles at nominal clock.
+ */
+static BOOL bench_run(const char* group, const char* algo, const char* path, const char* corpus,
+	bench_fn fn, bench_ctx* ctx, uint64_t bytes)
+{
+	LARGE_INTEGER freq, t0, t1;
+	uint64_t c0, c1, best_ticks = UINT64_MAX, best_cycles = 0, start = GetTickCount64();
+	int runs;
+	bench_result* res;
+
+	QueryPerformanceFrequency(&freq);
+	for (runs = 0; (runs < BENCH_MIN_RUNS) || ((GetTickCount64() - start < BENCH_MIN_TIME) && (runs < BENCH_MAX_RUNS)); runs++) {
+		QueryPerformanceCounter(&t0);
+		c0 = bench_cycles();
+		if (!fn(ctx)) {
+			printf("%s.%s.%s.%s: FAILED\n", group, algo, path, corpus);
+			return FALSE;
+		}
+		c1 = bench_cycles();
+		QueryPerformanceCounter(&t1);
+		if ((uint64_t)(t1.QuadPart - t0.QuadPart) < best_ticks) {
+			best_ticks = (uint64_t)(t1.QuadPart - t0.QuadPart);
+			best_cycles = c1 - c0;
+		}
+	}
+	if (num_results >= BENCH_MAX_RESULTS)
+		return TRUE;
+	res = &results[num_results++];
+	static_sprintf(res->name, "%s.%s.%s.%s", group, algo, path, corpus);
+	res->compared = FALSE;
+	res->mbps = ((double)bytes / (double)MB) / ((double)max(best_ticks, 1) / (double)freq.QuadPart);
+	res->cpb = (double)best_cycles / (double)bytes;
+#if defined(BENCH_HAS_TSC)
+	printf("%-40s %10.1f MB/s %8.2f cycles/byte\n", res->name, res->mbps, res->cpb);
+#else
+	printf("%-40s %10.1f MB/s\n", res->name, res->mbps);
+#endif
+	return TRUE;
+}
+
+static BOOL bench_hash(bench_ctx* ctx)
+{
+	HASH_CONTEXT hash_ctx;
+	size_t i;
+
+	hash_init[ctx->type](&hash_ctx);
+	for (i = 0; i < ctx->src_len; i += BENCH_CHUNK_SIZE)
+		hash_write[ctx->type](&hash_ctx, &ctx->src[i], min(BENCH_CHUNK_SIZE, ctx->src_len - i));
+	hash_final[ctx->type](&hash_ctx);
+	return TRUE;
+}
+
+static BOOL bench_crc32(bench_ctx* ctx)
+{
+	volatile uint32_t crc = crc32_le(0xffffffff, ctx->src, ctx->src_len, ctx->crc_table);
+	(void)crc;
+	return TRUE;
+}
+
+static BOOL bench_crc32c(bench_ctx* ctx)
+{
+	volatile uint32_t crc = ext2fs_crc32c_le(~0, ctx->src, ctx->src_len);
+	(void)crc;
+	return TRUE;
+}
+
+static BOOL bench_bled(bench_ctx* ctx)
+{
+	return (bled_uncompress_from_buffer_to_buffer((const char*)ctx->src, ctx->src_len,
+		(char*)ctx->dst, ctx->dst_len, ctx->type) == (int64_t)ctx->dst_len);
+}
+
+/* Chunks that wimlib couldn't compress are stored as is in a WIM, so we skip them */
+static BOOL bench_wim(bench_ctx* ctx)
+{
+	uint32_t i;
+	size_t len;
+
+	for (i = 0; i < ctx->num_chunks; i++) {
+		len = min(ctx->chunk_size, ctx->dst_len - (size_t)i * ctx->chunk_size);
+		if ((ctx->chunk_len[i] != 0) && (wimlib_decompress(ctx->chunk[i], ctx->chunk_len[i],
+			&ctx->dst[(size_t)i * ctx->chunk_size], len, ctx->decompressor) != 0))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static BOOL bench_utf8_to_utf16(bench_ctx* ctx)
+{
+	return (utf8_to_utf16le((const char*)ctx->src, ctx->src_len, (uint16_t*)ctx->dst) != TRANSCODE_INVALID);
+}
+
+static BOOL bench_utf16_to_utf8(bench_ctx* ctx)
+{
+	return (utf16le_to_utf8((const uint16_t*)ctx->src, ctx->src_len / sizeof(uint16_t), (char*)ctx->dst) != TRANSCODE_INVALID);
+}
+
+static int bench_hashes(const uint8_t* corpus, const char* corpus_name)
+{
+	bench_ctx ctx = { 0 };
+	BOOL sha1_accel = cpu_has_sha1_accel, sha256_accel = cpu_has_sha256_accel;
+	int r = 0;
+
+	ctx.src = corpus;
+	ctx.src_len = BENCH_CORPUS_SIZE;
+	for (ctx.type = 0; ctx.type < HASH_MAX; ctx.type++) {
+		cpu_has_sha1_accel = FALSE;
+		cpu_has_sha256_accel = FALSE;
+		r += !bench_run("hash", hash_bench_name[ctx.type], "generic", corpus_name, bench_hash, &ctx, ctx.src_len);
+		if (((ctx.type == HASH_SHA1) && sha1_accel) || ((ctx.type == HASH_SHA256) && sha256_accel)) {
+			cpu_has_sha1_accel = sha1_accel;
+			cpu_has_sha256_accel = sha256_accel;
+			r += !bench_run("hash", hash_bench_name[ctx.type], "accel", corpus_name, bench_hash, &ctx, ctx.src_len);
+		}
+	}
+	cpu_has_sha1_accel = sha1_accel;
+	cpu_has_sha256_accel = sha256_accel;
+	return r;
+}
+
+static int bench_crcs(const uint8_t* corpus, const char* corpus_name)
+{
+	bench_ctx ctx = { 0 };
+	int r = 0;
+
+	ctx.src = corpus;
+	ctx.src_len = BENCH_CORPUS_SIZE;
+	ctx.crc_table = crc32_filltable(NULL, 0);
+	if (ctx.crc_table != NULL)
+		r += !bench_run("crc", "crc32", "default", corpus_name, bench_crc32, &ctx, ctx.src_len);
+	r += !bench_run("crc", "crc32c", "default", corpus_name, bench_crc32c, &ctx, ctx.src_len);
+	free(ctx.crc_table);
+	return r;
+}
+
+/* Only the corpora that are valid UTF-8 are transcoded */
+static int bench_utf(const uint8_t* corpus, const char* corpus_name, uint8_t* dst)
+{
+	bench_ctx ctx = { 0 };
+	uint16_t* wbuf = NULL;
+	size_t wlen;
+	bool use_simd = transcode_use_simd;
+	int i, r = 0;
+
+	if (!utf8_validate((const char*)corpus, BENCH_CORPUS_SIZE))
+		return 0;
+	wbuf = malloc(UTF16_MAX_FROM_UTF8(BENCH_CORPUS_SIZE) * sizeof(uint16_t));
+	if (wbuf == NULL)
+		return 1;
+	wlen = utf8_to_utf16le((const char*)corpus, BENCH_CORPUS_SIZE, wbuf);
+	if ((wlen == TRANSCODE_INVALID) || (utf16le_to_utf8(wbuf, wlen, (char*)dst) != BENCH_CORPUS_SIZE) ||
+		(memcmp(dst, corpus, BENCH_CORPUS_SIZE) != 0)) {
+		printf("utf.%s: round trip FAILED\n", corpus_name);
+		free(wbuf);
+		return 1;
+	}
+	for (i = 0; i < 2; i++) {
+		transcode_use_simd = (i != 0);
+		if (transcode_use_simd && (strcmp(transcode_simd_name(), "none") == 0))
+			break;
+		ctx.src = corpus;
+		ctx.src_len = BENCH_CORPUS_SIZE;
+		ctx.dst = (uint8_t*)wbuf;
+		r += !bench_run("utf", "utf8to16", transcode_use_simd ? "simd" : "scalar", corpus_name,
+			bench_utf8_to_utf16, &ctx, ctx.src_len);
+		ctx.src = (const uint8_t*)wbuf;
+		ctx.src_len = wlen * sizeof(uint16_t);
+		ctx.dst = dst;
+		r += !bench_run("utf", "utf16to8", transcode_use_simd ? "simd" : "scalar", corpus_name,
+			bench_utf16_to_utf8, &ctx, ctx.src_len);
+	}
+	transcode_use_simd = use_simd;
+	free(wbuf);
+	return r;
+}
+
+static int bench_bled_codecs(const char* dir, const uint8_t* corpus, const char* corpus_name, uint8_t* dst)
+{
+	bench_ctx ctx = { 0 };
+	char path[MAX_PATH];
+	uint8_t* sample;
+	uint32_t size;
+	BOOL missing = FALSE;
+	int i, r = 0;
+
+	ctx.dst = dst;
+	ctx.dst_len = BENCH_CORPUS_SIZE;
+	for (i = 0; i < ARRAYSIZE(bled_codec); i++) {
+		static_sprintf(path, "%s\\%s.%s", dir, corpus_name, bled_codec[i].ext);
+		size = read_file(path, &sample);
+		if (size == 0) {
+			printf("%-40s skipped (no sample)\n", path);
+			missing = TRUE;
+			continue;
+		}
+		ctx.src = sample;
+		ctx.src_len = size;
+		ctx.type = bled_codec[i].type;
+		// Make sure the sample was produced from the current corpus
+		memset(dst, 0, BENCH_CORPUS_SIZE);
+		if (!bench_bled(&ctx) || (memcmp(dst, corpus, BENCH_CORPUS_SIZE) != 0)) {
+			printf("%-40s does not decode to the '%s' corpus - please regenerate it\n", path, corpus_name);
+			r++;
+		} else {
+			r += !bench_run("bled", bled_codec[i].name, "default", corpus_name, bench_bled, &ctx, ctx.dst_len);
+		}
+		free(sample);
+	}
+	if (missing) {
+		static_sprintf(path, "%s\\%s.bin", dir, corpus_name);
+		if (write_file(path, corpus, BENCH_CORPUS_SIZE) == BENCH_CORPUS_SIZE)
+			printf("Wrote '%s': run res/bench/mksamples.sh to create the missing samples\n", path);
+	}
+	return r;
+}
+
+static int bench_wim_codecs(const uint8_t* corpus, const char* corpus_name, uint8_t* dst)
+{
+	bench_ctx ctx = { 0 };
+	struct wimlib_compressor* compressor = NULL;
+	uint32_t i, j;
+#if defined(BENCH_HAS_WIMLIB_DISPATCH)
+	uint32_t saved_features;
+#endif
+	size_t len;
+	int r = 0;
+
+	ctx.dst = dst;
+	ctx.dst_len = BENCH_CORPUS_SIZE;
+	for (i = 0; i < ARRAYSIZE(wim_codec); i++) {
+		ctx.chunk_size = wim_codec[i].chunk_size;
+		ctx.num_chunks = (uint32_t)((BENCH_CORPUS_SIZE + ctx.chunk_size - 1) / ctx.chunk_size);
+		ctx.chunk = calloc(ctx.num_chunks, sizeof(uint8_t*));
+		ctx.chunk_len = calloc(ctx.num_chunks, sizeof(uint32_t));
+		if ((ctx.chunk == NULL) || (ctx.chunk_len == NULL) ||
+			(wimlib_create_compressor(wim_codec[i].ctype, ctx.chunk_size, 0, &compressor) != 0) ||
+			(wimlib_create_decompressor(wim_codec[i].ctype, ctx.chunk_size, &ctx.decompressor) != 0)) {
+			printf("Could not set up the %s codec\n", wim_codec[i].name);
+			r++;
+			goto next;
+		}
+		// Compression is only part of the setup, as we only ever decompress WIMs
+		for (j = 0; j < ctx.num_chunks; j++) {
+			len = min(ctx.chunk_size, BENCH_CORPUS_SIZE - (size_t)j * ctx.chunk_size);
+			ctx.chunk[j] = malloc(len);
+			if (ctx.chunk[j] == NULL)
+				goto next;
+			ctx.chunk_len[j] = (uint32_t)wimlib_compress(&corpus[(size_t)j * ctx.chunk_size], len,
+				ctx.chunk[j], len - 1, compressor);
+			if (ctx.chunk_len[j] == 0)
+				memcpy(&dst[(size_t)j * ctx.chunk_size], &corpus[(size_t)j * ctx.chunk_size], len);
+		}
+		if (!bench_wim(&ctx) || (memcmp(dst, corpus, BENCH_CORPUS_SIZE) != 0)) {
+			printf("wim.%s.%s: round trip FAILED\n", wim_codec[i].name, corpus_name);
+			r++;
+			goto next;
+		}
+#if defined(BENCH_HAS_WIMLIB_DISPATCH)
+		// Also run the codecs that have CPU specific code paths with these disabled
+		if (wim_codec[i].has_dispatch && (cpu_features != 0)) {
+			saved_features = cpu_features;
+			cpu_features = 0;
+			r += !bench_run("wim", wim_codec[i].name, "generic", corpus_name, bench_wim, &ctx, ctx.dst_len);
+			cpu_features = saved_features;
+		}
+#endif
+		r += !bench_run("wim", wim_codec[i].name, "default", corpus_name, bench_wim, &ctx, ctx.dst_len);
+next:
+		if (ctx.chunk != NULL) {
+			for (j = 0; j < ctx.num_chunks; j++)
+				free(ctx.chunk[j]);
+		}
+		safe_free(ctx.chunk);
+		safe_free(ctx.chunk_len);
+		wimlib_free_compressor(compressor);
+		compressor = NULL;
+		wimlib_free_decompressor(ctx.decompressor);
+		ctx.decompressor = NULL;
+	}
+	return r;
+}
+
+/*
+ * Compare the results against <dir>\baseline.txt and return the number of regressions.
+ * Results that have no baseline entry, and baseline entries that have no result (e.g.
+ * because a sample is missing), also count as failures, as they weren't checked.
+ */
+static int bench_compare(const char* dir)
+{
+	FILE* fd;
+	char path[MAX_PATH], line[256], name[64];
+	double mbps, tolerance, default_tolerance = BENCH_DEFAULT_TOLERANCE;
+	int i, n, r = 0, compared = 0, unchecked = 0;
+
+	static_sprintf(path, "%s\\baseline.txt", dir);
+	fd = fopenU(path, "r");
+	if (fd == NULL) {
+		printf("FAILED: No baseline found in '%s'\n", dir);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		if ((line[0] == '#') || (line[0] == '\r') || (line[0] == '\n'))
+			continue;
+		if (sscanf(line, "tolerance %lf", &tolerance) == 1) {
+			default_tolerance = tolerance;
+			continue;
+		}
+		n = sscanf(line, "%63s %lf %lf", name, &mbps, &tolerance);
+		if (n < 2)
+			continue;
+		if (n < 3)
+			tolerance = default_tolerance;
+		for (i = 0; i < num_results; i++) {
+			if (strcmp(results[i].name, name) != 0)
+				continue;
+			results[i].compared = TRUE;
+			compared++;
+			if (results[i].mbps < mbps * (100.0 - tolerance) / 100.0) {
+				printf("REGRESSION: %s: %.1f MB/s vs %.1f MB/s baseline (%+.1f%%)\n", name,
+					results[i].mbps, mbps, 100.0 * (results[i].mbps - mbps) / mbps);
+				r++;
+			} else if (results[i].mbps > mbps * (100.0 + tolerance) / 100.0) {
+				printf("Improvement: %s: %.1f MB/s vs %.1f MB/s baseline (%+.1f%%)\n", name,
+					results[i].mbps, mbps, 100.0 * (results[i].mbps - mbps) / mbps);
+			}
+			break;
+		}
+		if (i >= num_results) {
+			printf("NOT RUN: %s has a baseline entry but no result\n", name);
+			unchecked++;
+		}
+	}
+	fclose(fd);
+	for (i = 0; i < num_results; i++) {
+		if (!results[i].compared) {
+			printf("NO BASELINE: %s (%.1f MB/s)\n", results[i].name, results[i].mbps);
+			unchecked++;
+		}
+	}
+	printf("Compared %d result(s) against the baseline: %d regression(s), %d unchecked\n", compared, r, unchecked);
+	if ((unchecked != 0) && (compared == 0))
+		printf("The baseline has no figures for this machine - record one by copying '%s\\results.txt' over it\n", dir);
+	return r + unchecked;
+}
+
+static void bench_save(const char* dir)
+{
+	FILE* fd;
+	char path[MAX_PATH];
+	int i;
+
+	static_sprintf(path, "%s\\results.txt", dir);
+	fd = fopenU(path, "w");
+	if (fd == NULL) {
+		printf("Could not create '%s'\n", path);
+		return;
+	}
+	fprintf(fd, "# %s benchmark results\n", APPLICATION_NAME);
+	fprintf(fd, "tolerance %.0f\n", BENCH_DEFAULT_TOLERANCE);
+	for (i = 0; i < num_results; i++)
+		fprintf(fd, "%-40s %10.1f\n", results[i].name, results[i].mbps);
+	fclose(fd);
+}
+
+/*
+ * Run all the benchmarks, using 'dir' for the compressed samples, the baseline and the results.
+ * Returns the number of failures and regressions.
+ */
+int RunBenchmarks(const char* dir)
+{
+	uint8_t *corpus = NULL, *dst = NULL;
+	uint64_t state;
+	int i, r = 0;
+
+	num_results = 0;
+	corpus = _mm_malloc(BENCH_CORPUS_SIZE, 64);
+	dst = _mm_malloc(BENCH_CORPUS_SIZE, 64);
+	if ((corpus == NULL) || (dst == NULL)) {
+		r = 1;
+		goto out;
+	}
+	wimlib_global_init(0);
+	bled_init(0, uprintf, NULL, NULL, NULL, NULL, &ErrorStatus);
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+	printf("SHA1 acceleration: %s, SHA256 acceleration: %s\n",
+		cpu_has_sha1_accel ? "yes" : "no", cpu_has_sha256_accel ? "yes" : "no");
+	printf("UTF-8/UTF-16 transcoding: %s\n", transcode_simd_name());
+
+	for (i = 0; i < ARRAYSIZE(corpus_generator); i++) {
+		// Each corpus gets its own seed, so that adding a new one doesn't change the others
+		state = 0x9E3779B97F4A7C15ULL * (i + 1);
+		corpus_generator[i].generate(corpus, BENCH_CORPUS_SIZE, &state);
+		r += bench_hashes(corpus, corpus_generator[i].name);
+		r += bench_crcs(corpus, corpus_generator[i].name);
+		r += bench_utf(corpus, corpus_generator[i].name, dst);
+		r += bench_bled_codecs(dir, corpus, corpus_generator[i].name, dst);
+		r += bench_wim_codecs(corpus, corpus_generator[i].name, dst);
+	}
+
+	bench_save(dir);
+	r += bench_compare(dir);
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
+	bled_exit();
+	wimlib_global_cleanup();
+
+out:
+	safe_mm_free(corpus);
+	safe_mm_free(dst);
+	return r;
+}
@@ -17,23 +17,11 @@
 
 typedef long long int(*unpacker_t)(transformer_state_t *xstate);
 
-/* Globals */
-smallint bb_got_signal;
-uint64_t bb_total_rb;
-printf_t bled_printf = NULL;
-read_t bled_read = NULL;
-write_t bled_write = NULL;
-progress_t bled_progress = NULL;
-switch_t bled_switch = NULL;
-unsigned long* bled_cancel_request;
-static bool bled_initialized = 0;
-jmp_buf bb_error_jmp;
-char* bb_virtual_buf = NULL;
-size_t bb_virtual_len = 0, bb_virtual_pos = 0;
-int bb_virtual_fd = -1;
-// ZSTD has a minimal buffer size of (1 << ZSTD_BLOCKSIZELOG_MAX) + ZSTD_blockHeaderSize = 128 KB + 3
-// So we set our bufsize to 256 KB
-uint32_t BB_BUFSIZE = 0x40000;
+/* The context of the job running on the current thread, if any */
+BLED_TLS struct bled_ctx* bled_cur = NULL;
+/* The context used by the legacy API, set up by bled_init() */
+static struct bled_ctx default_ctx = { 0 };
+static bool bled_initialized = false;
 
 static long long int unpack_none(transformer_state_t *xstate)
 {
@@ -49,22 +37,26 @@ unpacker_t unpacker[BLED_COMPRESSION_MAX] = {
 	unpack_lzma_stream,
 	unpack_bz2_stream,
 	unpack_xz_stream,
-	unpack_none,
+	unpack_7z_stream,
 	unpack_vtsi_stream,
 	unpack_zstd_stream,
 };
 
+static int64_t run_unpacker(int type, transformer_state_t *xstate)
+{
+	uint64_t t = TRACE_BEGIN();
+	int64_t ret = unpacker[type](xstate);
+
+	TRACE_END_BYTES("bled decode", t, (ret > 0) ? ret : 0);
+	return ret;
+}
+
 /* Uncompress file 'src', compressed using 'type', to file 'dst' */
-int64_t bled_uncompress(const char* src, const char* dst, int type)
+static int64_t uncompress(const char* src, const char* dst, int type)
 {
 	transformer_state_t xstate;
 	int64_t ret = -1;
 
-	if (!bled_initialized) {
-		bb_error_msg("The library has not been initialized");
-		return -1;
-	}
-
 	bb_total_rb = 0;
 	init_transformer_state(&xstate);
 	xstate.src_fd = -1;
@@ -90,7 +82,7 @@ int64_t bled_uncompress(const char* src, const char* dst, int type)
 	if (setjmp(bb_error_jmp))
 		goto err;
 
-	ret = unpacker[type](&xstate);
+	ret = run_unpacker(type, &xstate);
 
 err:
 	free(xstate.dst_name);
@@ -102,15 +94,10 @@ err:
 }
 
 /* Uncompress using Windows handles */
-int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
+static int64_t uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
 {
 	transformer_state_t xstate;
 
-	if (!bled_initialized) {
-		bb_error_msg("The library has not been initialized");
-		return -1;
-	}
-
 	bb_total_rb = 0;
 	init_transformer_state(&xstate);
 	xstate.src_fd = -1;
@@ -136,20 +123,15 @@ int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
 	if (setjmp(bb_error_jmp))
 		return -1;
 
-	return unpacker[type](&xstate);
+	return run_unpacker(type, &xstate);
 }
 
 /* Uncompress file 'src', compressed using 'type', to buffer 'buf' of size 'size' */
-int64_t bled_uncompress_to_buffer(const char* src, char* buf, size_t size, int type)
+static int64_t uncompress_to_buffer(const char* src, char* buf, size_t size, int type)
 {
 	transformer_state_t xstate;
 	int64_t ret = -1;
 
-	if (!bled_initialized) {
-		bb_error_msg("The library has not been initialized");
-		return -1;
-	}
-
 	if ((src == NULL) || (buf == NULL)) {
 		bb_error_msg("Invalid parameter");
 		return -1;
@@ -182,7 +164,7 @@ int64_t bled_uncompress_to_buffer(const char* src, char* buf, size_t size, int t
 	if (setjmp(bb_error_jmp))
 		goto err;
 
-	ret = unpacker[type](&xstate);
+	ret = run_unpacker(type, &xstate);
 
 err:
 	free(xstate.dst_name);
@@ -192,16 +174,11 @@ err:
 }
 
 /* Uncompress all files from archive 'src', compressed using 'type', to destination dir 'dir' */
-int64_t bled_uncompress_to_dir(const char* src, const char* dir, int type)
+static int64_t uncompress_to_dir(const char* src, const char* dir, int type)
 {
 	transformer_state_t xstate;
 	int64_t ret = -1;
 
-	if (!bled_initialized) {
-		bb_error_msg("The library has not been initialized");
-		return -1;
-	}
-
 	bb_total_rb = 0;
 	init_transformer_state(&xstate);
 	xstate.src_fd = -1;
@@ -215,8 +192,8 @@ int64_t bled_uncompress_to_dir(const char* src, const char* dir, int type)
 
 	xstate.dst_dir = dir;
 
-	// Only zip archives are supported for now
-	if (type != BLED_COMPRESSION_ZIP) {
+	// Only zip and 7z archives are supported for now
+	if (type != BLED_COMPRESSION_ZIP && type != BLED_COMPRESSION_7ZIP) {
 		bb_error_msg("This compression format is not supported for directory extraction");
 		goto err;
 	}
@@ -224,7 +201,7 @@ int64_t bled_uncompress_to_dir(const char* src, const char* dir, int type)
 	if (setjmp(bb_error_jmp))
 		goto err;
 
-	ret = unpacker[type](&xstate);
+	ret = run_unpacker(type, &xstate);
 
 err:
 	free(xstate.dst_name);
@@ -235,15 +212,10 @@ err:
 	return ret;
 }
 
-int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_len, char* dst, size_t dst_len, int type)
+static int64_t uncompress_from_buffer_to_buffer(const char* src, const size_t src_len, char* dst, size_t dst_len, int type)
 {
 	int64_t ret;
 
-	if (!bled_initialized) {
-		bb_error_msg("The library has not been initialized");
-		return -1;
-	}
-
 	if ((src == NULL) || (dst == NULL)) {
 		bb_error_msg("Invalid parameter");
 		return -1;
@@ -259,7 +231,7 @@ int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_
 	bb_virtual_pos = 0;
 	bb_virtual_fd = 0;
 
-	ret = bled_uncompress_to_buffer("", dst, dst_len, type);
+	ret = uncompress_to_buffer("", dst, dst_len, type);
 
 	bb_virtual_buf = NULL;
 	bb_virtual_len = 0;
@@ -268,6 +240,127 @@ int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_
 	return ret;
 }
 
+static void setup_ctx(struct bled_ctx* ctx, uint32_t buffer_size, printf_t print_function, read_t read_function,
+	write_t write_function, progress_t progress_function, switch_t switch_function, unsigned long* cancel_request)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->bufsize = buffer_size;
+	/* buffer_size must be larger than 256 KB and a power of two */
+	if (buffer_size < 0x40000 || (buffer_size & (buffer_size - 1)) != 0) {
+		if (buffer_size != 0 && print_function != NULL)
+			print_function("bled_init: invalid buffer_size, defaulting to 256 KB");
+		// ZSTD has a minimal buffer size of (1 << ZSTD_BLOCKSIZELOG_MAX) + ZSTD_blockHeaderSize = 128 KB + 3
+		// So we set our bufsize to 256 KB
+		ctx->bufsize = 0x40000;
+	}
+	ctx->print_fn = print_function;
+	ctx->read_fn = read_function;
+	ctx->write_fn = write_function;
+	ctx->progress_fn = progress_function;
+	ctx->switch_fn = switch_function;
+	ctx->cancel_request = cancel_request;
+	ctx->virtual_fd = -1;
+}
+
+/* Create a decompression context, using the same parameters as bled_init() */
+bled_ctx* bled_ctx_new(uint32_t buffer_size, printf_t print_function, read_t read_function, write_t write_function,
+	progress_t progress_function, switch_t switch_function, unsigned long* cancel_request)
+{
+	struct bled_ctx* ctx = malloc(sizeof(struct bled_ctx));
+
+	if (ctx != NULL)
+		setup_ctx(ctx, buffer_size, print_function, read_function, write_function,
+			progress_function, switch_function, cancel_request);
+	return ctx;
+}
+
+void bled_ctx_free(bled_ctx* ctx)
+{
+	free(ctx);
+}
+
+/*
+ * Run a job with 'ctx' as the current context of the calling thread. The previous
+ * context is restored afterwards, so that a callback may run a job of its own.
+ */
+#define RUN_WITH_CTX(ctx, call) do {						\
+	struct bled_ctx* prev_ctx = bled_cur;					\
+	int64_t r;								\
+	if ((ctx) == NULL)							\
+		return -1;							\
+	bled_cur = (ctx);							\
+	r = call;								\
+	bled_cur = prev_ctx;							\
+	return r;								\
+} while (0)
+
+int64_t bled_ctx_uncompress(bled_ctx* ctx, const char* src, const char* dst, int type)
+{
+	RUN_WITH_CTX(ctx, uncompress(src, dst, type));
+}
+
+int64_t bled_ctx_uncompress_with_handles(bled_ctx* ctx, HANDLE hSrc, HANDLE hDst, int type)
+{
+	RUN_WITH_CTX(ctx, uncompress_with_handles(hSrc, hDst, type));
+}
+
+int64_t bled_ctx_uncompress_to_buffer(bled_ctx* ctx, const char* src, char* buf, size_t size, int type)
+{
+	RUN_WITH_CTX(ctx, uncompress_to_buffer(src, buf, size, type));
+}
+
+int64_t bled_ctx_uncompress_to_dir(bled_ctx* ctx, const char* src, const char* dir, int type)
+{
+	RUN_WITH_CTX(ctx, uncompress_to_dir(src, dir, type));
+}
+
+int64_t bled_ctx_uncompress_from_buffer_to_buffer(bled_ctx* ctx, const char* src, const size_t src_len,
+	char* dst, size_t dst_len, int type)
+{
+	RUN_WITH_CTX(ctx, uncompress_from_buffer_to_buffer(src, src_len, dst, dst_len, type));
+}
+
+/*
+ * Legacy API, which uses the context set up by bled_init(). As this context is
+ * shared, these calls must not be issued from more than one thread at a time.
+ */
+#define CHECK_INITIALIZED() do {						\
+	if (!bled_initialized) {						\
+		bb_error_msg("The library has not been initialized");		\
+		return -1;							\
+	}									\
+} while (0)
+
+int64_t bled_uncompress(const char* src, const char* dst, int type)
+{
+	CHECK_INITIALIZED();
+	return bled_ctx_uncompress(&default_ctx, src, dst, type);
+}
+
+int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
+{
+	CHECK_INITIALIZED();
+	return bled_ctx_uncompress_with_handles(&default_ctx, hSrc, hDst, type);
+}
+
+int64_t bled_uncompress_to_buffer(const char* src, char* buf, size_t size, int type)
+{
+	CHECK_INITIALIZED();
+	return bled_ctx_uncompress_to_buffer(&default_ctx, src, buf, size, type);
+}
+
+int64_t bled_uncompress_to_dir(const char* src, const char* dir, int type)
+{
+	CHECK_INITIALIZED();
+	return bled_ctx_uncompress_to_dir(&default_ctx, src, dir, type);
+}
+
+int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_len, char* dst, size_t dst_len, int type)
+{
+	CHECK_INITIALIZED();
+	return bled_ctx_uncompress_from_buffer_to_buffer(&default_ctx, src, src_len, dst, dst_len, type);
+}
+
 /* Initialize the library.
  * When the parameters are not NULL or zero you can:
  * - specify the buffer size to use (must be larger than 256KB and a power of two)
@@ -285,19 +378,8 @@ int bled_init(uint32_t buffer_size, printf_t print_function, read_t read_functio
 {
 	if (bled_initialized)
 		return -1;
-	BB_BUFSIZE = buffer_size;
-	/* buffer_size must be larger than 256 KB and a power of two */
-	if (buffer_size < 0x40000 || (buffer_size & (buffer_size - 1)) != 0) {
-		if (buffer_size != 0 && print_function != NULL)
-			print_function("bled_init: invalid buffer_size, defaulting to 64 KB");
-		BB_BUFSIZE = 0x40000;
-	}
-	bled_printf = print_function;
-	bled_read = read_function;
-	bled_write = write_function;
-	bled_progress = progress_function;
-	bled_switch = switch_function;
-	bled_cancel_request = cancel_request;
+	setup_ctx(&default_ctx, buffer_size, print_function, read_function, write_function,
+		progress_function, switch_function, cancel_request);
 	bled_initialized = true;
 	return 0;
 }
@@ -305,13 +387,7 @@ int bled_init(uint32_t buffer_size, printf_t print_function, read_t read_functio
 /* This call frees any resource used by the library */
 void bled_exit(void)
 {
-	bled_printf = NULL;
-	bled_progress = NULL;
-	bled_switch = NULL;
-	bled_cancel_request = NULL;
-	if (global_crc32_table) {
-		free(global_crc32_table);
-		global_crc32_table = NULL;
-	}
+	memset(&default_ctx, 0, sizeof(default_ctx));
+	default_ctx.virtual_fd = -1;
 	bled_initialized = false;
 }
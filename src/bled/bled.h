@@ -35,6 +35,31 @@ typedef enum {
 	BLED_COMPRESSION_MAX
 } bled_compression_type;
 
+/*
+ * A decompression context holds everything a job needs (buffer size, callbacks,
+ * cancellation, error recovery, progress counters), so that jobs that use
+ * different contexts can run concurrently on different threads. A context must
+ * only be used by one job at a time.
+ */
+typedef struct bled_ctx bled_ctx;
+
+/* Create a context, with the same parameters as bled_init() below */
+bled_ctx* bled_ctx_new(uint32_t buffer_size, printf_t print_function, read_t read_function, write_t write_function,
+    progress_t progress_function, switch_t switch_function, unsigned long* cancel_request);
+void bled_ctx_free(bled_ctx* ctx);
+
+int64_t bled_ctx_uncompress(bled_ctx* ctx, const char* src, const char* dst, int type);
+int64_t bled_ctx_uncompress_with_handles(bled_ctx* ctx, HANDLE hSrc, HANDLE hDst, int type);
+int64_t bled_ctx_uncompress_to_buffer(bled_ctx* ctx, const char* src, char* buf, size_t size, int type);
+int64_t bled_ctx_uncompress_to_dir(bled_ctx* ctx, const char* src, const char* dir, int type);
+int64_t bled_ctx_uncompress_from_buffer_to_buffer(bled_ctx* ctx, const char* src, const size_t src_len,
+    char* dst, size_t dst_len, int type);
+
+/*
+ * The calls below use a single context, which is set up by bled_init(), and must
+ * therefore not be issued from more than one thread at a time.
+ */
+
 /* Uncompress file 'src', compressed using 'type', to file 'dst' */
 int64_t bled_uncompress(const char* src, const char* dst, int type);
 
@@ -52,7 +77,7 @@ int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_
 
 /* Initialize the library.
  * When the parameters are not NULL or zero you can:
- * - specify the buffer size to use (must be larger than 64KB and a power of two)
+ * - specify the buffer size to use (must be larger than 256KB and a power of two)
  * - specify the printf-like function you want to use to output message
  *   void print_function(const char* format, ...);
  * - specify the read/write functions you want to use;
@@ -29,6 +29,8 @@
 
 /* This needs to be defined somewhere */
 uint32_t *global_crc32_table;
+static uint32_t crc32_table_le[256];
+static volatile LONG crc32_table_state = 0;
 
 static void crc32init_le(uint32_t *crc32table_le)
 {
@@ -131,6 +133,24 @@ uint32_t* crc32_filltable(uint32_t *crc_table, int endian)
 	return crc_table;
 }
 
+/*
+ * Point global_crc32_table at the little endian table, building it on first use.
+ * Several decompression jobs may get here at once, so only the first one builds
+ * the table, and the others wait for it to be published. The table is static and
+ * never freed, so that it remains valid for any job that is still running.
+ */
+void crc32_init_global_table(void)
+{
+	if (InterlockedCompareExchange(&crc32_table_state, 1, 0) == 0) {
+		crc32init_le(crc32_table_le);
+		InterlockedExchangePointer((PVOID volatile*)&global_crc32_table, crc32_table_le);
+		InterlockedExchange(&crc32_table_state, 2);
+	} else {
+		while (InterlockedCompareExchange(&crc32_table_state, 2, 2) != 2)
+			SwitchToThread();
+	}
+}
+
 /*
  * A brief CRC tutorial.
  *
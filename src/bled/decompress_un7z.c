@@ -0,0 +1,1369 @@
+/*
+ * un7z implementation for Bled/busybox
+ *
+ * Based on the 7z format description (7zFormat.txt) from the LZMA SDK by
+ * Igor Pavlov - Public Domain. Decompression is handled by the xz-embedded
+ * LZMA/LZMA2 and BCJ decoders.
+ *
+ * Licensed under GPLv2 or later, see file LICENSE in this source tree.
+ */
+
+#include "libbb.h"
+#include "bb_archive.h"
+#include "xz_private.h"
+
+#if 0
+# define dbg(...) bb_printf(__VA_ARGS__)
+#else
+# define dbg(...) ((void)0)
+#endif
+
+#define SZ_SIGNATURE_HEADER_SIZE 32
+/* Largest (decoded) header we are willing to process */
+#define SZ_MAX_HEADER_SIZE       (256 * 1024 * 1024)
+/* Largest LZMA/LZMA2 dictionary we are willing to allocate (7-Zip's maximum) */
+#define SZ_MAX_DICT_SIZE         ((sizeof(size_t) == 4) ? (1U << 28) : (3U << 29))
+#define SZ_MAX_FILES             (1 << 24)
+/* Maximum number of coders and coder streams in a folder (BCJ2 uses 4/7) */
+#define SZ_MAX_CODERS            4
+#define SZ_MAX_CODER_STREAMS     8
+#define SZ_MAX_THREADS           8
+#define SZ_NO_INDEX              0xFFFFFFFFU
+
+static const uint8_t sz_signature[6] = { '7', 'z', 0xBC, 0xAF, 0x27, 0x1C };
+
+/* Property IDs */
+enum {
+	kEnd = 0x00,
+	kHeader,
+	kArchiveProperties,
+	kAdditionalStreamsInfo,
+	kMainStreamsInfo,
+	kFilesInfo,
+	kPackInfo,
+	kUnPackInfo,
+	kSubStreamsInfo,
+	kSize,
+	kCRC,
+	kFolder,
+	kCodersUnPackSize,
+	kNumUnPackStream,
+	kEmptyStream,
+	kEmptyFile,
+	kAnti,
+	kName,
+	kCTime,
+	kATime,
+	kMTime,
+	kWinAttributes,
+	kComment,
+	kEncodedHeader,
+	kStartPos,
+	kDummy,
+};
+
+/* Method IDs */
+#define SZ_METHOD_COPY           0x00
+#define SZ_METHOD_LZMA2          0x21
+#define SZ_METHOD_LZMA           0x030101
+#define SZ_METHOD_BCJ_X86        0x03030103
+#define SZ_METHOD_BCJ_PPC        0x03030205
+#define SZ_METHOD_BCJ_IA64       0x03030401
+#define SZ_METHOD_BCJ_ARM        0x03030501
+#define SZ_METHOD_BCJ_ARMT       0x03030701
+#define SZ_METHOD_BCJ_SPARC      0x03030805
+
+typedef struct {
+	uint64_t id;
+	const uint8_t *props;
+	uint32_t props_size;
+	uint32_t num_in;
+	uint32_t num_out;
+} sz_coder_t;
+
+typedef struct {
+	uint32_t num_coders;
+	sz_coder_t coder[SZ_MAX_CODERS];
+	uint32_t num_in;
+	uint32_t num_out;
+	uint32_t num_bind_pairs;
+	struct {
+		uint32_t in;
+		uint32_t out;
+	} bind[SZ_MAX_CODER_STREAMS];
+	uint32_t num_packed;
+	uint32_t packed[SZ_MAX_CODER_STREAMS];
+	uint64_t unpack_size[SZ_MAX_CODER_STREAMS];
+	uint64_t size;          /* size of the final output stream */
+	uint32_t first_pack;    /* index of the first pack stream */
+	uint32_t first_stream;  /* index of the first substream */
+	uint32_t num_streams;
+	uint32_t crc;
+	bool has_crc;
+} sz_folder_t;
+
+typedef struct {
+	char *name;             /* UTF-8 */
+	uint64_t size;
+	uint32_t stream;        /* substream index, or SZ_NO_INDEX */
+	uint32_t attr;
+	bool is_dir;
+	bool is_anti;
+} sz_file_t;
+
+typedef struct {
+	uint8_t *header;        /* folder properties point into this buffer */
+	uint64_t data_offset;   /* absolute offset of the first pack stream */
+	uint32_t num_pack;
+	uint64_t *pack_offset;  /* relative to data_offset */
+	uint64_t *pack_size;
+	uint32_t num_folders;
+	sz_folder_t *folder;
+	uint32_t num_streams;
+	uint64_t *stream_size;
+	uint32_t *stream_crc;
+	uint8_t *stream_has_crc;
+	uint32_t *stream_file;  /* file index for each substream */
+	uint32_t num_files;
+	sz_file_t *file;
+} sz_archive_t;
+
+/* Bounded reader for the header data. Errors are sticky. */
+typedef struct {
+	const uint8_t *p;
+	const uint8_t *end;
+	bool err;
+} sz_buf_t;
+
+static uint8_t sz_byte(sz_buf_t *b)
+{
+	if (b->p >= b->end) {
+		b->err = true;
+		return 0;
+	}
+	return *b->p++;
+}
+
+static uint32_t sz_u32(sz_buf_t *b)
+{
+	uint32_t v;
+
+	if (b->end - b->p < 4) {
+		b->err = true;
+		b->p = b->end;
+		return 0;
+	}
+	v = get_unaligned_le32(b->p);
+	b->p += 4;
+	return v;
+}
+
+/* 7z variable length number: the count of leading 1 bits gives the extra bytes */
+static uint64_t sz_number(sz_buf_t *b)
+{
+	uint8_t first = sz_byte(b), mask = 0x80;
+	uint64_t value = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		if ((first & mask) == 0)
+			return value | ((uint64_t)(first & (mask - 1)) << (8 * i));
+		value |= (uint64_t)sz_byte(b) << (8 * i);
+		mask >>= 1;
+	}
+	return value;
+}
+
+static uint32_t sz_count(sz_buf_t *b, uint32_t max)
+{
+	uint64_t n = sz_number(b);
+
+	if (n > max) {
+		b->err = true;
+		return 0;
+	}
+	return (uint32_t)n;
+}
+
+static void sz_skip(sz_buf_t *b, uint64_t n)
+{
+	if (n > (uint64_t)(b->end - b->p)) {
+		b->err = true;
+		b->p = b->end;
+		return;
+	}
+	b->p += n;
+}
+
+static void sz_bits(sz_buf_t *b, uint32_t n, uint8_t *bits)
+{
+	uint8_t byte = 0, mask = 0;
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		if (mask == 0) {
+			byte = sz_byte(b);
+			mask = 0x80;
+		}
+		bits[i] = (byte & mask) ? 1 : 0;
+		mask >>= 1;
+	}
+}
+
+static void sz_digests(sz_buf_t *b, uint32_t n, uint8_t *defined, uint32_t *crc)
+{
+	uint32_t i;
+
+	if (sz_byte(b) == 0)
+		sz_bits(b, n, defined);
+	else
+		memset(defined, 1, n);
+	for (i = 0; i < n; i++)
+		crc[i] = defined[i] ? sz_u32(b) : 0;
+}
+
+static void sz_free_archive(sz_archive_t *arc)
+{
+	uint32_t i;
+
+	if (arc->file != NULL) {
+		for (i = 0; i < arc->num_files; i++)
+			free(arc->file[i].name);
+	}
+	free(arc->file);
+	free(arc->stream_file);
+	free(arc->stream_has_crc);
+	free(arc->stream_crc);
+	free(arc->stream_size);
+	free(arc->folder);
+	free(arc->pack_size);
+	free(arc->pack_offset);
+	free(arc->header);
+	memset(arc, 0, sizeof(*arc));
+}
+
+static int sz_read_pack_info(sz_buf_t *b, sz_archive_t *arc)
+{
+	uint64_t pack_pos = sz_number(b), offset = 0;
+	uint32_t i, *crc = NULL;
+	uint8_t id, *defined = NULL;
+
+	arc->data_offset = SZ_SIGNATURE_HEADER_SIZE + pack_pos;
+	arc->num_pack = sz_count(b, (uint32_t)(b->end - b->p));
+	arc->pack_size = xzalloc(MAX(arc->num_pack, 1) * sizeof(uint64_t));
+	arc->pack_offset = xzalloc(MAX(arc->num_pack, 1) * sizeof(uint64_t));
+	if (arc->pack_size == NULL || arc->pack_offset == NULL)
+		return -1;
+
+	for (id = sz_byte(b); id != kEnd && !b->err; id = sz_byte(b)) {
+		if (id == kSize) {
+			for (i = 0; i < arc->num_pack; i++) {
+				arc->pack_offset[i] = offset;
+				arc->pack_size[i] = sz_number(b);
+				offset += arc->pack_size[i];
+			}
+		} else if (id == kCRC) {
+			/* Pack stream digests are not used by 7-Zip, just skip them */
+			defined = xzalloc(MAX(arc->num_pack, 1));
+			crc = xzalloc(MAX(arc->num_pack, 1) * sizeof(uint32_t));
+			if (defined == NULL || crc == NULL) {
+				free(defined);
+				free(crc);
+				return -1;
+			}
+			sz_digests(b, arc->num_pack, defined, crc);
+			free(defined);
+			free(crc);
+		} else {
+			sz_skip(b, sz_number(b));
+		}
+	}
+	return b->err ? -1 : 0;
+}
+
+static void sz_read_folder(sz_buf_t *b, sz_folder_t *f)
+{
+	uint32_t i, j, num_packed;
+	uint8_t flags;
+
+	memset(f, 0, sizeof(*f));
+	f->num_coders = sz_count(b, SZ_MAX_CODERS);
+	if (f->num_coders == 0)
+		b->err = true;
+	for (i = 0; i < f->num_coders && !b->err; i++) {
+		sz_coder_t *c = &f->coder[i];
+		flags = sz_byte(b);
+		/* Alternative methods are not supported (and never used) */
+		if (flags & 0x80) {
+			b->err = true;
+			return;
+		}
+		for (j = 0; j < (flags & 0x0F); j++)
+			c->id = (c->id << 8) | sz_byte(b);
+		if (flags & 0x10) {
+			c->num_in = sz_count(b, SZ_MAX_CODER_STREAMS);
+			c->num_out = sz_count(b, SZ_MAX_CODER_STREAMS);
+		} else {
+			c->num_in = 1;
+			c->num_out = 1;
+		}
+		if (flags & 0x20) {
+			c->props_size = sz_count(b, (uint32_t)(b->end - b->p));
+			c->props = b->p;
+			sz_skip(b, c->props_size);
+		}
+		f->num_in += c->num_in;
+		f->num_out += c->num_out;
+	}
+	if (f->num_out == 0 || f->num_in > SZ_MAX_CODER_STREAMS ||
+		f->num_out > SZ_MAX_CODER_STREAMS || f->num_in < f->num_out - 1) {
+		b->err = true;
+		return;
+	}
+
+	f->num_bind_pairs = f->num_out - 1;
+	for (i = 0; i < f->num_bind_pairs; i++) {
+		f->bind[i].in = sz_count(b, f->num_in - 1);
+		f->bind[i].out = sz_count(b, f->num_out - 1);
+	}
+
+	num_packed = f->num_in - f->num_bind_pairs;
+	f->num_packed = num_packed;
+	if (num_packed == 1) {
+		/* The single packed stream is the one in stream that isn't bound */
+		for (i = 0; i < f->num_in; i++) {
+			for (j = 0; j < f->num_bind_pairs; j++)
+				if (f->bind[j].in == i)
+					break;
+			if (j == f->num_bind_pairs) {
+				f->packed[0] = i;
+				break;
+			}
+		}
+	} else {
+		for (i = 0; i < num_packed; i++)
+			f->packed[i] = sz_count(b, f->num_in - 1);
+	}
+}
+
+static int sz_read_unpack_info(sz_buf_t *b, sz_archive_t *arc)
+{
+	uint32_t i, j, pack = 0, *crc = NULL;
+	uint8_t id, *defined = NULL;
+	int r = -1;
+
+	if (sz_byte(b) != kFolder)
+		return -1;
+	arc->num_folders = sz_count(b, (uint32_t)(b->end - b->p));
+	/* External folders are not supported */
+	if (sz_byte(b) != 0)
+		return -1;
+	arc->folder = xzalloc(MAX(arc->num_folders, 1) * sizeof(sz_folder_t));
+	if (arc->folder == NULL)
+		return -1;
+	for (i = 0; i < arc->num_folders && !b->err; i++) {
+		sz_read_folder(b, &arc->folder[i]);
+		arc->folder[i].first_pack = pack;
+		pack += arc->folder[i].num_packed;
+	}
+	if (b->err || pack > arc->num_pack)
+		return -1;
+
+	if (sz_byte(b) != kCodersUnPackSize)
+		return -1;
+	for (i = 0; i < arc->num_folders; i++) {
+		sz_folder_t *f = &arc->folder[i];
+		for (j = 0; j < f->num_out; j++)
+			f->unpack_size[j] = sz_number(b);
+		/* The final output is the out stream that isn't bound */
+		for (j = 0; j < f->num_out; j++) {
+			uint32_t k;
+			for (k = 0; k < f->num_bind_pairs; k++)
+				if (f->bind[k].out == j)
+					break;
+			if (k == f->num_bind_pairs) {
+				f->size = f->unpack_size[j];
+				break;
+			}
+		}
+		/* Until told otherwise, each folder holds a single stream */
+		f->num_streams = 1;
+	}
+
+	for (id = sz_byte(b); id != kEnd && !b->err; id = sz_byte(b)) {
+		if (id == kCRC) {
+			defined = xzalloc(MAX(arc->num_folders, 1));
+			crc = xzalloc(MAX(arc->num_folders, 1) * sizeof(uint32_t));
+			if (defined == NULL || crc == NULL)
+				goto out;
+			sz_digests(b, arc->num_folders, defined, crc);
+			for (i = 0; i < arc->num_folders; i++) {
+				arc->folder[i].has_crc = defined[i];
+				arc->folder[i].crc = crc[i];
+			}
+			free(defined);
+			free(crc);
+			defined = NULL;
+			crc = NULL;
+		} else {
+			sz_skip(b, sz_number(b));
+		}
+	}
+	r = b->err ? -1 : 0;
+
+out:
+	free(defined);
+	free(crc);
+	return r;
+}
+
+/* Set up the substreams. If sub is NULL, each folder is a single stream. */
+static int sz_read_substreams_info(sz_buf_t *b, sz_archive_t *arc)
+{
+	uint32_t i, j, k, num_digests = 0, *crc = NULL;
+	uint64_t sum;
+	uint8_t id = kEnd, *defined = NULL;
+	int r = -1;
+
+	if (b != NULL) {
+		id = sz_byte(b);
+		if (id == kNumUnPackStream) {
+			for (i = 0; i < arc->num_folders; i++)
+				arc->folder[i].num_streams = sz_count(b, SZ_MAX_FILES);
+			id = sz_byte(b);
+		}
+	}
+
+	arc->num_streams = 0;
+	for (i = 0; i < arc->num_folders; i++) {
+		arc->folder[i].first_stream = arc->num_streams;
+		arc->num_streams += arc->folder[i].num_streams;
+		if (arc->num_streams > SZ_MAX_FILES)
+			return -1;
+	}
+	arc->stream_size = xzalloc(MAX(arc->num_streams, 1) * sizeof(uint64_t));
+	arc->stream_crc = xzalloc(MAX(arc->num_streams, 1) * sizeof(uint32_t));
+	arc->stream_has_crc = xzalloc(MAX(arc->num_streams, 1));
+	if (arc->stream_size == NULL || arc->stream_crc == NULL || arc->stream_has_crc == NULL)
+		return -1;
+
+	for (i = 0; i < arc->num_folders; i++) {
+		sz_folder_t *f = &arc->folder[i];
+		if (f->num_streams == 0)
+			continue;
+		sum = 0;
+		if (id == kSize) {
+			for (j = 0; j < f->num_streams - 1; j++) {
+				arc->stream_size[f->first_stream + j] = sz_number(b);
+				sum += arc->stream_size[f->first_stream + j];
+			}
+		}
+		if (sum > f->size)
+			return -1;
+		arc->stream_size[f->first_stream + f->num_streams - 1] = f->size - sum;
+		if (f->num_streams == 1 && f->has_crc) {
+			arc->stream_has_crc[f->first_stream] = 1;
+			arc->stream_crc[f->first_stream] = f->crc;
+		} else {
+			num_digests += f->num_streams;
+		}
+	}
+	if (id == kSize)
+		id = sz_byte(b);
+
+	for (; id != kEnd && b != NULL && !b->err; id = sz_byte(b)) {
+		if (id == kCRC) {
+			defined = xzalloc(MAX(num_digests, 1));
+			crc = xzalloc(MAX(num_digests, 1) * sizeof(uint32_t));
+			if (defined == NULL || crc == NULL)
+				goto out;
+			sz_digests(b, num_digests, defined, crc);
+			for (i = 0, k = 0; i < arc->num_folders; i++) {
+				sz_folder_t *f = &arc->folder[i];
+				if (f->num_streams == 1 && f->has_crc)
+					continue;
+				for (j = 0; j < f->num_streams; j++, k++) {
+					arc->stream_has_crc[f->first_stream + j] = defined[k];
+					arc->stream_crc[f->first_stream + j] = crc[k];
+				}
+			}
+			free(defined);
+			free(crc);
+			defined = NULL;
+			crc = NULL;
+		} else {
+			sz_skip(b, sz_number(b));
+		}
+	}
+	r = (b != NULL && b->err) ? -1 : 0;
+
+out:
+	free(defined);
+	free(crc);
+	return r;
+}
+
+static int sz_read_streams_info(sz_buf_t *b, sz_archive_t *arc)
+{
+	uint8_t id = sz_byte(b);
+
+	if (id == kPackInfo) {
+		if (sz_read_pack_info(b, arc) < 0)
+			return -1;
+		id = sz_byte(b);
+	}
+	if (id == kUnPackInfo) {
+		if (sz_read_unpack_info(b, arc) < 0)
+			return -1;
+		id = sz_byte(b);
+	}
+	if (id == kSubStreamsInfo) {
+		if (sz_read_substreams_info(b, arc) < 0)
+			return -1;
+		id = sz_byte(b);
+	} else if (sz_read_substreams_info(NULL, arc) < 0) {
+		return -1;
+	}
+	return (id == kEnd && !b->err) ? 0 : -1;
+}
+
+static char *sz_utf16_to_utf8(sz_buf_t *b)
+{
+	const uint8_t *start = b->p;
+	wchar_t *wname;
+	char *name;
+	size_t i, len;
+
+	while (b->end - b->p >= 2 && (b->p[0] != 0 || b->p[1] != 0))
+		b->p += 2;
+	if (b->end - b->p < 2) {
+		b->err = true;
+		return NULL;
+	}
+	len = (b->p - start) / 2;
+	b->p += 2;
+	wname = malloc((len + 1) * sizeof(wchar_t));
+	if (wname == NULL)
+		return NULL;
+	for (i = 0; i < len; i++)
+		wname[i] = (wchar_t)(start[2 * i] | (start[2 * i + 1] << 8));
+	wname[len] = 0;
+	name = wchar_to_utf8(wname);
+	free(wname);
+	return name;
+}
+
+static int sz_read_files_info(sz_buf_t *b, sz_archive_t *arc)
+{
+	uint8_t *empty_stream = NULL, *empty_file = NULL, *anti = NULL, *defined = NULL;
+	uint32_t i, j, num_empty = 0, stream = 0;
+	uint64_t type, size;
+	sz_buf_t p;
+	int r = -1;
+
+	arc->num_files = sz_count(b, SZ_MAX_FILES);
+	arc->file = xzalloc(MAX(arc->num_files, 1) * sizeof(sz_file_t));
+	empty_stream = xzalloc(MAX(arc->num_files, 1));
+	empty_file = xzalloc(MAX(arc->num_files, 1));
+	anti = xzalloc(MAX(arc->num_files, 1));
+	defined = xzalloc(MAX(arc->num_files, 1));
+	if (arc->file == NULL || empty_stream == NULL || empty_file == NULL ||
+		anti == NULL || defined == NULL)
+		goto out;
+
+	for (type = sz_number(b); type != kEnd && !b->err; type = sz_number(b)) {
+		size = sz_number(b);
+		p.p = b->p;
+		p.end = b->p + MIN(size, (uint64_t)(b->end - b->p));
+		p.err = false;
+		sz_skip(b, size);
+		switch (type) {
+		case kEmptyStream:
+			sz_bits(&p, arc->num_files, empty_stream);
+			for (i = 0, num_empty = 0; i < arc->num_files; i++)
+				num_empty += empty_stream[i];
+			break;
+		case kEmptyFile:
+			sz_bits(&p, num_empty, empty_file);
+			break;
+		case kAnti:
+			sz_bits(&p, num_empty, anti);
+			break;
+		case kName:
+			if (sz_byte(&p) != 0)
+				goto out;
+			for (i = 0; i < arc->num_files && !p.err; i++)
+				arc->file[i].name = sz_utf16_to_utf8(&p);
+			break;
+		case kWinAttributes:
+			if (sz_byte(&p) == 0)
+				sz_bits(&p, arc->num_files, defined);
+			else
+				memset(defined, 1, arc->num_files);
+			if (sz_byte(&p) != 0)
+				goto out;
+			for (i = 0; i < arc->num_files; i++)
+				arc->file[i].attr = defined[i] ? sz_u32(&p) : 0;
+			break;
+		default:
+			break;
+		}
+		if (p.err)
+			goto out;
+	}
+	if (b->err)
+		goto out;
+
+	/* Map the files to the substreams */
+	for (i = 0, j = 0; i < arc->num_files; i++) {
+		sz_file_t *f = &arc->file[i];
+		if (f->name == NULL)
+			goto out;
+		f->stream = SZ_NO_INDEX;
+		if (empty_stream[i]) {
+			f->is_dir = !empty_file[j] || (f->attr & FILE_ATTRIBUTE_DIRECTORY);
+			f->is_anti = anti[j];
+			j++;
+			continue;
+		}
+		if (stream >= arc->num_streams)
+			goto out;
+		f->stream = stream;
+		f->size = arc->stream_size[stream];
+		arc->stream_file[stream++] = i;
+	}
+	r = 0;
+
+out:
+	free(empty_stream);
+	free(empty_file);
+	free(anti);
+	free(defined);
+	return r;
+}
+
+static int sz_read_header(sz_buf_t *b, sz_archive_t *arc)
+{
+	uint8_t id = sz_byte(b);
+	uint32_t i;
+
+	if (id == kArchiveProperties) {
+		for (id = sz_byte(b); id != kEnd && !b->err; id = sz_byte(b))
+			sz_skip(b, sz_number(b));
+		id = sz_byte(b);
+	}
+	if (id == kAdditionalStreamsInfo) {
+		/* Never used by 7-Zip and we wouldn't know what to do with it */
+		return -1;
+	}
+	if (id == kMainStreamsInfo) {
+		if (sz_read_streams_info(b, arc) < 0)
+			return -1;
+		id = sz_byte(b);
+	} else if (sz_read_substreams_info(NULL, arc) < 0) {
+		return -1;
+	}
+	arc->stream_file = xzalloc(MAX(arc->num_streams, 1) * sizeof(uint32_t));
+	if (arc->stream_file == NULL)
+		return -1;
+	for (i = 0; i < arc->num_streams; i++)
+		arc->stream_file[i] = SZ_NO_INDEX;
+	if (id == kFilesInfo) {
+		if (sz_read_files_info(b, arc) < 0)
+			return -1;
+		id = sz_byte(b);
+	}
+	return (id == kEnd && !b->err) ? 0 : -1;
+}
+
+/*
+ * Archive input. Reads go through full_read() for the main thread, so that
+ * bled_read() and virtual buffers are honoured, and use positioned reads
+ * for the worker threads that extract folders in parallel.
+ */
+static int sz_read_at(int fd, void *buf, uint32_t count, uint64_t offset, bool threaded)
+{
+	OVERLAPPED ov = { 0 };
+	DWORD rb = 0;
+
+	if (!threaded) {
+		if (fd == bb_virtual_fd)
+			bb_virtual_pos = (size_t)MIN(offset, bb_virtual_len);
+		else if ((uint64_t)lseek(fd, offset, SEEK_SET) != offset)
+			return -1;
+		return full_read(fd, buf, count);
+	}
+
+	if ((bled_cancel_request != NULL) && (*bled_cancel_request != 0)) {
+		errno = EINTR;
+		return -1;
+	}
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	if (!ReadFile((HANDLE)_get_osfhandle(fd), buf, count, &rb, &ov)) {
+		errno = EIO;
+		return -1;
+	}
+	InterlockedExchangeAdd64((volatile LONG64*)&bb_total_rb, rb);
+	return (int)rb;
+}
+
+/* Output callback for folder decoding: 0 to continue, 1 to stop, < 0 on error */
+typedef int (*sz_output_t)(void *ctx, const uint8_t *buf, size_t len);
+
+/* Map a 7z BCJ method to the xz filter ID that xz_dec_bcj_reset() expects */
+static uint8_t sz_bcj_id(uint64_t method)
+{
+	switch (method) {
+	case SZ_METHOD_BCJ_X86: return 4;
+	case SZ_METHOD_BCJ_PPC: return 5;
+	case SZ_METHOD_BCJ_IA64: return 6;
+	case SZ_METHOD_BCJ_ARM: return 7;
+	case SZ_METHOD_BCJ_ARMT: return 8;
+	case SZ_METHOD_BCJ_SPARC: return 9;
+	default: return 0;
+	}
+}
+
+/*
+ * Only single coder folders (copy, LZMA, LZMA2) and LZMA/LZMA2 followed by
+ * a BCJ filter are supported, which is what 7-Zip produces for everything
+ * but BCJ2 (-mf=BCJ2) and encrypted archives.
+ */
+static bool sz_folder_chain(const sz_folder_t *f, int *dec, int *filter)
+{
+	int i;
+
+	for (i = 0; i < (int)f->num_coders; i++)
+		if (f->coder[i].num_in != 1 || f->coder[i].num_out != 1)
+			return false;
+	if (f->num_packed != 1)
+		return false;
+	if (f->num_coders == 1) {
+		*dec = 0;
+		*filter = -1;
+	} else if (f->num_coders == 2) {
+		/* The filter is the coder whose input is bound to the decoder's output */
+		*filter = f->bind[0].in;
+		*dec = f->bind[0].out;
+		if (*filter == *dec || f->packed[0] != (uint32_t)*dec ||
+			sz_bcj_id(f->coder[*filter].id) == 0)
+			return false;
+	} else {
+		return false;
+	}
+	switch (f->coder[*dec].id) {
+	case SZ_METHOD_COPY:
+		return (*filter < 0);
+	case SZ_METHOD_LZMA:
+		return (f->coder[*dec].props_size == 5);
+	case SZ_METHOD_LZMA2:
+		return (f->coder[*dec].props_size == 1);
+	default:
+		return false;
+	}
+}
+
+/* Dictionary memory needed to decode a folder */
+static uint64_t sz_folder_memory(const sz_folder_t *f)
+{
+	int dec, filter;
+	uint8_t props;
+
+	if (!sz_folder_chain(f, &dec, &filter))
+		return 0;
+	switch (f->coder[dec].id) {
+	case SZ_METHOD_LZMA:
+		return MIN(get_unaligned_le32(f->coder[dec].props + 1), f->unpack_size[dec]);
+	case SZ_METHOD_LZMA2:
+		props = MIN(f->coder[dec].props[0], 40);
+		return (props == 40) ? 0xFFFFFFFFULL : (uint64_t)(2 | (props & 1)) << (props / 2 + 11);
+	default:
+		return 0;
+	}
+}
+
+static int sz_decode_folder(const sz_archive_t *arc, uint32_t index, int fd,
+	bool threaded, sz_output_t output, void *ctx)
+{
+	const sz_folder_t *f = &arc->folder[index];
+	struct xz_dec_lzma2 *lzma = NULL;
+	struct xz_dec_bcj *bcj = NULL;
+	struct xz_buf b = { 0 };
+	uint8_t *in = NULL, *out = NULL;
+	uint64_t offset, in_left, out_left;
+	uint32_t crc = 0xFFFFFFFF;
+	enum xz_ret ret = XZ_OK;
+	int dec, filter, n, r = -1;
+
+	if (!sz_folder_chain(f, &dec, &filter)) {
+		bb_error_msg("unsupported 7z compression method (0x%llx)",
+			(unsigned long long)f->coder[0].id);
+		return -1;
+	}
+	if (f->first_pack >= arc->num_pack)
+		return -1;
+	offset = arc->data_offset + arc->pack_offset[f->first_pack];
+	in_left = arc->pack_size[f->first_pack];
+	out_left = f->size;
+
+	in = xmalloc(BB_BUFSIZE);
+	out = xmalloc(BB_BUFSIZE);
+	if (in == NULL || out == NULL)
+		bb_error_msg_and_err("memory allocation error");
+
+	if (f->coder[dec].id != SZ_METHOD_COPY) {
+		lzma = xz_dec_lzma2_create(XZ_DYNALLOC, SZ_MAX_DICT_SIZE);
+		if (lzma == NULL)
+			bb_error_msg_and_err("memory allocation error");
+		if (f->coder[dec].id == SZ_METHOD_LZMA)
+			ret = xz_dec_lzma1_reset(lzma, f->coder[dec].props, in_left, f->unpack_size[dec]);
+		else
+			ret = xz_dec_lzma2_reset(lzma, f->coder[dec].props[0]);
+		if (ret == XZ_OK && filter >= 0) {
+			bcj = xz_dec_bcj_create(false);
+			if (bcj == NULL)
+				ret = XZ_MEM_ERROR;
+			else
+				ret = xz_dec_bcj_reset(bcj, sz_bcj_id(f->coder[filter].id));
+		}
+		if (ret != XZ_OK)
+			goto xz_err;
+	}
+
+	b.in = in;
+	b.out = out;
+	while (out_left > 0) {
+		if (b.in_pos == b.in_size && in_left > 0) {
+			n = sz_read_at(fd, in, (uint32_t)MIN(in_left, BB_BUFSIZE), offset, threaded);
+			if (n <= 0)
+				bb_error_msg_and_err("read error (errno: %d)", n < 0 ? errno : EIO);
+			offset += n;
+			in_left -= n;
+			b.in_pos = 0;
+			b.in_size = n;
+		}
+		b.out_pos = 0;
+		b.out_size = (size_t)MIN(out_left, BB_BUFSIZE);
+		if (lzma == NULL) {
+			b.out_pos = MIN(b.out_size, b.in_size - b.in_pos);
+			memcpy(b.out, b.in + b.in_pos, b.out_pos);
+			b.in_pos += b.out_pos;
+		} else {
+			ret = (bcj != NULL) ? xz_dec_bcj_run(bcj, lzma, &b) : xz_dec_lzma2_run(lzma, &b);
+		}
+		if (b.out_pos > 0) {
+			out_left -= MIN(b.out_pos, out_left);
+			if (f->has_crc)
+				crc = crc32_le(crc, b.out, b.out_pos, global_crc32_table);
+			n = output(ctx, b.out, b.out_pos);
+			if (n < 0)
+				goto err;
+			if (n > 0) {
+				r = 0;
+				goto err;
+			}
+		}
+		if (ret == XZ_STREAM_END)
+			break;
+		if (ret != XZ_OK)
+			goto xz_err;
+		if (b.out_pos == 0 && b.in_pos == b.in_size && in_left == 0)
+			bb_error_msg_and_err("truncated 7z archive");
+	}
+	if (out_left != 0)
+		bb_error_msg_and_err("corrupted 7z archive");
+	if (f->has_crc && ~crc != f->crc)
+		bb_error_msg_and_err("7z folder crc error");
+	r = 0;
+	goto err;
+
+xz_err:
+	switch (ret) {
+	case XZ_MEM_ERROR:
+		bb_error_msg("memory allocation error");
+		break;
+	case XZ_MEMLIMIT_ERROR:
+		bb_error_msg("memory usage limit error");
+		break;
+	case XZ_OPTIONS_ERROR:
+		bb_error_msg("unsupported 7z compression option");
+		break;
+	default:
+		bb_error_msg("corrupted 7z archive");
+		break;
+	}
+
+err:
+	if (bcj != NULL)
+		xz_dec_bcj_end(bcj);
+	if (lzma != NULL)
+		xz_dec_lzma2_end(lzma);
+	free(in);
+	free(out);
+	return r;
+}
+
+/* Decoding of the (encoded) header to memory */
+typedef struct {
+	uint8_t *buf;
+	size_t pos;
+	size_t size;
+} sz_mem_t;
+
+static int sz_output_mem(void *ctx, const uint8_t *buf, size_t len)
+{
+	sz_mem_t *mem = (sz_mem_t *)ctx;
+
+	if (len > mem->size - mem->pos)
+		return -1;
+	memcpy(&mem->buf[mem->pos], buf, len);
+	mem->pos += len;
+	return 0;
+}
+
+static int sz_open_archive(int fd, sz_archive_t *arc)
+{
+	uint8_t sig[SZ_SIGNATURE_HEADER_SIZE];
+	sz_archive_t enc = { 0 };
+	sz_mem_t mem = { 0 };
+	uint64_t offset, size;
+	uint32_t crc;
+	sz_buf_t b;
+	int n;
+
+	memset(arc, 0, sizeof(*arc));
+	if (sz_read_at(fd, sig, sizeof(sig), 0, false) != sizeof(sig) ||
+		memcmp(sig, sz_signature, sizeof(sz_signature)) != 0 || sig[6] != 0) {
+		bb_error_msg("not a 7z archive");
+		return -1;
+	}
+	if (get_unaligned_le32(&sig[8]) != ~crc32_le(0xFFFFFFFF, &sig[12], 20, global_crc32_table))
+		bb_error_msg_and_err("7z header crc error");
+	offset = get_le64(&sig[12]);
+	size = get_le64(&sig[20]);
+	crc = get_unaligned_le32(&sig[28]);
+	if (size == 0)
+		return 0;
+	if (size > SZ_MAX_HEADER_SIZE)
+		bb_error_msg_and_err("7z header is too large");
+
+	arc->header = xmalloc((size_t)size);
+	if (arc->header == NULL)
+		bb_error_msg_and_err("memory allocation error");
+	offset += SZ_SIGNATURE_HEADER_SIZE;
+	for (mem.pos = 0; mem.pos < size; mem.pos += n, offset += n) {
+		n = sz_read_at(fd, &arc->header[mem.pos], (uint32_t)MIN(size - mem.pos, BB_BUFSIZE), offset, false);
+		if (n <= 0)
+			bb_error_msg_and_err("truncated 7z archive");
+	}
+	if (~crc32_le(0xFFFFFFFF, arc->header, (size_t)size, global_crc32_table) != crc)
+		bb_error_msg_and_err("7z header crc error");
+
+	b.p = arc->header;
+	b.end = arc->header + size;
+	b.err = false;
+	while (sz_byte(&b) == kEncodedHeader) {
+		/* The actual header is packed into the first folder of these streams */
+		if (sz_read_streams_info(&b, &enc) < 0 || enc.num_folders == 0 ||
+			enc.folder[0].size > SZ_MAX_HEADER_SIZE)
+			bb_error_msg_and_err("invalid 7z header");
+		enc.header = arc->header;
+		arc->header = NULL;
+		mem.size = (size_t)enc.folder[0].size;
+		mem.pos = 0;
+		mem.buf = xmalloc(MAX(mem.size, 1));
+		if (mem.buf == NULL)
+			bb_error_msg_and_err("memory allocation error");
+		if (sz_decode_folder(&enc, 0, fd, false, sz_output_mem, &mem) < 0 || mem.pos != mem.size) {
+			free(mem.buf);
+			bb_error_msg_and_err("could not decode 7z header");
+		}
+		sz_free_archive(&enc);
+		arc->header = mem.buf;
+		b.p = arc->header;
+		b.end = arc->header + mem.size;
+	}
+	b.p--;
+	if (sz_byte(&b) != kHeader || sz_read_header(&b, arc) < 0)
+		bb_error_msg_and_err("invalid 7z header");
+	return 0;
+
+err:
+	sz_free_archive(&enc);
+	sz_free_archive(arc);
+	return -1;
+}
+
+/* Reject names that would escape the destination directory */
+static bool sz_is_safe_name(const char *name)
+{
+	const char *p;
+
+	if (name[0] == 0 || name[0] == '/' || name[0] == '\\' || strchr(name, ':') != NULL)
+		return false;
+	for (p = name; *p != 0; p++) {
+		if ((p == name || p[-1] == '/' || p[-1] == '\\') && p[0] == '.' && p[1] == '.' &&
+			(p[2] == 0 || p[2] == '/' || p[2] == '\\'))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Splits the output of a folder into its files, either writing all of them
+ * into xstate->dst_dir, or only the target one through transformer_write().
+ */
+typedef struct {
+	const sz_archive_t *arc;
+	transformer_state_t *xstate;
+	CRITICAL_SECTION *lock;     /* serializes file switching for worker threads */
+	uint32_t stream;            /* next substream */
+	uint32_t end;               /* end of the folder's substreams */
+	uint32_t file;              /* current file, or SZ_NO_INDEX */
+	uint32_t target;            /* file to extract, or SZ_NO_INDEX for all */
+	uint64_t left;              /* bytes left in the current file */
+	uint32_t crc;
+	uint64_t written;
+	bool full;                  /* output buffer is full (-ENOSPC) */
+} sz_sink_t;
+
+static bool sz_wanted(const sz_sink_t *sink, uint32_t file)
+{
+	return (sink->target == SZ_NO_INDEX) ? sz_is_safe_name(sink->arc->file[file].name) :
+		(file == sink->target);
+}
+
+/* Close the current file and verify its crc */
+static int sz_end_file(sz_sink_t *sink)
+{
+	uint32_t s;
+
+	if (sink->file == SZ_NO_INDEX)
+		return 0;
+	s = sink->arc->file[sink->file].stream;
+	if (sink->xstate->dst_dir != NULL && sink->xstate->dst_fd >= 0) {
+		_close(sink->xstate->dst_fd);
+		sink->xstate->dst_fd = -1;
+	}
+	if (sz_wanted(sink, sink->file) && sink->arc->stream_has_crc[s] && ~sink->crc != sink->arc->stream_crc[s]) {
+		bb_error_msg("crc error for '%s'", sink->arc->file[sink->file].name);
+		return -1;
+	}
+	sink->file = SZ_NO_INDEX;
+	return 0;
+}
+
+static int sz_begin_file(sz_sink_t *sink)
+{
+	transformer_state_t *xstate = sink->xstate;
+	int r = 0;
+
+	sink->file = sink->arc->stream_file[sink->stream++];
+	if (sink->file == SZ_NO_INDEX) {
+		bb_error_msg("invalid 7z substream");
+		return -1;
+	}
+	sink->left = sink->arc->file[sink->file].size;
+	sink->crc = 0xFFFFFFFF;
+	if (sink->target == SZ_NO_INDEX) {
+		if (!sz_is_safe_name(sink->arc->file[sink->file].name)) {
+			bb_error_msg("Skipping unsafe path '%s'", sink->arc->file[sink->file].name);
+			return 0;
+		}
+		xstate->dst_name = strdup(sink->arc->file[sink->file].name);
+		xstate->dst_size = sink->left;
+		if (xstate->dst_name == NULL)
+			return -1;
+		if (sink->lock != NULL)
+			EnterCriticalSection(sink->lock);
+		r = transformer_switch_file(xstate);
+		if (sink->lock != NULL)
+			LeaveCriticalSection(sink->lock);
+	}
+	return r;
+}
+
+static int sz_output_files(void *ctx, const uint8_t *buf, size_t len)
+{
+	sz_sink_t *sink = (sz_sink_t *)ctx;
+	ssize_t nwrote;
+	size_t n;
+
+	while (len > 0) {
+		while (sink->left == 0) {
+			if (sz_end_file(sink) < 0)
+				return -1;
+			/* Once the target is done, there's no need to decode any further */
+			if (sink->target != SZ_NO_INDEX && sink->written > 0)
+				return 1;
+			if (sink->stream >= sink->end) {
+				bb_error_msg("corrupted 7z archive");
+				return -1;
+			}
+			if (sz_begin_file(sink) < 0)
+				return -1;
+		}
+		n = (size_t)MIN(len, sink->left);
+		if (sz_wanted(sink, sink->file)) {
+			sink->crc = crc32_le(sink->crc, buf, n, global_crc32_table);
+			nwrote = transformer_write(sink->xstate, buf, n);
+			if (nwrote == -ENOSPC) {
+				sink->full = true;
+				return 1;
+			}
+			if (nwrote < 0)
+				return -1;
+			sink->written += n;
+		}
+		sink->left -= n;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Process the files at the end of a folder, including empty ones */
+static int sz_finish_folder(sz_sink_t *sink)
+{
+	while (sink->left == 0) {
+		if (sz_end_file(sink) < 0)
+			return -1;
+		if (sink->stream >= sink->end || (sink->target != SZ_NO_INDEX && sink->written > 0))
+			return 0;
+		if (sz_begin_file(sink) < 0)
+			return -1;
+	}
+	bb_error_msg("truncated 7z folder");
+	return -1;
+}
+
+static int sz_extract_folder(sz_sink_t *sink, uint32_t index, int fd, bool threaded)
+{
+	const sz_folder_t *f = &sink->arc->folder[index];
+	int r;
+
+	sink->stream = f->first_stream;
+	sink->end = f->first_stream + f->num_streams;
+	sink->file = SZ_NO_INDEX;
+	sink->left = 0;
+	r = sz_decode_folder(sink->arc, index, fd, threaded, sz_output_files, sink);
+	if (r == 0 && !sink->full)
+		r = sz_finish_folder(sink);
+	if (r < 0 && sink->xstate->dst_dir != NULL && sink->xstate->dst_fd >= 0) {
+		_close(sink->xstate->dst_fd);
+		sink->xstate->dst_fd = -1;
+	}
+	return r;
+}
+
+/* Parallel extraction of independent folders */
+typedef struct {
+	struct bled_ctx *ctx;
+	const sz_archive_t *arc;
+	transformer_state_t *xstate;
+	CRITICAL_SECTION lock;
+	volatile LONG next;
+	volatile LONG failed;
+	volatile LONG64 written;
+} sz_pool_t;
+
+static DWORD WINAPI sz_worker(LPVOID param)
+{
+	sz_pool_t *pool = (sz_pool_t *)param;
+	transformer_state_t xstate;
+	sz_sink_t sink = { 0 };
+	LONG i;
+
+	/* Workers report and read through the context of the job they belong to */
+	bled_cur = pool->ctx;
+	init_transformer_state(&xstate);
+	xstate.src_fd = pool->xstate->src_fd;
+	xstate.dst_fd = -1;
+	xstate.dst_dir = pool->xstate->dst_dir;
+	sink.arc = pool->arc;
+	sink.xstate = &xstate;
+	sink.lock = &pool->lock;
+	sink.target = SZ_NO_INDEX;
+
+	while (!pool->failed) {
+		i = InterlockedIncrement(&pool->next) - 1;
+		if (i >= (LONG)pool->arc->num_folders)
+			break;
+		sink.written = 0;
+		if (sz_extract_folder(&sink, i, xstate.src_fd, true) < 0)
+			InterlockedExchange(&pool->failed, 1);
+		InterlockedExchangeAdd64(&pool->written, sink.written);
+	}
+	free(xstate.dst_name);
+	return 0;
+}
+
+/* Number of threads to use, based on the CPUs, folders and memory available */
+static uint32_t sz_num_threads(const sz_archive_t *arc, transformer_state_t *xstate)
+{
+	SYSTEM_INFO si;
+	MEMORYSTATUSEX ms = { sizeof(ms) };
+	uint64_t mem = 0;
+	uint32_t i, n = 0;
+
+	if (xstate->dst_dir == NULL || bled_read != NULL || bled_write != NULL ||
+		xstate->src_fd == bb_virtual_fd)
+		return 1;
+	for (i = 0; i < arc->num_folders; i++) {
+		if (arc->folder[i].num_streams != 0) {
+			mem = MAX(mem, sz_folder_memory(&arc->folder[i]) + 2 * BB_BUFSIZE);
+			n++;
+		}
+	}
+	GetSystemInfo(&si);
+	n = MIN(n, MIN(si.dwNumberOfProcessors, SZ_MAX_THREADS));
+	if (GlobalMemoryStatusEx(&ms)) {
+		while (n > 1 && n * mem > ms.ullAvailPhys / 2)
+			n--;
+	}
+	return MAX(n, 1);
+}
+
+static int sz_extract_parallel(const sz_archive_t *arc, transformer_state_t *xstate,
+	uint32_t num_threads, uint64_t *written)
+{
+	HANDLE thread[SZ_MAX_THREADS];
+	sz_pool_t pool = { 0 };
+	uint32_t i, n = 0;
+	DWORD wr;
+
+	pool.ctx = bled_cur;
+	pool.arc = arc;
+	pool.xstate = xstate;
+	InitializeCriticalSection(&pool.lock);
+	for (i = 0; i < num_threads; i++) {
+		thread[n] = CreateThread(NULL, 0, sz_worker, &pool, 0, NULL);
+		if (thread[n] != NULL)
+			n++;
+	}
+	if (n == 0) {
+		DeleteCriticalSection(&pool.lock);
+		return 1;
+	}
+	dbg("Extracting 7z folders with %d threads", n);
+	/* Report the progress from this thread while the workers are busy */
+	do {
+		wr = WaitForMultipleObjects(n, thread, TRUE, 100);
+		if (bled_progress != NULL)
+			bled_progress(bb_total_rb);
+	} while (wr == WAIT_TIMEOUT);
+	for (i = 0; i < n; i++)
+		CloseHandle(thread[i]);
+	DeleteCriticalSection(&pool.lock);
+	*written += pool.written;
+	return pool.failed ? -1 : 0;
+}
+
+/* Pick the entry to stream when not extracting to a directory: the largest one */
+static uint32_t sz_select_entry(const sz_archive_t *arc)
+{
+	uint32_t i, r = SZ_NO_INDEX;
+
+	for (i = 0; i < arc->num_files; i++) {
+		if (arc->file[i].stream == SZ_NO_INDEX)
+			continue;
+		if (r == SZ_NO_INDEX || arc->file[i].size > arc->file[r].size)
+			r = i;
+	}
+	return r;
+}
+
+static uint32_t sz_file_folder(const sz_archive_t *arc, uint32_t file)
+{
+	uint32_t i, s = arc->file[file].stream;
+
+	for (i = 0; i < arc->num_folders; i++)
+		if (s >= arc->folder[i].first_stream && s < arc->folder[i].first_stream + arc->folder[i].num_streams)
+			return i;
+	return SZ_NO_INDEX;
+}
+
+static int sz_create_empty_entries(const sz_archive_t *arc, transformer_state_t *xstate)
+{
+	char path[MAX_PATH];
+	uint32_t i;
+	size_t j;
+
+	for (i = 0; i < arc->num_files; i++) {
+		const sz_file_t *f = &arc->file[i];
+		if (f->stream != SZ_NO_INDEX || f->is_anti)
+			continue;
+		if (!sz_is_safe_name(f->name)) {
+			bb_error_msg("Skipping unsafe path '%s'", f->name);
+			continue;
+		}
+		if (f->is_dir) {
+			_snprintf_s(path, sizeof(path), _TRUNCATE, "%s/%s", xstate->dst_dir, f->name);
+			for (j = 0; j < strlen(path); j++)
+				if (path[j] == '/')
+					path[j] = '\\';
+			bb_make_directory(path, 0, 0);
+		} else {
+			xstate->dst_name = strdup(f->name);
+			xstate->dst_size = 0;
+			if (xstate->dst_name == NULL || transformer_switch_file(xstate) < 0)
+				return -1;
+			_close(xstate->dst_fd);
+			xstate->dst_fd = -1;
+		}
+	}
+	return 0;
+}
+
+IF_DESKTOP(long long) int FAST_FUNC unpack_7z_stream(transformer_state_t *xstate)
+{
+	IF_DESKTOP(long long) int n = -1;
+	sz_archive_t arc;
+	sz_sink_t sink = { 0 };
+	uint32_t i, num_threads;
+	uint64_t written = 0;
+	int r = 0;
+
+	crc32_init_global_table();
+
+	if (sz_open_archive(xstate->src_fd, &arc) < 0)
+		return -1;
+	dbg("7z: %d pack streams, %d folders, %d files", arc.num_pack, arc.num_folders, arc.num_files);
+
+	sink.arc = &arc;
+	sink.xstate = xstate;
+	if (xstate->dst_dir == NULL) {
+		/* Stream a single entry, e.g. a disk image, straight to the target */
+		sink.target = sz_select_entry(&arc);
+		if (sink.target == SZ_NO_INDEX)
+			bb_error_msg_and_err("no file to extract in 7z archive");
+		xstate->dst_size = arc.file[sink.target].size;
+		if (xstate->dst_size != 0)
+			r = sz_extract_folder(&sink, sz_file_folder(&arc, sink.target), xstate->src_fd, false);
+		written = sink.written;
+	} else {
+		sink.target = SZ_NO_INDEX;
+		r = sz_create_empty_entries(&arc, xstate);
+		num_threads = sz_num_threads(&arc, xstate);
+		if (r == 0 && num_threads > 1)
+			r = sz_extract_parallel(&arc, xstate, num_threads, &written);
+		/* Also used as fallback if the threads could not be created */
+		if ((r == 0 && num_threads <= 1) || r > 0) {
+			r = 0;
+			for (i = 0; i < arc.num_folders && r == 0; i++)
+				if (arc.folder[i].num_streams != 0)
+					r = sz_extract_folder(&sink, i, xstate->src_fd, false);
+			written += sink.written;
+		}
+	}
+	if (r < 0)
+		goto err;
+	n = (IF_DESKTOP(long long) int)written;
+	if (sink.full)
+		n = xstate->mem_output_size_max;
+
+err:
+	sz_free_archive(&arc);
+	return n;
+}
@@ -141,6 +141,25 @@ static ALWAYS_INLINE int rc_direct_bit(rc_t *rc)
 	return 0;
 }
 
+#if ENABLE_FEATURE_LZMA_FAST
+/* Copy a match that neither wraps around the dictionary nor crosses its end.
+ * For overlapping matches (distance shorter than the length), what was already
+ * copied is itself a repetition of the source, so each chunk can be twice as
+ * large as the previous one while never overlapping. */
+static ALWAYS_INLINE void copy_match(uint8_t *dst, uint32_t dist, size_t len)
+{
+	const uint8_t *src = dst - dist;
+	size_t chunk;
+
+	while (len != 0) {
+		chunk = MIN(len, (size_t)(dst - src));
+		memcpy(dst, src, chunk);
+		dst += chunk;
+		len -= chunk;
+	}
+}
+#endif
+
 /* Called twice */
 static speed_inline void
 rc_bit_tree_decode(rc_t *rc, uint16_t *p, int num_levels, int *symbol)
@@ -485,6 +504,25 @@ unpack_lzma_stream(transformer_state_t *xstate)
 			 * Our code is slower (more checks per byte copy):
 			 */
  IF_NOT_FEATURE_LZMA_FAST(string:)
+#if ENABLE_FEATURE_LZMA_FAST
+			if (buffer_pos >= rep0) {
+				size_t cur_len = MIN((size_t)len, buffer_size - buffer_pos);
+				copy_match(&buffer[buffer_pos], rep0, cur_len);
+				buffer_pos += cur_len;
+				len -= (int)cur_len;
+				previous_byte = buffer[buffer_pos - 1];
+				if (buffer_pos == header.dict_size) {
+					buffer_pos = 0;
+					global_pos += header.dict_size;
+					nwrote = transformer_write(xstate, buffer, header.dict_size);
+					if (nwrote != (ssize_t)header.dict_size)
+						goto bad;
+					IF_DESKTOP(total_written += header.dict_size;)
+				}
+				if (len == 0 || buffer_pos >= header.dst_size)
+					continue;
+			}
+#endif
 			do {
 				uint32_t pos = (uint32_t)(buffer_pos - rep0);
 				if ((int32_t)pos < 0) {
@@ -19,8 +19,7 @@
 
 static void XZ_FUNC xz_crc32_init(void)
 {
-	if (!global_crc32_table)
-		global_crc32_table = crc32_filltable(NULL, 0);
+	crc32_init_global_table();
 }
 
 static uint32_t XZ_FUNC xz_crc32(const uint8_t *buf, size_t size, uint32_t crc)
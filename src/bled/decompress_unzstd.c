@@ -22,6 +22,25 @@ ALWAYS_INLINE static size_t roundupsize(size_t size, size_t align)
 	return (size + align - 1U) & ~(align - 1);
 }
 
+/*
+ * Images compressed with --long=N need a (1 << N) bytes window, which the
+ * decoder refuses above ZSTD_WINDOWLOG_LIMIT_DEFAULT (128 MB) unless told
+ * otherwise. Allow up to ZSTD_WINDOWLOG_MAX (2 GB on 64-bit), as long as
+ * the window does not exceed half of the physical memory. On 32-bit, where
+ * a 2 GB window could never be allocated in the address space, stop at 1 GB.
+ */
+static int zstd_window_log_max(void)
+{
+	MEMORYSTATUSEX ms = { sizeof(ms) };
+	int log = (sizeof(void*) == 4) ? ZSTD_WINDOWLOG_MAX_32 : ZSTD_WINDOWLOG_MAX;
+
+	if (!GlobalMemoryStatusEx(&ms))
+		return ZSTD_WINDOWLOG_LIMIT_DEFAULT;
+	while ((log > ZSTD_WINDOWLOG_LIMIT_DEFAULT) && ((1ULL << log) > ms.ullTotalPhys / 2))
+		log--;
+	return log;
+}
+
 ALWAYS_INLINE static IF_DESKTOP(long long) int
 unpack_zstd_stream_inner(transformer_state_t *xstate,
 	ZSTD_DStream *dctx, void *out_buff)
@@ -103,6 +122,9 @@ unpack_zstd_stream_inner(transformer_state_t *xstate,
 		 */
 		if (last_result == ZSTD_error_maxCode + 1) {
 			bb_simple_error_msg("could not read zstd data");
+		} else if (ZSTD_getErrorCode(last_result) == ZSTD_error_frameParameter_windowTooLarge) {
+			bb_error_msg("zstd window is larger than the %u MB allowed for this system",
+				(unsigned)((1ULL << zstd_window_log_max()) >> 20));
 		} else {
 #if defined(ZSTD_STRIP_ERROR_STRINGS) && ZSTD_STRIP_ERROR_STRINGS == 1
 			bb_error_msg("zstd decoder error: %u", (unsigned)last_result);
@@ -131,6 +153,7 @@ unpack_zstd_stream(transformer_state_t *xstate)
 		/* should be the only possibly reason of failure */
 		bb_error_msg_and_die("memory exhausted");
 	}
+	ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, zstd_window_log_max());
 
 	out_buff = xmalloc(in_allocsize + out_allocsize);
 
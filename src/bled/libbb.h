@@ -22,6 +22,7 @@
 
 #include "platform.h"
 #include "msapi_utf8.h"
+#include "trace.h"
 
 #include <ctype.h>
 #include <errno.h>
@@ -49,7 +50,12 @@
 #define IF_DESKTOP(x)
 #define IF_NOT_DESKTOP(x)               x
 #endif
+#define ENABLE_FEATURE_LZMA_FAST        1
+#if ENABLE_FEATURE_LZMA_FAST
+#define IF_NOT_FEATURE_LZMA_FAST(x)
+#else
 #define IF_NOT_FEATURE_LZMA_FAST(x)     x
+#endif
 #define ENABLE_FEATURE_UNZIP_CDF        1
 #define ENABLE_FEATURE_UNZIP_BZIP2      1
 #define ENABLE_FEATURE_UNZIP_LZMA       1
@@ -117,13 +123,44 @@ typedef unsigned int uid_t;
 #define get_le16(ptr) (*(const uint16_t *)(ptr))
 #endif
 
-extern uint32_t BB_BUFSIZE;
-extern smallint bb_got_signal;
+/*
+ * Everything a decompression job needs that used to be global. Each bled_ctx_*()
+ * call points the calling thread's bled_cur at its context for the duration of
+ * the job, so that the busybox derived code below can keep using the old names.
+ */
+struct bled_ctx {
+	uint32_t bufsize;
+	void (*print_fn)(const char* format, ...);
+	int (*read_fn)(int fd, void* buf, unsigned int count);
+	int (*write_fn)(int fd, const void* buf, unsigned int count);
+	void (*progress_fn)(const uint64_t processed_bytes);
+	void (*switch_fn)(const char* filename, const uint64_t filesize);
+	unsigned long* cancel_request;
+	jmp_buf error_jmp;
+	smallint got_signal;
+	uint64_t total_rb;
+	char* virtual_buf;
+	size_t virtual_len, virtual_pos;
+	int virtual_fd;
+};
+
+#if defined(_MSC_VER)
+#define BLED_TLS __declspec(thread)
+#else
+#define BLED_TLS __thread
+#endif
+extern BLED_TLS struct bled_ctx* bled_cur;
+
+#define BB_BUFSIZE (bled_cur->bufsize)
+#define bb_got_signal (bled_cur->got_signal)
+#define bb_error_jmp (bled_cur->error_jmp)
+#define bb_virtual_buf (bled_cur->virtual_buf)
+#define bb_virtual_len (bled_cur->virtual_len)
+#define bb_virtual_pos (bled_cur->virtual_pos)
+#define bb_virtual_fd (bled_cur->virtual_fd)
+
 extern uint32_t *global_crc32_table;
-extern jmp_buf bb_error_jmp;
-extern char* bb_virtual_buf;
-extern size_t bb_virtual_len, bb_virtual_pos;
-extern int bb_virtual_fd;
+void crc32_init_global_table(void);
 
 uint32_t* crc32_filltable(uint32_t *crc_table, int endian);
 uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len, uint32_t *crc32table_le);
@@ -151,12 +188,13 @@ struct timeval64 {
 	int32_t tv_usec;
 };
 
-extern void (*bled_printf) (const char* format, ...);
-extern void (*bled_progress) (const uint64_t processed_bytes);
-extern void (*bled_switch) (const char* filename, const uint64_t filesize);
-extern int (*bled_read)(int fd, void* buf, unsigned int count);
-extern int (*bled_write)(int fd, const void* buf, unsigned int count);
-extern unsigned long* bled_cancel_request;
+/* bled_printf may be used outside of a job, to report that there is no context */
+#define bled_printf ((bled_cur != NULL) ? bled_cur->print_fn : NULL)
+#define bled_progress (bled_cur->progress_fn)
+#define bled_switch (bled_cur->switch_fn)
+#define bled_read (bled_cur->read_fn)
+#define bled_write (bled_cur->write_fn)
+#define bled_cancel_request (bled_cur->cancel_request)
 
 #define xfunc_die() longjmp(bb_error_jmp, 1)
 #define bb_printf(...) do { if (bled_printf != NULL) bled_printf(__VA_ARGS__); \
@@ -192,7 +230,7 @@ static inline pid_t wait(int* status) { *status = 4; return -1; }
 #define wait_any_nohang wait
 
 /* This enables the display of a progress based on the number of bytes read */
-extern uint64_t bb_total_rb;
+#define bb_total_rb (bled_cur->total_rb)
 static inline int full_read(int fd, void *buf, unsigned int count) {
 	int rb;
 
@@ -221,7 +259,9 @@ static inline int full_read(int fd, void *buf, unsigned int count) {
 		bb_virtual_pos += count;
 		rb = (int)count;
 	} else {
+		uint64_t t = TRACE_BEGIN();
 		rb = (bled_read != NULL) ? bled_read(fd, buf, count) : _read(fd, buf, count);
+		TRACE_END_BYTES("bled read", t, (rb > 0) ? rb : 0);
 	}
 	if (rb > 0) {
 		bb_total_rb += rb;
@@ -26,6 +26,7 @@ int FAST_FUNC check_signature16(transformer_state_t *xstate, unsigned magic16)
 ssize_t FAST_FUNC transformer_write(transformer_state_t *xstate, const void *buf, size_t bufsize)
 {
 	ssize_t nwrote;
+	uint64_t t;
 
 	if (xstate->mem_output_size_max != 0) {
 		size_t pos = xstate->mem_output_size;
@@ -38,7 +39,9 @@ ssize_t FAST_FUNC transformer_write(transformer_state_t *xstate, const void *buf
 		memcpy(xstate->mem_output_buf + pos, buf, bufsize);
 		xstate->mem_output_size += bufsize;
 	} else {
+		t = TRACE_BEGIN();
 		nwrote = full_write(xstate->dst_fd, buf, (unsigned int)bufsize);
+		TRACE_END_BYTES("bled write", t, bufsize);
 		if (nwrote != (ssize_t)bufsize) {
 			if (nwrote < 0)
 				bb_perror_msg("write error: %d", (int)nwrote);
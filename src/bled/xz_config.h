@@ -31,6 +31,22 @@
 
 #include "xz.h"
 
+/*
+ * SIMD support for the BCJ filters, as determined at compile time. SSE2 and
+ * NEON are part of the x86-64 and ARM64 baselines, so no runtime detection
+ * is needed. Define XZ_NO_INTRINSICS to use the plain C filters.
+ */
+#if !defined(XZ_NO_INTRINSICS)
+#	if defined(__SSE2__) || defined(_M_AMD64) || \
+		(defined(_M_IX86) && defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#		define XZ_ARCH_X86_SSE2
+#		include <emmintrin.h>
+#	elif defined(__ARM_NEON) || defined(_M_ARM64)
+#		define XZ_ARCH_ARM_NEON
+#		include <arm_neon.h>
+#	endif
+#endif
+
 #define kmalloc(size, flags) malloc(size)
 #define kfree(ptr) free(ptr)
 #define vmalloc(size) malloc(size)
@@ -118,6 +134,27 @@ static inline void XZ_FUNC put_unaligned_be32(uint32_t val, uint8_t *buf)
 }
 #endif
 
+/* Index of the least significant bit set (val must not be zero) */
+#if defined(_MSC_VER)
+#include <intrin.h>
+static inline uint32_t XZ_FUNC xz_ctz64(uint64_t val)
+{
+	unsigned long r;
+#if defined(_M_AMD64) || defined(_M_ARM64)
+	_BitScanForward64(&r, val);
+#else
+	if ((uint32_t)val == 0) {
+		_BitScanForward(&r, (uint32_t)(val >> 32));
+		return (uint32_t)r + 32;
+	}
+	_BitScanForward(&r, (uint32_t)val);
+#endif
+	return (uint32_t)r;
+}
+#else
+#define xz_ctz64(val) ((uint32_t)__builtin_ctzll(val))
+#endif
+
 /*
  * Use get_unaligned_le32() also for aligned access for simplicity. On
  * little endian systems, #define get_le32(ptr) (*(const uint32_t *)(ptr))
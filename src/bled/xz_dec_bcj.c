@@ -85,6 +85,47 @@ static inline int bcj_x86_test_msbyte(uint8_t b)
 	return b == 0x00 || b == 0xFF;
 }
 
+/*
+ * Return the position of the next 0xE8 (CALL) or 0xE9 (JMP) opcode in
+ * buf[i] to buf[size - 1], or i if i >= size, or size if there is none.
+ * Executables are mostly made of bytes we don't care about, so finding
+ * the next candidate 16 bytes at a time is much faster than testing each
+ * byte in the filter loop.
+ */
+static __always_inline size_t XZ_FUNC bcj_x86_next(
+		const uint8_t *buf, size_t i, size_t size)
+{
+#if defined(XZ_ARCH_X86_SSE2)
+	const __m128i mask = _mm_set1_epi8((char)0xFE);
+	const __m128i opcode = _mm_set1_epi8((char)0xE8);
+	int found;
+
+	for (; i + 16 <= size; i += 16) {
+		found = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(
+				_mm_loadu_si128((const __m128i *)(buf + i)),
+				mask), opcode));
+		if (found != 0)
+			return i + xz_ctz64((uint32_t)found);
+	}
+#elif defined(XZ_ARCH_ARM_NEON)
+	uint64_t found;
+
+	for (; i + 16 <= size; i += 16) {
+		/* Narrow the byte comparison to a 4 bits per byte mask */
+		found = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(
+				vreinterpretq_u16_u8(vceqq_u8(vandq_u8(
+				vld1q_u8(buf + i), vdupq_n_u8(0xFE)),
+				vdupq_n_u8(0xE8))), 4)), 0);
+		if (found != 0)
+			return i + (xz_ctz64(found) >> 2);
+	}
+#endif
+	while (i < size && (buf[i] & 0xFE) != 0xE8)
+		++i;
+
+	return i;
+}
+
 static noinline_for_stack size_t XZ_FUNC bcj_x86(
 		struct xz_dec_bcj *s, uint8_t *buf, size_t size)
 {
@@ -105,10 +146,8 @@ static noinline_for_stack size_t XZ_FUNC bcj_x86(
 		return 0;
 
 	size -= 4;
-	for (i = 0; i < size; ++i) {
-		if ((buf[i] & 0xFE) != 0xE8)
-			continue;
-
+	for (i = bcj_x86_next(buf, 0, size); i < size;
+			i = bcj_x86_next(buf, i + 1, size)) {
 		// coverity[overflow_const]
 		prev_pos = i - prev_pos;
 		if (prev_pos > 3) {
@@ -271,8 +310,33 @@ static noinline_for_stack size_t XZ_FUNC bcj_arm(
 {
 	size_t i;
 	uint32_t addr;
+#if defined(XZ_ARCH_ARM_NEON)
+	uint64_t found;
+#endif
 
 	for (i = 0; i + 4 <= size; i += 4) {
+#if defined(XZ_ARCH_ARM_NEON)
+		/*
+		 * Skip 16 bytes at a time until one of the 4 instructions they
+		 * hold is a BL (0xEB in the most significant byte). The byte
+		 * comparison is narrowed to 4 bits per byte, so that the most
+		 * significant byte of each instruction maps to bits 12-15 of
+		 * each 16-bit lane of the mask.
+		 */
+		while (i + 16 <= size) {
+			found = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(
+					vreinterpretq_u16_u8(vceqq_u8(vld1q_u8(buf + i),
+					vdupq_n_u8(0xEB))), 4)), 0)
+					& 0xF000F000F000F000ULL;
+			if (found != 0) {
+				i += (xz_ctz64(found) >> 4) << 2;
+				break;
+			}
+			i += 16;
+		}
+		if (i + 4 > size)
+			break;
+#endif
 		if (buf[i + 3] == 0xEB) {
 			addr = (uint32_t)buf[i] | ((uint32_t)buf[i + 1] << 8)
 					| ((uint32_t)buf[i + 2] << 16);
@@ -248,6 +248,15 @@ struct lzma2_dec {
 	 * before the first LZMA chunk.
 	 */
 	bool need_props;
+
+	/*
+	 * True when decoding a raw LZMA stream (see xz_dec_lzma1_reset()),
+	 * in which case the whole input is a single LZMA chunk of which
+	 * lzma1_in compressed and lzma1_out uncompressed bytes are left.
+	 */
+	bool lzma1;
+	uint64_t lzma1_in;
+	uint64_t lzma1_out;
 };
 
 struct xz_dec_lzma2 {
@@ -360,11 +369,34 @@ static bool XZ_FUNC dict_repeat(
 	if (dist >= dict->pos)
 		back += dict->end;
 
-	do {
-		dict->buf[dict->pos++] = dict->buf[back++];
-		if (back == dict->end)
-			back = 0;
-	} while (--left > 0);
+	if (back < dict->pos) {
+		/*
+		 * The source doesn't wrap around, so copy the match in chunks
+		 * instead of byte by byte. For overlapping matches (distance
+		 * shorter than the length) the already copied data is itself
+		 * a repetition of the source, so each chunk can be twice as
+		 * large as the previous one without any overlap.
+		 */
+		size_t pos = dict->pos, chunk;
+
+		do {
+			chunk = min_t(size_t, pos - back, left);
+			memcpy(dict->buf + pos, dict->buf + back, chunk);
+			pos += chunk;
+			left -= (uint32_t)chunk;
+		} while (left > 0);
+		dict->pos = pos;
+	} else if (dict->end - back >= left) {
+		/* The source is ahead of the destination and doesn't wrap */
+		memmove(dict->buf + dict->pos, dict->buf + back, left);
+		dict->pos += left;
+	} else {
+		do {
+			dict->buf[dict->pos++] = dict->buf[back++];
+			if (back == dict->end)
+				back = 0;
+		} while (--left > 0);
+	}
 
 	if (dict->full < dict->pos)
 		dict->full = dict->pos;
@@ -517,6 +549,32 @@ static __always_inline int XZ_FUNC rc_bit(struct rc_dec *rc, uint16_t *prob)
 	return bit;
 }
 
+/*
+ * Decode one bit without branching on its value. Bits that are decoded
+ * through bittrees (literals, lengths, distance slots) are close to random,
+ * so computing both outcomes and selecting the right one with a mask is
+ * faster than having the CPU mispredict a branch every other bit. The
+ * results are bit for bit identical to rc_bit().
+ */
+static __always_inline uint32_t XZ_FUNC rc_bit_select(
+		struct rc_dec *rc, uint16_t *prob)
+{
+	uint32_t bound;
+	uint32_t mask;
+	uint32_t p = *prob;
+
+	rc_normalize(rc);
+	bound = (rc->range >> RC_BIT_MODEL_TOTAL_BITS) * p;
+	mask = (uint32_t)0 - (uint32_t)(rc->code >= bound);
+	rc->range = (bound & ~mask) | ((rc->range - bound) & mask);
+	rc->code -= bound & mask;
+	p += (((RC_BIT_MODEL_TOTAL - p) >> RC_MOVE_BITS) & ~mask)
+			- ((p >> RC_MOVE_BITS) & mask);
+	*prob = (uint16_t)p;
+
+	return mask & 1;
+}
+
 /* Decode a bittree starting from the most significant bit. */
 static __always_inline uint32_t XZ_FUNC rc_bittree(
 		struct rc_dec *rc, uint16_t *probs, uint32_t limit)
@@ -524,10 +582,7 @@ static __always_inline uint32_t XZ_FUNC rc_bittree(
 	uint32_t symbol = 1;
 
 	do {
-		if (rc_bit(rc, &probs[symbol]))
-			symbol = (symbol << 1) + 1;
-		else
-			symbol <<= 1;
+		symbol = (symbol << 1) + rc_bit_select(rc, &probs[symbol]);
 	} while (symbol < limit);
 
 	return symbol;
@@ -587,6 +642,7 @@ static void XZ_FUNC lzma_literal(struct xz_dec_lzma2 *s)
 	uint32_t match_byte;
 	uint32_t match_bit;
 	uint32_t offset;
+	uint32_t bit;
 	uint32_t i;
 
 	probs = lzma_literal_probs(s);
@@ -603,13 +659,9 @@ static void XZ_FUNC lzma_literal(struct xz_dec_lzma2 *s)
 			match_byte <<= 1;
 			i = offset + match_bit + symbol;
 
-			if (rc_bit(&s->rc, &probs[i])) {
-				symbol = (symbol << 1) + 1;
-				offset &= match_bit;
-			} else {
-				symbol <<= 1;
-				offset &= ~match_bit;
-			}
+			bit = rc_bit_select(&s->rc, &probs[i]);
+			symbol = (symbol << 1) + bit;
+			offset &= ~(match_bit ^ ((uint32_t)0 - bit));
 		} while (symbol < 0x100);
 	}
 
@@ -928,6 +980,54 @@ static bool XZ_FUNC lzma2_lzma(struct xz_dec_lzma2 *s, struct xz_buf *b)
 	return true;
 }
 
+/*
+ * Decode a raw LZMA stream. There is no chunking, so the compressed size of
+ * the single chunk that lzma2_lzma() works with is topped up from lzma1_in,
+ * as it is only 32-bit. The decoding stops once lzma1_out bytes have been
+ * produced, since end of payload markers are not supported.
+ */
+static enum xz_ret XZ_FUNC lzma1_run(struct xz_dec_lzma2 *s, struct xz_buf *b)
+{
+	size_t in_start, out_start;
+	uint32_t tmp;
+
+	if (s->lzma2.sequence == SEQ_LZMA_PREPARE) {
+		if (!rc_read_init(&s->rc, b))
+			return XZ_OK;
+
+		s->lzma2.sequence = SEQ_LZMA_RUN;
+	}
+
+	while (s->lzma2.lzma1_out > 0) {
+		if (b->out_pos == b->out_size)
+			return XZ_OK;
+
+		tmp = (uint32_t)min_t(uint64_t, s->lzma2.lzma1_in,
+				(1U << 31) - s->lzma2.compressed);
+		s->lzma2.compressed += tmp;
+		s->lzma2.lzma1_in -= tmp;
+
+		in_start = b->in_pos;
+		out_start = b->out_pos;
+		dict_limit(&s->dict, (size_t)min_t(uint64_t,
+				b->out_size - b->out_pos, s->lzma2.lzma1_out));
+		if (!lzma2_lzma(s, b))
+			return XZ_DATA_ERROR;
+
+		s->lzma2.lzma1_out -= dict_flush(&s->dict, b);
+
+		/*
+		 * No progress means that we need more input, unless all of
+		 * it is already here, in which case the stream is truncated.
+		 */
+		if (b->in_pos == in_start && b->out_pos == out_start)
+			return s->lzma2.compressed > s->temp.size ?
+					XZ_OK : XZ_DATA_ERROR;
+	}
+
+	return XZ_STREAM_END;
+}
+
 /*
  * Take care of the LZMA2 control layer, and forward the job of actual LZMA
  * decoding or copying of uncompressed chunks to other functions.
@@ -937,6 +1037,9 @@ XZ_EXTERN NOINLINE enum xz_ret XZ_FUNC xz_dec_lzma2_run(
 {
 	uint32_t tmp;
 
+	if (s->lzma2.lzma1)
+		return lzma1_run(s, b);
+
 	while (b->in_pos < b->in_size || s->lzma2.sequence == SEQ_LZMA_RUN) {
 		switch (s->lzma2.sequence) {
 		case SEQ_CONTROL:
@@ -1128,9 +1231,36 @@ XZ_EXTERN struct xz_dec_lzma2 * XZ_FUNC xz_dec_lzma2_create(
 	return s;
 }
 
+/* Check the dictionary size against the limit and allocate it if needed. */
+static enum xz_ret XZ_FUNC dict_alloc(struct dictionary *dict)
+{
+	if (DEC_IS_MULTI(dict->mode)) {
+		if (dict->size > dict->size_max)
+			return XZ_MEMLIMIT_ERROR;
+
+		dict->end = dict->size;
+
+		if (DEC_IS_DYNALLOC(dict->mode)) {
+			if (dict->allocated < dict->size) {
+				vfree(dict->buf);
+				dict->buf = vmalloc(dict->size);
+				if (dict->buf == NULL) {
+					dict->allocated = 0;
+					return XZ_MEM_ERROR;
+				}
+				dict->allocated = dict->size;
+			}
+		}
+	}
+
+	return XZ_OK;
+}
+
 XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma2_reset(
 		struct xz_dec_lzma2 *s, uint8_t props)
 {
+	enum xz_ret ret;
+
 	/* This limits dictionary size to 3 GiB to keep parsing simpler. */
 	if (props > 39)
 		return XZ_OPTIONS_ERROR;
@@ -1138,34 +1268,59 @@ XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma2_reset(
 	s->dict.size = 2 + (props & 1);
 	s->dict.size <<= (props >> 1) + 11;
 
-	if (DEC_IS_MULTI(s->dict.mode)) {
-		if (s->dict.size > s->dict.size_max)
-			return XZ_MEMLIMIT_ERROR;
-
-		s->dict.end = s->dict.size;
-
-		if (DEC_IS_DYNALLOC(s->dict.mode)) {
-			if (s->dict.allocated < s->dict.size) {
-				vfree(s->dict.buf);
-				s->dict.buf = vmalloc(s->dict.size);
-				if (s->dict.buf == NULL) {
-					s->dict.allocated = 0;
-					return XZ_MEM_ERROR;
-				}
-			}
-		}
-	}
+	ret = dict_alloc(&s->dict);
+	if (ret != XZ_OK)
+		return ret;
 
 	s->lzma.len = 0;
 
 	s->lzma2.sequence = SEQ_CONTROL;
 	s->lzma2.need_dict_reset = true;
+	s->lzma2.lzma1 = false;
 
 	s->temp.size = 0;
 
 	return XZ_OK;
 }
 
+XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma1_reset(struct xz_dec_lzma2 *s,
+		const uint8_t *props, uint64_t in_size, uint64_t out_size)
+{
+	enum xz_ret ret;
+
+	if (!DEC_IS_MULTI(s->dict.mode) || in_size < RC_INIT_BYTES)
+		return XZ_OPTIONS_ERROR;
+
+	/*
+	 * There is no point in a dictionary larger than the output, and the
+	 * LZMA SDK never uses less than 4 KiB.
+	 */
+	s->dict.size = get_le32(props + 1);
+	if (s->dict.size > out_size)
+		s->dict.size = (uint32_t)out_size;
+	if (s->dict.size < 4096)
+		s->dict.size = 4096;
+
+	ret = dict_alloc(&s->dict);
+	if (ret != XZ_OK)
+		return ret;
+
+	if (!lzma_props(s, props[0]))
+		return XZ_OPTIONS_ERROR;
+
+	dict_reset(&s->dict, NULL);
+	s->lzma.len = 0;
+	s->temp.size = 0;
+
+	s->lzma2.sequence = SEQ_LZMA_PREPARE;
+	s->lzma2.compressed = 0;
+	s->lzma2.lzma1 = true;
+	s->lzma2.lzma1_in = in_size - RC_INIT_BYTES;
+	s->lzma2.lzma1_out = out_size;
+
+	return XZ_OK;
+}
+
 XZ_EXTERN void XZ_FUNC xz_dec_lzma2_end(struct xz_dec_lzma2 *s)
 {
 	if (DEC_IS_MULTI(s->dict.mode))
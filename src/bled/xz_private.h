@@ -121,6 +121,15 @@ XZ_EXTERN struct xz_dec_lzma2 * XZ_FUNC xz_dec_lzma2_create(
 XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma2_reset(
 		struct xz_dec_lzma2 *s, uint8_t props);
 
+/*
+ * Reset the decoder for a raw LZMA stream of in_size bytes, that decodes to
+ * out_size bytes, using the 5 bytes of LZMA properties (lc/lp/pb and the
+ * dictionary size) from props. Only multi-call modes are supported. The
+ * stream is then decoded with xz_dec_lzma2_run() or xz_dec_bcj_run().
+ */
+XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma1_reset(struct xz_dec_lzma2 *s,
+		const uint8_t *props, uint64_t in_size, uint64_t out_size);
+
 /* Decode raw LZMA2 stream from b->in to b->out. */
 XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma2_run(
 		struct xz_dec_lzma2 *s, struct xz_buf *b);
@@ -11,6 +11,17 @@
 #define ZSTD_DECOMPRESS_MULTIFRAME      0
 #define ZSTD_NO_TRACE                   1
 
+/* Decoder size/speed tier:
+ * 0: speed - X1 and X2 Huffman decoders (picked per block by HUF_selectDecoder())
+ *    and runtime BMI2 dispatch on x86_64
+ * 5: X1 Huffman decoder only
+ * 7: X1 Huffman decoder and short sequences decoder only, no runtime BMI2
+ * 9: same as 7 with no forced inlining
+ */
+#ifndef CONFIG_FEATURE_ZSTD_SMALL
+#define CONFIG_FEATURE_ZSTD_SMALL       0
+#endif
+
 #if CONFIG_FEATURE_ZSTD_SMALL >= 9
 #define ZSTD_NO_INLINE 1
 #endif
@@ -0,0 +1,308 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Device write cache management
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "devcache.h"
+
+#define SCSI_MODE_SELECT_6          0x15
+#define SCSI_MODE_SENSE_6           0x1a
+#define SCSI_SYNCHRONIZE_CACHE_10   0x35
+#define SCSI_MODE_SELECT_10         0x55
+#define SCSI_MODE_SENSE_10          0x5a
+#define SAT_ATA_PASSTHROUGH_16      0x85
+
+#define ATA_FLUSH_CACHE             0xe7
+#define ATA_IDENTIFY_DEVICE         0xec
+#define ATA_SET_FEATURES            0xef
+#define SETFEATURES_WC_ON           0x02
+#define SETFEATURES_WC_OFF          0x82
+
+#define CACHING_PAGE                0x08
+#define CACHING_PAGE_WCE            0x04
+#define MODE_PC_CURRENT             0x00
+#define MODE_PC_CHANGEABLE          0x40
+#define MODE_BUFFER_SIZE            0xfc
+
+#define SHORT_TIMEOUT               5	// In seconds
+#define FLUSH_TIMEOUT               60
+
+static const char* mode_name[DEVCACHE_MAX] = { "off", "auto", "on" };
+static const char* method_name[] = { "none", "Caching mode page", "ATA SET FEATURES" };
+
+bool devcache_parse_mode(const char* str, int* mode)
+{
+	int i;
+
+	for (i = 0; i < DEVCACHE_MAX; i++) {
+		if (str != NULL && strcmp(str, mode_name[i]) == 0) {
+			*mode = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char* devcache_mode_name(int mode)
+{
+	return (mode >= 0 && mode < DEVCACHE_MAX) ? mode_name[mode] : "unknown";
+}
+
+const char* devcache_method_name(int method)
+{
+	return (method >= DEVCACHE_METHOD_NONE && method <= DEVCACHE_METHOD_ATA) ? method_name[method] : "unknown";
+}
+
+static int dc_send(devcache_state* s, const uint8_t* cdb, size_t cdb_len, int dir, void* buf, size_t len,
+	uint32_t timeout)
+{
+	int r = s->scsi(s->ctx, cdb, cdb_len, dir, buf, len, timeout);
+
+	if (r != 0)
+		s->last_status = r;
+	return r;
+}
+
+/*
+ * Caching mode page
+ */
+
+// Read the Caching mode page and return the offset of the page in buf, or -1 on error
+static int mode_sense(devcache_state* s, uint8_t pc, uint8_t* buf)
+{
+	uint8_t cdb[10] = { 0 };
+	size_t hdr_len, bd_len, data_len, off;
+
+	memset(buf, 0, MODE_BUFFER_SIZE);
+	if (s->use_10) {
+		cdb[0] = SCSI_MODE_SENSE_10;
+		cdb[1] = 0x08;		// DBD: we don't need the block descriptors
+		cdb[2] = pc | CACHING_PAGE;
+		cdb[8] = MODE_BUFFER_SIZE;
+		if (dc_send(s, cdb, 10, DEVCACHE_DATA_IN, buf, MODE_BUFFER_SIZE, SHORT_TIMEOUT) != 0)
+			return -1;
+		hdr_len = 8;
+		data_len = ((buf[0] << 8) | buf[1]) + 2;
+		bd_len = (buf[6] << 8) | buf[7];
+	} else {
+		cdb[0] = SCSI_MODE_SENSE_6;
+		cdb[1] = 0x08;
+		cdb[2] = pc | CACHING_PAGE;
+		cdb[4] = MODE_BUFFER_SIZE;
+		if (dc_send(s, cdb, 6, DEVCACHE_DATA_IN, buf, MODE_BUFFER_SIZE, SHORT_TIMEOUT) != 0)
+			return -1;
+		hdr_len = 4;
+		data_len = buf[0] + 1;
+		bd_len = buf[3];
+	}
+	// Some devices ignore DBD, and some return the first page they have rather than the one we asked for
+	off = hdr_len + bd_len;
+	if (data_len > MODE_BUFFER_SIZE || off + 3 > data_len || (buf[off] & 0x3f) != CACHING_PAGE ||
+		off + 2 + buf[off + 1] > data_len)
+		return -1;
+	return (int)off;
+}
+
+static int mode_select(devcache_state* s, uint8_t* buf, int off)
+{
+	uint8_t cdb[10] = { 0 };
+	size_t hdr_len = s->use_10 ? 8 : 4, page_len = 2 + buf[off + 1], len = hdr_len + page_len;
+
+	// Send the page back without the block descriptors. The mode data length and the
+	// device specific parameter are reserved for MODE SELECT, and the PS bit must be zero.
+	memmove(&buf[hdr_len], &buf[off], page_len);
+	memset(buf, 0, hdr_len);
+	buf[hdr_len] &= 0x3f;
+	if (s->use_10) {
+		cdb[0] = SCSI_MODE_SELECT_10;
+		cdb[1] = 0x10;		// PF, but not SP, so that the setting isn't saved
+		cdb[7] = (uint8_t)(len >> 8);
+		cdb[8] = (uint8_t)len;
+	} else {
+		cdb[0] = SCSI_MODE_SELECT_6;
+		cdb[1] = 0x10;
+		cdb[4] = (uint8_t)len;
+	}
+	return dc_send(s, cdb, s->use_10 ? 10 : 6, DEVCACHE_DATA_OUT, buf, len, SHORT_TIMEOUT);
+}
+
+// Returns 1 if enabled, 0 if disabled, -1 on error
+static int mode_page_get(devcache_state* s)
+{
+	uint8_t buf[MODE_BUFFER_SIZE];
+	int off = mode_sense(s, MODE_PC_CURRENT, buf);
+
+	return (off < 0) ? -1 : ((buf[off + 2] & CACHING_PAGE_WCE) ? 1 : 0);
+}
+
+static int mode_page_set(devcache_state* s, bool enable)
+{
+	uint8_t buf[MODE_BUFFER_SIZE];
+	int off = mode_sense(s, MODE_PC_CURRENT, buf);
+
+	if (off < 0)
+		return -1;
+	if (enable)
+		buf[off + 2] |= CACHING_PAGE_WCE;
+	else
+		buf[off + 2] &= ~CACHING_PAGE_WCE;
+	if (mode_select(s, buf, off) != 0)
+		return -1;
+	// Bridges have been known to accept a MODE SELECT and do nothing with it
+	return (mode_page_get(s) == (enable ? 1 : 0)) ? 0 : -1;
+}
+
+static bool mode_page_probe(devcache_state* s)
+{
+	uint8_t buf[MODE_BUFFER_SIZE];
+	int off;
+
+	// Start with the 6-byte commands, which USB devices are the most likely to support
+	for (s->use_10 = false; ; s->use_10 = true) {
+		off = mode_sense(s, MODE_PC_CHANGEABLE, buf);
+		if (off >= 0)
+			return (buf[off + 2] & CACHING_PAGE_WCE) != 0;
+		if (s->use_10)
+			return false;
+	}
+}
+
+/*
+ * ATA SET FEATURES, through ATA PASS-THROUGH (16)
+ */
+static int ata_command(devcache_state* s, uint8_t command, uint8_t features, void* buf, uint32_t timeout)
+{
+	uint8_t cdb[16] = { 0 };
+
+	cdb[0] = SAT_ATA_PASSTHROUGH_16;
+	if (buf != NULL) {
+		cdb[1] = 4 << 1;	// PIO Data-In
+		cdb[2] = 0x0e;		// T_DIR (from device), BYTE_BLOCK, T_LENGTH in the sector count field
+		cdb[6] = 1;
+	} else {
+		cdb[1] = 3 << 1;	// Non-data
+	}
+	cdb[4] = features;
+	cdb[13] = 0x40;			// LBA mode
+	cdb[14] = command;
+	return dc_send(s, cdb, sizeof(cdb), (buf != NULL) ? DEVCACHE_DATA_IN : DEVCACHE_DATA_NONE,
+		buf, (buf != NULL) ? 512 : 0, timeout);
+}
+
+// Returns 1 if enabled, 0 if disabled, -1 on error or if the device has no write cache
+static int ata_get(devcache_state* s)
+{
+	uint8_t ident[512];
+	uint16_t word82, word85;
+
+	memset(ident, 0, sizeof(ident));
+	if (ata_command(s, ATA_IDENTIFY_DEVICE, 0, ident, SHORT_TIMEOUT) != 0)
+		return -1;
+	// Word 82 bit 5: write cache supported, word 85 bit 5: write cache enabled
+	word82 = ident[2 * 82] | (ident[2 * 82 + 1] << 8);
+	word85 = ident[2 * 85] | (ident[2 * 85 + 1] << 8);
+	if (word82 == 0x0000 || word82 == 0xffff || !(word82 & 0x0020))
+		return -1;
+	return (word85 & 0x0020) ? 1 : 0;
+}
+
+static int ata_set(devcache_state* s, bool enable)
+{
+	if (ata_command(s, ATA_SET_FEATURES, enable ? SETFEATURES_WC_ON : SETFEATURES_WC_OFF, NULL, SHORT_TIMEOUT) != 0)
+		return -1;
+	return (ata_get(s) == (enable ? 1 : 0)) ? 0 : -1;
+}
+
+static int set_cache(devcache_state* s, bool enable)
+{
+	return (s->method == DEVCACHE_METHOD_ATA) ? ata_set(s, enable) : mode_page_set(s, enable);
+}
+
+int devcache_begin(devcache_state* s, int mode, devcache_scsi_fn scsi, void* ctx)
+{
+	int r;
+
+	memset(s, 0, sizeof(*s));
+	s->scsi = scsi;
+	s->ctx = ctx;
+	s->mode = mode;
+	if (mode <= DEVCACHE_OFF || mode >= DEVCACHE_MAX || scsi == NULL)
+		return 0;
+
+	if (mode_page_probe(s)) {
+		s->method = DEVCACHE_METHOD_MODE_PAGE;
+		r = mode_page_get(s);
+	} else if (mode == DEVCACHE_ON && (r = ata_get(s)) >= 0) {
+		s->method = DEVCACHE_METHOD_ATA;
+	} else {
+		// The device may still have its write cache enabled, in which case we might as well flush it
+		s->use_10 = false;
+		r = mode_page_get(s);
+		if (r < 0) {
+			s->use_10 = true;
+			r = mode_page_get(s);
+		}
+		s->was_enabled = s->enabled = (r == 1);
+		return s->enabled ? 0 : ENOTSUP;
+	}
+	if (r < 0) {
+		s->method = DEVCACHE_METHOD_NONE;
+		return EIO;
+	}
+	s->was_enabled = s->enabled = (r == 1);
+	if (s->enabled)
+		return 0;
+	// Consider the setting changed as soon as we try, so that the caller restores it
+	// if the device ends up in an unexpected state
+	s->changed = true;
+	if (set_cache(s, true) != 0) {
+		s->enabled = (((s->method == DEVCACHE_METHOD_ATA) ? ata_get(s) : mode_page_get(s)) == 1);
+		if (!s->enabled)
+			s->changed = false;
+		return s->enabled ? 0 : EIO;
+	}
+	s->enabled = true;
+	return 0;
+}
+
+int devcache_flush(devcache_state* s)
+{
+	uint8_t cdb[10] = { SCSI_SYNCHRONIZE_CACHE_10, 0 };
+
+	if (s->scsi == NULL || !s->enabled)
+		return 0;
+	if (s->method == DEVCACHE_METHOD_ATA)
+		return (ata_command(s, ATA_FLUSH_CACHE, 0, NULL, FLUSH_TIMEOUT) == 0) ? 0 : EIO;
+	return (dc_send(s, cdb, sizeof(cdb), DEVCACHE_DATA_NONE, NULL, 0, FLUSH_TIMEOUT) == 0) ? 0 : EIO;
+}
+
+int devcache_end(devcache_state* s)
+{
+	int r = devcache_flush(s);
+
+	if (s->changed) {
+		if (set_cache(s, s->was_enabled) != 0)
+			r = EIO;
+		else
+			s->enabled = s->was_enabled;
+		s->changed = false;
+	}
+	return r;
+}
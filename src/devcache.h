@@ -0,0 +1,92 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Device write cache management
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#pragma once
+
+/*
+ * Many USB-SATA bridges and enclosures come with their write cache disabled, which
+ * makes every write wait for the media. This enables the write cache of a device for
+ * the duration of a write job, flushes it at checkpoints and at the end of the job,
+ * and then restores the original setting.
+ * The setting is changed through the SCSI Caching mode page (08h) which SAT bridges
+ * translate to ATA SET FEATURES, or, in DEVCACHE_ON mode only, since some bridges
+ * don't take well to commands they don't know, with SET FEATURES sent through ATA
+ * PASS-THROUGH. The setting is never saved, so a power cycle also restores it.
+ * Commands go through a SCSI transport provided by the caller, so that this can be
+ * used with any passthrough interface, or with a mocked one.
+ */
+
+enum {
+	DEVCACHE_OFF = 0,		// Leave the device alone
+	DEVCACHE_AUTO,			// Enable the write cache if the device lets us do it through the Caching mode page
+	DEVCACHE_ON,			// Also try ATA SET FEATURES through ATA PASS-THROUGH
+	DEVCACHE_MAX
+};
+
+enum {
+	DEVCACHE_METHOD_NONE = 0,
+	DEVCACHE_METHOD_MODE_PAGE,
+	DEVCACHE_METHOD_ATA,
+};
+
+// Same values as SCSI_IOCTL_DATA_###
+#define DEVCACHE_DATA_OUT           0
+#define DEVCACHE_DATA_IN            1
+#define DEVCACHE_DATA_NONE          2
+
+// Flush the cache every time this much data has been written
+#define DEVCACHE_CHECKPOINT_SIZE    (1024 * 1024 * 1024ULL)
+
+/*
+ * Send a CDB to the device and transfer len bytes of data in the direction dir.
+ * timeout is in seconds. Must return 0 on success, a positive SCSI status if the
+ * command failed, or a negative value if it could not be sent.
+ */
+typedef int (*devcache_scsi_fn)(void* ctx, const uint8_t* cdb, size_t cdb_len, int dir,
+	void* buf, size_t len, uint32_t timeout);
+
+typedef struct {
+	devcache_scsi_fn scsi;
+	void* ctx;
+	int mode;
+	int method;             // DEVCACHE_METHOD_###
+	bool was_enabled;       // Setting of the write cache before the job
+	bool enabled;           // Current setting of the write cache
+	bool changed;           // Whether we changed the setting, and need to restore it
+	bool use_10;            // Whether the device wants MODE SENSE/SELECT (10) rather than (6)
+	int last_status;        // Status of the last command that failed
+} devcache_state;
+
+// Parse "auto", "on" or "off". Returns false if the string is none of these.
+extern bool devcache_parse_mode(const char* str, int* mode);
+extern const char* devcache_mode_name(int mode);
+extern const char* devcache_method_name(int method);
+
+// Returns 0 if the write cache is enabled (whether it already was or not) or if mode is
+// DEVCACHE_OFF, ENOTSUP if the device doesn't let us change it, or EIO on command error.
+extern int devcache_begin(devcache_state* s, int mode, devcache_scsi_fn scsi, void* ctx);
+// Flush the write cache, if enabled. Returns 0 or EIO.
+extern int devcache_flush(devcache_state* s);
+// Flush the write cache and restore the original setting. Safe to call more than once,
+// and after a failed devcache_begin(). Returns 0 or EIO.
+extern int devcache_end(devcache_state* s);
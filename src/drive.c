@@ -2566,6 +2566,32 @@ BOOL RefreshDriveLayout(HANDLE hDrive)
 	return r;
 }
 
+/*
+ * Ask the storage stack to discard (TRIM/UNMAP) a range of the drive.
+ * Note that, unless the device guarantees it, discarded data need not read back as zeroes.
+ */
+BOOL DiscardDriveRange(HANDLE hDrive, uint64_t offset, uint64_t length)
+{
+	BOOL r;
+	DWORD size;
+	struct {
+		DEVICE_MANAGE_DATA_SET_ATTRIBUTES dsm;
+		DEVICE_DATA_SET_RANGE range;
+	} attr = { 0 };
+
+	attr.dsm.Size = sizeof(attr.dsm);
+	attr.dsm.Action = DeviceDsmAction_Trim;
+	attr.dsm.DataSetRangesOffset = (DWORD)((uint8_t*)&attr.range - (uint8_t*)&attr);
+	attr.dsm.DataSetRangesLength = sizeof(attr.range);
+	attr.range.StartingOffset = (LONGLONG)offset;
+	attr.range.LengthInBytes = length;
+
+	r = DeviceIoControl(hDrive, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &attr, sizeof(attr), NULL, 0, &size, NULL);
+	if (!r)
+		uprintf("Could not discard drive range: %s", WindowsErrorString());
+	return r;
+}
+
 /* Initialize disk for partitioning */
 BOOL InitializeDisk(HANDLE hDrive)
 {
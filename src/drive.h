@@ -332,11 +332,58 @@ typedef struct _DRIVE_LAYOUT_INFORMATION_EX4 {
 	PARTITION_INFORMATION_EX PartitionEntry[MAX_PARTITIONS];
 } DRIVE_LAYOUT_INFORMATION_EX4, *PDRIVE_LAYOUT_INFORMATION_EX4;
 
+/* On-disk GPT header and partition entry */
+#pragma pack(push, 1)
+typedef struct {
+	char Signature[8];
+	uint32_t Revision;
+	uint32_t HeaderSize;
+	uint32_t HeaderCRC32;
+	uint32_t Reserved;
+	uint64_t MyLBA;
+	uint64_t AlternateLBA;
+	uint64_t FirstUsableLBA;
+	uint64_t LastUsableLBA;
+	GUID DiskGUID;
+	uint64_t PartitionEntryLBA;
+	uint32_t NumberOfPartitionEntries;
+	uint32_t SizeOfPartitionEntry;
+	uint32_t PartitionEntryArrayCRC32;
+} GPT_HEADER;
+
+typedef struct {
+	GUID PartitionTypeGUID;
+	GUID UniquePartitionGUID;
+	uint64_t StartingLBA;
+	uint64_t EndingLBA;
+	uint64_t Attributes;
+	wchar_t PartitionName[36];
+} GPT_ENTRY;
+#pragma pack(pop)
+
 static __inline BOOL UnlockDrive(HANDLE hDrive) {
 	return DeviceIoControl(hDrive, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0, NULL, NULL);
 }
 #define safe_unlockclose(h) do {if ((h != INVALID_HANDLE_VALUE) && (h != NULL)) {UnlockDrive(h); CloseHandle(h); h = INVALID_HANDLE_VALUE;}} while(0)
 
+/* Transfer and provisioning limits, as reported by the device */
+typedef struct {
+	uint32_t LogicalBlockSize;
+	uint32_t PhysicalBlockSize;
+	uint32_t AlignmentOffset;		// In bytes
+	uint32_t MaxTransferLength;		// In bytes, 0 if unknown
+	uint32_t OptimalTransferLength;	// In bytes, 0 if unknown
+	uint64_t MaxWriteSameLength;	// In blocks, 0 if unknown
+	uint32_t MaxUnmapLength;		// In blocks, 0 if unknown
+	uint32_t UnmapGranularity;		// In blocks, 0 if unknown
+	uint32_t UnmapAlignment;		// In blocks, LBA of the first unmap granularity unit
+	BOOL ProvisioningReported;
+	BOOL CanUnmap;
+	BOOL CanWriteSameUnmap;
+	BOOL ReadsZeroesAfterUnmap;
+	BOOL IsAta;
+} DEVICE_LIMITS;
+
 /* Current drive info */
 typedef struct {
 	LONGLONG DiskSize;
@@ -360,6 +407,7 @@ typedef struct {
 		ULONG Allowed;
 		ULONG Default;
 	} ClusterSize[FS_MAX];
+	DEVICE_LIMITS Limits;
 } RUFUS_DRIVE_INFO;
 extern RUFUS_DRIVE_INFO SelectedDrive;
 extern int partition_index[PI_MAX];
@@ -398,6 +446,11 @@ BOOL RemountVolume(char* drive_name, BOOL bSilent);
 BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL mbr_uefi_marker, uint8_t extra_partitions);
 BOOL InitializeDisk(HANDLE hDrive);
 BOOL RefreshDriveLayout(HANDLE hDrive);
+BOOL DiscardDriveRange(HANDLE hDrive, uint64_t offset, uint64_t length);
+BOOL GetDeviceLimits(HANDLE hPhysical, DEVICE_LIMITS* Limits);
+BOOL SetDeviceWriteCache(HANDLE hPhysical, int Mode);
+BOOL FlushDeviceWriteCache(HANDLE hPhysical);
+BOOL RestoreDeviceWriteCache(HANDLE hPhysical, DWORD DriveIndex);
 const char* GetMBRPartitionType(const uint8_t type);
 const char* GetGPTPartitionType(const GUID* guid);
 const char* GetExtFsLabel(DWORD DriveIndex, uint64_t PartitionOffset);
@@ -260,6 +260,137 @@ static blk64_t get_midpoint_journal_block(ext2_filsys fs)
 	return ext2fs_group_first_block2(fs, group);
 }
 
+/*
+ * For Rufus usage: allocate the blocks of a block mapped journal inode in one
+ * go, with the indirect blocks laid out inline, as the kernel would, rather
+ * than going through ext2fs_bmap2() for every single block. The blocks are
+ * picked sequentially from the goal, so that the journal gets allocated as a
+ * single contiguous run, unless it has to span group metadata.
+ *
+ * The data blocks are only zeroed if 'zero' is set, in which case each run
+ * is handed to ext2fs_zero_blocks2() as a whole, which lets the I/O manager
+ * use a discard, when the device guarantees that it reads back as zeroes.
+ * Otherwise, we only opportunistically try such a discard.
+ */
+static errcode_t alloc_ind_journal_blocks(ext2_filsys fs,
+					  struct ext2_inode *inode,
+					  blk_t num_blocks, blk64_t goal,
+					  int zero)
+{
+	errcode_t	retval;
+	blk64_t		*phys = NULL, run_start;
+	blk_t		lblk, i, total, allocated = 0, addr_per_block;
+	blk_t		ind_idx = 0, ind_blk = 0, dind_blk = 0;
+	__u32		*ind = NULL, *dind = NULL;
+	int		run_len, try_zeroout = 1;
+
+	addr_per_block = (blk_t) fs->blocksize >> 2;
+	/* Triple indirect journals are left to ext2fs_fallocate() */
+	if (num_blocks > EXT2_NDIR_BLOCKS + addr_per_block +
+	    addr_per_block * addr_per_block)
+		return EXT2_ET_OP_NOT_SUPPORTED;
+
+	total = num_blocks;
+	if (num_blocks > EXT2_NDIR_BLOCKS)
+		total++;
+	if (num_blocks > EXT2_NDIR_BLOCKS + addr_per_block)
+		total += 1 + ext2fs_div_ceil(num_blocks - EXT2_NDIR_BLOCKS -
+					     addr_per_block, addr_per_block);
+
+	retval = ext2fs_get_array(total, sizeof(blk64_t), &phys);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_memzero(fs->blocksize, &ind);
+	if (retval)
+		goto out;
+	retval = ext2fs_get_memzero(fs->blocksize, &dind);
+	if (retval)
+		goto out;
+
+	/* Allocate everything, in on-disk order */
+	for (; allocated < total; allocated++) {
+		retval = ext2fs_new_block2(fs, goal, NULL, &phys[allocated]);
+		if (retval)
+			goto errout;
+		if (phys[allocated] > 0xffffffffULL) {
+			retval = EXT2_ET_BLOCK_ALLOC_FAIL;
+			goto errout;
+		}
+		ext2fs_block_alloc_stats2(fs, phys[allocated], +1);
+		goal = phys[allocated] + 1;
+	}
+
+	/* Zero the contiguous runs, before any indirect block gets written */
+	ext2fs_print_progress(0, 0);
+	for (i = 0; i < total; i += run_len) {
+		run_start = phys[i];
+		for (run_len = 1; (i + run_len < total) && (run_len < 65536) &&
+		     (phys[i + run_len] == run_start + run_len); run_len++);
+		retval = ext2fs_print_progress(i, total);
+		if (retval)
+			goto errout;
+		if (zero) {
+			retval = ext2fs_zero_blocks2(fs, run_start, run_len,
+						     NULL, NULL);
+			if (retval)
+				goto errout;
+		} else if (try_zeroout) {
+			try_zeroout = (io_channel_zeroout(fs->io, run_start,
+							  run_len) == 0);
+		}
+	}
+
+	/* Fill the block map and write the indirect blocks */
+	for (lblk = 0, i = 0; lblk < num_blocks; lblk++) {
+		if (lblk >= EXT2_NDIR_BLOCKS &&
+		    (lblk - EXT2_NDIR_BLOCKS) % addr_per_block == 0) {
+			if (ind_blk) {
+				retval = io_channel_write_blk64(fs->io,
+							ind_blk, 1, ind);
+				if (retval)
+					goto errout;
+				memset(ind, 0, fs->blocksize);
+			}
+			if (lblk == EXT2_NDIR_BLOCKS + addr_per_block) {
+				dind_blk = (blk_t) phys[i++];
+				inode->i_block[EXT2_DIND_BLOCK] = dind_blk;
+			}
+			ind_blk = (blk_t) phys[i++];
+			if (lblk == EXT2_NDIR_BLOCKS)
+				inode->i_block[EXT2_IND_BLOCK] = ind_blk;
+			else
+				dind[ind_idx++] = ext2fs_cpu_to_le32(ind_blk);
+		}
+		if (lblk < EXT2_NDIR_BLOCKS)
+			inode->i_block[lblk] = (blk_t) phys[i++];
+		else
+			ind[(lblk - EXT2_NDIR_BLOCKS) % addr_per_block] =
+				ext2fs_cpu_to_le32((blk_t) phys[i++]);
+	}
+	if (ind_blk) {
+		retval = io_channel_write_blk64(fs->io, ind_blk, 1, ind);
+		if (retval)
+			goto errout;
+	}
+	if (dind_blk) {
+		retval = io_channel_write_blk64(fs->io, dind_blk, 1, dind);
+		if (retval)
+			goto errout;
+	}
+
+	retval = ext2fs_iblk_set(fs, inode, total);
+	goto out;
+
+errout:
+	for (i = 0; i < allocated; i++)
+		ext2fs_block_alloc_stats2(fs, phys[i], -1);
+out:
+	ext2fs_free_mem(&dind);
+	ext2fs_free_mem(&ind);
+	ext2fs_free_mem(&phys);
+	return retval;
+}
+
 /*
  * This function creates a journal using direct I/O routines.
  */
@@ -277,6 +408,18 @@ static errcode_t write_journal_inode(ext2_filsys fs, ext2_ino_t journal_ino,
 						       &buf)))
 		return retval;
 
+	/*
+	 * For Rufus usage: the kernel doesn't replay a journal whose s_start is
+	 * zero, so leaving stale data in the journal area is fine, as long as none
+	 * of it can later pass for one of our transactions. Starting from the
+	 * sequence number the UUID gives us takes care of that.
+	 */
+	if (flags & EXT2_MKJOURNAL_LAZYINIT) {
+		__u32 seq;
+		memcpy(&seq, fs->super->s_uuid, sizeof(seq));
+		((journal_superblock_t *) buf)->s_sequence = htonl(seq | 1);
+	}
+
 	if ((retval = ext2fs_read_bitmaps(fs)))
 		goto out2;
 
@@ -305,8 +448,14 @@ static errcode_t write_journal_inode(ext2_filsys fs, ext2_ino_t journal_ino,
 	if (retval)
 		goto out2;
 
-	retval = ext2fs_fallocate(fs, falloc_flags, journal_ino,
-				  &inode, goal, 0, num_blocks);
+	if (inode.i_flags & EXT4_EXTENTS_FL)
+		retval = EXT2_ET_OP_NOT_SUPPORTED;
+	else
+		retval = alloc_ind_journal_blocks(fs, &inode, num_blocks, goal,
+					!(flags & EXT2_MKJOURNAL_LAZYINIT));
+	if (retval == EXT2_ET_OP_NOT_SUPPORTED)
+		retval = ext2fs_fallocate(fs, falloc_flags, journal_ino,
+					  &inode, goal, 0, num_blocks);
 	if (retval)
 		goto out2;
 
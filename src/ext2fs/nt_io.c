@@ -28,11 +28,13 @@
 #include "config.h"
 #include "ext2fs.h"
 #include "rufus.h"
+#include "trace.h"
 #include "ntdll.h"
 #include "msapi_utf8.h"
 
 extern char* NtStatusError(NTSTATUS Status);
-static DWORD LastWinError = 0;
+// Per thread, as the persistence partition can be formatted in the background
+static THREAD_LOCAL DWORD LastWinError = 0;
 
 #define ARGUMENT_PRESENT(ArgumentPointer)   ((CHAR *)((ULONG_PTR)(ArgumentPointer)) != (CHAR *)(NULL))
 
@@ -57,6 +59,9 @@ typedef struct _NT_PRIVATE_DATA {
     // Used by Rufus
     __u64   offset;
     __u64   size;
+    BOOLEAN no_discard;
+    __u64   discard_granularity;    // In bytes, 0 if unknown
+    __u64   discard_alignment;      // In bytes, from the start of the device
 } NT_PRIVATE_DATA, *PNT_PRIVATE_DATA;
 
 //
@@ -71,6 +76,9 @@ static errcode_t nt_read_blk64(io_channel channel, unsigned long long block, int
 static errcode_t nt_write_blk(io_channel channel, unsigned long block, int count, const void *data);
 static errcode_t nt_write_blk64(io_channel channel, unsigned long long block, int count, const void* data);
 static errcode_t nt_flush(io_channel channel);
+static errcode_t nt_discard(io_channel channel, unsigned long long block, unsigned long long count);
+static errcode_t nt_zeroout(io_channel channel, unsigned long long block, unsigned long long count);
+static errcode_t nt_set_option(io_channel channel, const char *option, const char *arg);
 
 struct struct_io_manager struct_nt_manager = {
 	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
@@ -82,7 +90,10 @@ struct struct_io_manager struct_nt_manager = {
 	.read_blk64	= nt_read_blk64,
 	.write_blk	= nt_write_blk,
 	.write_blk64	= nt_write_blk64,
-	.flush		= nt_flush
+	.flush		= nt_flush,
+	.discard	= nt_discard,
+	.zeroout	= nt_zeroout,
+	.set_option	= nt_set_option
 };
 
 io_manager nt_io_manager = &struct_nt_manager;
@@ -394,12 +405,49 @@ static BOOLEAN _BlockIo(IN HANDLE Handle, IN LARGE_INTEGER Offset, IN ULONG Byte
 
 static BOOLEAN _RawWrite(IN HANDLE Handle, IN LARGE_INTEGER Offset, IN ULONG Bytes, OUT const CHAR* Buffer, OUT errcode_t* Errno)
 {
-	return _BlockIo(Handle, Offset, Bytes, (PCHAR)Buffer, FALSE, Errno);
+	uint64_t t = TRACE_BEGIN();
+	BOOLEAN r = _BlockIo(Handle, Offset, Bytes, (PCHAR)Buffer, FALSE, Errno);
+
+	TRACE_END_BYTES("ext2fs write", t, Bytes);
+	return r;
 }
 
 static BOOLEAN _RawRead(IN HANDLE Handle, IN LARGE_INTEGER Offset, IN ULONG Bytes, IN PCHAR Buffer, OUT errcode_t* Errno)
 {
-	return _BlockIo(Handle, Offset, Bytes, Buffer, TRUE, Errno);
+	uint64_t t = TRACE_BEGIN();
+	BOOLEAN r = _BlockIo(Handle, Offset, Bytes, Buffer, TRUE, Errno);
+
+	TRACE_END_BYTES("ext2fs read", t, Bytes);
+	return r;
+}
+
+static BOOLEAN _Trim(IN HANDLE Handle, IN LARGE_INTEGER Offset, IN __u64 Bytes, OUT errcode_t* Errno)
+{
+	IO_STATUS_BLOCK IoStatusBlock;
+	NTSTATUS Status;
+	uint64_t t = TRACE_BEGIN();
+	struct {
+		DEVICE_MANAGE_DATA_SET_ATTRIBUTES dsm;
+		DEVICE_DATA_SET_RANGE range;
+	} attr = { 0 };
+
+	attr.dsm.Size = sizeof(attr.dsm);
+	attr.dsm.Action = DeviceDsmAction_Trim;
+	attr.dsm.DataSetRangesOffset = (DWORD)((uint8_t*)&attr.range - (uint8_t*)&attr);
+	attr.dsm.DataSetRangesLength = sizeof(attr.range);
+	attr.range.StartingOffset = Offset.QuadPart;
+	attr.range.LengthInBytes = Bytes;
+
+	LastWinError = 0;
+	Status = NtDeviceIoControlFile(Handle, NULL, NULL, NULL, &IoStatusBlock,
+		IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &attr, sizeof(attr), NULL, 0);
+	TRACE_END_BYTES("ext2fs discard", t, Bytes);
+	if (!NT_SUCCESS(Status)) {
+		*Errno = _MapNtStatus(Status);
+		return FALSE;
+	}
+	*Errno = 0;
+	return TRUE;
 }
 
 static BOOLEAN _SetPartType(IN HANDLE Handle, IN UCHAR Type)
@@ -698,6 +746,128 @@ static errcode_t nt_write_blk(io_channel channel, unsigned long block, int count
 	return nt_write_blk64(channel, block, count, buf);
 }
 
+static errcode_t nt_discard(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	LARGE_INTEGER offset;
+	PNT_PRIVATE_DATA nt_data = NULL;
+	errcode_t errcode = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
+	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
+
+	if (nt_data->read_only)
+		return EACCES;
+	// Don't keep on issuing requests that the device has already rejected
+	if (nt_data->no_discard)
+		return EXT2_ET_UNIMPLEMENTED;
+
+	offset.QuadPart = block * channel->block_size + nt_data->offset;
+	if (!_Trim(nt_data->handle, offset, count * channel->block_size, &errcode)) {
+		nt_data->no_discard = TRUE;
+		return errcode;
+	}
+
+	if ((nt_data->buffer_block_number >= block) && (nt_data->buffer_block_number < block + count))
+		nt_data->buffer_block_number = 0xffffffff;
+	nt_data->written = TRUE;
+
+	return 0;
+}
+
+static errcode_t nt_write_zeroes(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	errcode_t errcode = 0;
+	unsigned long long n, max_blocks = max(1ULL * MB / channel->block_size, 1ULL);
+	void* buf = calloc((size_t)min(count, max_blocks), channel->block_size);
+
+	if (buf == NULL)
+		return EXT2_ET_NO_MEMORY;
+	for (; (count > 0) && (errcode == 0); block += n, count -= n) {
+		n = min(count, max_blocks);
+		errcode = nt_write_blk64(channel, block, (int)n, buf);
+	}
+	free(buf);
+	return errcode;
+}
+
+/*
+ * Only a discard that the device guarantees to read back as zeroes can stand in for
+ * writing zeroes, which is something that the caller must tell us, through the
+ * CHANNEL_FLAGS_DISCARD_ZEROES channel flag, since we can't query it from here.
+ * Even then, the guarantee only holds for whole unmap granularity units, and devices
+ * are free to ignore partial ones, so we only discard the part of the range that is
+ * made of aligned units, and write zeroes at both ends. If there is no such part, or
+ * the granularity wasn't provided (see nt_set_option()), libext2fs writes the zeroes.
+ */
+static errcode_t nt_zeroout(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	PNT_PRIVATE_DATA nt_data = NULL;
+	unsigned long long start, end, first, last, bs, g, a;
+	errcode_t errcode;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
+	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
+
+	if (!io_channel_discard_zeroes_data(channel) || nt_data->no_discard)
+		return EXT2_ET_UNIMPLEMENTED;
+	bs = channel->block_size;
+	g = nt_data->discard_granularity;
+	// Units must map to whole blocks, so that the ends can be written
+	if ((g == 0) || (g % bs != 0) || (nt_data->offset % bs != 0))
+		return EXT2_ET_UNIMPLEMENTED;
+	a = nt_data->discard_alignment % g;
+
+	// Device offsets of the start of the first and the end of the last aligned unit
+	start = block * bs + nt_data->offset;
+	end = start + count * bs;
+	if (end < a + g)
+		return EXT2_ET_UNIMPLEMENTED;
+	start = (start <= a) ? a : ((start - a + g - 1) / g) * g + a;
+	end = ((end - a) / g) * g + a;
+	if (start >= end)
+		return EXT2_ET_UNIMPLEMENTED;
+	first = (start - nt_data->offset) / bs;
+	last = (end - nt_data->offset) / bs;
+
+	errcode = nt_discard(channel, first, last - first);
+	if ((errcode == 0) && (first > block))
+		errcode = nt_write_zeroes(channel, block, first - block);
+	if ((errcode == 0) && (block + count > last))
+		errcode = nt_write_zeroes(channel, last, block + count - last);
+	return errcode;
+}
+
+/*
+ * Rufus specific options, that can be set with io_channel_set_options():
+ * - discard_granularity=<bytes>: the unmap granularity of the device
+ * - discard_alignment=<bytes>: the device offset of the first unmap granularity unit
+ */
+static errcode_t nt_set_option(io_channel channel, const char *option, const char *arg)
+{
+	PNT_PRIVATE_DATA nt_data = NULL;
+	unsigned long long val;
+	char *end;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
+	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
+
+	if (arg == NULL)
+		return EXT2_ET_INVALID_ARGUMENT;
+	val = strtoull(arg, &end, 0);
+	if (*end != 0)
+		return EXT2_ET_INVALID_ARGUMENT;
+	if (strcmp(option, "discard_granularity") == 0)
+		nt_data->discard_granularity = val;
+	else if (strcmp(option, "discard_alignment") == 0)
+		nt_data->discard_alignment = val;
+	else
+		return EXT2_ET_INVALID_ARGUMENT;
+	return 0;
+}
+
 static errcode_t nt_flush(io_channel channel)
 {
 	PNT_PRIVATE_DATA nt_data = NULL;
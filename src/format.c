@@ -55,12 +55,23 @@
 #include "drive.h"
 #include "format.h"
 #include "badblocks.h"
+#include "smart.h"
+#include "devcache.h"
 #include "bled/bled.h"
 #include "../res/grub/grub_version.h"
 
 /* Numbers of buffer used for asynchronous DD reads */
 #define NUM_BUFFERS 2
 
+/* Device-native erase parameters */
+#define ERASE_CHUNK_SIZE            (256 * MB)	// Amount of data per WRITE SAME/discard request
+#define ERASE_TIMEOUT               30			// Timeout for a single WRITE SAME request (in seconds)
+#define ERASE_PROBE_SIZE            (1 * MB)	// Amount of data for the first WRITE SAME request
+#define ERASE_PROBE_TIMEOUT         5			// Timeout for the first WRITE SAME request (in seconds)
+#define ERASE_VERIFY_THREADS        4
+#define ERASE_SAMPLE_COUNT          256
+#define ERASE_SAMPLE_SIZE           (64 * KB)
+
 /*
  * Globals
  */
@@ -70,12 +81,19 @@ badblocks_report report = { 0 };
 static float format_percent = 0.0f;
 static int task_number = 0, actual_fs_type;
 static unsigned int sec_buf_pos = 0;
+static BOOL building_master_image = FALSE;
+static const char* master_image_path = NULL;
+static char master_image[MAX_PATH] = "";
 extern const int nb_steps[FS_MAX];
 extern const char* md5sum_name[2];
 extern uint32_t dur_mins, dur_secs;
 extern BOOL force_large_fat32, enable_ntfs_compression, lock_drive, zero_drive, fast_zeroing, enable_file_indexing;
-extern BOOL write_as_image, use_vds, write_as_esp, is_vds_available, has_ffu_support, use_rufus_mbr;
+extern BOOL write_as_image, use_vds, write_as_esp, is_vds_available, has_ffu_support, use_rufus_mbr, mass_flash;
+extern int default_thread_priority, device_cache_mode;
 extern char* archive_path;
+// From bled/libbb.h, which we don't want to pull in here
+extern uint32_t* crc32_filltable(uint32_t* crc_table, int endian);
+extern uint32_t crc32_le(uint32_t crc, unsigned char const* p, size_t len, uint32_t* crc32table_le);
 uint8_t *grub2_buf = NULL, *sec_buf = NULL;
 long grub2_len;
 
@@ -1148,7 +1166,32 @@ static int sector_write(int fd, const void* _buf, unsigned int count)
 	return (int)count;
 }
 
+/*
+ * Size the DD requests as a multiple of the optimal transfer length the device reported
+ * or, failing that, of its physical block size. We don't go below DD_BUFFER_SIZE, even
+ * if the device has a smaller maximum transfer length, since the storage stack splits
+ * large requests on its own, and issuing small ones would only slow us down. But we do
+ * make the requests a whole number of maximum length transfers, so that the split does
+ * not leave a short transfer at the end of each request.
+ */
+static DWORD GetDDBufferSize(void)
+{
+	DEVICE_LIMITS* l = &SelectedDrive.Limits;
+	DWORD unit = SelectedDrive.SectorSize;
+
+	if ((l->PhysicalBlockSize > unit) && (l->PhysicalBlockSize % unit == 0) && (l->PhysicalBlockSize <= 64 * KB))
+		unit = l->PhysicalBlockSize;
+	if ((l->OptimalTransferLength > unit) && (l->OptimalTransferLength % unit == 0) &&
+		(l->OptimalTransferLength <= DD_BUFFER_SIZE))
+		unit = l->OptimalTransferLength;
+	if ((l->MaxTransferLength > unit) && (l->MaxTransferLength % unit == 0) &&
+		(l->MaxTransferLength <= DD_BUFFER_SIZE))
+		unit = l->MaxTransferLength;
+	return ((DD_BUFFER_SIZE + unit - 1) / unit) * unit;
+}
+
 /* Write an image file or zero a drive */
+
 static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 {
 	BOOL s, ret = FALSE;
@@ -1176,7 +1219,7 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 	if (bZeroDrive) {
 		uprintf(fast_zeroing ? "Fast-zeroing drive:" : "Zeroing drive:");
 		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
-		buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
+		buf_size = GetDDBufferSize();
 		buffer = (uint8_t*)_mm_malloc(buf_size, SelectedDrive.SectorSize);
 		if (buffer == NULL) {
 			ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
@@ -1277,6 +1320,8 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 			}
 			if (i > WRITE_RETRIES)
 				goto out;
+			if ((wb + write_size) / DEVCACHE_CHECKPOINT_SIZE != wb / DEVCACHE_CHECKPOINT_SIZE)
+				FlushDeviceWriteCache(hPhysicalDrive);
 		}
 		uprintfs("\r\n");
 	} else if (img_report.compression_type != BLED_COMPRESSION_NONE && img_report.compression_type < BLED_COMPRESSION_MAX) {
@@ -1338,7 +1383,7 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 		}
 
 		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
-		buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
+		buf_size = GetDDBufferSize();
 		buffer = (uint8_t*)_mm_malloc(buf_size * NUM_BUFFERS, SelectedDrive.SectorSize);
 		if (buffer == NULL) {
 			ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
@@ -1416,9 +1461,14 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 			}
 			if (i > WRITE_RETRIES)
 				goto out;
+
+			// 5. Flush the device write cache at regular intervals, if we enabled it
+			if ((wb + write_size) / DEVCACHE_CHECKPOINT_SIZE != wb / DEVCACHE_CHECKPOINT_SIZE)
+				FlushDeviceWriteCache(hPhysicalDrive);
 		}
 		uprintfs("\r\n");
 	}
+	FlushDeviceWriteCache(hPhysicalDrive);
 	RefreshDriveLayout(hPhysicalDrive);
 	ret = TRUE;
 out:
@@ -1433,8 +1483,520 @@ out:
 	return ret;
 }
 
+/* Returns TRUE if a buffer only contains zeroes, or, if allowed, only 0xFF bytes */
+static BOOL IsErasedBuffer(const uint8_t* buf, size_t len, BOOL allow_ff)
+{
+	const uint64_t* p = (const uint64_t*)buf;
+	uint64_t fill = p[0];
+	size_t i;
+
+	if ((fill != 0) && !(allow_ff && (fill == UINT64_MAX)))
+		return FALSE;
+	for (i = 1; i < len / sizeof(uint64_t); i++) {
+		if (p[i] != fill)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+typedef struct {
+	DWORD DriveIndex;
+	uint64_t start;
+	uint64_t end;
+	BOOL allow_ff;
+	volatile LONG64* processed;
+	volatile LONG* mismatch;
+} ERASE_VERIFY_RANGE;
+
+/* Read back a range of the drive, through its own handle, and check that it was erased */
+static DWORD WINAPI EraseVerifyThread(void* param)
+{
+	ERASE_VERIFY_RANGE* range = (ERASE_VERIFY_RANGE*)param;
+	HANDLE hDrive;
+	LARGE_INTEGER li;
+	uint8_t* buffer = NULL;
+	uint64_t pos;
+	DWORD size, r = ERROR_READ_FAULT;
+
+	hDrive = GetPhysicalHandle(range->DriveIndex, FALSE, FALSE, TRUE);
+	buffer = (uint8_t*)_mm_malloc(DD_BUFFER_SIZE, SelectedDrive.SectorSize);
+	if ((hDrive == INVALID_HANDLE_VALUE) || (buffer == NULL))
+		goto out;
+	li.QuadPart = range->start;
+	if (!SetFilePointerEx(hDrive, li, NULL, FILE_BEGIN))
+		goto out;
+	for (pos = range->start; pos < range->end; pos += size) {
+		if (*range->mismatch || IS_ERROR(ErrorStatus))
+			break;
+		size = (DWORD)min(DD_BUFFER_SIZE, range->end - pos);
+		if (!ReadFile(hDrive, buffer, size, &size, NULL) || (size == 0)) {
+			uprintf("Could not read back erased data at offset 0x%llx: %s", pos, WindowsErrorString());
+			InterlockedExchange(range->mismatch, 1);
+			goto out;
+		}
+		if (!IsErasedBuffer(buffer, size, range->allow_ff)) {
+			uprintf("Data at offset 0x%llx was not erased", pos);
+			InterlockedExchange(range->mismatch, 1);
+			break;
+		}
+		InterlockedExchangeAdd64(range->processed, size);
+	}
+	r = 0;
+
+out:
+	safe_mm_free(buffer);
+	safe_closehandle(hDrive);
+	ExitThread(r);
+}
+
 /*
- * Standalone thread for the formatting operation
+ * Check that the whole drive reads back as erased, with several readers
+ * working in parallel on separate slices of the drive.
+ */
+static BOOL VerifyErasedFull(DWORD DriveIndex, BOOL allow_ff)
+{
+	ERASE_VERIFY_RANGE range[ERASE_VERIFY_THREADS];
+	HANDLE thread[ERASE_VERIFY_THREADS] = { NULL };
+	volatile LONG64 processed = 0;
+	volatile LONG mismatch = 0;
+	uint64_t slice = (SelectedDrive.DiskSize / ERASE_VERIFY_THREADS) & ~((uint64_t)MB - 1);
+	DWORD i, nb_threads = 0, r;
+
+	uprintf("Verifying erased data (full read-back)...");
+	for (i = 0; i < ERASE_VERIFY_THREADS; i++) {
+		range[i].DriveIndex = DriveIndex;
+		range[i].start = i * slice;
+		range[i].end = (i == ERASE_VERIFY_THREADS - 1) ? SelectedDrive.DiskSize : (i + 1) * slice;
+		range[i].allow_ff = allow_ff;
+		range[i].processed = &processed;
+		range[i].mismatch = &mismatch;
+		thread[i] = CreateThread(NULL, 0, EraseVerifyThread, &range[i], 0, NULL);
+		if (thread[i] == NULL) {
+			uprintf("Could not start verification thread: %s", WindowsErrorString());
+			mismatch = 1;
+			break;
+		}
+		nb_threads++;
+	}
+	do {
+		r = WaitForMultipleObjects(nb_threads, thread, TRUE, 100);
+		UpdateProgressWithInfo(OP_FORMAT, MSG_286, (uint64_t)processed, SelectedDrive.DiskSize);
+	} while (r == WAIT_TIMEOUT);
+	for (i = 0; i < nb_threads; i++) {
+		if (!GetExitCodeThread(thread[i], &r) || (r != 0))
+			mismatch = 1;
+		safe_closehandle(thread[i]);
+	}
+	return (mismatch == 0) && !IS_ERROR(ErrorStatus);
+}
+
+/*
+ * Check that the beginning, the end and a spread of samples across the
+ * drive read back as erased.
+ */
+static BOOL VerifyErasedSampled(HANDLE hPhysicalDrive, BOOL allow_ff)
+{
+	BOOL ret = FALSE;
+	LARGE_INTEGER li;
+	uint8_t* buffer = NULL;
+	uint64_t stride = SelectedDrive.DiskSize / ERASE_SAMPLE_COUNT;
+	DWORD i, size;
+
+	uprintf("Verifying erased data (%d samples)...", ERASE_SAMPLE_COUNT + 1);
+	buffer = (uint8_t*)_mm_malloc(ERASE_SAMPLE_SIZE, SelectedDrive.SectorSize);
+	if (buffer == NULL)
+		goto out;
+	for (i = 0; i <= ERASE_SAMPLE_COUNT; i++) {
+		CHECK_FOR_USER_CANCEL;
+		// The last sample covers the very end of the drive
+		li.QuadPart = (i < ERASE_SAMPLE_COUNT) ? (i * stride) & ~((uint64_t)ERASE_SAMPLE_SIZE - 1) :
+			SelectedDrive.DiskSize - ERASE_SAMPLE_SIZE;
+		if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN) ||
+			!ReadFile(hPhysicalDrive, buffer, ERASE_SAMPLE_SIZE, &size, NULL) || (size != ERASE_SAMPLE_SIZE)) {
+			uprintf("Could not read back erased data at offset 0x%llx: %s", li.QuadPart, WindowsErrorString());
+			goto out;
+		}
+		if (!IsErasedBuffer(buffer, ERASE_SAMPLE_SIZE, allow_ff)) {
+			uprintf("Data at offset 0x%llx was not erased", li.QuadPart);
+			goto out;
+		}
+	}
+	ret = TRUE;
+
+out:
+	safe_mm_free(buffer);
+	return ret;
+}
+
+/*
+ * Erase a drive using device-native commands rather than streaming writes:
+ * - SCSI WRITE SAME (16) of a zeroed block, preferably with UNMAP, for which
+ *   the device guarantees zeroes on read, so a sampled read-back is enough.
+ *   This is only used if the device reported a maximum WRITE SAME length.
+ * - Otherwise, a discard (TRIM/UNMAP) of the whole drive, which, unless the
+ *   device reports deterministic zeroes after unmap, must be followed by a full
+ *   read-back.
+ * Request sizes follow the limits the device reported in its Block Limits VPD page.
+ * Returns FALSE if the caller should fall back to writing the whole drive.
+ */
+static BOOL EraseDriveNative(DWORD DriveIndex, HANDLE hPhysicalDrive)
+{
+	DEVICE_LIMITS* l = &SelectedDrive.Limits;
+	// Don't bother trying UNMAP if the device told us it doesn't support it with WRITE SAME
+	BOOL ret = FALSE, unmap = !(l->ProvisioningReported && !l->CanWriteSameUnmap);
+	uint8_t* block = NULL;
+	uint64_t pos, len, blocks_per_chunk = ERASE_CHUNK_SIZE / SelectedDrive.SectorSize;
+	uint64_t probe_blocks = ERASE_PROBE_SIZE / SelectedDrive.SectorSize;
+	uint64_t nb_blocks = SelectedDrive.DiskSize / SelectedDrive.SectorSize;
+	uint64_t discard_chunk = ERASE_CHUNK_SIZE, granularity;
+	uint32_t timeout;
+	int r = SPT_ERROR_UNKNOWN_ERROR;
+
+	if ((SelectedDrive.DiskSize < ERASE_CHUNK_SIZE) || (SelectedDrive.SectorSize > 64 * KB))
+		return FALSE;
+	if ((l->MaxWriteSameLength != 0) && (l->MaxWriteSameLength < blocks_per_chunk))
+		blocks_per_chunk = l->MaxWriteSameLength;
+	probe_blocks = max(min(probe_blocks, blocks_per_chunk), 1);
+	if ((l->MaxUnmapLength != 0) && (l->MaxUnmapLength != UINT32_MAX) &&
+		((uint64_t)l->MaxUnmapLength * SelectedDrive.SectorSize < discard_chunk)) {
+		discard_chunk = (uint64_t)l->MaxUnmapLength * SelectedDrive.SectorSize;
+		granularity = (uint64_t)max(l->UnmapGranularity, 1) * SelectedDrive.SectorSize;
+		if (discard_chunk >= granularity)
+			discard_chunk -= discard_chunk % granularity;
+	}
+
+	block = (uint8_t*)_mm_malloc(SelectedDrive.SectorSize, 0x10);
+	if (block == NULL)
+		return FALSE;
+	memset(block, 0, SelectedDrive.SectorSize);
+	UpdateProgressWithInfoInit(NULL, FALSE);
+
+	// WRITE SAME is only sent to devices that reported how much of it they accept, which
+	// GetDeviceLimits() only asks of devices that sit on a native bus. The first request
+	// is a small probe with a short timeout, that tells us if the device supports WRITE
+	// SAME, with or without UNMAP, without bridges that ignore it stalling for long.
+	for (pos = 0; (l->MaxWriteSameLength != 0) && (pos < nb_blocks); pos += len) {
+		CHECK_FOR_USER_CANCEL;
+		len = min((pos == 0) ? probe_blocks : blocks_per_chunk, nb_blocks - pos);
+		timeout = (pos == 0) ? ERASE_PROBE_TIMEOUT : ERASE_TIMEOUT;
+		r = ScsiWriteSame(hPhysicalDrive, pos, (uint32_t)len, block, SelectedDrive.SectorSize, unmap, timeout);
+		if ((r != SPT_SUCCESS) && (pos == 0) && unmap) {
+			unmap = FALSE;
+			r = ScsiWriteSame(hPhysicalDrive, pos, (uint32_t)len, block, SelectedDrive.SectorSize, unmap, timeout);
+		}
+		if (r != SPT_SUCCESS)
+			break;
+		UpdateProgressWithInfo(OP_FORMAT, MSG_286, pos + len, nb_blocks);
+	}
+	if (r == SPT_SUCCESS) {
+		uprintf("Erased drive using WRITE SAME%s", unmap ? " with UNMAP" : "");
+		ret = VerifyErasedSampled(hPhysicalDrive, fast_zeroing);
+		goto out;
+	}
+	if ((l->MaxWriteSameLength != 0) && (pos != 0))
+		uprintf("WRITE SAME failed at block %lld: %s", pos, SptStrerr(r));
+
+	for (pos = 0; pos < (uint64_t)SelectedDrive.DiskSize; pos += len) {
+		CHECK_FOR_USER_CANCEL;
+		len = min(discard_chunk, SelectedDrive.DiskSize - pos);
+		if (!DiscardDriveRange(hPhysicalDrive, pos, len))
+			goto out;
+		UpdateProgressWithInfo(OP_FORMAT, MSG_286, pos + len, SelectedDrive.DiskSize);
+	}
+	uprintf("Discarded drive content");
+	ret = l->ReadsZeroesAfterUnmap ? VerifyErasedSampled(hPhysicalDrive, fast_zeroing) :
+		VerifyErasedFull(DriveIndex, fast_zeroing);
+
+out:
+	if (!ret && !IS_ERROR(ErrorStatus))
+		uprintf("Device-native erase %s - Falling back to writing the whole drive", (r == SPT_SUCCESS) ?
+			"could not be verified" : "is not available");
+	safe_mm_free(block);
+	return ret;
+}
+
+/*
+ * Formatting work units. A unit owns a declared range of the drive, which it accesses
+ * through its own handle, and may therefore run alongside the main formatting sequence
+ * as long as its range does not overlap with the main partition or the boot records.
+ */
+typedef struct {
+	const char* name;
+	DWORD DriveIndex;
+	uint64_t offset;
+	uint64_t size;
+	USHORT fs_type;
+	const char* label;
+	DWORD flags;
+	HANDLE thread;
+	BOOL ret;
+} FORMAT_UNIT;
+
+static BOOL RangesOverlap(uint64_t offset1, uint64_t size1, uint64_t offset2, uint64_t size2)
+{
+	return (offset1 < offset2 + size2) && (offset2 < offset1 + size1);
+}
+
+static DWORD WINAPI FormatUnitThread(void* param)
+{
+	FORMAT_UNIT* unit = (FORMAT_UNIT*)param;
+
+	unit->ret = FormatExtFs(unit->DriveIndex, unit->offset, 0, FileSystemLabel[unit->fs_type],
+		unit->label, unit->flags | FP_NO_PROGRESS);
+	ExitThread(unit->ret ? 0 : 1);
+}
+
+/*
+ * Start a work unit in the background, or run it to completion right away if its
+ * range conflicts with the ones that the main sequence is going to write.
+ */
+static BOOL StartFormatUnit(FORMAT_UNIT* unit, int main_index)
+{
+	uint64_t gpt_size = 33ULL * SelectedDrive.SectorSize;
+	// A main ext partition would have to share the ext2fs library state with the unit
+	BOOL concurrent = (unit->size != 0) && !IS_EXT(fs_type) &&
+		!RangesOverlap(unit->offset, unit->size, SelectedDrive.Partition[main_index].Offset,
+			SelectedDrive.Partition[main_index].Size) &&
+		!RangesOverlap(unit->offset, unit->size, 0, SelectedDrive.Partition[0].Offset) &&
+		!((partition_type == PARTITION_STYLE_GPT) &&
+			RangesOverlap(unit->offset, unit->size, SelectedDrive.DiskSize - gpt_size, gpt_size));
+
+	if (concurrent) {
+		unit->thread = CreateThread(NULL, 0, FormatUnitThread, unit, 0, NULL);
+		if (unit->thread != NULL) {
+			SetThreadPriority(unit->thread, default_thread_priority);
+			uprintf("Formatting %s partition in the background", unit->name);
+			return TRUE;
+		}
+		uprintf("Could not start %s formatting thread: %s", unit->name, WindowsErrorString());
+	}
+	unit->ret = FormatExtFs(unit->DriveIndex, unit->offset, 0, FileSystemLabel[unit->fs_type],
+		unit->label, unit->flags);
+	return unit->ret;
+}
+
+static BOOL WaitFormatUnit(FORMAT_UNIT* unit)
+{
+	if (unit->thread != NULL) {
+		if (WaitForSingleObject(unit->thread, INFINITE) != WAIT_OBJECT_0)
+			unit->ret = FALSE;
+		safe_closehandle(unit->thread);
+		uprintf("Background formatting of %s partition %s", unit->name, unit->ret ? "completed" : "failed");
+	}
+	return unit->ret;
+}
+
+/*
+ * Fill a disk signature, serial number or GUID with random data
+ */
+static void SetRandomId(void* id, size_t size)
+{
+	GUID guid;
+
+	assert(size <= sizeof(guid));
+	IGNORE_RETVAL(CoCreateGuid(&guid));
+	memcpy(id, &guid, size);
+}
+
+/*
+ * Give the file system that starts at 'lba' a new serial number (FAT, exFAT, NTFS)
+ * or UUID (ext). A duplicate serial doesn't prevent a volume from being mounted, so
+ * failures here are only reported.
+ */
+static void ResetVolumeSerial(HANDLE hPhysicalDrive, uint64_t lba)
+{
+	const DWORD SectorSize = SelectedDrive.SectorSize;
+	const char* fs_name = NULL;
+	uint8_t* buf = NULL;
+	uint32_t i, checksum = 0, nb_sectors = 1;
+	uint64_t write_lba = lba, backup_lba = 0;
+
+	// An exFAT boot region is 12 sectors
+	buf = (uint8_t*)_mm_malloc(12 * SectorSize, 16);
+	if ((buf == NULL) || (read_sectors(hPhysicalDrive, SectorSize, lba, 1, buf) != SectorSize))
+		goto out;
+
+	if (memcmp(&buf[0x03], "NTFS    ", 8) == 0) {
+		fs_name = "NTFS";
+		SetRandomId(&buf[0x48], 8);
+		// The backup boot sector follows the last sector of the volume
+		backup_lba = lba + *((uint64_t*)&buf[0x28]);
+	} else if (memcmp(&buf[0x03], "EXFAT   ", 8) == 0) {
+		fs_name = "exFAT";
+		if ((buf[0x6c] > 12) || ((1U << buf[0x6c]) != SectorSize) ||
+			(read_sectors(hPhysicalDrive, SectorSize, lba, 12, buf) != 12 * SectorSize))
+			goto out;
+		SetRandomId(&buf[0x64], 4);
+		// The 12th sector of the boot region holds a checksum of the first 11,
+		// that excludes the VolumeFlags and PercentInUse fields.
+		for (i = 0; i < 11 * SectorSize; i++) {
+			if ((i == 106) || (i == 107) || (i == 112))
+				continue;
+			checksum = ((checksum & 1) ? 0x80000000 : 0) + (checksum >> 1) + buf[i];
+		}
+		for (i = 0; i < SectorSize / sizeof(uint32_t); i++)
+			((uint32_t*)&buf[11 * SectorSize])[i] = checksum;
+		nb_sectors = 12;
+		backup_lba = lba + 12;
+	} else if (memcmp(&buf[0x52], "FAT32   ", 8) == 0) {
+		fs_name = "FAT32";
+		SetRandomId(&buf[0x43], 4);
+		if ((*((uint16_t*)&buf[0x32]) != 0) && (*((uint16_t*)&buf[0x32]) != 0xffff))
+			backup_lba = lba + *((uint16_t*)&buf[0x32]);
+	} else if ((memcmp(&buf[0x36], "FAT", 3) == 0) && (buf[0x26] == 0x29)) {
+		fs_name = "FAT";
+		SetRandomId(&buf[0x27], 4);
+	} else {
+		// ext2/3/4 superblock, 1024 bytes into the volume
+		uint8_t* sb;
+		write_lba = lba + 1024 / SectorSize;
+		nb_sectors = (1024 % SectorSize + 1024 + SectorSize - 1) / SectorSize;
+		if (read_sectors(hPhysicalDrive, SectorSize, write_lba, nb_sectors, buf) != nb_sectors * SectorSize)
+			goto out;
+		sb = &buf[1024 % SectorSize];
+		if (*((uint16_t*)&sb[0x38]) != 0xef53)
+			goto out;
+		fs_name = "ext";
+		// With group descriptor (0x10) or metadata (0x400) checksums, the UUID seeds every checksum
+		if (*((uint32_t*)&sb[0x64]) & (0x0010 | 0x0400)) {
+			uprintf("Mass flash: Keeping the UUID of the checksummed %s partition at LBA %llu", fs_name, lba);
+			goto out;
+		}
+		SetRandomId(&sb[0x68], 16);
+	}
+
+	if (write_sectors(hPhysicalDrive, SectorSize, write_lba, nb_sectors, buf) != nb_sectors * SectorSize) {
+		uprintf("Mass flash: Could not update the serial of the %s partition at LBA %llu", fs_name, lba);
+		goto out;
+	}
+	if ((backup_lba != 0) &&
+		(write_sectors(hPhysicalDrive, SectorSize, backup_lba, nb_sectors, buf) != nb_sectors * SectorSize))
+		uprintf("Mass flash: Could not update the backup boot record of the %s partition at LBA %llu", fs_name, lba);
+	uprintf("Mass flash: Set a new serial for the %s partition at LBA %llu", fs_name, lba);
+
+out:
+	safe_mm_free(buf);
+}
+
+/*
+ * Give a drive that was replicated from a master image an identity of its own.
+ * Windows takes a disk offline when its MBR signature or GPT disk GUID collides
+ * with the one of another disk, which is exactly what flashing many drives from
+ * the same master would produce. The partition GUIDs and file system serials get
+ * the same treatment, for the same reason.
+ */
+static BOOL ResetDiskIdentifiers(HANDLE hPhysicalDrive)
+{
+	const DWORD SectorSize = SelectedDrive.SectorSize;
+	BOOL r = FALSE, is_gpt = FALSE;
+	uint8_t *buf = NULL, *entries = NULL, type;
+	uint32_t i, j, nb_parts = 0, nb_sectors = 0, entries_size = 0, entries_crc = 0, signature, *crc_table = NULL;
+	uint64_t lba, alternate_lba = 0, part_lba[MAX_PARTITIONS];
+	GPT_HEADER* gpt;
+	GPT_ENTRY* entry;
+	GUID disk_guid;
+
+	buf = (uint8_t*)_mm_malloc(SectorSize, 16);
+	if ((buf == NULL) || (read_sectors(hPhysicalDrive, SectorSize, 0, 1, buf) != SectorSize)) {
+		uprintf("Mass flash: Could not read MBR");
+		goto out;
+	}
+	// No partition table => nothing to do
+	if ((buf[0x1fe] != 0x55) || (buf[0x1ff] != 0xaa)) {
+		r = TRUE;
+		goto out;
+	}
+
+	for (i = 0; i < 4; i++) {
+		type = buf[0x1be + 16 * i + 4];
+		if (type == 0xee)
+			is_gpt = TRUE;
+		else if ((type != 0x00) && (type != 0x05) && (type != 0x0f) && (nb_parts < MAX_PARTITIONS))
+			part_lba[nb_parts++] = *((uint32_t*)&buf[0x1be + 16 * i + 8]);
+	}
+
+	// Windows does not use the MBR signature of GPT disks, and the UEFI marker is
+	// how we tell apart MBR drives that were created for UEFI targets.
+	signature = *((uint32_t*)&buf[0x1b8]);
+	if (!is_gpt && (signature != MBR_UEFI_MARKER)) {
+		do {
+			SetRandomId(&signature, sizeof(signature));
+		} while ((signature == 0) || (signature == MBR_UEFI_MARKER));
+		*((uint32_t*)&buf[0x1b8]) = signature;
+		if (write_sectors(hPhysicalDrive, SectorSize, 0, 1, buf) != SectorSize) {
+			uprintf("Mass flash: Could not write MBR");
+			goto out;
+		}
+		uprintf("Mass flash: New disk ID: 0x%08X", signature);
+	}
+
+	if (is_gpt) {
+		crc_table = crc32_filltable(NULL, 0);
+		if (crc_table == NULL)
+			goto out;
+		SetRandomId(&disk_guid, sizeof(disk_guid));
+		gpt = (GPT_HEADER*)buf;
+		// Same GUIDs for the primary GPT at LBA 1 and its backup at the end of the disk
+		for (i = 0, lba = 1; i < 2; i++, lba = alternate_lba) {
+			if ((read_sectors(hPhysicalDrive, SectorSize, lba, 1, buf) != SectorSize) ||
+				(memcmp(gpt->Signature, "EFI PART", 8) != 0) || (gpt->HeaderSize < sizeof(GPT_HEADER)) ||
+				(gpt->HeaderSize > SectorSize) || (gpt->SizeOfPartitionEntry < sizeof(GPT_ENTRY)) ||
+				(gpt->NumberOfPartitionEntries > 1024) ||
+				((i != 0) && (gpt->NumberOfPartitionEntries * gpt->SizeOfPartitionEntry != entries_size))) {
+				uprintf("Mass flash: Could not read %s GPT header", (i == 0) ? "primary" : "backup");
+				// Windows seems to be keen on keeping a lock on the backup GPT, so we're
+				// lenient about not being able to access it, as ClearMBRGPT() is.
+				if (i == 0)
+					goto out;
+				break;
+			}
+			if (i == 0) {
+				entries_size = gpt->NumberOfPartitionEntries * gpt->SizeOfPartitionEntry;
+				nb_sectors = (entries_size + SectorSize - 1) / SectorSize;
+				entries = (uint8_t*)_mm_malloc((size_t)nb_sectors * SectorSize, 16);
+				if ((entries == NULL) || (read_sectors(hPhysicalDrive, SectorSize, gpt->PartitionEntryLBA,
+					nb_sectors, entries) != nb_sectors * SectorSize)) {
+					uprintf("Mass flash: Could not read GPT partition entries");
+					goto out;
+				}
+				for (j = 0; j < gpt->NumberOfPartitionEntries; j++) {
+					entry = (GPT_ENTRY*)&entries[j * gpt->SizeOfPartitionEntry];
+					if (CompareGUID(&entry->PartitionTypeGUID, &GUID_NULL))
+						continue;
+					SetRandomId(&entry->UniquePartitionGUID, sizeof(GUID));
+					if (nb_parts < MAX_PARTITIONS)
+						part_lba[nb_parts++] = entry->StartingLBA;
+				}
+				entries_crc = ~crc32_le(~0U, entries, entries_size, crc_table);
+				alternate_lba = gpt->AlternateLBA;
+			}
+			gpt->DiskGUID = disk_guid;
+			gpt->PartitionEntryArrayCRC32 = entries_crc;
+			gpt->HeaderCRC32 = 0;
+			gpt->HeaderCRC32 = ~crc32_le(~0U, buf, gpt->HeaderSize, crc_table);
+			if ((write_sectors(hPhysicalDrive, SectorSize, gpt->PartitionEntryLBA, nb_sectors, entries) != nb_sectors * SectorSize) ||
+				(write_sectors(hPhysicalDrive, SectorSize, lba, 1, buf) != SectorSize)) {
+				uprintf("Mass flash: Could not write %s GPT", (i == 0) ? "primary" : "backup");
+				if (i == 0)
+					goto out;
+			}
+		}
+		uprintf("Mass flash: New disk GUID: %s", GuidToString(&disk_guid, TRUE));
+	}
+
+	for (i = 0; i < nb_parts; i++)
+		ResetVolumeSerial(hPhysicalDrive, part_lba[i]);
+	r = TRUE;
+
+out:
+	safe_free(crc_table);
+	safe_mm_free(entries);
+	safe_mm_free(buf);
+	return r;
+}
+
+/*
+ * Run the formatting operation against a single drive
  * According to https://learn.microsoft.com/windows/win32/api/winioctl/ni-winioctl-fsctl_dismount_volume
  * To change a volume file system
  *   Open a volume.
@@ -1444,14 +2006,14 @@ out:
  *   Unlock the volume.
  *   Close the volume handle.
  */
-DWORD WINAPI FormatThread(void* param)
+static void FormatDrive(DWORD DriveIndex)
 {
 	int r;
 	BOOL ret, use_large_fat32, windows_to_go, actual_lock_drive = lock_drive, write_as_ext = FALSE;
 	// Windows 11 and VDS (which I suspect is what fmifs.dll's FormatEx() is now calling behind the scenes)
 	// require us to unlock the physical drive to format the drive, else access denied is returned.
 	BOOL need_logical = FALSE, must_unlock_physical = (use_vds || WindowsVersion.Version >= WINDOWS_11);
-	DWORD cr, DriveIndex = (DWORD)(uintptr_t)param, ClusterSize, Flags;
+	DWORD cr, ClusterSize, Flags;
 	HANDLE hPhysicalDrive = INVALID_HANDLE_VALUE;
 	HANDLE hLogicalVolume = INVALID_HANDLE_VALUE;
 	SYSTEMTIME lt;
@@ -1460,6 +2022,7 @@ DWORD WINAPI FormatThread(void* param)
 	char drive_name[] = "?:\\";
 	char drive_letters[27], fs_name[32], label[64];
 	char logfile[MAX_PATH], *userdir;
+	FORMAT_UNIT persistence = { 0 };
 	char efi_dst[] = "?:\\efi\\boot\\bootx64.efi";
 	char kolibri_dst[] = "?:\\MTLD_F32";
 	char grub4dos_dst[] = "?:\\grldr";
@@ -1552,11 +2115,13 @@ DWORD WINAPI FormatThread(void* param)
 		goto out;
 	}
 	RefreshDriveLayout(hPhysicalDrive);
+	GetDeviceLimits(hPhysicalDrive, &SelectedDrive.Limits);
+	SetDeviceWriteCache(hPhysicalDrive, device_cache_mode);
 
 	// If we write an image that contains an ESP, Windows forcibly reassigns/removes the target
 	// drive, which causes a write error. To work around this, we must lock the logical drive.
 	// Also need to lock logical drive if we couldn't delete partitions, to keep Windows happy...
-	if (((boot_type == BT_IMAGE) && write_as_image) || (need_logical)) {
+	if (((boot_type == BT_IMAGE) && write_as_image) || (master_image_path != NULL) || (need_logical)) {
 		uprintf("Requesting logical volume handle...");
 		hLogicalVolume = GetLogicalHandle(DriveIndex, 0, TRUE, FALSE, !actual_lock_drive);
 		if (hLogicalVolume == INVALID_HANDLE_VALUE) {
@@ -1578,7 +2143,8 @@ DWORD WINAPI FormatThread(void* param)
 	}
 
 	if (zero_drive) {
-		WriteDrive(hPhysicalDrive, TRUE);
+		if (!EraseDriveNative(DriveIndex, hPhysicalDrive) && !IS_ERROR(ErrorStatus))
+			WriteDrive(hPhysicalDrive, TRUE);
 		goto out;
 	}
 
@@ -1595,7 +2161,8 @@ DWORD WINAPI FormatThread(void* param)
 		}
 	}
 
-	if (IsChecked(IDC_BAD_BLOCKS)) {
+	// Bad blocks are a property of the target, not of the master image
+	if (IsChecked(IDC_BAD_BLOCKS) && !building_master_image) {
 		do {
 			FILE* log_fd;
 			int sel = ComboBox_GetCurSel(hNBPasses);
@@ -1662,6 +2229,16 @@ DWORD WINAPI FormatThread(void* param)
 		}
 	}
 
+	// Replicate the master image composed by MassFlashDrive()
+	if (master_image_path != NULL) {
+		if (!VhdWriteSparseImage(hPhysicalDrive, master_image_path))
+			uprintf("Could not replicate master image");
+		else if (!ResetDiskIdentifiers(hPhysicalDrive) && !IS_ERROR(ErrorStatus))
+			ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+		RefreshDriveLayout(hPhysicalDrive);
+		goto out;
+	}
+
 	// Write an image file
 	if ((boot_type == BT_IMAGE) && write_as_image) {
 		// Special case for FFU images
@@ -1749,17 +2326,24 @@ DWORD WINAPI FormatThread(void* param)
 	}
 	CHECK_FOR_USER_CANCEL;
 
-	// Format Casper partition if required. Do it before we format anything with
-	// a file system that Windows will recognize, to avoid concurrent access.
+	// Format Casper partition if required. Since it lives on its own range of the drive
+	// and is accessed through its own handle, it gets formatted in the background, while
+	// we format the main partition and extract the image. Boot records are still written
+	// in sequence by this thread, and Windows won't mount an ext partition concurrently.
 	if (extra_partitions & XP_PERSISTENCE) {
 		uint32_t ext_version = ReadSetting32(SETTING_USE_EXT_VERSION);
 		if ((ext_version < 2) || (ext_version > 4))
 			ext_version = 3;
 		uprintf("Using %s-like method to enable persistence", img_report.uses_casper ? "Ubuntu" : "Debian");
-		if (!FormatPartition(DriveIndex, SelectedDrive.Partition[partition_index[PI_CASPER]].Offset, 0, FS_EXT2 + (ext_version - 2),
-			img_report.uses_casper ? "casper-rw" : "persistence",
-			(img_report.uses_casper ? 0 : FP_CREATE_PERSISTENCE_CONF) |
-			(IsChecked(IDC_QUICK_FORMAT) ? FP_QUICK : 0))) {
+		persistence.name = img_report.uses_casper ? "casper-rw" : "persistence";
+		persistence.DriveIndex = DriveIndex;
+		persistence.offset = SelectedDrive.Partition[partition_index[PI_CASPER]].Offset;
+		persistence.size = SelectedDrive.Partition[partition_index[PI_CASPER]].Size;
+		persistence.fs_type = FS_EXT2 + (ext_version - 2);
+		persistence.label = persistence.name;
+		persistence.flags = (img_report.uses_casper ? 0 : FP_CREATE_PERSISTENCE_CONF) |
+			(IsChecked(IDC_QUICK_FORMAT) ? FP_QUICK : 0);
+		if (!StartFormatUnit(&persistence, partition_index[PI_MAIN])) {
 			if (!IS_ERROR(ErrorStatus))
 				ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
 			goto out;
@@ -1999,6 +2583,10 @@ DWORD WINAPI FormatThread(void* param)
 		}
 	}
 
+	// The persistence partition must be complete before we report success
+	if (!WaitFormatUnit(&persistence) && !IS_ERROR(ErrorStatus))
+		ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+
 	// Copy any additonal files from an optional zip archive selected by the user
 	if (!IS_ERROR(ErrorStatus)) {
 		UpdateProgress(OP_EXTRACT_ZIP, 0.0f);
@@ -2008,14 +2596,18 @@ DWORD WINAPI FormatThread(void* param)
 	}
 
 out:
+	// On error, the background unit picks up the cancellation from ErrorStatus
+	WaitFormatUnit(&persistence);
 	if ((write_as_esp || write_as_ext) && volume_name != NULL)
 		AltUnmountVolume(volume_name, TRUE);
 	else
 		safe_free(volume_name);
 	safe_free(buffer);
 	safe_unlockclose(hLogicalVolume);
+	// Also done on error or cancellation, so that the drive is left as we found it
+	RestoreDeviceWriteCache(hPhysicalDrive, DriveIndex);
 	safe_unlockclose(hPhysicalDrive);	// This can take a while
-	if ((boot_type == BT_IMAGE) && write_as_image) {
+	if (((boot_type == BT_IMAGE) && write_as_image) || (master_image_path != NULL)) {
 		PrintInfo(0, MSG_320, lmprintf(MSG_307));
 		Sleep(200);
 		VdsRescan(VDS_RESCAN_REFRESH, 0, TRUE);
@@ -2041,6 +2633,103 @@ out:
 			free(volume_name);
 		}
 	}
+}
+
+/*
+ * Build-once, replicate-many: Run the whole formatting operation against a sparse VHD
+ * that has the geometry of the target, then copy the allocated blocks of that master
+ * image to the drive. The master image is kept in the temp directory, so that it can
+ * be replicated as is onto the next drive of the same size and with the same options.
+ */
+static void MassFlashDrive(DWORD DriveIndex)
+{
+	static char master_key[MAX_PATH + 256];
+	char key[sizeof(master_key)], label[64], fs_name[32], *physical;
+	struct __stat64 stat = { 0 };
+	RUFUS_DRIVE_INFO target = SelectedDrive;
+	DWORD MasterIndex;
+
+	if (SelectedDrive.SectorSize != 512) {
+		uprintf("Mass flash: %d-byte sectors are not supported for master images - Formatting drive directly",
+			SelectedDrive.SectorSize);
+		FormatDrive(DriveIndex);
+		return;
+	}
+
+	// Anything that affects the content of the drive must be part of the key, including
+	// the size and modification time of the image, in case it was replaced in place.
+	GetWindowTextU(hLabel, label, sizeof(label));
+	if ((boot_type == BT_IMAGE) && (_stat64U(image_path, &stat) != 0))
+		memset(&stat, 0, sizeof(stat));
+	static_sprintf(key, "%s|%" PRIi64 "|%" PRIi64 "|%d|%d|%d|%d|%d|%d|%d|%d|%x|%" PRIi64 "|%" PRIu64 "|%s",
+		(boot_type == BT_IMAGE) ? image_path : "", (int64_t)stat.st_size, (int64_t)stat.st_mtime,
+		boot_type, fs_type, partition_type, target_type,
+		(int)ComboBox_GetCurItemData(hClusterSize), (int)ComboBox_GetCurItemData(hImageOption),
+		IsChecked(IDC_QUICK_FORMAT), IsChecked(IDC_OLD_BIOS_FIXES), (unattend_xml_path != NULL) ? unattend_xml_flags : 0,
+		SelectedDrive.DiskSize, persistence_size, label);
+
+	if ((strcmp(key, master_key) != 0) || (!PathFileExistsU(master_image))) {
+		master_key[0] = 0;
+		static_sprintf(master_image, "%s%s_master.vhd", temp_dir, APPLICATION_NAME);
+		uprintf("Mass flash: Composing master image '%s'", master_image);
+		physical = VhdCreateSparseImage(master_image, SelectedDrive.DiskSize);
+		if ((physical == NULL) || (sscanf(physical, "\\\\.\\PhysicalDrive%lu", &MasterIndex) != 1)) {
+			ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
+			VhdUnmountImage();
+			return;
+		}
+		MasterIndex += DRIVE_INDEX_MIN;
+		SelectedDrive.DeviceNumber = MasterIndex;
+		if (!GetDrivePartitionData(MasterIndex, fs_name, sizeof(fs_name), TRUE) && (SelectedDrive.DiskSize == 0)) {
+			uprintf("Could not access mounted master image");
+			ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
+		} else if (SelectedDrive.DiskSize > target.DiskSize) {
+			uprintf("Master image is larger than the target (%" PRIi64 " vs %" PRIi64 " bytes)",
+				SelectedDrive.DiskSize, target.DiskSize);
+			ErrorStatus = RUFUS_ERROR(APPERR(ERROR_INVALID_VOLUME_SIZE));
+		} else {
+			building_master_image = TRUE;
+			FormatDrive(MasterIndex);
+			building_master_image = FALSE;
+		}
+		VhdUnmountImage();
+		SelectedDrive = target;
+		if (IS_ERROR(ErrorStatus)) {
+			DeleteFileU(master_image);
+			return;
+		}
+		static_strcpy(master_key, key);
+	} else {
+		uprintf("Mass flash: Reusing master image '%s'", master_image);
+	}
+
+	master_image_path = master_image;
+	FormatDrive(DriveIndex);
+	master_image_path = NULL;
+}
+
+/*
+ * Delete the master image left in the temp directory by MassFlashDrive(), if any
+ */
+void DeleteMasterImage(void)
+{
+	if ((master_image[0] != 0) && PathFileExistsU(master_image) && !DeleteFileU(master_image))
+		uprintf("Could not delete '%s': %s", master_image, WindowsErrorString());
+	master_image[0] = 0;
+}
+
+/*
+ * Standalone thread for the formatting operation
+ */
+DWORD WINAPI FormatThread(void* param)
+{
+	DWORD DriveIndex = (DWORD)(uintptr_t)param;
+
+	// Zeroing and DD image writes are already single sequential passes
+	if (mass_flash && !zero_drive && !((boot_type == BT_IMAGE) && write_as_image))
+		MassFlashDrive(DriveIndex);
+	else
+		FormatDrive(DriveIndex);
 	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)TRUE, 0);
 	ExitThread(0);
 }
@@ -41,7 +41,9 @@
 extern const char* FileSystemLabel[FS_MAX];
 extern io_manager nt_io_manager;
 extern DWORD ext2_last_winerror(DWORD default_error);
-static float ext2_percent_start = 0.0f, ext2_percent_share = 0.5f;
+// Per thread, as a persistence partition may be formatted in the background
+static THREAD_LOCAL float ext2_percent_start = 0.0f, ext2_percent_share = 0.5f;
+static THREAD_LOCAL BOOL ext2_no_progress = FALSE;
 
 typedef struct {
 	uint64_t max_size;
@@ -52,7 +54,7 @@ typedef struct {
 
 const char* error_message(errcode_t error_code)
 {
-	static char error_string[256];
+	static THREAD_LOCAL char error_string[256];
 
 	switch (error_code) {
 	case EXT2_ET_MAGIC_EXT2FS_FILSYS:
@@ -186,8 +188,11 @@ const char* error_message(errcode_t error_code)
 
 errcode_t ext2fs_print_progress(int64_t cur_value, int64_t max_value)
 {
-	UpdateProgressWithInfo(OP_FORMAT, MSG_217, (uint64_t)((ext2_percent_start * max_value) + (ext2_percent_share * cur_value)), max_value);
-	uprint_progress((uint64_t)cur_value, (uint64_t)max_value);
+	// When formatting in the background, the progress bar belongs to the main operation
+	if (!ext2_no_progress) {
+		UpdateProgressWithInfo(OP_FORMAT, MSG_217, (uint64_t)((ext2_percent_start * max_value) + (ext2_percent_share * cur_value)), max_value);
+		uprint_progress((uint64_t)cur_value, (uint64_t)max_value);
+	}
 	return IS_ERROR(ErrorStatus) ? EXT2_ET_CANCEL_REQUESTED : 0;
 }
 
@@ -230,7 +235,7 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 	};
 
 	BOOL ret = FALSE;
-	char* volume_name = NULL;
+	char* volume_name = NULL, io_options[80];
 	int i, count;
 	struct ext2_super_block features = { 0 };
 	io_manager manager = nt_io_manager;
@@ -279,8 +284,11 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		FSName = FileSystemLabel[FS_EXT3];
 	}
 
-	PrintInfoDebug(0, MSG_222, FSName);
-	UpdateProgressWithInfoInit(NULL, TRUE);
+	ext2_no_progress = (Flags & FP_NO_PROGRESS) ? TRUE : FALSE;
+	if (!ext2_no_progress) {
+		PrintInfoDebug(0, MSG_222, FSName);
+		UpdateProgressWithInfoInit(NULL, TRUE);
+	}
 
 	// Figure out the volume size and block size
 	r = ext2fs_get_device_size2(volume_name, KB, &size);
@@ -341,6 +349,16 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		uprintf("Could not initialize %s features: %s", FSName, error_message(r));
 		goto out;
 	}
+	// Zeroing inode tables and journal blocks can be done with a discard, if the device
+	// guarantees that discarded blocks read back as zeroes. This only holds for whole
+	// unmap granularity units, so the I/O manager needs to know what these are.
+	if (SelectedDrive.Limits.ReadsZeroesAfterUnmap && (SelectedDrive.Limits.UnmapGranularity != 0)) {
+		static_sprintf(io_options, "discard_granularity=%llu&discard_alignment=%llu",
+			(unsigned long long)SelectedDrive.Limits.UnmapGranularity * SelectedDrive.Limits.LogicalBlockSize,
+			(unsigned long long)SelectedDrive.Limits.UnmapAlignment * SelectedDrive.Limits.LogicalBlockSize);
+		if (io_channel_set_options(ext2fs->io, io_options) == 0)
+			ext2fs->io->flags |= CHANNEL_FLAGS_DISCARD_ZEROES;
+	}
 
 	// Zero 16 blocks of data from the start of our volume
 	buf = calloc(16, ext2fs->io->block_size);
@@ -436,7 +454,8 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		journal_size /= 2;	// That journal init is really killing us!
 		uprintf("Creating %d journal blocks: [1 marker = %0.1f block(s)]", journal_size,
 			max((float)journal_size / MAX_MARKER, 1.0f));
-		// Even with EXT2_MKJOURNAL_LAZYINIT, this call is absolutely dreadful in terms of speed...
+		// The journal blocks are allocated contiguously, and, with EXT2_MKJOURNAL_LAZYINIT,
+		// only the journal superblock and the indirect blocks get written.
 		r = ext2fs_add_journal_inode(ext2fs, journal_size, EXT2_MKJOURNAL_NO_MNT_CHECK | ((Flags & FP_QUICK) ? EXT2_MKJOURNAL_LAZYINIT : 0));
 		uprintfs("\r\n");
 		if (r != 0) {
@@ -491,7 +510,8 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		uprintf("Could not create %s volume: %s", FSName, error_message(r));
 		goto out;
 	}
-	UpdateProgressWithInfo(OP_FORMAT, MSG_217, 100, 100);
+	if (!ext2_no_progress)
+		UpdateProgressWithInfo(OP_FORMAT, MSG_217, 100, 100);
 	ret = TRUE;
 
 out:
@@ -72,6 +72,7 @@
 #include "db.h"
 #include "efi.h"
 #include "rufus.h"
+#include "trace.h"
 #include "winio.h"
 #include "missing.h"
 #include "darkmode.h"
@@ -1524,6 +1525,7 @@ static void null_final(HASH_CONTEXT *ctx) { }
 hash_init_t *hash_init[HASH_MAX] = { md5_init, sha1_init , sha256_init, sha512_init };
 hash_write_t *hash_write[HASH_MAX] = { md5_write, sha1_write , sha256_write, sha512_write };
 hash_final_t *hash_final[HASH_MAX] = { md5_final, sha1_final , sha256_final, sha512_final };
+static const char* trace_hash_name[HASH_MAX] = { "hash md5", "hash sha1", "hash sha256", "hash sha512" };
 
 /* Compute an individual hash without threading or buffering, for a single file */
 BOOL HashFile(const unsigned type, const char* path, uint8_t* hash)
@@ -1968,6 +1970,7 @@ DWORD WINAPI IndividualHashThread(void* param)
 {
 	HASH_CONTEXT hash_ctx = { {0} }; // There's a memset in hash_init, but static analyzers still bug us
 	uint32_t i = (uint32_t)(uintptr_t)param, j;
+	uint64_t t;
 
 	hash_init[i](&hash_ctx);
 	// Signal that we're ready to service requests
@@ -1981,7 +1984,9 @@ DWORD WINAPI IndividualHashThread(void* param)
 			return 1;
 		}
 		if (read_size[proc_bufnum] != 0) {
+			t = TRACE_BEGIN();
 			hash_write[i](&hash_ctx, buffer[proc_bufnum], (size_t)read_size[proc_bufnum]);
+			TRACE_END_BYTES(trace_hash_name[i], t, read_size[proc_bufnum]);
 			if (!SetEvent(thread_ready[i]))
 				goto error;
 		} else {
@@ -2008,7 +2013,7 @@ DWORD WINAPI HashThread(void* param)
 	HANDLE hash_thread[HASH_MAX] = { NULL, NULL, NULL, NULL };
 	DWORD wr;
 	VOID* fd = NULL;
-	uint64_t processed_bytes;
+	uint64_t processed_bytes, t;
 	int i, read_bufnum, r = -1;
 	int num_hashes = HASH_MAX - (enable_extra_hashes ? 0 : 1);
 
@@ -2057,6 +2062,7 @@ DWORD WINAPI HashThread(void* param)
 	UpdateProgressWithInfoInit(hMainDialog, FALSE);
 
 	// Start the initial read
+	t = TRACE_BEGIN();
 	ReadFileAsync(fd, buffer[read_bufnum], BUFFER_SIZE);
 
 	for (processed_bytes = 0; read_size[proc_bufnum] != 0; processed_bytes += read_size[proc_bufnum]) {
@@ -2071,11 +2077,13 @@ DWORD WINAPI HashThread(void* param)
 			ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
 			goto out;
 		}
+		TRACE_END_BYTES("hash read", t, read_size[read_bufnum]);
 
 		// 2. Switch to the next reading buffer
 		read_bufnum = (read_bufnum + 1) % NUM_BUFFERS;
 
 		// 3. Launch the next asynchronous read operation
+		t = TRACE_BEGIN();
 		ReadFileAsync(fd, buffer[read_bufnum], BUFFER_SIZE);
 
 		// 4. Wait for all the hash threads to indicate that they are ready to process data
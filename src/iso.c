@@ -45,8 +45,11 @@
 #include "rufus.h"
 #include "ui.h"
 #include "vhd.h"
+#include "trace.h"
 #include "drive.h"
 #include "libfat.h"
+#include "isobuild.h"
+#include "isocache.h"
 #include "missing.h"
 #include "resource.h"
 #include "msapi_utf8.h"
@@ -57,6 +60,9 @@
 // progress bar too frequently will bring extraction to a crawl
 _Static_assert(256 * KB >= ISO_BLOCKSIZE, "Can't set PROGRESS_THRESHOLD");
 #define PROGRESS_THRESHOLD        ((256 * KB) / ISO_BLOCKSIZE)
+// In single pass mode, the size of the content is only known once everything has been
+// extracted, so we report progress against the size of the image instead.
+#define EXTRACT_TOTAL_BLOCKS      (single_pass ? image_blocks : total_blocks)
 
 // Needed for UDF symbolic link testing
 #define S_IFLNK                   0xA000
@@ -79,6 +85,14 @@ typedef struct {
 	BOOLEAN is_old_c32[NB_OLD_C32];
 } EXTRACT_PROPS;
 
+// A config file that is to be patched once the whole image has been walked
+typedef struct {
+	char* fullpath;
+	char* path;
+	char* basename;
+	EXTRACT_PROPS props;
+} DEFERRED_FIXUP;
+
 RUFUS_IMG_REPORT img_report;
 FILE* fd_md5sum = NULL;
 int64_t iso_blocking_status = -1;
@@ -126,7 +140,10 @@ const char* old_c32_name[NB_OLD_C32] = OLD_C32_NAMES;
 static const int64_t old_c32_threshold[NB_OLD_C32] = OLD_C32_THRESHOLD;
 static uint8_t joliet_level = 0;
 static uint32_t md5sum_size = 0;
-static BOOL scan_only = FALSE;
+static BOOL scan_only = FALSE, single_pass = FALSE, allow_wim_split = FALSE;
+static uint64_t image_blocks = 0;
+static DEFERRED_FIXUP* deferred_fixup = NULL;
+static size_t nb_deferred_fixups = 0;
 static StrArray config_path, isolinux_path, grub_filesystems;
 static char symlinked_syslinux[MAX_PATH], *md5sum_data = NULL, *md5sum_pos = NULL;
 
@@ -238,6 +255,202 @@ static void _print_extracted_file(char* psz_fullpath, uint64_t file_length, BOOL
 #define print_extracted_file(p, l) _print_extracted_file(p, l, FALSE)
 #define print_split_file(p, l) _print_extracted_file(p, l, TRUE)
 
+/*
+ * File classification rules.
+ * check_iso_props() is called for every single file of an image, and used to compare
+ * each name against every entry of the tables above, which showed on images with more
+ * than 100k files. Instead, the tables are compiled, the first time we need them, into
+ * two case-insensitive perfect hashes (one for base names, one for directory names),
+ * whose entries hold all the properties a name has, so that classifying a file takes
+ * one lookup for its name and one for its directory. The tables above remain the only
+ * place where names need to be added.
+ */
+enum {
+	NAME_SYSLINUX_CFG = 0,
+	NAME_OLD_C32,
+	NAME_GRUB_CFG,
+	NAME_MENU_CFG,
+	NAME_LDLINUX_SYS,
+	NAME_LDLINUX_C32,
+	NAME_BOOTMGR,
+	NAME_BOOTMGR_EFI,
+	NAME_GRLDR,
+	NAME_KOLIBRI,
+	NAME_MANJARO,
+	NAME_MD5SUM,
+	NAME_REACTOS,
+	NAME_WININST,
+	NAME_UNATTEND,
+	NAME_PE_FILE,
+	NAME_ISOLINUX_BIN,
+	NAME_EFI_BOOT,
+	NAME_BOOTX64_EFI,
+	NAME_RULE_MAX
+};
+
+enum {
+	DIR_LOADER_ENTRIES = 0,
+	DIR_EFI_BOOT,
+	DIR_GRUB,
+	DIR_PROXMOX,
+	DIR_PANTHER,
+	DIR_PE,
+	DIR_RULE_MAX
+};
+
+#define ISO_RULE_MAX              NAME_RULE_MAX
+#define ISO_RULE_SLOTS_MAX        2048
+#define HAS_RULE(r, p)            (((r)->props & (1 << (p))) != 0)
+
+typedef struct {
+	const char* key;
+	size_t len;
+	uint32_t props;
+	uint8_t index[ISO_RULE_MAX];	// Index of the key in the table each property comes from
+} ISO_RULE;
+
+typedef struct {
+	ISO_RULE rule[128];
+	size_t nb_rules;
+	uint32_t seed;
+	uint32_t mask;
+	uint8_t slot[ISO_RULE_SLOTS_MAX];	// Index of the rule + 1, or 0 if unused
+} ISO_RULE_TABLE;
+
+static ISO_RULE_TABLE name_rules, dir_rules;
+static const ISO_RULE no_rule = { 0 };
+static char efi_bootloader_name[ARRAYSIZE(efi_bootname)][ARCH_MAX][32];
+static BOOL rules_compiled = FALSE;
+
+static __inline uint32_t rule_hash(const char* str, size_t len, uint32_t seed)
+{
+	uint32_t h = 2166136261U ^ seed;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (uint8_t)((str[i] >= 'A' && str[i] <= 'Z') ? str[i] + 0x20 : str[i])) * 16777619U;
+	return h ^ (h >> 15);
+}
+
+static void add_rule(ISO_RULE_TABLE* table, const char* key, int prop, size_t index)
+{
+	size_t i;
+
+	for (i = 0; i < table->nb_rules; i++)
+		if (_stricmp(table->rule[i].key, key) == 0)
+			break;
+	if (i == table->nb_rules) {
+		assert(i < ARRAYSIZE(table->rule));
+		if (i >= ARRAYSIZE(table->rule))
+			return;
+		table->rule[i].key = key;
+		table->rule[i].len = strlen(key);
+		table->nb_rules++;
+	}
+	table->rule[i].props |= 1 << prop;
+	table->rule[i].index[prop] = (uint8_t)index;
+}
+
+// Look for a seed that sends every key to a slot of its own, growing the table if needed
+static void seal_rules(ISO_RULE_TABLE* table)
+{
+	uint32_t size, seed, h;
+	size_t i;
+
+	for (size = 4; size < 4 * table->nb_rules; size <<= 1);
+	for (; size <= ISO_RULE_SLOTS_MAX; size <<= 1) {
+		for (seed = 0; seed < 256; seed++) {
+			memset(table->slot, 0, sizeof(table->slot));
+			for (i = 0; i < table->nb_rules; i++) {
+				h = rule_hash(table->rule[i].key, table->rule[i].len, seed) & (size - 1);
+				if (table->slot[h] != 0)
+					break;
+				table->slot[h] = (uint8_t)(i + 1);
+			}
+			if (i == table->nb_rules) {
+				table->seed = seed;
+				table->mask = size - 1;
+				return;
+			}
+		}
+	}
+	// Can't happen with the number of keys we have
+	assert(FALSE);
+}
+
+static const ISO_RULE* lookup_rule(const ISO_RULE_TABLE* table, const char* str)
+{
+	const ISO_RULE* rule;
+	size_t len;
+	uint8_t i;
+
+	if (str == NULL)
+		return &no_rule;
+	len = strlen(str);
+	i = table->slot[rule_hash(str, len, table->seed) & table->mask];
+	if (i == 0)
+		return &no_rule;
+	rule = &table->rule[i - 1];
+	return (rule->len == len && _strnicmp(rule->key, str, len) == 0) ? rule : &no_rule;
+}
+
+static void compile_rules(void)
+{
+	size_t i, k;
+
+	if (rules_compiled)
+		return;
+	memset(&name_rules, 0, sizeof(name_rules));
+	memset(&dir_rules, 0, sizeof(dir_rules));
+
+	for (i = 0; i < ARRAYSIZE(syslinux_cfg); i++)
+		add_rule(&name_rules, syslinux_cfg[i], NAME_SYSLINUX_CFG, i);
+	for (i = 0; i < NB_OLD_C32; i++)
+		add_rule(&name_rules, old_c32_name[i], NAME_OLD_C32, i);
+	for (i = 0; i < ARRAYSIZE(grub_cfg); i++)
+		add_rule(&name_rules, grub_cfg[i], NAME_GRUB_CFG, i);
+	add_rule(&name_rules, menu_cfg, NAME_MENU_CFG, 0);
+	add_rule(&name_rules, ldlinux_name, NAME_LDLINUX_SYS, 0);
+	add_rule(&name_rules, ldlinux_c32, NAME_LDLINUX_C32, 0);
+	add_rule(&name_rules, bootmgr_name, NAME_BOOTMGR, 0);
+	add_rule(&name_rules, bootmgr_efi_name, NAME_BOOTMGR_EFI, 0);
+	add_rule(&name_rules, grldr_name, NAME_GRLDR, 0);
+	add_rule(&name_rules, kolibri_name, NAME_KOLIBRI, 0);
+	add_rule(&name_rules, manjaro_marker, NAME_MANJARO, 0);
+	for (i = 0; i < ARRAYSIZE(md5sum_name); i++)
+		add_rule(&name_rules, md5sum_name[i], NAME_MD5SUM, i);
+	for (i = 0; i < ARRAYSIZE(reactos_name); i++)
+		add_rule(&name_rules, reactos_name[i], NAME_REACTOS, i);
+	for (i = 0; i < ARRAYSIZE(wininst_name); i++)
+		add_rule(&name_rules, wininst_name[i], NAME_WININST, i);
+	add_rule(&name_rules, "unattend.xml", NAME_UNATTEND, 0);
+	for (i = 0; i < ARRAYSIZE(pe_file); i++)
+		add_rule(&name_rules, pe_file[i], NAME_PE_FILE, i);
+	for (i = 0; i < ARRAYSIZE(isolinux_bin); i++)
+		add_rule(&name_rules, isolinux_bin[i], NAME_ISOLINUX_BIN, i);
+	// The EFI bootloader names are indexed by type * ARCH_MAX + arch
+	for (k = 0; k < ARRAYSIZE(efi_bootname); k++) {
+		for (i = 0; i < ARRAYSIZE(efi_archname); i++) {
+			static_sprintf(efi_bootloader_name[k][i], "%s%s.efi", efi_bootname[k], efi_archname[i]);
+			add_rule(&name_rules, efi_bootloader_name[k][i], NAME_EFI_BOOT, k * ARCH_MAX + i);
+		}
+	}
+	add_rule(&name_rules, "bootx64.efi", NAME_BOOTX64_EFI, 0);
+	seal_rules(&name_rules);
+
+	add_rule(&dir_rules, "/loader/entries", DIR_LOADER_ENTRIES, 0);
+	add_rule(&dir_rules, efi_dirname, DIR_EFI_BOOT, 0);
+	for (i = 0; i < ARRAYSIZE(grub_dirname); i++)
+		add_rule(&dir_rules, grub_dirname[i], DIR_GRUB, i);
+	add_rule(&dir_rules, proxmox_dirname, DIR_PROXMOX, 0);
+	add_rule(&dir_rules, "/sources/$OEM$/$$/Panther", DIR_PANTHER, 0);
+	for (i = 0; i < ARRAYSIZE(pe_dirname); i++)
+		add_rule(&dir_rules, pe_dirname[i], DIR_PE, i);
+	seal_rules(&dir_rules);
+
+	rules_compiled = TRUE;
+}
+
 /*
  * Scan and set ISO properties
  * Returns true if the the current file does not need to be processed further
@@ -245,85 +458,47 @@ static void _print_extracted_file(char* psz_fullpath, uint64_t file_length, BOOL
 static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const char* psz_basename,
 	const char* psz_fullpath, EXTRACT_PROPS *props)
 {
-	size_t i, j, k, len;
-	char bootloader_name[32];
+	size_t i, j, k, len, dir_len;
+	const ISO_RULE *name, *dir;
+
+	compile_rules();
+	name = lookup_rule(&name_rules, psz_basename);
+	dir = lookup_rule(&dir_rules, psz_dirname);
+	len = safe_strlen(psz_basename);
+	dir_len = safe_strlen(psz_dirname);
 
 	// Check for an isolinux/syslinux config file anywhere
 	memset(props, 0, sizeof(EXTRACT_PROPS));
-	for (i = 0; i < ARRAYSIZE(syslinux_cfg); i++) {
-		if (safe_stricmp(psz_basename, syslinux_cfg[i]) == 0) {
-			props->is_cfg = TRUE;	// Required for "extlinux.conf"
-			props->is_syslinux_cfg = TRUE;
-			// Maintain a list of all the isolinux/syslinux config files identified so far
-			if ((scan_only) && (i < 3))
-				StrArrayAdd(&config_path, psz_fullpath, TRUE);
-			if ((scan_only) && (i == 1) && (safe_stricmp(psz_dirname, efi_dirname) == 0))
-				img_report.has_efi_syslinux = TRUE;
-		}
+	if (HAS_RULE(name, NAME_SYSLINUX_CFG)) {
+		i = name->index[NAME_SYSLINUX_CFG];
+		props->is_cfg = TRUE;	// Required for "extlinux.conf"
+		props->is_syslinux_cfg = TRUE;
+		// Maintain a list of all the isolinux/syslinux config files identified so far
+		if ((scan_only || single_pass) && (i < 3))
+			StrArrayAdd(&config_path, psz_fullpath, TRUE);
+		if ((scan_only || single_pass) && (i == 1) && HAS_RULE(dir, DIR_EFI_BOOT))
+			img_report.has_efi_syslinux = TRUE;
 	}
 
 	// Check for archiso loader/entries/*.conf files
-	if (safe_stricmp(psz_dirname, "/loader/entries") == 0) {
-		len = safe_strlen(psz_basename);
+	if (HAS_RULE(dir, DIR_LOADER_ENTRIES))
 		props->is_conf = ((len > 4) && (stricmp(&psz_basename[len - 5], ".conf") == 0));
-	}
 
 	// Check for an old incompatible c32 file anywhere
-	for (i = 0; i < NB_OLD_C32; i++) {
-		if ((safe_stricmp(psz_basename, old_c32_name[i]) == 0) && (file_length <= old_c32_threshold[i]))
+	if (HAS_RULE(name, NAME_OLD_C32)) {
+		i = name->index[NAME_OLD_C32];
+		if (file_length <= old_c32_threshold[i])
 			props->is_old_c32[i] = TRUE;
 	}
 
-	if (!scan_only) {	// Write-time checks
-		// Check for config files that may need patching
-		len = safe_strlen(psz_basename);
-		if ((len >= 4) && safe_stricmp(&psz_basename[len - 4], ".cfg") == 0) {
-			props->is_cfg = TRUE;
-			for (i = 0; i < ARRAYSIZE(grub_cfg); i++) {
-				if (safe_stricmp(psz_basename, grub_cfg[i]) == 0)
-					props->is_grub_cfg = TRUE;
-			}
-			if (safe_stricmp(psz_basename, menu_cfg) == 0) {
-				props->is_menu_cfg = TRUE;
-			}
-		}
-
-		// In case there's an ldlinux.sys on the ISO, prevent it from overwriting ours
-		if ((psz_dirname != NULL) && (psz_dirname[0] == 0) && (safe_stricmp(psz_basename, ldlinux_name) == 0)) {
-			uprintf("Skipping '%s' file from ISO image", psz_basename);
-			return TRUE;
-		}
-
-		// Split a >4GB install.wim if the target filesystem is FAT
-		if (file_length >= 4 * GB && psz_dirname != NULL && IS_FAT(fs_type) && img_report.has_4GB_file == 0x81) {
-			if (safe_stricmp(&psz_dirname[max(0, ((int)safe_strlen(psz_dirname)) -
-				((int)strlen(sources_str)))], sources_str) == 0) {
-				char wim_path[4 * MAX_PATH];
-				for (i = 0; i < ARRAYSIZE(wininst_name) - 1; i++) {
-					if (safe_stricmp(psz_basename, wininst_name[i]) == 0 && file_length >= 4 * GB) {
-						print_split_file((char*)psz_fullpath, file_length);
-						char* dst = safe_strdup(psz_fullpath);
-						dst[strlen(dst) - 3] = 's';
-						dst[strlen(dst) - 2] = 'w';
-						dst[strlen(dst) - 1] = 'm';
-						assert(safe_strlen(image_path) + safe_strlen(psz_dirname) + safe_strlen(psz_basename) + 2 < ARRAYSIZE(wim_path));
-						static_sprintf(wim_path, "%s|%s/%s", image_path, psz_dirname, psz_basename);
-						WimSplitFile(wim_path, dst);
-						free(dst);
-						return TRUE;
-					}
-				}
-			}
-		}
-	} else {	// Scan-time checks
+	// Scan-time checks, which single pass mode also performs while extracting
+	if (scan_only || single_pass) {
 		// Check for GRUB artifacts
-		for (i = 0; i < ARRAYSIZE(grub_dirname); i++) {
-			if (safe_stricmp(psz_dirname, grub_dirname[i]) == 0)
-				img_report.has_grub2 = (uint8_t)i + 1;
-		}
+		if (HAS_RULE(dir, DIR_GRUB))
+			img_report.has_grub2 = (uint8_t)(dir->index[DIR_GRUB] + 1);
 
 		// Check for a syslinux v5.0+ file anywhere
-		if (safe_stricmp(psz_basename, ldlinux_c32) == 0) {
+		if (HAS_RULE(name, NAME_LDLINUX_C32)) {
 			has_ldlinux_c32 = TRUE;
 		}
 
@@ -335,16 +510,16 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 		}
 
 		// Check for a '/proxmox' directory
-		if (safe_stricmp(psz_dirname, proxmox_dirname) == 0) {
+		if (HAS_RULE(dir, DIR_PROXMOX)) {
 			img_report.disable_iso = TRUE;
 		}
 
 		// Check for various files and directories in root (psz_dirname = "")
 		if ((psz_dirname != NULL) && (psz_dirname[0] == 0)) {
-			if (safe_stricmp(psz_basename, bootmgr_name) == 0) {
+			if (HAS_RULE(name, NAME_BOOTMGR)) {
 				img_report.has_bootmgr = TRUE;
 			}
-			if (safe_stricmp(psz_basename, bootmgr_efi_name) == 0) {
+			if (HAS_RULE(name, NAME_BOOTMGR_EFI)) {
 				// We may extract the bootloaders for revocation validation later but
 				// to do so, since we're working with case sensitive file systems, we
 				// must store all found UEFI bootloader paths with the right case.
@@ -358,49 +533,41 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 				img_report.has_efi |= 1;
 				img_report.has_bootmgr_efi = TRUE;
 			}
-			if (safe_stricmp(psz_basename, grldr_name) == 0) {
+			if (HAS_RULE(name, NAME_GRLDR)) {
 				img_report.has_grub4dos = TRUE;
 			}
-			if (safe_stricmp(psz_basename, kolibri_name) == 0) {
+			if (HAS_RULE(name, NAME_KOLIBRI)) {
 				img_report.has_kolibrios = TRUE;
 			}
-			if (safe_stricmp(psz_basename, manjaro_marker) == 0) {
+			if (HAS_RULE(name, NAME_MANJARO)) {
 				img_report.disable_iso = TRUE;
 			}
-			for (i = 0; i < ARRAYSIZE(md5sum_name); i++) {
-				if (safe_stricmp(psz_basename, md5sum_name[i]) == 0)
-					img_report.has_md5sum = (uint8_t)(i + 1);
-			}
+			if (HAS_RULE(name, NAME_MD5SUM))
+				img_report.has_md5sum = (uint8_t)(name->index[NAME_MD5SUM] + 1);
 		}
 
 		// Check for ReactOS presence anywhere
-		if (img_report.reactos_path[0] == 0) {
-			for (i = 0; i < ARRAYSIZE(reactos_name); i++)
-				if (safe_stricmp(psz_basename, reactos_name[i]) == 0)
-					static_strcpy(img_report.reactos_path, psz_fullpath);
-		}
+		if ((img_report.reactos_path[0] == 0) && HAS_RULE(name, NAME_REACTOS))
+			static_strcpy(img_report.reactos_path, psz_fullpath);
 
 		// Check for the first 'efi*.img' we can find (that hopefully contains EFI boot files)
-		if (!HAS_EFI_IMG(img_report) && (safe_strlen(psz_basename) >= 7) &&
+		if (!HAS_EFI_IMG(img_report) && (len >= 7) &&
 			(safe_strnicmp(psz_basename, "efi", 3) == 0) &&
-			(safe_stricmp(&psz_basename[strlen(psz_basename) - 4], ".img") == 0))
+			(safe_stricmp(&psz_basename[len - 4], ".img") == 0))
 			static_strcpy(img_report.efi_img_path, psz_fullpath);
 
 		// Check for the EFI boot entries
-		if (safe_stricmp(psz_dirname, efi_dirname) == 0) {
-			for (k = 0; k < ARRAYSIZE(efi_bootname); k++) {
-				for (i = 0; i < ARRAYSIZE(efi_archname); i++) {
-					static_sprintf(bootloader_name, "%s%s.efi", efi_bootname[k], efi_archname[i]);
-					if (safe_stricmp(psz_basename, bootloader_name) == 0) {
-						if (k == 0)
-							img_report.has_efi |= (2 << i);	// start at 2 since "bootmgr.efi" is bit 0
-						for (j = 0; j < ARRAYSIZE(img_report.efi_boot_entry); j++) {
-							if (img_report.efi_boot_entry[j].path[0] == 0) {
-								img_report.efi_boot_entry[j].type = (uint8_t)k;
-								static_strcpy(img_report.efi_boot_entry[j].path, psz_fullpath);
-								break;
-							}
-						}
+		if (HAS_RULE(dir, DIR_EFI_BOOT)) {
+			if (HAS_RULE(name, NAME_EFI_BOOT)) {
+				k = name->index[NAME_EFI_BOOT] / ARCH_MAX;
+				i = name->index[NAME_EFI_BOOT] % ARCH_MAX;
+				if (k == 0)
+					img_report.has_efi |= (2 << i);	// start at 2 since "bootmgr.efi" is bit 0
+				for (j = 0; j < ARRAYSIZE(img_report.efi_boot_entry); j++) {
+					if (img_report.efi_boot_entry[j].path[0] == 0) {
+						img_report.efi_boot_entry[j].type = (uint8_t)k;
+						static_strcpy(img_report.efi_boot_entry[j].path, psz_fullpath);
+						break;
 					}
 				}
 			}
@@ -410,49 +577,42 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 			// https://salsa.debian.org/live-team/live-build/-/commit/5bff71fea2dd54adcd6c428d3f1981734079a2f7
 			// Because of this, if we detect a small bootx64.efi file, we assert that it's a
 			// broken link and try to extract a "good" version from the El-Torito image.
-			if ((safe_stricmp(psz_basename, "bootx64.efi") == 0) && (file_length < 256)) {
+			if (HAS_RULE(name, NAME_BOOTX64_EFI) && (file_length < 256)) {
 				img_report.has_efi |= 0x4000;
 				static_strcpy(img_report.efi_img_path, "[BOOT]/1-Boot-NoEmul.img");
 			}
 		}
 
 		if (psz_dirname != NULL) {
-			if (safe_stricmp(&psz_dirname[max(0, ((int)safe_strlen(psz_dirname)) -
-				((int)strlen(sources_str)))], sources_str) == 0) {
+			if (safe_stricmp(&psz_dirname[max(0, ((int)dir_len) - ((int)strlen(sources_str)))], sources_str) == 0) {
 				// Check for "install.###" in "###/sources/"
-				for (i = 0; i < ARRAYSIZE(wininst_name); i++) {
-					if (safe_stricmp(psz_basename, wininst_name[i]) == 0) {
-						if (img_report.wininst_index < MAX_WININST) {
-							static_sprintf(img_report.wininst_path[img_report.wininst_index],
-								"?:%s", psz_fullpath);
-							img_report.wininst_index++;
-							if (file_length >= 4 * GB)
-								img_report.has_4GB_file |= 0x80;
-						}
+				if (HAS_RULE(name, NAME_WININST)) {
+					if (img_report.wininst_index < MAX_WININST) {
+						static_sprintf(img_report.wininst_path[img_report.wininst_index],
+							"?:%s", psz_fullpath);
+						img_report.wininst_index++;
+						if (file_length >= 4 * GB)
+							img_report.has_4GB_file |= 0x80;
 					}
 				}
 			}
 		}
 
 		// Check for "\sources\\$OEM$\\$$\\Panther\\unattend.xml"
-		if ((safe_stricmp(psz_dirname, "/sources/$OEM$/$$/Panther") == 0) &&
-			(safe_stricmp(psz_basename, "unattend.xml") == 0))
+		if (HAS_RULE(dir, DIR_PANTHER) && HAS_RULE(name, NAME_UNATTEND))
 			img_report.has_panther_unattend = TRUE;
 
 		// Check for PE (XP) specific files in "/i386", "/amd64" or "/minint"
-		for (i = 0; i < ARRAYSIZE(pe_dirname); i++)
-			if (safe_stricmp(psz_dirname, pe_dirname[i]) == 0)
-				for (j=0; j<ARRAYSIZE(pe_file); j++)
-					if (safe_stricmp(psz_basename, pe_file[j]) == 0)
-						img_report.winpe |= (1<<j)<<(ARRAYSIZE(pe_dirname)*i);
-
-		for (i = 0; i < ARRAYSIZE(isolinux_bin); i++) {
-			if (safe_stricmp(psz_basename, isolinux_bin[i]) == 0) {
-				// Maintain a list of all the isolinux.bin files found
-				StrArrayAdd(&isolinux_path, psz_fullpath, TRUE);
-			}
+		if (HAS_RULE(dir, DIR_PE) && HAS_RULE(name, NAME_PE_FILE)) {
+			i = dir->index[DIR_PE];
+			j = name->index[NAME_PE_FILE];
+			img_report.winpe |= (1<<j)<<(ARRAYSIZE(pe_dirname)*i);
 		}
 
+		// Maintain a list of all the isolinux.bin files found
+		if (HAS_RULE(name, NAME_ISOLINUX_BIN))
+			StrArrayAdd(&isolinux_path, psz_fullpath, TRUE);
+
 		for (i = 0; i < NB_OLD_C32; i++) {
 			if (props->is_old_c32[i])
 				img_report.has_old_c32[i] = TRUE;
@@ -462,7 +622,46 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 		// Compute projected size needed (NB: ISO_BLOCKSIZE = UDF_BLOCKSIZE)
 		if (file_length != 0)
 			total_blocks += (file_length + (ISO_BLOCKSIZE - 1)) / ISO_BLOCKSIZE;
-		return TRUE;
+		if (scan_only)
+			return TRUE;
+	}
+
+	if (!scan_only) {	// Write-time checks
+		// Check for config files that may need patching
+		if ((len >= 4) && safe_stricmp(&psz_basename[len - 4], ".cfg") == 0) {
+			props->is_cfg = TRUE;
+			if (HAS_RULE(name, NAME_GRUB_CFG))
+				props->is_grub_cfg = TRUE;
+			if (HAS_RULE(name, NAME_MENU_CFG))
+				props->is_menu_cfg = TRUE;
+		}
+
+		// In case there's an ldlinux.sys on the ISO, prevent it from overwriting ours
+		if ((psz_dirname != NULL) && (psz_dirname[0] == 0) && HAS_RULE(name, NAME_LDLINUX_SYS)) {
+			uprintf("Skipping '%s' file from ISO image", psz_basename);
+			return TRUE;
+		}
+
+		// Split a >4GB install.wim if the target filesystem is FAT. In single pass mode, we
+		// can't know yet whether it is the only >4GB file, so we go by what the caller said.
+		if (file_length >= 4 * GB && psz_dirname != NULL && IS_FAT(fs_type) &&
+			(single_pass ? allow_wim_split : (img_report.has_4GB_file == 0x81))) {
+			if (safe_stricmp(&psz_dirname[max(0, ((int)dir_len) - ((int)strlen(sources_str)))], sources_str) == 0) {
+				char wim_path[4 * MAX_PATH];
+				if (HAS_RULE(name, NAME_WININST) && name->index[NAME_WININST] < ARRAYSIZE(wininst_name) - 1) {
+					print_split_file((char*)psz_fullpath, file_length);
+					char* dst = safe_strdup(psz_fullpath);
+					dst[strlen(dst) - 3] = 's';
+					dst[strlen(dst) - 2] = 'w';
+					dst[strlen(dst) - 1] = 'm';
+					assert(safe_strlen(image_path) + dir_len + len + 2 < ARRAYSIZE(wim_path));
+					static_sprintf(wim_path, "%s|%s/%s", image_path, psz_dirname, psz_basename);
+					WimSplitFile(wim_path, dst);
+					free(dst);
+					return TRUE;
+				}
+			}
+		}
 	}
 	return FALSE;
 }
@@ -599,6 +798,48 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 	free(src);
 }
 
+// Most of the config file patches depend on what the image contains (persistence support,
+// EFI syslinux, etc.). In single pass mode, this may only be known after the file has been
+// extracted, so the patching is deferred until the whole image has been walked.
+static void queue_fix_config(const char* psz_fullpath, const char* psz_path, const char* psz_basename, EXTRACT_PROPS* props)
+{
+	DEFERRED_FIXUP* fixup;
+
+	if (!single_pass) {
+		fix_config(psz_fullpath, psz_path, psz_basename, props);
+		return;
+	}
+	fixup = realloc(deferred_fixup, (nb_deferred_fixups + 1) * sizeof(DEFERRED_FIXUP));
+	if (fixup == NULL) {
+		uprintf("  Could not queue '%s' for patching", psz_fullpath);
+		return;
+	}
+	deferred_fixup = fixup;
+	fixup = &deferred_fixup[nb_deferred_fixups++];
+	fixup->fullpath = safe_strdup(psz_fullpath);
+	fixup->path = safe_strdup(psz_path);
+	fixup->basename = safe_strdup(psz_basename);
+	memcpy(&fixup->props, props, sizeof(EXTRACT_PROPS));
+}
+
+// Apply (or just discard, if apply is FALSE) the config file patches that were deferred
+static void apply_deferred_fixups(BOOL apply)
+{
+	size_t i;
+
+	for (i = 0; i < nb_deferred_fixups; i++) {
+		if (apply && (deferred_fixup[i].fullpath != NULL) && (deferred_fixup[i].path != NULL) &&
+			(deferred_fixup[i].basename != NULL))
+			fix_config(deferred_fixup[i].fullpath, deferred_fixup[i].path, deferred_fixup[i].basename,
+				&deferred_fixup[i].props);
+		safe_free(deferred_fixup[i].fullpath);
+		safe_free(deferred_fixup[i].path);
+		safe_free(deferred_fixup[i].basename);
+	}
+	safe_free(deferred_fixup);
+	nb_deferred_fixups = 0;
+}
+
 // Convert from time_t to FILETIME
 // Uses 3 static entries so that we can convert 3 concurrent values at the same time
 static LPFILETIME __inline to_filetime(time_t t)
@@ -624,6 +865,76 @@ static void __inline set_directory_timestamp(char* path, LPFILETIME creation, LP
 	safe_closehandle(dir_handle);
 }
 
+// Extract a file from the ISO cache, if it is there. Returns 1 if the file was extracted,
+// 0 if it isn't in the cache, or if the cached copy turned out to be corrupted (in which
+// case file_handle has been rewound, so that the file can be extracted from the image),
+// or -1 on error.
+static int extract_cached_file(uint32_t lsn, int64_t file_length, HANDLE file_handle,
+	uint8_t* buf, size_t buf_size, const char* psz_fullpath, uint64_t progress_total)
+{
+	ISO_CACHE_FILE cf;
+	LARGE_INTEGER zero = { 0 };
+	DWORD wr_size;
+	BOOL r;
+	int64_t read;
+	uint64_t t, blocks = 0;
+	size_t j;
+
+	if (!IsoCacheOpenFile(&cf, lsn, file_length, fd_md5sum != NULL))
+		return 0;
+	while (cf.pos < cf.size) {
+		if (ErrorStatus)
+			goto out;
+		t = TRACE_BEGIN();
+		read = IsoCacheReadFile(&cf, buf, buf_size);
+		if (read <= 0) {
+			uprintf("  Extracting from the image instead");
+			IsoCacheCloseFile(&cf, TRUE);
+			nb_blocks -= blocks;
+			if (!SetFilePointerEx(file_handle, zero, NULL, FILE_BEGIN)) {
+				uprintf("  Could not rewind file: %s", WindowsErrorString());
+				return -1;
+			}
+			return 0;
+		}
+		TRACE_END_BYTES("iso cache read", t, read);
+		t = TRACE_BEGIN();
+		ISO_BLOCKING(r = WriteFileWithRetry(file_handle, buf, (DWORD)read, &wr_size, WRITE_RETRIES));
+		TRACE_END_BYTES("iso write", t, read);
+		if (!r || (wr_size != read)) {
+			uprintf("  Error writing file: %s", r ? "Short write detected" : WindowsErrorString());
+			goto out;
+		}
+		blocks += (read + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
+		nb_blocks += (read + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
+		if (nb_blocks - last_nb_blocks >= PROGRESS_THRESHOLD) {
+			UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, progress_total);
+			last_nb_blocks = nb_blocks;
+		}
+	}
+	if (fd_md5sum != NULL) {
+		for (j = 0; j < MD5_HASHSIZE; j++)
+			fprintf(fd_md5sum, "%02x", cf.md5[j]);
+		fprintf(fd_md5sum, "  ./%s\n", &psz_fullpath[3]);
+	}
+	IsoCacheCloseFile(&cf, FALSE);
+	return 1;
+
+out:
+	IsoCacheCloseFile(&cf, FALSE);
+	return -1;
+}
+
+// The location of the data of a UDF file, or 0 if it doesn't have any
+static uint32_t udf_get_file_lsn(udf_dirent_t* p_udf_dirent)
+{
+	uint32_t start, end;
+
+	if (!udf_get_lba(&p_udf_dirent->fe, &start, &end))
+		return 0;
+	return p_udf_dirent->i_part_start + start;
+}
+
 // Returns 0 on success, nonzero on error
 static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const char *psz_path)
 {
@@ -631,16 +942,19 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 	DWORD buf_size, wr_size, err;
 	EXTRACT_PROPS props;
 	HASH_CONTEXT ctx;
+	ISO_CACHE_STORE cs = { 0 };
 	BOOL r, is_identical;
-	int length;
+	int length, cached;
 	size_t i, j, nb;
+	uint32_t lsn;
 	char tmp[128], *psz_fullpath = NULL, *psz_sanpath = NULL;
 	const char* psz_basename;
 	udf_dirent_t *p_udf_dirent2;
-	_Static_assert(ISO_BUFFER_SIZE % UDF_BLOCKSIZE == 0,
-		"ISO_BUFFER_SIZE is not a multiple of UDF_BLOCKSIZE");
-	uint8_t* buf = malloc(ISO_BUFFER_SIZE);
+	_Static_assert(UDF_BUFFER_SIZE % UDF_BLOCKSIZE == 0,
+		"UDF_BUFFER_SIZE is not a multiple of UDF_BLOCKSIZE");
+	uint8_t* buf = malloc(UDF_BUFFER_SIZE);
 	int64_t read, file_length;
+	uint64_t t;
 
 	if ((p_udf_dirent == NULL) || (psz_path == NULL) || (buf == NULL)) {
 		safe_free(buf);
@@ -712,30 +1026,40 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 					uprintf(stupid_antivirus);
 				else
 					goto out;
-			} else {
+			} else if ((cached = extract_cached_file(lsn = udf_get_file_lsn(p_udf_dirent), file_length,
+				file_handle, buf, UDF_BUFFER_SIZE, psz_fullpath, EXTRACT_TOTAL_BLOCKS)) < 0) {
+				goto out;
+			} else if (!cached) {
+				IsoCacheStoreBegin(&cs, lsn, file_length);
 				if (fd_md5sum != NULL)
 					hash_init[HASH_MD5](&ctx);
 				while (file_length > 0) {
 					if (ErrorStatus)
 						goto out;
-					nb = (size_t)MIN(ISO_BUFFER_SIZE / UDF_BLOCKSIZE, (file_length + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+					// Reads are served from the file's extent list and stop at extent boundaries
+					nb = (size_t)MIN(UDF_BUFFER_SIZE / UDF_BLOCKSIZE, (file_length + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+					t = TRACE_BEGIN();
 					read = udf_read_block(p_udf_dirent, buf, nb);
-					if (read < 0) {
+					if (read <= 0) {
 						uprintf("  Error reading UDF file %s", &psz_fullpath[strlen(psz_extract_dir)]);
 						goto out;
 					}
+					TRACE_END_BYTES("iso read", t, read);
 					buf_size = (DWORD)MIN(file_length, read);
 					if (fd_md5sum != NULL)
 						hash_write[HASH_MD5](&ctx, buf, buf_size);
+					IsoCacheStoreWrite(&cs, buf, buf_size);
+					t = TRACE_BEGIN();
 					ISO_BLOCKING(r = WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES));
+					TRACE_END_BYTES("iso write", t, buf_size);
 					if (!r || (wr_size != buf_size)) {
 						uprintf("  Error writing file: %s", r ? "Short write detected" : WindowsErrorString());
 						goto out;
 					}
 					file_length -= wr_size;
-					nb_blocks += nb;
+					nb_blocks += (read + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE;
 					if (nb_blocks - last_nb_blocks >= PROGRESS_THRESHOLD) {
-						UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, total_blocks);
+						UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, EXTRACT_TOTAL_BLOCKS);
 						last_nb_blocks = nb_blocks;
 					}
 				}
@@ -745,6 +1069,7 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 						fprintf(fd_md5sum, "%02x", ctx.buf[j]);
 					fprintf(fd_md5sum, "  ./%s\n", &psz_fullpath[3]);
 				}
+				IsoCacheStoreEnd(&cs, (fd_md5sum != NULL) ? ctx.buf : NULL);
 			}
 			if ((preserve_timestamps) && (!SetFileTime(file_handle, to_filetime(udf_get_attribute_time(p_udf_dirent)),
 				to_filetime(udf_get_access_time(p_udf_dirent)), to_filetime(udf_get_modification_time(p_udf_dirent)))))
@@ -757,7 +1082,7 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 			// may take forever to complete and is not interruptible. We try to detect this.
 			ISO_BLOCKING(safe_closehandle(file_handle));
 			if (props.is_cfg || props.is_conf)
-				fix_config(psz_sanpath, psz_path, psz_basename, &props);
+				queue_fix_config(psz_sanpath, psz_path, psz_basename, &props);
 			safe_free(psz_sanpath);
 		}
 		safe_free(psz_fullpath);
@@ -766,6 +1091,7 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 	return 0;
 
 out:
+	IsoCacheStoreAbort(&cs);
 	udf_dirent_free(p_udf_dirent);
 	ISO_BLOCKING(safe_closehandle(file_handle));
 	safe_free(psz_sanpath);
@@ -781,8 +1107,9 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 	DWORD buf_size, wr_size, err;
 	EXTRACT_PROPS props;
 	HASH_CONTEXT ctx;
-	BOOL is_symlink, is_identical, create_file, free_p_statbuf = FALSE;
-	int length, r = 1;
+	ISO_CACHE_STORE cs = { 0 };
+	BOOL is_symlink, is_identical, create_file, skip_file, free_p_statbuf = FALSE;
+	int length, cached, r = 1;
 	char psz_fullpath[MAX_PATH], *psz_basename = NULL, *psz_sanpath = NULL;
 	char tmp[128], target_path[256];
 	const char *psz_iso_name = &psz_fullpath[strlen(psz_extract_dir)];
@@ -795,6 +1122,7 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 	size_t i, j, nb;
 	lsn_t lsn;
 	int64_t file_length;
+	uint64_t t;
 
 	if ((p_iso == NULL) || (psz_path == NULL) || (buf == NULL)) {
 		safe_free(buf);
@@ -818,7 +1146,7 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 		if (ErrorStatus) goto out;
 		p_statbuf = (iso9660_stat_t*) _cdio_list_node_data(p_entnode);
 		free_p_statbuf = FALSE;
-		if (scan_only && (p_statbuf->rr.b3_rock == yep) && enable_rockridge) {
+		if ((scan_only || single_pass) && (p_statbuf->rr.b3_rock == yep) && enable_rockridge) {
 			if (p_statbuf->rr.u_su_fields & ISO_ROCK_SUF_PL) {
 				if (!img_report.has_deep_directories)
 					uprintf("  Note: The selected ISO uses Rock Ridge 'deep directories'.\r\n"
@@ -832,10 +1160,13 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 				// entries to appear below anything we care for, we cut things
 				// short by telling the parent not to bother any further once we
 				// find that we are dealing with a deep directory.
-				r = -1;
-				// Add at least one extra block, since we're skipping content.
-				total_blocks++;
-				goto out;
+				// Of course, we can't do that for content we must also extract.
+				if (scan_only) {
+					r = -1;
+					// Add at least one extra block, since we're skipping content.
+					total_blocks++;
+					goto out;
+				}
 			}
 		}
 		// Eliminate . and .. entries
@@ -871,7 +1202,8 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 				break;
 		} else {
 			file_length = p_statbuf->total_size;
-			if (check_iso_props(psz_path, file_length, psz_basename, psz_fullpath, &props)) {
+			skip_file = check_iso_props(psz_path, file_length, psz_basename, psz_fullpath, &props);
+			if (skip_file || single_pass) {
 				if (is_symlink && (file_length == 0)) {
 					// Add symlink duplicated files to total_size at scantime
 					if ((strcmp(psz_path, "/firmware") == 0)) {
@@ -887,7 +1219,8 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 						img_report.needs_ntfs = TRUE;
 					}
 				}
-				continue;
+				if (skip_file)
+					continue;
 			}
 			if (!is_symlink)
 				print_extracted_file(psz_fullpath, file_length);
@@ -976,7 +1309,11 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 						uprintf("  Error writing file: %s", WindowsErrorString());
 						goto out;
 					}
-				} else {
+				} else if ((cached = extract_cached_file(p_statbuf->lsn, file_length, file_handle, buf,
+					ISO_BUFFER_SIZE, psz_fullpath, EXTRACT_TOTAL_BLOCKS + ((fs_type != FS_NTFS) ? extra_blocks : 0))) < 0) {
+					goto out;
+				} else if (!cached) {
+					IsoCacheStoreBegin(&cs, p_statbuf->lsn, file_length);
 					if (fd_md5sum != NULL)
 						hash_init[HASH_MD5](&ctx);
 					for (i = 0; file_length > 0; i += nb) {
@@ -984,15 +1321,20 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 							goto out;
 						lsn = p_statbuf->lsn + (lsn_t)i;
 						nb = (size_t)MIN(ISO_BUFFER_SIZE / ISO_BLOCKSIZE, (file_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+						t = TRACE_BEGIN();
 						if (iso9660_iso_seek_read(p_iso, buf, lsn, (long)nb) != (nb * ISO_BLOCKSIZE)) {
 							uprintf("  Error reading ISO9660 file %s at LSN %lu",
 								psz_iso_name, (long unsigned int)lsn);
 							goto out;
 						}
+						TRACE_END_BYTES("iso read", t, nb * ISO_BLOCKSIZE);
 						buf_size = (DWORD)MIN(file_length, ISO_BUFFER_SIZE);
 						if (fd_md5sum != NULL)
 							hash_write[HASH_MD5](&ctx, buf, buf_size);
+						IsoCacheStoreWrite(&cs, buf, buf_size);
+						t = TRACE_BEGIN();
 						ISO_BLOCKING(r = WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES));
+						TRACE_END_BYTES("iso write", t, buf_size);
 						if (!r || wr_size != buf_size) {
 							uprintf("  Error writing file: %s", r ? "Short write detected" : WindowsErrorString());
 							goto out;
@@ -1000,7 +1342,7 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 						file_length -= wr_size;
 						nb_blocks += nb;
 						if (nb_blocks - last_nb_blocks >= PROGRESS_THRESHOLD) {
-							UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, total_blocks +
+							UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, EXTRACT_TOTAL_BLOCKS +
 								((fs_type != FS_NTFS) ? extra_blocks : 0));
 							last_nb_blocks = nb_blocks;
 						}
@@ -1011,6 +1353,7 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 							fprintf(fd_md5sum, "%02x", ctx.buf[j]);
 						fprintf(fd_md5sum, "  ./%s\n", &psz_fullpath[3]);
 					}
+					IsoCacheStoreEnd(&cs, (fd_md5sum != NULL) ? ctx.buf : NULL);
 				}
 				if (preserve_timestamps) {
 					LPFILETIME ft = to_filetime(mktime(&p_statbuf->tm));
@@ -1022,13 +1365,14 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 				iso9660_stat_free(p_statbuf);
 			ISO_BLOCKING(safe_closehandle(file_handle));
 			if (props.is_cfg || props.is_conf)
-				fix_config(psz_sanpath, psz_path, psz_basename, &props);
+				queue_fix_config(psz_sanpath, psz_path, psz_basename, &props);
 			safe_free(psz_sanpath);
 		}
 	}
 	r = 0;
 
 out:
+	IsoCacheStoreAbort(&cs);
 	ISO_BLOCKING(safe_closehandle(file_handle));
 	if (p_entlist != NULL)
 		iso9660_filelist_free(p_entlist);
@@ -1176,6 +1520,24 @@ void GetEfiBootInfo(char* buf, size_t buf_size, const char* source)
 	}
 }
 
+// Set up the data we need to validate the extracted files: the image's own md5sum.txt if it
+// has one, or else the one we create from the hashes of the files we extract.
+static void init_md5sum(const char* src_iso, const char* dest_dir, BOOL has_md5sum_txt)
+{
+	char path[MAX_PATH];
+
+	md5sum_totalbytes = 0;
+	if (!has_md5sum_txt) {
+		static_sprintf(path, "%s\\%s", dest_dir, md5sum_name[0]);
+		fd_md5sum = fopenU(path, "wb");
+		if (fd_md5sum == NULL)
+			uprintf("WARNING: Could not create '%s'", md5sum_name[0]);
+	} else {
+		md5sum_size = ReadISOFileToBuffer(src_iso, md5sum_name[0], (uint8_t**)&md5sum_data);
+		md5sum_pos = md5sum_data;
+	}
+}
+
 BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 {
 	const char* basedir[] = { "i386", "amd64", "minint" };
@@ -1200,10 +1562,12 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 		spacing = "";
 	cdio_log_set_handler(log_handler);
 	psz_extract_dir = dest_dir;
-	// Change progress style to marquee for scanning
-	if (scan_only) {
-		uprintf("ISO analysis:");
-		SendMessage(hMainDialog, UM_PROGRESS_INIT, PBS_MARQUEE, 0);
+	if (scan_only || single_pass) {
+		// Change progress style to marquee for scanning
+		if (scan_only) {
+			uprintf("ISO analysis:");
+			SendMessage(hMainDialog, UM_PROGRESS_INIT, PBS_MARQUEE, 0);
+		}
 		total_blocks = 0;
 		extra_blocks = 0;
 		has_ldlinux_c32 = FALSE;
@@ -1211,11 +1575,16 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 		StrArrayCreate(&config_path, 8);
 		StrArrayCreate(&isolinux_path, 8);
 		StrArrayCreate(&grub_filesystems, 8);
-		PrintInfo(0, MSG_202);
-	} else {
-		uprintf("Extracting files...");
+		if (scan_only)
+			PrintInfo(0, MSG_202);
+	}
+	if (!scan_only) {
+		uprintf(single_pass ? "Scanning and extracting files..." : "Extracting files...");
 		IGNORE_RETVAL(_chdirU(app_data_dir));
-		if (total_blocks == 0) {
+		if (single_pass) {
+			struct __stat64 stat;
+			image_blocks = (_stat64U(src_iso, &stat) == 0) ? (stat.st_size + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE : 0;
+		} else if (total_blocks == 0) {
 			uprintf("Error: ISO has not been properly scanned.");
 			ErrorStatus = RUFUS_ERROR(APPERR(ERROR_ISO_SCAN));
 			goto out;
@@ -1225,19 +1594,11 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 		iso_blocking_status = 0;
 		symlinked_syslinux[0] = 0;
 		StrArrayClear(&modified_files);
-		if (validate_md5sum) {
-			md5sum_totalbytes = 0;
-			// If there isn't an already existing md5sum.txt create one
-			if (img_report.has_md5sum != 1) {
-				static_sprintf(path, "%s\\%s", dest_dir, md5sum_name[0]);
-				fd_md5sum = fopenU(path, "wb");
-				if (fd_md5sum == NULL)
-					uprintf("WARNING: Could not create '%s'", md5sum_name[0]);
-			} else {
-				md5sum_size = ReadISOFileToBuffer(src_iso, md5sum_name[0], (uint8_t**)&md5sum_data);
-				md5sum_pos = md5sum_data;
-			}
-		}
+		// In single pass mode, we don't know yet whether the image has an md5sum.txt, so
+		// this is done once we have opened it.
+		if (validate_md5sum && !single_pass)
+			init_md5sum(src_iso, dest_dir, img_report.has_md5sum == 1);
+		IsoCacheOpen(src_iso);
 	}
 
 	// First try to open as UDF - fallback to ISO if it failed
@@ -1251,20 +1612,26 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 		uprintf("%sCould not locate UDF root directory", spacing);
 		goto try_iso;
 	}
-	if (scan_only) {
+	if (scan_only || single_pass) {
 		if (udf_get_logical_volume_id(p_udf, img_report.label, sizeof(img_report.label)) <= 0)
 			img_report.label[0] = 0;
 		// Open the UDF as ISO so that we can perform size checks
 		p_iso = iso9660_open(src_iso);
 	}
+	if (single_pass && validate_md5sum) {
+		udf_dirent_t* p_md5sum = udf_fopen(p_udf_root, md5sum_name[0]);
+		init_md5sum(src_iso, dest_dir, p_md5sum != NULL);
+		udf_dirent_free(p_md5sum);
+	}
 	r = udf_extract_files(p_udf, p_udf_root, "");
 	goto out;
 
 try_iso:
 	// Perform our first scan with Joliet disabled (if Rock Ridge is enabled), so that we can find if
 	// there exists a Rock Ridge file with a name > 64 chars or if there are symlinks. If that is the
-	// case then we also disable Joliet during the extract phase.
-	if ((!enable_joliet) || (enable_rockridge && (scan_only || img_report.has_long_filename ||
+	// case then we also disable Joliet during the extract phase. In single pass mode, we
+	// can't know that beforehand so we always extract with Rock Ridge.
+	if ((!enable_joliet) || (enable_rockridge && (scan_only || single_pass || img_report.has_long_filename ||
 		(img_report.has_symlinks == SYMLINKS_RR)))) {
 		iso_extension_mask &= ~ISO_EXTENSION_JOLIET;
 	}
@@ -1280,13 +1647,19 @@ try_iso:
 	}
 	uprintf("%sImage is an ISO9660 image", spacing);
 	joliet_level = iso9660_ifs_get_joliet_level(p_iso);
-	if (scan_only) {
+	if (scan_only || single_pass) {
 		if (iso9660_ifs_get_volume_id(p_iso, &tmp)) {
 			static_strcpy(img_report.label, tmp);
 			safe_free(tmp);
 		} else
 			img_report.label[0] = 0;
-	} else {
+	}
+	if (!scan_only) {
+		if (single_pass && validate_md5sum) {
+			iso9660_stat_t* p_md5sum = iso9660_ifs_stat_translate(p_iso, md5sum_name[0]);
+			init_md5sum(src_iso, dest_dir, p_md5sum != NULL);
+			iso9660_stat_free(p_md5sum);
+		}
 		if (iso_extension_mask & (ISO_EXTENSION_JOLIET|ISO_EXTENSION_ROCK_RIDGE))
 			uprintf("%sThis image will be extracted using %s extensions (if present)", spacing,
 				(iso_extension_mask & ISO_EXTENSION_JOLIET)?"Joliet":"Rock Ridge");
@@ -1297,7 +1670,7 @@ try_iso:
 
 out:
 	iso_blocking_status = -1;
-	if (scan_only) {
+	if (scan_only || single_pass) {
 		const char* fs_name[] = { "fat", "exfat", "ntfs" };
 		struct __stat64 stat;
 		char fses[256] = { 0 };
@@ -1461,8 +1834,12 @@ out:
 		StrArrayDestroy(&config_path);
 		StrArrayDestroy(&isolinux_path);
 		StrArrayDestroy(&grub_filesystems);
-		SendMessage(hMainDialog, UM_PROGRESS_EXIT, 0, 0);
-	} else {
+		if (scan_only)
+			SendMessage(hMainDialog, UM_PROGRESS_EXIT, 0, 0);
+	}
+	if (!scan_only) {
+		// Now that we know everything about the image, patch the config files we extracted
+		apply_deferred_fixups(r == 0);
 		// Solus and other ISOs only provide EFI boot files in a FAT efi.img
 		// Also work around ISOs that have a borked symbolic link for bootx64.efi.
 		// See https://github.com/linuxmint/linuxmint/issues/622.
@@ -1563,6 +1940,7 @@ out:
 			md5sum_size = 0;
 		}
 	}
+	IsoCacheClose();
 	iso9660_close(p_iso);
 	udf_close(p_udf);
 	if ((r != 0) && (ErrorStatus == 0))
@@ -1570,6 +1948,32 @@ out:
 	return (r == 0);
 }
 
+/*
+ * Scan and extract an ISO in a single walk of its file system, for when the target
+ * settings are already known (i.e. no user has to be presented with the scan results).
+ * Everything that depends on the whole image (syslinux version, config file patches,
+ * etc.) is worked out at the end, from what was found along the way. The caller must
+ * have set the USB label, and can then use img_report as if the image had been scanned.
+ * Since img_report is reset, split_wim tells whether a >4GB install.wim may be split on
+ * a FAT target, which the two-pass flow decides from the scan results.
+ */
+BOOL ScanAndExtractISO(const char* src_iso, const char* dest_dir, BOOL split_wim)
+{
+	BOOL r;
+	char usb_label[sizeof(img_report.usb_label)];
+
+	static_strcpy(usb_label, img_report.usb_label);
+	memset(&img_report, 0, sizeof(img_report));
+	static_strcpy(img_report.usb_label, usb_label);
+	allow_wim_split = split_wim;
+	single_pass = TRUE;
+	r = ExtractISO(src_iso, dest_dir, FALSE);
+	single_pass = FALSE;
+	allow_wim_split = FALSE;
+	img_report.is_iso = (BOOLEAN)r;
+	return r;
+}
+
 int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_file, DWORD attributes)
 {
 	size_t i;
@@ -2160,27 +2564,82 @@ void OpticalDiscSaveImage(void)
 	}
 }
 
-// Create an ISO image from the currently selected drive, using oscdimg.exe
+static void IsoSaveProgress(uint64_t done, uint64_t total)
+{
+	UpdateProgressWithInfo(OP_FORMAT, MSG_261, done, total);
+}
+
+static void IsoSaveHash(void* hash_ctx, const uint8_t* buf, size_t len)
+{
+	hash_write[HASH_SHA256]((HASH_CONTEXT*)hash_ctx, buf, len);
+}
+
+// Create an ISO image from the currently selected drive
 DWORD WINAPI IsoSaveImageThread(void* param)
 {
-	DWORD r;
+	DWORD r = 0;
 	IMG_SAVE* img_save = (IMG_SAVE*)param;
-	char cmd[2 * MAX_PATH], letters[27], * label;
+	HASH_CONTEXT hash_ctx;
+	isob_job job = { 0 };
+	char src[4], hash_hex[2 * SHA256_HASHSIZE + 1], letters[27], * label;
+	uint64_t t;
+	int i, err;
 
 	if (!GetDriveLabel(SelectedDrive.DeviceNumber, letters, &label, TRUE) || letters[0] == '\0')
 		ExitThread(ERROR_NOT_FOUND);
 	// Save to UDF only, as Microsoft's implementation of ISO-9660 doesn't support multiextent
 	// and produces BROKEN images if you try to add files larger than 4 GB.
 	// Plus ISO-9660/Joliet limits labels to 16 characters and has issues with long paths.
-	static_sprintf(cmd, "%s\\%s\\oscdimg.exe -g -h -k -l\"%s\" -m -u2 -udfver102 %c:\\ %s",
-		app_data_dir, FILES_DIR, label, letters[0], img_save->ImagePath);
-	uprintf("Running command: '%s'", cmd);
-	// For detecting typical oscdimg commandline progress report of type: "\r15.5% complete"
-	r = RunCommandWithProgress(cmd, sysnative_dir, FALSE, MSG_261, ".*\r([0-9\\.]+)% complete.*");
-	if (r != 0 && !IS_ERROR(ErrorStatus)) {
-		SetLastError(r);
-		uprintf("Failed to write ISO image: %s", WindowsErrorString());
-		ErrorStatus = RUFUS_ERROR(SCODE_CODE(r));
+	static_sprintf(src, "%c:\\", letters[0]);
+	job.src_dir = src;
+	job.image_path = img_save->ImagePath;
+	job.label = label;
+	job.cancel = (volatile int*)&ErrorStatus;
+	job.progress = IsoSaveProgress;
+	job.hash = IsoSaveHash;
+	job.hash_ctx = &hash_ctx;
+	hash_init[HASH_SHA256](&hash_ctx);
+	uprintf("Creating UDF image of '%s' (%s)", src, label);
+	t = TRACE_BEGIN();
+	err = isob_run(&job);
+	TRACE_END_BYTES("iso save", t, job.image_size);
+	if (err != 0) {
+		if (job.failed_path[0] != 0)
+			uprintf("Failed to write ISO image: %s: %s", job.failed_path, strerror(err));
+		else
+			uprintf("Failed to write ISO image: %s", strerror(err));
+		switch (err) {
+		case ECANCELED:
+			r = ERROR_CANCELLED;
+			break;
+		case ENOSPC:
+			r = ERROR_DISK_FULL;
+			break;
+		case ENOMEM:
+			r = ERROR_NOT_ENOUGH_MEMORY;
+			break;
+		case EACCES:
+			r = ERROR_ACCESS_DENIED;
+			break;
+		default:
+			r = ERROR_WRITE_FAULT;
+			break;
+		}
+		if (!IS_ERROR(ErrorStatus))
+			ErrorStatus = RUFUS_ERROR(r);
+	} else {
+		hash_final[HASH_SHA256](&hash_ctx);
+		for (i = 0; i < SHA256_HASHSIZE; i++)
+			safe_sprintf(&hash_hex[2 * i], sizeof(hash_hex) - 2 * i, "%02x", hash_ctx.buf[i]);
+		uprintf("Wrote %d files and %d directories (%s)", job.num_files, job.num_dirs,
+			SizeToHumanReadable(job.image_size, FALSE, FALSE));
+		if (job.num_skipped != 0)
+			uprintf("WARNING: Skipped %d links, special files or files that are too large for UDF", job.num_skipped);
+		if (job.num_changed != 0)
+			uprintf("WARNING: %d files changed size while the image was being created", job.num_changed);
+		if (job.num_renamed != 0)
+			uprintf("WARNING: %d file names were truncated", job.num_renamed);
+		uprintf("SHA-256: %s", hash_hex);
 	}
 	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)TRUE, 0);
 	if (!IS_ERROR(ErrorStatus))
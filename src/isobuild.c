@@ -0,0 +1,1641 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * UDF image builder
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <malloc.h>
+#include "msapi_utf8.h"
+#else
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "isobuild.h"
+#include "transcode.h"
+#include "trace.h"
+
+/*
+ * Layout of the image, in 2048 byte sectors:
+ *   0-15         System Area
+ *   16-17        ISO-9660 Primary Volume Descriptor and Volume Descriptor Set Terminator
+ *   18-20        UDF Volume Recognition Sequence (BEA01, NSR02, TEA01)
+ *   21-23        ISO-9660 root directory (empty) and path tables
+ *   32-47        UDF Main Volume Descriptor Sequence
+ *   48-63        UDF Reserve Volume Descriptor Sequence
+ *   64-65        UDF Logical Volume Integrity Sequence
+ *   256          UDF Anchor Volume Descriptor Pointer
+ *   257-(N-2)    UDF partition:
+ *                  File Set Descriptor and Terminating Descriptor
+ *                  for each directory (depth first): its File Entry, its File Identifier
+ *                    Descriptors and the File Entries of its files
+ *                  the data of all the files, in the same order as their File Entries
+ *   N-1          UDF Anchor Volume Descriptor Pointer
+ */
+#define SECTOR_SIZE         2048
+#define ISO_PVD_LBA         16
+#define ISO_ROOT_LBA        21
+#define ISO_LPATH_LBA       22
+#define ISO_MPATH_LBA       23
+#define MAIN_VDS_LBA        32
+#define RESERVE_VDS_LBA     48
+#define VDS_LENGTH          16
+#define LVID_LBA            64
+#define AVDP_LBA            256
+#define PART_START          257
+// Partition relative
+#define FSD_BLOCK           0
+#define FIRST_FREE_BLOCK    2
+
+// Descriptor tag identifiers (ECMA-167 3/7.2.1 and 4/7.2.1)
+#define TAG_PVD             1
+#define TAG_AVDP            2
+#define TAG_IUVD            4
+#define TAG_PD              5
+#define TAG_LVD             6
+#define TAG_USD             7
+#define TAG_TD              8
+#define TAG_LVID            9
+#define TAG_FSD             256
+#define TAG_FID             257
+#define TAG_FE              261
+
+#define FE_SIZE             176
+// Largest multiple of the block size that fits in the 30 bits of an allocation descriptor length
+#define MAX_EXTENT_SIZE     0x3FFFF800U
+#define MAX_EXTENTS         ((SECTOR_SIZE - FE_SIZE) / 8)
+#define MAX_FILE_SIZE       ((uint64_t)MAX_EXTENTS * MAX_EXTENT_SIZE)
+#define FID_SIZE(ident_len) (((38 + (ident_len)) + 3) & ~3)
+#define BLOCKS(size)        (((uint64_t)(size) + SECTOR_SIZE - 1) / SECTOR_SIZE)
+#define UDF_REVISION        0x0102
+#define IMPL_IDENTIFIER     "*Rufus"
+#define MAX_PATH_SIZE       4096
+#define MAX_NAME_SIZE       1024
+
+#if defined(_WIN32)
+#define PATH_SEP            '\\'
+#define OS_CLASS            6	// Windows NT
+#elif defined(__APPLE__)
+#define PATH_SEP            '/'
+#define OS_CLASS            3	// Mac OS
+#else
+#define PATH_SEP            '/'
+#define OS_CLASS            4	// UNIX
+#endif
+
+/*
+ * Minimal threading and file I/O abstraction
+ */
+#if defined(_WIN32)
+typedef SRWLOCK isob_mutex;
+typedef CONDITION_VARIABLE isob_cond;
+typedef HANDLE isob_thread;
+typedef HANDLE isob_fd;
+#define INVALID_FD              INVALID_HANDLE_VALUE
+#define THREAD_PROC(name)       static DWORD WINAPI name(void* param)
+#define THREAD_EXIT             return 0
+#define mutex_init(m)           InitializeSRWLock(m)
+#define mutex_destroy(m)        do { } while (0)
+#define mutex_lock(m)           AcquireSRWLockExclusive(m)
+#define mutex_unlock(m)         ReleaseSRWLockExclusive(m)
+#define cond_init(c)            InitializeConditionVariable(c)
+#define cond_destroy(c)         do { } while (0)
+#define cond_wait(c, m)         SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define cond_signal(c)          WakeConditionVariable(c)
+#define cond_broadcast(c)       WakeAllConditionVariable(c)
+#define aligned_free(p)         _aligned_free(p)
+
+static bool thread_create(isob_thread* t, LPTHREAD_START_ROUTINE proc, void* param)
+{
+	*t = CreateThread(NULL, 0, proc, param, 0, NULL);
+	return (*t != NULL);
+}
+
+static void thread_join(isob_thread t)
+{
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+
+static void* aligned_alloc_(size_t size, size_t alignment)
+{
+	return _aligned_malloc(size, alignment);
+}
+
+static int last_error(void)
+{
+	switch (GetLastError()) {
+	case ERROR_FILE_NOT_FOUND:
+	case ERROR_PATH_NOT_FOUND:
+		return ENOENT;
+	case ERROR_ACCESS_DENIED:
+	case ERROR_SHARING_VIOLATION:
+	case ERROR_LOCK_VIOLATION:
+		return EACCES;
+	case ERROR_DISK_FULL:
+	case ERROR_HANDLE_DISK_FULL:
+		return ENOSPC;
+	case ERROR_NOT_ENOUGH_MEMORY:
+	case ERROR_OUTOFMEMORY:
+		return ENOMEM;
+	case ERROR_FILENAME_EXCED_RANGE:
+		return ENAMETOOLONG;
+	default:
+		return EIO;
+	}
+}
+
+// Source paths are prefixed with \\?\, so that they aren't limited to MAX_PATH
+static wchar_t* long_path(const char* path, const char* suffix)
+{
+	char* str = malloc(4 + strlen(path) + strlen(suffix) + 1);
+	wchar_t* wstr;
+
+	if (str == NULL)
+		return NULL;
+	sprintf(str, "\\\\?\\%s%s", path, suffix);
+	wstr = utf8_to_wchar(str);
+	free(str);
+	return wstr;
+}
+
+static isob_fd file_open_read(const char* path, int* err)
+{
+	isob_fd fd = INVALID_FD;
+	wchar_t* wpath = long_path(path, "");
+
+	if (wpath == NULL) {
+		*err = ENOMEM;
+		return INVALID_FD;
+	}
+	fd = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (fd == INVALID_FD)
+		*err = last_error();
+	free(wpath);
+	return fd;
+}
+
+static isob_fd file_create(const char* path, int* err)
+{
+	isob_fd fd = INVALID_FD;
+	wchar_t* wpath = utf8_to_wchar(path);
+
+	if (wpath == NULL) {
+		*err = ENOMEM;
+		return INVALID_FD;
+	}
+	fd = CreateFileW(wpath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (fd == INVALID_FD)
+		*err = last_error();
+	free(wpath);
+	return fd;
+}
+
+static void file_delete(const char* path)
+{
+	wchar_t* wpath = utf8_to_wchar(path);
+
+	if (wpath != NULL)
+		DeleteFileW(wpath);
+	free(wpath);
+}
+
+// Returns the number of bytes read, which is less than len at EOF, or a negated errno value
+static int64_t file_read(isob_fd fd, uint8_t* buf, size_t len)
+{
+	DWORD size;
+	size_t done = 0;
+
+	while (done < len) {
+		if (!ReadFile(fd, &buf[done], (DWORD)min(len - done, 0x40000000), &size, NULL))
+			return -last_error();
+		if (size == 0)
+			break;
+		done += size;
+	}
+	return (int64_t)done;
+}
+
+static int file_write(isob_fd fd, const uint8_t* buf, size_t len)
+{
+	DWORD size;
+	size_t done = 0;
+
+	while (done < len) {
+		if (!WriteFile(fd, &buf[done], (DWORD)min(len - done, 0x40000000), &size, NULL))
+			return last_error();
+		done += size;
+	}
+	return 0;
+}
+
+#define file_close(fd)      CloseHandle(fd)
+
+static uint32_t num_cpus(void)
+{
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors;
+}
+
+static int gmtime_(const time_t* t, struct tm* tm)
+{
+	return (gmtime_s(tm, t) == 0) ? 0 : -1;
+}
+#else
+typedef pthread_mutex_t isob_mutex;
+typedef pthread_cond_t isob_cond;
+typedef pthread_t isob_thread;
+typedef int isob_fd;
+typedef void* (*LPTHREAD_START_ROUTINE)(void*);
+#define INVALID_FD              (-1)
+#define THREAD_PROC(name)       static void* name(void* param)
+#define THREAD_EXIT             return NULL
+#define mutex_init(m)           pthread_mutex_init(m, NULL)
+#define mutex_destroy(m)        pthread_mutex_destroy(m)
+#define mutex_lock(m)           pthread_mutex_lock(m)
+#define mutex_unlock(m)         pthread_mutex_unlock(m)
+#define cond_init(c)            pthread_cond_init(c, NULL)
+#define cond_destroy(c)         pthread_cond_destroy(c)
+#define cond_wait(c, m)         pthread_cond_wait(c, m)
+#define cond_signal(c)          pthread_cond_signal(c)
+#define cond_broadcast(c)       pthread_cond_broadcast(c)
+#define aligned_free(p)         free(p)
+#define file_close(fd)          close(fd)
+#ifndef min
+#define min(a, b)               (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b)               (((a) > (b)) ? (a) : (b))
+#endif
+
+static bool thread_create(isob_thread* t, LPTHREAD_START_ROUTINE proc, void* param)
+{
+	return (pthread_create(t, NULL, proc, param) == 0);
+}
+
+static void thread_join(isob_thread t)
+{
+	pthread_join(t, NULL);
+}
+
+static void* aligned_alloc_(size_t size, size_t alignment)
+{
+	void* p = NULL;
+
+	return (posix_memalign(&p, alignment, size) == 0) ? p : NULL;
+}
+
+static isob_fd file_open_read(const char* path, int* err)
+{
+	isob_fd fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		*err = errno;
+		return INVALID_FD;
+	}
+	// We read each file once, from start to end
+#if defined(__linux__)
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#elif defined(__APPLE__)
+	fcntl(fd, F_RDAHEAD, 1);
+#endif
+	return fd;
+}
+
+static isob_fd file_create(const char* path, int* err)
+{
+	isob_fd fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0)
+		*err = errno;
+	return fd;
+}
+
+#define file_delete(path)   unlink(path)
+
+static int64_t file_read(isob_fd fd, uint8_t* buf, size_t len)
+{
+	ssize_t size;
+	size_t done = 0;
+
+	while (done < len) {
+		size = read(fd, &buf[done], len - done);
+		if (size < 0 && errno == EINTR)
+			continue;
+		if (size < 0)
+			return -errno;
+		if (size == 0)
+			break;
+		done += (size_t)size;
+	}
+	return (int64_t)done;
+}
+
+static int file_write(isob_fd fd, const uint8_t* buf, size_t len)
+{
+	ssize_t size;
+	size_t done = 0;
+
+	while (done < len) {
+		size = write(fd, &buf[done], len - done);
+		if (size < 0 && errno == EINTR)
+			continue;
+		if (size < 0)
+			return errno;
+		done += (size_t)size;
+	}
+	return 0;
+}
+
+static uint32_t num_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (n > 0) ? (uint32_t)n : 1;
+}
+
+static int gmtime_(const time_t* t, struct tm* tm)
+{
+	return (gmtime_r(t, tm) != NULL) ? 0 : -1;
+}
+#endif
+
+/*
+ * Entries of the root directory that aren't part of the content of the drive
+ */
+static const char* skip_root[] = {
+#if defined(_WIN32)
+	"System Volume Information", "$RECYCLE.BIN",
+#else
+	".Spotlight-V100", ".fseventsd", ".Trashes", ".TemporaryItems",
+#endif
+};
+
+typedef struct isob_node {
+	struct isob_node* parent;
+	struct isob_node* next;         // Next entry of the parent directory
+	struct isob_node* child;        // First entry, for directories
+	uint64_t size;
+	int64_t mtime;
+	uint64_t unique_id;
+	uint32_t fe_block;              // Partition relative location of the File Entry
+	uint32_t data_block;            // Partition relative location of the data or of the FIDs
+	uint32_t fid_len;               // Total size of the FIDs, for directories
+	uint32_t num_subdirs;
+	bool is_dir;
+	bool hidden;
+	uint8_t ident_len;              // Length of the file identifier (OSTA CS0)
+	uint8_t* ident;
+	char name[];                    // UTF-8
+} isob_node;
+
+typedef struct {
+	isob_job* job;
+	char root[MAX_PATH_SIZE];
+	isob_node* root_node;
+	isob_mutex lock;
+	isob_cond cond;
+	int error;
+	// Tree walk
+	isob_node** queue;
+	size_t queue_len, queue_size;
+	uint32_t active;
+	// Layout
+	isob_node** order;
+	size_t num_nodes;
+	uint32_t part_len;
+	uint64_t num_sectors;
+	uint64_t next_unique_id;
+	time_t now;
+	// Buffer ring, that the reader thread fills and that the calling thread writes out
+	uint8_t* ring;
+	uint32_t* ring_len;
+	uint32_t ring_fill, ring_write, ring_count;
+	bool ring_done;
+	uint8_t* cur;
+	uint32_t cur_pos;
+} isob_ctx;
+
+/*
+ * On disk structure helpers
+ */
+static __inline void set16(uint8_t* p, uint16_t v)
+{
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+}
+
+static __inline void set32(uint8_t* p, uint32_t v)
+{
+	set16(p, (uint16_t)v);
+	set16(&p[2], (uint16_t)(v >> 16));
+}
+
+static __inline void set64(uint8_t* p, uint64_t v)
+{
+	set32(p, (uint32_t)v);
+	set32(&p[4], (uint32_t)(v >> 32));
+}
+
+static __inline void set16be(uint8_t* p, uint16_t v)
+{
+	p[0] = (uint8_t)(v >> 8);
+	p[1] = (uint8_t)v;
+}
+
+static __inline void set32be(uint8_t* p, uint32_t v)
+{
+	set16be(p, (uint16_t)(v >> 16));
+	set16be(&p[2], (uint16_t)v);
+}
+
+// ISO-9660 "both byte order" fields
+static __inline void set16both(uint8_t* p, uint16_t v)
+{
+	set16(p, v);
+	set16be(&p[2], v);
+}
+
+static __inline void set32both(uint8_t* p, uint32_t v)
+{
+	set32(p, v);
+	set32be(&p[4], v);
+}
+
+// CRC-ITU-T (x^16 + x^12 + x^5 + 1), as used by the UDF descriptor tags
+static uint16_t crc16(const uint8_t* p, size_t len)
+{
+	static uint16_t table[256];
+	uint16_t crc = 0;
+	size_t i;
+	int j;
+
+	if (table[1] == 0) {
+		for (i = 0; i < 256; i++) {
+			crc = (uint16_t)(i << 8);
+			for (j = 0; j < 8; j++)
+				crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+			table[i] = crc;
+		}
+		crc = 0;
+	}
+	for (i = 0; i < len; i++)
+		crc = (uint16_t)((crc << 8) ^ table[((crc >> 8) ^ p[i]) & 0xff]);
+	return crc;
+}
+
+// Must be called once the rest of the descriptor has been filled
+static void set_tag(uint8_t* d, uint16_t id, uint32_t location, size_t len)
+{
+	uint8_t sum = 0;
+	int i;
+
+	set16(&d[0], id);
+	set16(&d[2], 2);		// Descriptor version, for NSR02
+	set16(&d[6], 1);		// Serial number
+	set16(&d[8], crc16(&d[16], len - 16));
+	set16(&d[10], (uint16_t)(len - 16));
+	set32(&d[12], location);
+	for (i = 0; i < 16; i++) {
+		if (i != 4)
+			sum += d[i];
+	}
+	d[4] = sum;
+}
+
+static void set_charspec(uint8_t* p)
+{
+	p[0] = 0;			// CS0
+	memcpy(&p[1], "OSTA Compressed Unicode", 23);
+}
+
+static void set_regid(uint8_t* p, const char* id)
+{
+	memcpy(&p[1], id, strlen(id));
+}
+
+static void set_domain_id(uint8_t* p)
+{
+	set_regid(p, "*OSTA UDF Compliant");
+	set16(&p[24], UDF_REVISION);
+}
+
+static void set_impl_id(uint8_t* p)
+{
+	set_regid(p, IMPL_IDENTIFIER);
+	p[24] = OS_CLASS;
+}
+
+static void set_timestamp(uint8_t* p, int64_t t)
+{
+	time_t tt = (time_t)t;
+	struct tm tm;
+
+	if (gmtime_(&tt, &tm) != 0)
+		return;
+	set16(&p[0], 0x1000);		// Local time, with a zero offset from UTC
+	set16(&p[2], (uint16_t)(tm.tm_year + 1900));
+	p[4] = (uint8_t)(tm.tm_mon + 1);
+	p[5] = (uint8_t)tm.tm_mday;
+	p[6] = (uint8_t)tm.tm_hour;
+	p[7] = (uint8_t)tm.tm_min;
+	p[8] = (uint8_t)tm.tm_sec;
+}
+
+static void set_long_ad(uint8_t* p, uint32_t len, uint32_t block, uint64_t unique_id)
+{
+	set32(&p[0], len);
+	set32(&p[4], block);
+	set16(&p[8], 0);		// Partition reference
+	set32(&p[12], (uint32_t)unique_id);
+}
+
+/*
+ * Encode a UTF-8 string to OSTA Compressed Unicode, with at most 'max' bytes, including the
+ * compression ID. Returns the encoded length and sets *truncated if the string didn't fit.
+ */
+static uint8_t cs0_encode(const char* str, uint8_t* dst, size_t max, bool* truncated)
+{
+	uint16_t u16[MAX_NAME_SIZE];
+	size_t i, n, len = strlen(str);
+	bool wide = false;
+
+	*truncated = false;
+	if (len > MAX_NAME_SIZE) {
+		len = MAX_NAME_SIZE;
+		*truncated = true;
+	}
+	n = utf8_to_utf16le(str, len, u16);
+	if (n == TRANSCODE_INVALID) {
+		// POSIX file names need not be UTF-8, so just treat those as Latin-1
+		for (n = 0; n < len; n++)
+			u16[n] = (uint8_t)str[n];
+	}
+	// The 8-bit form is Latin-1, but some readers (including libcdio) take it as
+	// UTF-8, so only use it for plain ASCII names.
+	for (i = 0; i < n; i++) {
+		if (u16[i] > 0x7f) {
+			wide = true;
+			break;
+		}
+	}
+	if (!wide) {
+		if (n > max - 1) {
+			n = max - 1;
+			*truncated = true;
+		}
+		dst[0] = 8;
+		for (i = 0; i < n; i++)
+			dst[i + 1] = (uint8_t)u16[i];
+		return (uint8_t)(n + 1);
+	}
+	if (n > (max - 1) / 2) {
+		n = (max - 1) / 2;
+		// Don't split a surrogate pair
+		if ((u16[n - 1] & 0xfc00) == 0xd800)
+			n--;
+		*truncated = true;
+	}
+	dst[0] = 16;
+	for (i = 0; i < n; i++)
+		set16be(&dst[2 * i + 1], u16[i]);
+	return (uint8_t)(2 * n + 1);
+}
+
+static void set_dstring(uint8_t* p, size_t size, const char* str)
+{
+	bool truncated;
+	uint8_t len;
+
+	if (str == NULL || str[0] == 0)
+		return;
+	len = cs0_encode(str, p, size - 1, &truncated);
+	p[size - 1] = len;
+}
+
+/*
+ * Tree walk
+ */
+static void set_error(isob_ctx* ctx, int r, const char* path)
+{
+	size_t len;
+
+	mutex_lock(&ctx->lock);
+	if (ctx->error == 0) {
+		ctx->error = r;
+		if (path != NULL) {
+			// Truncated if needed, as this is only used for reporting
+			len = strnlen(path, sizeof(ctx->job->failed_path) - 1);
+			memcpy(ctx->job->failed_path, path, len);
+			ctx->job->failed_path[len] = '\0';
+		}
+	}
+	cond_broadcast(&ctx->cond);
+	mutex_unlock(&ctx->lock);
+}
+
+static bool is_cancelled(isob_ctx* ctx)
+{
+	return (ctx->job->cancel != NULL && *ctx->job->cancel != 0);
+}
+
+static int node_path(isob_ctx* ctx, isob_node* node, char* path, size_t size)
+{
+	size_t len = strlen(ctx->root), pos, l;
+	isob_node* n;
+
+	for (n = node; n != ctx->root_node; n = n->parent)
+		len += 1 + strlen(n->name);
+	if (len + 1 > size)
+		return ENAMETOOLONG;
+	path[len] = 0;
+	pos = len;
+	for (n = node; n != ctx->root_node; n = n->parent) {
+		l = strlen(n->name);
+		pos -= l;
+		memcpy(&path[pos], n->name, l);
+		path[--pos] = PATH_SEP;
+	}
+	memcpy(path, ctx->root, strlen(ctx->root));
+	return 0;
+}
+
+typedef struct {
+	isob_node** list;
+	size_t len, size;
+	uint32_t num_files, num_dirs, num_skipped, num_renamed;
+} isob_scan;
+
+static int add_entry(isob_ctx* ctx, isob_node* dir, isob_scan* scan, const char* name,
+	bool is_dir, bool hidden, uint64_t size, int64_t mtime)
+{
+	uint8_t ident[256], ident_len;
+	isob_node* node;
+	isob_node** list;
+	size_t i, name_len = strlen(name);
+	bool truncated;
+
+	if (dir == ctx->root_node) {
+		for (i = 0; i < sizeof(skip_root) / sizeof(skip_root[0]); i++) {
+			if (strcmp(name, skip_root[i]) == 0)
+				return 0;
+		}
+	}
+	if (!is_dir && size > MAX_FILE_SIZE) {
+		scan->num_skipped++;
+		return 0;
+	}
+	if (scan->len >= scan->size) {
+		list = realloc(scan->list, (scan->size + 64) * sizeof(isob_node*));
+		if (list == NULL)
+			return ENOMEM;
+		scan->list = list;
+		scan->size += 64;
+	}
+	ident_len = cs0_encode(name, ident, sizeof(ident) - 1, &truncated);
+	node = calloc(1, sizeof(isob_node) + name_len + 1 + ident_len);
+	if (node == NULL)
+		return ENOMEM;
+	memcpy(node->name, name, name_len + 1);
+	node->ident = (uint8_t*)&node->name[name_len + 1];
+	node->ident_len = ident_len;
+	memcpy(node->ident, ident, ident_len);
+	node->parent = dir;
+	node->is_dir = is_dir;
+	node->hidden = hidden;
+	node->size = is_dir ? 0 : size;
+	node->mtime = mtime;
+	scan->list[scan->len++] = node;
+	if (truncated)
+		scan->num_renamed++;
+	if (is_dir)
+		scan->num_dirs++;
+	else
+		scan->num_files++;
+	return 0;
+}
+
+static int compare_nodes(const void* a, const void* b)
+{
+	return strcmp((*(const isob_node**)a)->name, (*(const isob_node**)b)->name);
+}
+
+#if defined(_WIN32)
+static int64_t filetime_to_time(const FILETIME* ft)
+{
+	uint64_t t = ((uint64_t)ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+
+	return (int64_t)(t / 10000000ULL) - 11644473600LL;
+}
+
+static int list_dir(isob_ctx* ctx, isob_node* dir, const char* path, isob_scan* scan)
+{
+	WIN32_FIND_DATAW fd;
+	HANDLE h;
+	wchar_t* wpath = long_path(path, "\\*");
+	char* name;
+	int r = 0;
+
+	if (wpath == NULL)
+		return ENOMEM;
+	h = FindFirstFileExW(wpath, FindExInfoBasic, &fd, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	free(wpath);
+	if (h == INVALID_HANDLE_VALUE)
+		return (GetLastError() == ERROR_FILE_NOT_FOUND) ? 0 : last_error();
+	do {
+		if (wcscmp(fd.cFileName, L".") == 0 || wcscmp(fd.cFileName, L"..") == 0)
+			continue;
+		// Junctions and links could lead us outside of the drive, or into a loop
+		if (fd.dwFileAttributes & (FILE_ATTRIBUTE_REPARSE_POINT | FILE_ATTRIBUTE_DEVICE)) {
+			scan->num_skipped++;
+			continue;
+		}
+		name = wchar_to_utf8(fd.cFileName);
+		if (name == NULL) {
+			r = ENOMEM;
+			break;
+		}
+		r = add_entry(ctx, dir, scan, name, (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0,
+			(fd.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN) != 0,
+			((uint64_t)fd.nFileSizeHigh << 32) | fd.nFileSizeLow, filetime_to_time(&fd.ftLastWriteTime));
+		free(name);
+	} while (r == 0 && FindNextFileW(h, &fd));
+	FindClose(h);
+	return r;
+}
+#else
+static int list_dir(isob_ctx* ctx, isob_node* dir, const char* path, isob_scan* scan)
+{
+	DIR* d = opendir(path[0] == 0 ? "/" : path);
+	struct dirent* de;
+	struct stat st;
+	int r = 0;
+
+	if (d == NULL)
+		return errno;
+	while (r == 0 && (de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			r = errno;
+			break;
+		}
+		// Links could lead us outside of the drive, or into a loop
+		if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+			scan->num_skipped++;
+			continue;
+		}
+		r = add_entry(ctx, dir, scan, de->d_name, S_ISDIR(st.st_mode), false,
+			(uint64_t)st.st_size, (int64_t)st.st_mtime);
+	}
+	closedir(d);
+	return r;
+}
+#endif
+
+static int scan_dir(isob_ctx* ctx, isob_node* dir)
+{
+	char path[MAX_PATH_SIZE];
+	isob_scan scan = { 0 };
+	isob_node** queue;
+	size_t i, needed;
+	int r;
+
+	if (is_cancelled(ctx))
+		return ECANCELED;
+	r = node_path(ctx, dir, path, sizeof(path));
+	if (r == 0)
+		r = list_dir(ctx, dir, path, &scan);
+	if (r != 0) {
+		set_error(ctx, r, path);
+		goto out;
+	}
+	// Sort the entries, so that the same tree always produces the same image
+	if (scan.len > 1)
+		qsort(scan.list, scan.len, sizeof(isob_node*), compare_nodes);
+	dir->fid_len = FID_SIZE(0);	// Parent directory
+	for (i = 0; i < scan.len; i++) {
+		scan.list[i]->next = (i + 1 < scan.len) ? scan.list[i + 1] : NULL;
+		dir->fid_len += FID_SIZE(scan.list[i]->ident_len);
+		if (scan.list[i]->is_dir)
+			dir->num_subdirs++;
+	}
+	dir->child = (scan.len > 0) ? scan.list[0] : NULL;
+
+	mutex_lock(&ctx->lock);
+	ctx->job->num_files += scan.num_files;
+	ctx->job->num_dirs += scan.num_dirs;
+	ctx->job->num_skipped += scan.num_skipped;
+	ctx->job->num_renamed += scan.num_renamed;
+	needed = ctx->queue_len + dir->num_subdirs;
+	if (needed > ctx->queue_size) {
+		queue = realloc(ctx->queue, (needed + 256) * sizeof(isob_node*));
+		if (queue == NULL) {
+			r = ENOMEM;
+			mutex_unlock(&ctx->lock);
+			goto out;
+		}
+		ctx->queue = queue;
+		ctx->queue_size = needed + 256;
+	}
+	for (i = 0; i < scan.len; i++) {
+		if (scan.list[i]->is_dir)
+			ctx->queue[ctx->queue_len++] = scan.list[i];
+	}
+	cond_broadcast(&ctx->cond);
+	mutex_unlock(&ctx->lock);
+
+out:
+	free(scan.list);
+	return r;
+}
+
+THREAD_PROC(walk_thread)
+{
+	isob_ctx* ctx = (isob_ctx*)param;
+	isob_node* dir;
+	int r;
+
+	mutex_lock(&ctx->lock);
+	while (1) {
+		while (ctx->queue_len == 0 && ctx->active != 0 && ctx->error == 0)
+			cond_wait(&ctx->cond, &ctx->lock);
+		if (ctx->queue_len == 0 || ctx->error != 0)
+			break;
+		dir = ctx->queue[--ctx->queue_len];
+		ctx->active++;
+		mutex_unlock(&ctx->lock);
+		r = scan_dir(ctx, dir);
+		mutex_lock(&ctx->lock);
+		ctx->active--;
+		if (r != 0 && ctx->error == 0)
+			ctx->error = r;
+	}
+	cond_broadcast(&ctx->cond);
+	mutex_unlock(&ctx->lock);
+	THREAD_EXIT;
+}
+
+static int walk_tree(isob_ctx* ctx)
+{
+	isob_thread thread[64];
+	uint32_t i, num_threads = ctx->job->num_threads;
+	uint64_t t = TRACE_BEGIN();
+
+	if (num_threads == 0)
+		num_threads = min(ISOB_DEFAULT_NUM_THREADS, 2 * num_cpus());
+	num_threads = min(num_threads, (uint32_t)(sizeof(thread) / sizeof(thread[0])));
+	ctx->queue = malloc(256 * sizeof(isob_node*));
+	if (ctx->queue == NULL)
+		return ENOMEM;
+	ctx->queue_size = 256;
+	ctx->queue[ctx->queue_len++] = ctx->root_node;
+	for (i = 0; i < num_threads; i++) {
+		if (!thread_create(&thread[i], walk_thread, ctx))
+			break;
+	}
+	if (i == 0)
+		return EAGAIN;
+	while (i > 0)
+		thread_join(thread[--i]);
+	TRACE_END("tree walk", t);
+	return ctx->error;
+}
+
+static void free_tree(isob_node* node)
+{
+	isob_node *child, *next;
+
+	if (node == NULL)
+		return;
+	for (child = node->child; child != NULL; child = next) {
+		next = child->next;
+		free_tree(child);
+	}
+	free(node);
+}
+
+/*
+ * Layout: give every descriptor and every file its location, so that the image can be
+ * written in one go.
+ */
+static int layout(isob_ctx* ctx)
+{
+	isob_node **stack = NULL, *node, *child;
+	size_t i, sp = 0, num_nodes = (size_t)ctx->job->num_files + ctx->job->num_dirs + 1;
+	uint64_t next = FIRST_FREE_BLOCK;
+	int r = ENOMEM;
+
+	ctx->order = malloc(num_nodes * sizeof(isob_node*));
+	stack = malloc((ctx->job->num_dirs + 1) * sizeof(isob_node*));
+	if (ctx->order == NULL || stack == NULL)
+		goto out;
+	// Depth first, with each directory followed by its files
+	ctx->next_unique_id = 16;	// 0-15 are reserved, with 0 for the root
+	stack[sp++] = ctx->root_node;
+	while (sp > 0) {
+		node = stack[--sp];
+		node->unique_id = (node == ctx->root_node) ? 0 : ctx->next_unique_id++;
+		node->fe_block = (uint32_t)next++;
+		node->data_block = (uint32_t)next;
+		next += BLOCKS(node->fid_len);
+		ctx->order[ctx->num_nodes++] = node;
+		for (child = node->child; child != NULL; child = child->next) {
+			if (child->is_dir)
+				continue;
+			child->unique_id = ctx->next_unique_id++;
+			child->fe_block = (uint32_t)next++;
+			ctx->order[ctx->num_nodes++] = child;
+		}
+		// Push the subdirectories in reverse, so that they come out in order
+		i = sp + node->num_subdirs;
+		for (child = node->child; child != NULL; child = child->next) {
+			if (child->is_dir)
+				stack[--i] = child;
+		}
+		sp += node->num_subdirs;
+	}
+	for (i = 0; i < ctx->num_nodes; i++) {
+		node = ctx->order[i];
+		if (node->is_dir || node->size == 0)
+			continue;
+		node->data_block = (uint32_t)next;
+		next += BLOCKS(node->size);
+	}
+	// Partition, followed by the last AVDP
+	if (next + PART_START + 1 > UINT32_MAX) {
+		r = EFBIG;
+		goto out;
+	}
+	ctx->part_len = (uint32_t)next;
+	ctx->num_sectors = PART_START + next + 1;
+	r = 0;
+
+out:
+	free(stack);
+	return r;
+}
+
+/*
+ * Reader side of the buffer ring
+ */
+static int out_acquire(isob_ctx* ctx)
+{
+	int r;
+
+	mutex_lock(&ctx->lock);
+	while (ctx->ring_count == ctx->job->num_buffers && ctx->error == 0)
+		cond_wait(&ctx->cond, &ctx->lock);
+	r = ctx->error;
+	mutex_unlock(&ctx->lock);
+	if (r == 0 && is_cancelled(ctx))
+		r = ECANCELED;
+	if (r == 0) {
+		ctx->cur = &ctx->ring[(size_t)ctx->ring_fill * ctx->job->buffer_size];
+		ctx->cur_pos = 0;
+	}
+	return r;
+}
+
+static void out_flush(isob_ctx* ctx)
+{
+	if (ctx->cur == NULL)
+		return;
+	mutex_lock(&ctx->lock);
+	ctx->ring_len[ctx->ring_fill] = ctx->cur_pos;
+	ctx->ring_fill = (ctx->ring_fill + 1) % ctx->job->num_buffers;
+	ctx->ring_count++;
+	cond_broadcast(&ctx->cond);
+	mutex_unlock(&ctx->lock);
+	ctx->cur = NULL;
+}
+
+// Get the contiguous space left in the current buffer. A full buffer is only handed over
+// to the writer here, so that the last block committed can still be filled by the caller.
+static int out_space(isob_ctx* ctx, uint8_t** p, uint32_t* len)
+{
+	int r;
+
+	if (ctx->cur != NULL && ctx->cur_pos == ctx->job->buffer_size)
+		out_flush(ctx);
+	if (ctx->cur == NULL) {
+		r = out_acquire(ctx);
+		if (r != 0)
+			return r;
+	}
+	*p = &ctx->cur[ctx->cur_pos];
+	*len = ctx->job->buffer_size - ctx->cur_pos;
+	return 0;
+}
+
+static void out_commit(isob_ctx* ctx, uint32_t len)
+{
+	ctx->cur_pos += len;
+}
+
+// Get a zeroed sector to fill. Metadata only ever gets written one sector at a time.
+static uint8_t* out_sector(isob_ctx* ctx, int* r)
+{
+	uint8_t* p;
+	uint32_t len;
+
+	*r = out_space(ctx, &p, &len);
+	if (*r != 0)
+		return NULL;
+	memset(p, 0, SECTOR_SIZE);
+	out_commit(ctx, SECTOR_SIZE);
+	return p;
+}
+
+/*
+ * Descriptors
+ */
+static void write_iso_dir_record(isob_ctx* ctx, uint8_t* p, uint8_t name)
+{
+	struct tm tm;
+
+	p[0] = 34;
+	set32both(&p[2], ISO_ROOT_LBA);
+	set32both(&p[10], SECTOR_SIZE);
+	if (gmtime_(&ctx->now, &tm) == 0) {
+		p[18] = (uint8_t)tm.tm_year;
+		p[19] = (uint8_t)(tm.tm_mon + 1);
+		p[20] = (uint8_t)tm.tm_mday;
+		p[21] = (uint8_t)tm.tm_hour;
+		p[22] = (uint8_t)tm.tm_min;
+		p[23] = (uint8_t)tm.tm_sec;
+	}
+	p[25] = 0x02;			// Directory
+	set16both(&p[28], 1);
+	p[32] = 1;
+	p[33] = name;
+}
+
+static void write_iso_pvd(isob_ctx* ctx, uint8_t* p)
+{
+	const char* label = ctx->job->label;
+	char date[32] = "0000000000000000";
+	struct tm tm;
+	size_t i, j;
+
+	p[0] = 1;
+	memcpy(&p[1], "CD001", 5);
+	p[6] = 1;
+	memset(&p[8], ' ', 64);
+	// The volume identifier is restricted to d-characters
+	for (i = 0, j = 0; label != NULL && label[i] != 0 && j < 32; i++) {
+		if ((label[i] >= 'A' && label[i] <= 'Z') || (label[i] >= '0' && label[i] <= '9') || label[i] == '_')
+			p[40 + j++] = label[i];
+		else if (label[i] >= 'a' && label[i] <= 'z')
+			p[40 + j++] = label[i] - 'a' + 'A';
+		else if (label[i] == ' ' || label[i] == '-' || label[i] == '.')
+			p[40 + j++] = '_';
+	}
+	set32both(&p[80], (uint32_t)ctx->num_sectors);
+	set16both(&p[120], 1);
+	set16both(&p[124], 1);
+	set16both(&p[128], SECTOR_SIZE);
+	set32both(&p[132], 10);
+	set32(&p[140], ISO_LPATH_LBA);
+	set32be(&p[148], ISO_MPATH_LBA);
+	write_iso_dir_record(ctx, &p[156], 0);
+	memset(&p[190], ' ', 813 - 190);
+	if (gmtime_(&ctx->now, &tm) == 0)
+		snprintf(date, sizeof(date), "%04d%02d%02d%02d%02d%02d00", (tm.tm_year + 1900) % 10000,
+			(tm.tm_mon + 1) % 100, tm.tm_mday % 100, tm.tm_hour % 100, tm.tm_min % 100, tm.tm_sec % 100);
+	memcpy(&p[813], date, 16);
+	memcpy(&p[830], date, 16);
+	memcpy(&p[847], "0000000000000000", 16);
+	memcpy(&p[864], "0000000000000000", 16);
+	p[881] = 1;
+}
+
+static void write_iso_path_table(uint8_t* p, bool big_endian)
+{
+	p[0] = 1;
+	if (big_endian) {
+		set32be(&p[2], ISO_ROOT_LBA);
+		set16be(&p[6], 1);
+	} else {
+		set32(&p[2], ISO_ROOT_LBA);
+		set16(&p[6], 1);
+	}
+}
+
+static void write_vds(isob_ctx* ctx, uint8_t* p, uint32_t index, uint32_t location)
+{
+	const char* label = ctx->job->label;
+	char volset_id[17];
+
+	set32(&p[16], index);		// Volume Descriptor Sequence Number
+	switch (index) {
+	case 0:		// Primary Volume Descriptor
+		set_dstring(&p[24], 32, label);
+		set16(&p[56], 1);
+		set16(&p[58], 1);
+		set16(&p[60], 2);
+		set16(&p[62], 3);
+		set32(&p[64], 1);
+		set32(&p[68], 1);
+		// The first 16 characters of the volume set identifier should be unique
+		sprintf(volset_id, "%016llX", (unsigned long long)ctx->now);
+		set_dstring(&p[72], 128, volset_id);
+		set_charspec(&p[200]);
+		set_charspec(&p[264]);
+		set_impl_id(&p[344]);
+		set_timestamp(&p[376], ctx->now);
+		set_impl_id(&p[388]);
+		set_tag(p, TAG_PVD, location, 512);
+		break;
+	case 1:		// Implementation Use Volume Descriptor
+		set_regid(&p[20], "*UDF LV Info");
+		set16(&p[44], UDF_REVISION);
+		p[46] = OS_CLASS;
+		set_charspec(&p[52]);
+		set_dstring(&p[116], 128, label);
+		set_impl_id(&p[352]);
+		set_tag(p, TAG_IUVD, location, 512);
+		break;
+	case 2:		// Partition Descriptor
+		set16(&p[20], 1);		// Allocated
+		set16(&p[22], 0);		// Partition number
+		set_regid(&p[24], "+NSR02");
+		set32(&p[184], 1);		// Read only
+		set32(&p[188], PART_START);
+		set32(&p[192], ctx->part_len);
+		set_impl_id(&p[196]);
+		set_tag(p, TAG_PD, location, 512);
+		break;
+	case 3:		// Logical Volume Descriptor
+		set_charspec(&p[20]);
+		set_dstring(&p[84], 128, label);
+		set32(&p[212], SECTOR_SIZE);
+		set_domain_id(&p[216]);
+		set_long_ad(&p[248], SECTOR_SIZE, FSD_BLOCK, 0);
+		set32(&p[264], 6);		// Partition map table length
+		set32(&p[268], 1);		// Number of partition maps
+		set_impl_id(&p[272]);
+		set32(&p[432], 2 * SECTOR_SIZE);
+		set32(&p[436], LVID_LBA);
+		p[440] = 1;			// Type 1 partition map
+		p[441] = 6;
+		set16(&p[442], 1);		// Volume sequence number
+		set16(&p[444], 0);		// Partition number
+		set_tag(p, TAG_LVD, location, 446);
+		break;
+	case 4:		// Unallocated Space Descriptor
+		set_tag(p, TAG_USD, location, 24);
+		break;
+	case 5:		// Terminating Descriptor
+		set_tag(p, TAG_TD, location, 512);
+		break;
+	}
+}
+
+static void write_lvid(isob_ctx* ctx, uint8_t* p)
+{
+	set_timestamp(&p[16], ctx->now);
+	set32(&p[28], 1);		// Close integrity descriptor
+	set64(&p[40], ctx->next_unique_id);
+	set32(&p[72], 1);		// Number of partitions
+	set32(&p[76], 46);		// Length of implementation use
+	set32(&p[80], 0);		// Free space
+	set32(&p[84], ctx->part_len);	// Size
+	set_impl_id(&p[88]);
+	set32(&p[120], ctx->job->num_files);
+	set32(&p[124], ctx->job->num_dirs + 1);
+	set16(&p[128], UDF_REVISION);
+	set16(&p[130], UDF_REVISION);
+	set16(&p[132], UDF_REVISION);
+	set_tag(p, TAG_LVID, LVID_LBA, 134);
+}
+
+static void write_avdp(uint8_t* p, uint32_t location)
+{
+	set32(&p[16], VDS_LENGTH * SECTOR_SIZE);
+	set32(&p[20], MAIN_VDS_LBA);
+	set32(&p[24], VDS_LENGTH * SECTOR_SIZE);
+	set32(&p[28], RESERVE_VDS_LBA);
+	set_tag(p, TAG_AVDP, location, 512);
+}
+
+static void write_fsd(isob_ctx* ctx, uint8_t* p)
+{
+	set_timestamp(&p[16], ctx->now);
+	set16(&p[28], 3);
+	set16(&p[30], 3);
+	set32(&p[32], 1);
+	set32(&p[36], 1);
+	set_charspec(&p[48]);
+	set_dstring(&p[112], 128, ctx->job->label);
+	set_charspec(&p[240]);
+	set_dstring(&p[304], 32, ctx->job->label);
+	set_long_ad(&p[400], SECTOR_SIZE, ctx->root_node->fe_block, 0);
+	set_domain_id(&p[416]);
+	set_tag(p, TAG_FSD, FSD_BLOCK, 512);
+}
+
+static void write_fe(isob_node* node, uint8_t* p)
+{
+	uint64_t size = node->is_dir ? node->fid_len : node->size, left, len;
+	uint32_t num_ad = 0, pos = node->data_block;
+
+	set16(&p[20], 4);		// ICB strategy
+	set16(&p[24], 1);		// Maximum number of entries
+	p[27] = node->is_dir ? 4 : 5;
+	set16(&p[34], 0);		// Short allocation descriptors
+	set32(&p[36], 0xffffffff);	// uid
+	set32(&p[40], 0xffffffff);	// gid
+	// Read (and execute, for directories) for everyone
+	set32(&p[44], node->is_dir ? 0x14a5 : 0x1084);
+	set16(&p[48], (uint16_t)(node->is_dir ? 1 + node->num_subdirs : 1));
+	set64(&p[56], size);
+	set64(&p[64], BLOCKS(size));
+	set_timestamp(&p[72], node->mtime);
+	set_timestamp(&p[84], node->mtime);
+	set_timestamp(&p[96], node->mtime);
+	set32(&p[108], 1);		// Checkpoint
+	set_impl_id(&p[128]);
+	set64(&p[160], node->unique_id);
+	for (left = size; left > 0; left -= len, num_ad++) {
+		len = min(left, MAX_EXTENT_SIZE);
+		set32(&p[FE_SIZE + 8 * num_ad], (uint32_t)len);
+		set32(&p[FE_SIZE + 8 * num_ad + 4], pos);
+		pos += (uint32_t)BLOCKS(len);
+	}
+	set32(&p[172], 8 * num_ad);
+	set_tag(p, TAG_FE, node->fe_block, FE_SIZE + 8 * num_ad);
+}
+
+static size_t write_fid(uint8_t* p, uint32_t location, uint8_t characteristics, isob_node* node,
+	bool parent)
+{
+	uint8_t ident_len = parent ? 0 : node->ident_len;
+
+	set16(&p[16], 1);		// File version
+	p[18] = characteristics;
+	p[19] = ident_len;
+	set_long_ad(&p[20], SECTOR_SIZE, node->fe_block, node->unique_id);
+	if (ident_len != 0)
+		memcpy(&p[38], node->ident, ident_len);
+	set_tag(p, TAG_FID, location, FID_SIZE(ident_len));
+	return FID_SIZE(ident_len);
+}
+
+static int write_dir(isob_ctx* ctx, isob_node* dir, uint8_t* buf)
+{
+	uint8_t* p;
+	isob_node* child;
+	size_t pos = 0, len = (size_t)BLOCKS(dir->fid_len) * SECTOR_SIZE;
+	int r = 0;
+
+	memset(buf, 0, len);
+	// FIDs can straddle blocks, and their tag location is the block where they start
+	pos += write_fid(buf, dir->data_block, 0x0a, (dir->parent != NULL) ? dir->parent : dir, true);
+	for (child = dir->child; child != NULL; child = child->next)
+		pos += write_fid(&buf[pos], dir->data_block + (uint32_t)(pos / SECTOR_SIZE),
+			(child->is_dir ? 0x02 : 0) | (child->hidden ? 0x01 : 0), child, false);
+	for (pos = 0; pos < len; pos += SECTOR_SIZE) {
+		p = out_sector(ctx, &r);
+		if (p == NULL)
+			break;
+		memcpy(p, &buf[pos], SECTOR_SIZE);
+	}
+	return r;
+}
+
+static int write_metadata(isob_ctx* ctx)
+{
+	uint8_t *p, *buf = NULL;
+	uint32_t s, max_dir_len = 0;
+	size_t i;
+	int r = 0;
+
+	for (s = 0; s < PART_START; s++) {
+		p = out_sector(ctx, &r);
+		if (p == NULL)
+			return r;
+		switch (s) {
+		case ISO_PVD_LBA:
+			write_iso_pvd(ctx, p);
+			break;
+		case ISO_PVD_LBA + 1:
+			p[0] = 255;
+			memcpy(&p[1], "CD001", 5);
+			p[6] = 1;
+			break;
+		case ISO_PVD_LBA + 2:
+		case ISO_PVD_LBA + 3:
+		case ISO_PVD_LBA + 4:
+			memcpy(&p[1], (s == ISO_PVD_LBA + 2) ? "BEA01" : ((s == ISO_PVD_LBA + 3) ? "NSR02" : "TEA01"), 5);
+			p[6] = 1;
+			break;
+		case ISO_ROOT_LBA:
+			write_iso_dir_record(ctx, &p[0], 0);
+			write_iso_dir_record(ctx, &p[34], 1);
+			break;
+		case ISO_LPATH_LBA:
+		case ISO_MPATH_LBA:
+			write_iso_path_table(p, s == ISO_MPATH_LBA);
+			break;
+		case LVID_LBA:
+			write_lvid(ctx, p);
+			break;
+		case LVID_LBA + 1:
+			set_tag(p, TAG_TD, s, 512);
+			break;
+		case AVDP_LBA:
+			write_avdp(p, s);
+			break;
+		default:
+			if (s >= MAIN_VDS_LBA && s < MAIN_VDS_LBA + 6)
+				write_vds(ctx, p, s - MAIN_VDS_LBA, s);
+			else if (s >= RESERVE_VDS_LBA && s < RESERVE_VDS_LBA + 6)
+				write_vds(ctx, p, s - RESERVE_VDS_LBA, s);
+			break;
+		}
+	}
+
+	p = out_sector(ctx, &r);
+	if (p == NULL)
+		return r;
+	write_fsd(ctx, p);
+	p = out_sector(ctx, &r);
+	if (p == NULL)
+		return r;
+	set_tag(p, TAG_TD, FSD_BLOCK + 1, 512);
+
+	for (i = 0; i < ctx->num_nodes; i++)
+		max_dir_len = max(max_dir_len, ctx->order[i]->fid_len);
+	buf = malloc((size_t)BLOCKS(max_dir_len) * SECTOR_SIZE);
+	if (buf == NULL)
+		return ENOMEM;
+	for (i = 0; i < ctx->num_nodes && r == 0; i++) {
+		p = out_sector(ctx, &r);
+		if (p == NULL)
+			break;
+		write_fe(ctx->order[i], p);
+		if (ctx->order[i]->is_dir)
+			r = write_dir(ctx, ctx->order[i], buf);
+	}
+	free(buf);
+	return r;
+}
+
+/*
+ * File data is read straight into the ring, with reads that are as large as the space left
+ * in the current buffer. Files that got shorter since the tree was walked are zero padded.
+ */
+static int copy_file(isob_ctx* ctx, isob_node* node)
+{
+	char path[MAX_PATH_SIZE] = "";
+	isob_fd fd;
+	uint8_t* p;
+	uint32_t space, len;
+	uint64_t left = node->size, t;
+	int64_t got = 0;
+	bool eof = false;
+	int r;
+
+	r = node_path(ctx, node, path, sizeof(path));
+	if (r != 0)
+		goto out;
+	fd = file_open_read(path, &r);
+	if (fd == INVALID_FD)
+		goto out;
+	while (left > 0) {
+		r = out_space(ctx, &p, &space);
+		if (r != 0)
+			break;
+		len = (uint32_t)min(left, space);
+		if (!eof) {
+			t = TRACE_BEGIN();
+			got = file_read(fd, p, len);
+			TRACE_END_BYTES("file read", t, (got > 0) ? got : 0);
+			if (got < 0) {
+				r = (int)-got;
+				break;
+			}
+			if ((uint32_t)got < len) {
+				eof = true;
+				ctx->job->num_changed++;
+			}
+		} else {
+			got = 0;
+		}
+		memset(&p[got], 0, len - (size_t)got);
+		left -= len;
+		// Pad the last block
+		if (left == 0 && (node->size % SECTOR_SIZE) != 0) {
+			memset(&p[len], 0, SECTOR_SIZE - (node->size % SECTOR_SIZE));
+			len += SECTOR_SIZE - (uint32_t)(node->size % SECTOR_SIZE);
+		}
+		out_commit(ctx, len);
+	}
+	file_close(fd);
+
+out:
+	if (r != 0 && r != ECANCELED)
+		set_error(ctx, r, path);
+	return r;
+}
+
+THREAD_PROC(read_thread)
+{
+	isob_ctx* ctx = (isob_ctx*)param;
+	uint8_t* p;
+	size_t i;
+	int r;
+
+	r = write_metadata(ctx);
+	for (i = 0; i < ctx->num_nodes && r == 0; i++) {
+		if (!ctx->order[i]->is_dir && ctx->order[i]->size != 0)
+			r = copy_file(ctx, ctx->order[i]);
+	}
+	if (r == 0) {
+		p = out_sector(ctx, &r);
+		if (p != NULL)
+			write_avdp(p, (uint32_t)ctx->num_sectors - 1);
+	}
+	if (r == 0)
+		out_flush(ctx);
+	mutex_lock(&ctx->lock);
+	if (r != 0 && ctx->error == 0)
+		ctx->error = r;
+	ctx->ring_done = true;
+	cond_broadcast(&ctx->cond);
+	mutex_unlock(&ctx->lock);
+	THREAD_EXIT;
+}
+
+static int write_image(isob_ctx* ctx, isob_fd fd)
+{
+	isob_job* job = ctx->job;
+	isob_thread thread;
+	uint8_t* buf;
+	uint64_t done = 0, t;
+	uint32_t len;
+	int r = 0;
+
+	if (!thread_create(&thread, read_thread, ctx))
+		return EAGAIN;
+	if (job->progress != NULL)
+		job->progress(0, job->image_size);
+	while (1) {
+		mutex_lock(&ctx->lock);
+		while (ctx->ring_count == 0 && !ctx->ring_done && ctx->error == 0)
+			cond_wait(&ctx->cond, &ctx->lock);
+		if (ctx->error != 0 || ctx->ring_count == 0) {
+			mutex_unlock(&ctx->lock);
+			break;
+		}
+		buf = &ctx->ring[(size_t)ctx->ring_write * job->buffer_size];
+		len = ctx->ring_len[ctx->ring_write];
+		mutex_unlock(&ctx->lock);
+
+		if (is_cancelled(ctx)) {
+			r = ECANCELED;
+		} else {
+			if (job->hash != NULL) {
+				t = TRACE_BEGIN();
+				job->hash(job->hash_ctx, buf, len);
+				TRACE_END_BYTES("image hash", t, len);
+			}
+			t = TRACE_BEGIN();
+			r = file_write(fd, buf, len);
+			TRACE_END_BYTES("image write", t, len);
+		}
+		if (r != 0) {
+			if (r != ECANCELED)
+				set_error(ctx, r, job->image_path);
+			break;
+		}
+		done += len;
+		if (job->progress != NULL)
+			job->progress(done, job->image_size);
+		mutex_lock(&ctx->lock);
+		ctx->ring_write = (ctx->ring_write + 1) % job->num_buffers;
+		ctx->ring_count--;
+		cond_broadcast(&ctx->cond);
+		mutex_unlock(&ctx->lock);
+	}
+	// Make sure the reader doesn't wait for us forever
+	if (r != 0)
+		set_error(ctx, r, NULL);
+	thread_join(thread);
+	if (r == 0)
+		r = ctx->error;
+	if (r == 0 && done != job->image_size)
+		r = EIO;
+	return r;
+}
+
+int isob_run(isob_job* job)
+{
+	isob_ctx* ctx;
+	isob_fd fd = INVALID_FD;
+	size_t len;
+	int r = 0;
+
+	if (job == NULL || job->src_dir == NULL || job->image_path == NULL)
+		return EINVAL;
+	if (job->buffer_size == 0)
+		job->buffer_size = ISOB_DEFAULT_BUFFER_SIZE;
+	if (job->num_buffers == 0)
+		job->num_buffers = ISOB_DEFAULT_NUM_BUFFERS;
+	if (job->buffer_size % 4096 != 0 || job->num_buffers < 2)
+		return EINVAL;
+	job->image_size = 0;
+	job->num_files = 0;
+	job->num_dirs = 0;
+	job->num_skipped = 0;
+	job->num_changed = 0;
+	job->num_renamed = 0;
+	job->failed_path[0] = 0;
+
+	ctx = calloc(1, sizeof(isob_ctx));
+	if (ctx == NULL)
+		return ENOMEM;
+	ctx->job = job;
+	ctx->now = time(NULL);
+	mutex_init(&ctx->lock);
+	cond_init(&ctx->cond);
+	len = strlen(job->src_dir);
+	if (len >= sizeof(ctx->root)) {
+		r = ENAMETOOLONG;
+		goto out;
+	}
+	memcpy(ctx->root, job->src_dir, len + 1);
+	while (len > 0 && (ctx->root[len - 1] == '/' || ctx->root[len - 1] == PATH_SEP))
+		ctx->root[--len] = 0;
+	ctx->root_node = calloc(1, sizeof(isob_node) + 1);
+	if (ctx->root_node == NULL) {
+		r = ENOMEM;
+		goto out;
+	}
+	ctx->root_node->is_dir = true;
+	ctx->root_node->mtime = ctx->now;
+
+	r = walk_tree(ctx);
+	if (r == 0)
+		r = layout(ctx);
+	if (r != 0)
+		goto out;
+	job->image_size = ctx->num_sectors * SECTOR_SIZE;
+
+	ctx->ring = aligned_alloc_((size_t)job->num_buffers * job->buffer_size, 4096);
+	ctx->ring_len = calloc(job->num_buffers, sizeof(uint32_t));
+	if (ctx->ring == NULL || ctx->ring_len == NULL) {
+		r = ENOMEM;
+		goto out;
+	}
+	fd = file_create(job->image_path, &r);
+	if (fd == INVALID_FD) {
+		set_error(ctx, r, job->image_path);
+		goto out;
+	}
+	r = write_image(ctx, fd);
+	file_close(fd);
+	if (r != 0)
+		file_delete(job->image_path);
+
+out:
+	if (ctx->ring != NULL)
+		aligned_free(ctx->ring);
+	free(ctx->ring_len);
+	free(ctx->order);
+	free(ctx->queue);
+	free_tree(ctx->root_node);
+	cond_destroy(&ctx->cond);
+	mutex_destroy(&ctx->lock);
+	free(ctx);
+	return r;
+}
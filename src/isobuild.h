@@ -0,0 +1,63 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * UDF image builder
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#pragma once
+
+/*
+ * Creates an ISO image from a directory tree, in process, on Windows and on the POSIX ports.
+ * The image is UDF 1.02 only, with a minimal ISO-9660 volume descriptor set so that it is
+ * still recognized as an ISO, which is what we used to get from 'oscdimg -u2 -udfver102'.
+ * The tree is walked with a pool of threads, after which every file gets its final location,
+ * so that the image can be produced strictly sequentially: all the metadata, then the file
+ * data, in the order of the directory tree. One thread reads the files, with large reads,
+ * into a ring of aligned buffers, while the calling thread hashes and writes them out.
+ */
+
+#define ISOB_DEFAULT_BUFFER_SIZE    (4 * 1024 * 1024)
+#define ISOB_DEFAULT_NUM_BUFFERS    4
+#define ISOB_DEFAULT_NUM_THREADS    8
+
+typedef struct {
+	const char* src_dir;            // UTF-8 root of the tree to save (e.g. "E:\\" or "/Volumes/USB")
+	const char* image_path;         // UTF-8 path of the image to create
+	const char* label;              // UTF-8 volume label. May be NULL.
+	uint32_t num_threads;           // Threads used to walk the tree. 0 for the default.
+	uint32_t buffer_size;           // Must be a multiple of 4096. 0 for the default.
+	uint32_t num_buffers;           // 0 for the default.
+	volatile int* cancel;           // Abort with ECANCELED when non zero. May be NULL.
+	// Called from the calling thread with the number of bytes written. May be NULL.
+	void (*progress)(uint64_t done, uint64_t total);
+	// Called from the calling thread with all the data of the image, in order. May be NULL.
+	void (*hash)(void* hash_ctx, const uint8_t* buf, size_t len);
+	void* hash_ctx;
+	// Set on return
+	uint64_t image_size;
+	uint32_t num_files;
+	uint32_t num_dirs;
+	uint32_t num_skipped;           // Special files, links, and files that are too large for UDF
+	uint32_t num_changed;           // Files whose size changed while the image was being created
+	uint32_t num_renamed;           // Files whose name had to be truncated
+	char failed_path[512];          // Set on failure, if the error relates to a specific file
+} isob_job;
+
+// Returns 0 on success, or an errno value
+extern int isob_run(isob_job* job);
@@ -0,0 +1,863 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Cache of extracted ISO content
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "isocache.h"
+#include "missing.h"
+#include "msapi_utf8.h"
+
+#define ISO_CACHE_MAGIC         0x43495552	// "RUIC"
+#define ISO_CACHE_VERSION       1
+#define ISO_CACHE_HAS_MD5       0x00000001
+#define ISO_CACHE_INVALID       0x00000002
+// The data is only in RAM, so the record is never saved in the index
+#define ISO_CACHE_RAM_ONLY      0x00000004
+// The volume descriptors, which start after the 32 KB system area
+#define ISO_CACHE_ID_OFFSET     (32 * KB)
+#define ISO_CACHE_ID_SIZE       (32 * KB)
+#define ISO_CACHE_RAM_BUCKETS   1024
+// Number of images for which we keep the records of the files that are only in RAM
+#define ISO_CACHE_RAM_IMAGES    8
+
+#pragma pack(push, 1)
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t reserved;
+} ISO_CACHE_HEADER;
+
+typedef struct {
+	uint32_t lsn;
+	uint32_t flags;
+	uint64_t size;
+	uint8_t sha256[SHA256_HASHSIZE];
+	uint8_t md5[MD5_HASHSIZE];
+} ISO_CACHE_RECORD;
+#pragma pack(pop)
+
+typedef struct ISO_CACHE_RAM_ENTRY {
+	uint8_t sha256[SHA256_HASHSIZE];
+	uint64_t size;
+	uint8_t* data;
+	struct ISO_CACHE_RAM_ENTRY* hash_next;
+	struct ISO_CACHE_RAM_ENTRY* lru_prev;
+	struct ISO_CACHE_RAM_ENTRY* lru_next;
+} ISO_CACHE_RAM_ENTRY;
+
+typedef struct {
+	char id[2 * MD5_HASHSIZE + 1];
+	ISO_CACHE_RECORD* record;
+	int num_records;
+	uint64_t last_used;
+} ISO_CACHE_RAM_INDEX;
+
+typedef struct {
+	char name[2 * SHA256_HASHSIZE + 5];
+	uint64_t size;
+	uint64_t last_used;
+} ISO_CACHE_BLOB;
+
+uint32_t iso_cache_size = 0, iso_cache_ram_size = ISO_CACHE_DEFAULT_RAM_MB;
+
+// The cache is only ever used from the thread that extracts the image
+static struct {
+	BOOL open;
+	char dir[MAX_PATH];
+	char id[2 * MD5_HASHSIZE + 1];
+	ISO_CACHE_RECORD* record;
+	int num_records;
+	int num_sorted;                 // Records that can be looked up (the ones that were loaded)
+	int max_records;
+	BOOL dirty;
+	uint64_t disk_used;
+	// Statistics for the current image
+	uint32_t hits, ram_hits, stored, deduped, corrupted;
+	uint64_t hit_bytes, stored_bytes;
+} cache = { 0 };
+
+// The RAM cache outlives the images, so that we can switch between them
+static struct {
+	ISO_CACHE_RAM_ENTRY* bucket[ISO_CACHE_RAM_BUCKETS];
+	ISO_CACHE_RAM_ENTRY* lru_head;
+	ISO_CACHE_RAM_ENTRY* lru_tail;
+	uint64_t used;
+	// Records of the files that are only in RAM, which don't outlive the process either
+	ISO_CACHE_RAM_INDEX index[ISO_CACHE_RAM_IMAGES];
+	uint64_t index_tick;
+} ram = { 0 };
+
+static __inline void to_hex(char* dst, const uint8_t* src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sprintf(&dst[2 * i], "%02x", src[i]);
+}
+
+static __inline uint64_t ram_budget(void)
+{
+	return (uint64_t)iso_cache_ram_size * MB;
+}
+
+static __inline size_t ram_bucket(const uint8_t* sha256)
+{
+	return (sha256[0] | (sha256[1] << 8)) % ISO_CACHE_RAM_BUCKETS;
+}
+
+static __inline void blob_path(char* path, size_t size, const uint8_t* sha256)
+{
+	char hex[2 * SHA256_HASHSIZE + 1];
+
+	to_hex(hex, sha256, SHA256_HASHSIZE);
+	safe_sprintf(path, size, "%s\\%s.bin", cache.dir, hex);
+}
+
+/*
+ * RAM cache
+ */
+static void ram_unlink(ISO_CACHE_RAM_ENTRY* e)
+{
+	if (e->lru_prev != NULL)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		ram.lru_head = e->lru_next;
+	if (e->lru_next != NULL)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		ram.lru_tail = e->lru_prev;
+	e->lru_prev = NULL;
+	e->lru_next = NULL;
+}
+
+static void ram_push(ISO_CACHE_RAM_ENTRY* e)
+{
+	e->lru_next = ram.lru_head;
+	if (ram.lru_head != NULL)
+		ram.lru_head->lru_prev = e;
+	ram.lru_head = e;
+	if (ram.lru_tail == NULL)
+		ram.lru_tail = e;
+}
+
+static void ram_remove(ISO_CACHE_RAM_ENTRY* e)
+{
+	ISO_CACHE_RAM_ENTRY** p;
+
+	for (p = &ram.bucket[ram_bucket(e->sha256)]; *p != NULL; p = &(*p)->hash_next) {
+		if (*p == e) {
+			*p = e->hash_next;
+			break;
+		}
+	}
+	ram_unlink(e);
+	ram.used -= e->size;
+	free(e->data);
+	free(e);
+}
+
+static ISO_CACHE_RAM_ENTRY* ram_lookup(const uint8_t* sha256)
+{
+	ISO_CACHE_RAM_ENTRY* e;
+
+	for (e = ram.bucket[ram_bucket(sha256)]; e != NULL; e = e->hash_next) {
+		if (memcmp(e->sha256, sha256, SHA256_HASHSIZE) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static ISO_CACHE_RAM_ENTRY* ram_find(const uint8_t* sha256)
+{
+	ISO_CACHE_RAM_ENTRY* e = ram_lookup(sha256);
+
+	if (e != NULL) {
+		// Most recently used files are at the head
+		ram_unlink(e);
+		ram_push(e);
+	}
+	return e;
+}
+
+// Files larger than a quarter of the budget would push out too many others
+static __inline BOOL ram_admits(uint64_t size)
+{
+	return (size != 0) && (size <= ram_budget() / 4);
+}
+
+// Takes ownership of data
+static void ram_insert(const uint8_t* sha256, uint8_t* data, uint64_t size)
+{
+	ISO_CACHE_RAM_ENTRY* e;
+	size_t b = ram_bucket(sha256);
+
+	if (!ram_admits(size) || ram_find(sha256) != NULL) {
+		free(data);
+		return;
+	}
+	while (ram.lru_tail != NULL && ram.used + size > ram_budget())
+		ram_remove(ram.lru_tail);
+	e = calloc(1, sizeof(ISO_CACHE_RAM_ENTRY));
+	if (e == NULL) {
+		free(data);
+		return;
+	}
+	memcpy(e->sha256, sha256, SHA256_HASHSIZE);
+	e->size = size;
+	e->data = data;
+	e->hash_next = ram.bucket[b];
+	ram.bucket[b] = e;
+	ram_push(e);
+	ram.used += size;
+}
+
+/*
+ * Index of the current image
+ */
+static int cmp_record(const void* a, const void* b)
+{
+	const ISO_CACHE_RECORD* ra = (const ISO_CACHE_RECORD*)a;
+	const ISO_CACHE_RECORD* rb = (const ISO_CACHE_RECORD*)b;
+
+	if (ra->lsn != rb->lsn)
+		return (ra->lsn < rb->lsn) ? -1 : 1;
+	if (ra->size != rb->size)
+		return (ra->size < rb->size) ? -1 : 1;
+	return 0;
+}
+
+// Only the records that were loaded can be looked up, as the ones that get added
+// during an extraction are not needed before the next one.
+static int lookup_record(uint32_t lsn, uint64_t size)
+{
+	ISO_CACHE_RECORD key = { 0 }, *r;
+
+	key.lsn = lsn;
+	key.size = size;
+	if (cache.num_sorted == 0)
+		return -1;
+	r = bsearch(&key, cache.record, cache.num_sorted, sizeof(ISO_CACHE_RECORD), cmp_record);
+	return (r == NULL) ? -1 : (int)(r - cache.record);
+}
+
+static int find_record(uint32_t lsn, uint64_t size)
+{
+	int i = lookup_record(lsn, size);
+
+	return (i < 0 || (cache.record[i].flags & ISO_CACHE_INVALID)) ? -1 : i;
+}
+
+static ISO_CACHE_RECORD* add_record(void)
+{
+	ISO_CACHE_RECORD* r;
+
+	if (cache.num_records >= cache.max_records) {
+		r = realloc(cache.record, (cache.max_records + 1024) * sizeof(ISO_CACHE_RECORD));
+		if (r == NULL)
+			return NULL;
+		cache.record = r;
+		cache.max_records += 1024;
+	}
+	r = &cache.record[cache.num_records++];
+	memset(r, 0, sizeof(ISO_CACHE_RECORD));
+	cache.dirty = TRUE;
+	return r;
+}
+
+static void load_index(void)
+{
+	char path[MAX_PATH];
+	ISO_CACHE_HEADER hdr;
+	FILE* fd;
+
+	safe_sprintf(path, sizeof(path), "%s\\%s.idx", cache.dir, cache.id);
+	fd = fopenU(path, "rb");
+	if (fd == NULL)
+		return;
+	if (fread(&hdr, sizeof(hdr), 1, fd) != 1 || hdr.magic != ISO_CACHE_MAGIC ||
+		hdr.version != ISO_CACHE_VERSION || hdr.count > 16 * 1024 * 1024)
+		goto out;
+	cache.record = malloc((size_t)hdr.count * sizeof(ISO_CACHE_RECORD));
+	if (cache.record == NULL)
+		goto out;
+	if (fread(cache.record, sizeof(ISO_CACHE_RECORD), hdr.count, fd) != hdr.count) {
+		safe_free(cache.record);
+		goto out;
+	}
+	cache.num_records = hdr.count;
+	cache.max_records = hdr.count;
+	// The index is saved sorted, but let's not trust it
+	qsort(cache.record, cache.num_records, sizeof(ISO_CACHE_RECORD), cmp_record);
+	cache.num_sorted = cache.num_records;
+
+out:
+	fclose(fd);
+}
+
+static void save_index(void)
+{
+	char path[MAX_PATH], tmp[MAX_PATH];
+	ISO_CACHE_HEADER hdr = { ISO_CACHE_MAGIC, ISO_CACHE_VERSION, 0, 0 };
+	int i, j;
+	FILE* fd;
+
+	// Duplicates can only come from files that were extracted more than once (e.g. through
+	// symbolic links), in which case they are identical
+	qsort(cache.record, cache.num_records, sizeof(ISO_CACHE_RECORD), cmp_record);
+	for (i = 0, j = 0; i < cache.num_records; i++) {
+		if ((cache.record[i].flags & (ISO_CACHE_INVALID | ISO_CACHE_RAM_ONLY)) ||
+			(j > 0 && cmp_record(&cache.record[j - 1], &cache.record[i]) == 0))
+			continue;
+		cache.record[j++] = cache.record[i];
+	}
+	cache.num_records = j;
+	hdr.count = j;
+
+	safe_sprintf(path, sizeof(path), "%s\\%s.idx", cache.dir, cache.id);
+	safe_sprintf(tmp, sizeof(tmp), "%s\\%s.idx.tmp", cache.dir, cache.id);
+	fd = fopenU(tmp, "wb");
+	if (fd == NULL) {
+		uprintf("Could not create ISO cache index: %s", strerror(errno));
+		return;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fd) != 1 ||
+		fwrite(cache.record, sizeof(ISO_CACHE_RECORD), cache.num_records, fd) != (size_t)cache.num_records) {
+		uprintf("Could not write ISO cache index: %s", strerror(errno));
+		fclose(fd);
+		DeleteFileU(tmp);
+		return;
+	}
+	fclose(fd);
+	if (!MoveFileExU(tmp, path, MOVEFILE_REPLACE_EXISTING)) {
+		uprintf("Could not update ISO cache index: %s", WindowsErrorString());
+		DeleteFileU(tmp);
+	}
+}
+
+/*
+ * Records of the files that are only in RAM, for the images that were used last. These
+ * aren't saved in the index, since their data is gone once the application exits, but
+ * need to be found the next time the same image gets extracted.
+ */
+static void save_ram_index(void)
+{
+	ISO_CACHE_RAM_INDEX* ri = &ram.index[0];
+	int i, n;
+
+	for (i = 0; i < ISO_CACHE_RAM_IMAGES; i++) {
+		if (strcmp(ram.index[i].id, cache.id) == 0) {
+			ri = &ram.index[i];
+			break;
+		}
+		if (ram.index[i].last_used < ri->last_used)
+			ri = &ram.index[i];
+	}
+	safe_free(ri->record);
+	ri->num_records = 0;
+	static_strcpy(ri->id, cache.id);
+	ri->last_used = ++ram.index_tick;
+	for (i = 0, n = 0; i < cache.num_records; i++) {
+		if ((cache.record[i].flags & (ISO_CACHE_INVALID | ISO_CACHE_RAM_ONLY)) == ISO_CACHE_RAM_ONLY)
+			n++;
+	}
+	if (n == 0 || (ri->record = malloc(n * sizeof(ISO_CACHE_RECORD))) == NULL)
+		return;
+	for (i = 0; i < cache.num_records; i++) {
+		if ((cache.record[i].flags & (ISO_CACHE_INVALID | ISO_CACHE_RAM_ONLY)) == ISO_CACHE_RAM_ONLY)
+			ri->record[ri->num_records++] = cache.record[i];
+	}
+}
+
+// Add the records of the files of the current image that are still in RAM
+static void load_ram_index(void)
+{
+	ISO_CACHE_RAM_INDEX* ri = NULL;
+	ISO_CACHE_RECORD* r;
+	BOOL dirty = cache.dirty;
+	int i;
+
+	for (i = 0; i < ISO_CACHE_RAM_IMAGES && ri == NULL; i++) {
+		if (ram.index[i].record != NULL && strcmp(ram.index[i].id, cache.id) == 0)
+			ri = &ram.index[i];
+	}
+	if (ri == NULL)
+		return;
+	ri->last_used = ++ram.index_tick;
+	for (i = 0; i < ri->num_records; i++) {
+		if (ram_lookup(ri->record[i].sha256) == NULL ||
+			lookup_record(ri->record[i].lsn, ri->record[i].size) >= 0)
+			continue;
+		r = add_record();
+		if (r == NULL)
+			break;
+		*r = ri->record[i];
+	}
+	qsort(cache.record, cache.num_records, sizeof(ISO_CACHE_RECORD), cmp_record);
+	cache.num_sorted = cache.num_records;
+	// Nothing that needs saving
+	cache.dirty = dirty;
+}
+
+/*
+ * Identify the image from its size, modification time and volume descriptors. This is
+ * what tells us that the file locations from a previous extraction still apply.
+ */
+static BOOL identify_image(const char* iso_path)
+{
+	HASH_CONTEXT ctx;
+	HANDLE h;
+	LARGE_INTEGER size, offset;
+	FILETIME mtime;
+	uint8_t* buf;
+	DWORD rd = 0;
+	BOOL r = FALSE;
+
+	buf = malloc(ISO_CACHE_ID_SIZE);
+	if (buf == NULL)
+		return FALSE;
+	h = CreateFileU(iso_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		goto out;
+	offset.QuadPart = ISO_CACHE_ID_OFFSET;
+	if (!GetFileSizeEx(h, &size) || !GetFileTime(h, NULL, NULL, &mtime) ||
+		!SetFilePointerEx(h, offset, NULL, FILE_BEGIN) || !ReadFile(h, buf, ISO_CACHE_ID_SIZE, &rd, NULL))
+		goto out;
+	hash_init[HASH_SHA256](&ctx);
+	hash_write[HASH_SHA256](&ctx, (uint8_t*)&size, sizeof(size));
+	hash_write[HASH_SHA256](&ctx, (uint8_t*)&mtime, sizeof(mtime));
+	hash_write[HASH_SHA256](&ctx, buf, rd);
+	hash_final[HASH_SHA256](&ctx);
+	to_hex(cache.id, ctx.buf, MD5_HASHSIZE);
+	r = TRUE;
+
+out:
+	safe_closehandle(h);
+	free(buf);
+	return r;
+}
+
+static int cmp_blob(const void* a, const void* b)
+{
+	const ISO_CACHE_BLOB* ba = (const ISO_CACHE_BLOB*)a;
+	const ISO_CACHE_BLOB* bb = (const ISO_CACHE_BLOB*)b;
+
+	if (ba->last_used == bb->last_used)
+		return 0;
+	return (ba->last_used < bb->last_used) ? -1 : 1;
+}
+
+/*
+ * Work out how much disk space the data files use, removing the least recently used
+ * ones if we are over budget, as well as any leftover from an interrupted extraction.
+ * This is only done between extractions, so that the data of the image that is being
+ * extracted doesn't get evicted from under us.
+ */
+static void trim_disk_cache(void)
+{
+	char mask[MAX_PATH], path[MAX_PATH];
+	WIN32_FIND_DATAA fd;
+	ISO_CACHE_BLOB* blob = NULL, *new_blob;
+	size_t i, num_blobs = 0, max_blobs = 0, len;
+	uint64_t budget = (uint64_t)iso_cache_size * MB;
+	HANDLE h;
+
+	cache.disk_used = 0;
+	safe_sprintf(mask, sizeof(mask), "%s\\*", cache.dir);
+	h = FindFirstFileU(mask, &fd);
+	if (h == INVALID_HANDLE_VALUE)
+		return;
+	do {
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			continue;
+		len = strlen(fd.cFileName);
+		if (len > 4 && _stricmp(&fd.cFileName[len - 4], ".tmp") == 0) {
+			safe_sprintf(path, sizeof(path), "%s\\%s", cache.dir, fd.cFileName);
+			DeleteFileU(path);
+			continue;
+		}
+		if (len != 2 * SHA256_HASHSIZE + 4 || _stricmp(&fd.cFileName[len - 4], ".bin") != 0)
+			continue;
+		if (num_blobs >= max_blobs) {
+			new_blob = realloc(blob, (max_blobs + 256) * sizeof(ISO_CACHE_BLOB));
+			if (new_blob == NULL)
+				break;
+			blob = new_blob;
+			max_blobs += 256;
+		}
+		static_strcpy(blob[num_blobs].name, fd.cFileName);
+		blob[num_blobs].size = ((uint64_t)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+		blob[num_blobs].last_used = ((uint64_t)fd.ftLastWriteTime.dwHighDateTime << 32) |
+			fd.ftLastWriteTime.dwLowDateTime;
+		cache.disk_used += blob[num_blobs].size;
+		num_blobs++;
+	} while (FindNextFileU(h, &fd));
+	FindClose(h);
+
+	if (cache.disk_used > budget) {
+		// Leave some room for the files of the image we are about to extract
+		qsort(blob, num_blobs, sizeof(ISO_CACHE_BLOB), cmp_blob);
+		for (i = 0; i < num_blobs && cache.disk_used > budget - budget / 8; i++) {
+			safe_sprintf(path, sizeof(path), "%s\\%s", cache.dir, blob[i].name);
+			if (DeleteFileU(path))
+				cache.disk_used -= blob[i].size;
+		}
+		uprintf("Evicted %d file(s) from the ISO cache", (int)i);
+	}
+	free(blob);
+}
+
+// Parse "SIZE[,RAM]", in MB
+BOOL IsoCacheParseSize(const char* str)
+{
+	char* end;
+	unsigned long size, ram_size = ISO_CACHE_DEFAULT_RAM_MB;
+
+	size = strtoul(str, &end, 10);
+	if (*end == ',')
+		ram_size = strtoul(end + 1, &end, 10);
+	if (*end != '\0' || size > UINT32_MAX || ram_size > UINT32_MAX)
+		return FALSE;
+	iso_cache_size = (uint32_t)size;
+	iso_cache_ram_size = (uint32_t)ram_size;
+	return TRUE;
+}
+
+BOOL IsoCacheOpen(const char* iso_path)
+{
+	int r;
+
+	IsoCacheClose();
+	if (iso_cache_size == 0)
+		return FALSE;
+	safe_sprintf(cache.dir, sizeof(cache.dir), "%s\\%s\\%s", app_data_dir, FILES_DIR, ISO_CACHE_DIR);
+	r = SHCreateDirectoryExU(NULL, cache.dir, NULL);
+	if (r != ERROR_SUCCESS && r != ERROR_ALREADY_EXISTS && r != ERROR_FILE_EXISTS) {
+		SetLastError(r);
+		uprintf("Could not create ISO cache directory '%s': %s", cache.dir, WindowsErrorString());
+		return FALSE;
+	}
+	if (!identify_image(iso_path)) {
+		uprintf("Could not identify image for the ISO cache: %s", WindowsErrorString());
+		return FALSE;
+	}
+	trim_disk_cache();
+	load_index();
+	load_ram_index();
+	cache.open = TRUE;
+	uprintf("Using ISO cache (%d file(s) known for this image, %s on disk)", cache.num_records,
+		SizeToHumanReadable(cache.disk_used, FALSE, FALSE));
+	return TRUE;
+}
+
+void IsoCacheClose(void)
+{
+	if (!cache.open)
+		return;
+	if (cache.hits != 0)
+		uprintf("ISO cache: %d file(s) served from the cache (%d from RAM), %s", cache.hits, cache.ram_hits,
+			SizeToHumanReadable(cache.hit_bytes, FALSE, FALSE));
+	if (cache.stored != 0)
+		uprintf("ISO cache: %d file(s) added (%d already present), %s", cache.stored, cache.deduped,
+			SizeToHumanReadable(cache.stored_bytes, FALSE, FALSE));
+	if (cache.corrupted != 0)
+		uprintf("ISO cache: %d corrupted file(s) removed", cache.corrupted);
+	if (cache.dirty)
+		save_index();
+	save_ram_index();
+	safe_free(cache.record);
+	memset(&cache, 0, sizeof(cache));
+}
+
+void IsoCacheExit(void)
+{
+	int i;
+
+	IsoCacheClose();
+	while (ram.lru_tail != NULL)
+		ram_remove(ram.lru_tail);
+	for (i = 0; i < ISO_CACHE_RAM_IMAGES; i++)
+		safe_free(ram.index[i].record);
+	memset(ram.index, 0, sizeof(ram.index));
+}
+
+/*
+ * Reading files from the cache
+ */
+BOOL IsoCacheOpenFile(ISO_CACHE_FILE* f, uint32_t lsn, uint64_t size, BOOL want_md5)
+{
+	char path[MAX_PATH];
+	ISO_CACHE_RAM_ENTRY* e;
+	ISO_CACHE_RECORD* r;
+	FILETIME now;
+
+	memset(f, 0, sizeof(ISO_CACHE_FILE));
+	f->handle = INVALID_HANDLE_VALUE;
+	f->index = -1;
+	if (!cache.open || lsn == 0 || size == 0)
+		return FALSE;
+	f->index = find_record(lsn, size);
+	if (f->index < 0)
+		return FALSE;
+	r = &cache.record[f->index];
+	f->size = size;
+	// No need to hash the data again if we already have its MD5
+	f->want_md5 = want_md5 && !(r->flags & ISO_CACHE_HAS_MD5);
+	if (f->want_md5)
+		hash_init[HASH_MD5](&f->md5_ctx);
+	if (want_md5 && !f->want_md5)
+		memcpy(f->md5, r->md5, MD5_HASHSIZE);
+
+	e = ram_find(r->sha256);
+	if (e != NULL && e->size == size) {
+		f->data = e->data;
+		cache.ram_hits++;
+		return TRUE;
+	}
+
+	blob_path(path, sizeof(path), r->sha256);
+	f->handle = CreateFileU(path, GENERIC_READ | FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (f->handle == INVALID_HANDLE_VALUE) {
+		// Evicted
+		f->index = -1;
+		return FALSE;
+	}
+	// Data files are evicted by last use
+	GetSystemTimeAsFileTime(&now);
+	SetFileTime(f->handle, NULL, NULL, &now);
+	hash_init[HASH_SHA256](&f->sha256_ctx);
+	if (ram_admits(size))
+		f->ram_copy = malloc((size_t)size);
+	return TRUE;
+}
+
+// Returns the number of bytes read, or -1 on error, including when the data turns out
+// not to match what was stored, which is only known once all of it has been read.
+int64_t IsoCacheReadFile(ISO_CACHE_FILE* f, uint8_t* buf, size_t len)
+{
+	ISO_CACHE_RECORD* r = &cache.record[f->index];
+	DWORD rd;
+	uint8_t* data;
+
+	len = (size_t)MIN(len, f->size - f->pos);
+	if (len == 0)
+		return 0;
+	if (f->data != NULL) {
+		memcpy(buf, &f->data[f->pos], len);
+	} else {
+		if (!ReadFile(f->handle, buf, (DWORD)len, &rd, NULL) || rd != len) {
+			uprintf("  Could not read cached file: %s", WindowsErrorString());
+			return -1;
+		}
+		hash_write[HASH_SHA256](&f->sha256_ctx, buf, len);
+		if (f->ram_copy != NULL)
+			memcpy(&f->ram_copy[f->pos], buf, len);
+	}
+	if (f->want_md5)
+		hash_write[HASH_MD5](&f->md5_ctx, buf, len);
+	f->pos += len;
+	if (f->pos < f->size)
+		return (int64_t)len;
+
+	if (f->data == NULL) {
+		hash_final[HASH_SHA256](&f->sha256_ctx);
+		if (memcmp(f->sha256_ctx.buf, r->sha256, SHA256_HASHSIZE) != 0) {
+			uprintf("  Cached file is corrupted");
+			return -1;
+		}
+		if (f->ram_copy != NULL) {
+			data = f->ram_copy;
+			f->ram_copy = NULL;
+			ram_insert(r->sha256, data, f->size);
+		}
+	}
+	if (f->want_md5) {
+		hash_final[HASH_MD5](&f->md5_ctx);
+		memcpy(f->md5, f->md5_ctx.buf, MD5_HASHSIZE);
+		memcpy(r->md5, f->md5, MD5_HASHSIZE);
+		r->flags |= ISO_CACHE_HAS_MD5;
+		cache.dirty = TRUE;
+	}
+	cache.hits++;
+	cache.hit_bytes += f->size;
+	return (int64_t)len;
+}
+
+// Set discard if the data could not be used, so that it is removed from the cache
+void IsoCacheCloseFile(ISO_CACHE_FILE* f, BOOL discard)
+{
+	char path[MAX_PATH];
+	ISO_CACHE_RAM_ENTRY* e;
+
+	safe_closehandle(f->handle);
+	safe_free(f->ram_copy);
+	if (discard && f->index >= 0) {
+		cache.corrupted++;
+		if (f->data != NULL) {
+			e = ram_find(cache.record[f->index].sha256);
+			if (e != NULL)
+				ram_remove(e);
+		} else {
+			blob_path(path, sizeof(path), cache.record[f->index].sha256);
+			DeleteFileU(path);
+		}
+		// Will be replaced when the file gets extracted from the image
+		cache.record[f->index].flags |= ISO_CACHE_INVALID;
+		cache.dirty = TRUE;
+	}
+	f->index = -1;
+}
+
+/*
+ * Adding files to the cache, as they are extracted from the image
+ */
+static void discard_tmp(ISO_CACHE_STORE* s)
+{
+	char tmp[MAX_PATH];
+
+	if (s->handle == INVALID_HANDLE_VALUE || s->handle == NULL)
+		return;
+	safe_closehandle(s->handle);
+	safe_sprintf(tmp, sizeof(tmp), "%s\\%s.tmp", cache.dir, cache.id);
+	DeleteFileU(tmp);
+}
+
+void IsoCacheStoreBegin(ISO_CACHE_STORE* s, uint32_t lsn, uint64_t size)
+{
+	char path[MAX_PATH];
+
+	memset(s, 0, sizeof(ISO_CACHE_STORE));
+	s->handle = INVALID_HANDLE_VALUE;
+	if (!cache.open || lsn == 0 || size == 0)
+		return;
+	if (size >= ISO_CACHE_MIN_DISK_FILE && cache.disk_used + size <= (uint64_t)iso_cache_size * MB) {
+		safe_sprintf(path, sizeof(path), "%s\\%s.tmp", cache.dir, cache.id);
+		s->handle = CreateFileU(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	}
+	if (ram_admits(size))
+		s->ram_copy = malloc((size_t)size);
+	if (s->handle == INVALID_HANDLE_VALUE && s->ram_copy == NULL)
+		return;
+	s->active = TRUE;
+	s->lsn = lsn;
+	s->size = size;
+	hash_init[HASH_SHA256](&s->sha256_ctx);
+}
+
+void IsoCacheStoreWrite(ISO_CACHE_STORE* s, const uint8_t* buf, size_t len)
+{
+	DWORD wr;
+
+	if (!s->active)
+		return;
+	if (s->pos + len > s->size) {
+		IsoCacheStoreAbort(s);
+		return;
+	}
+	hash_write[HASH_SHA256](&s->sha256_ctx, buf, len);
+	if (s->ram_copy != NULL)
+		memcpy(&s->ram_copy[s->pos], buf, len);
+	if (s->handle != INVALID_HANDLE_VALUE && (!WriteFile(s->handle, buf, (DWORD)len, &wr, NULL) || wr != len)) {
+		// Most likely out of space: keep going without the disk copy
+		uprintf("  Could not add file to the ISO cache: %s", WindowsErrorString());
+		discard_tmp(s);
+		if (s->ram_copy == NULL) {
+			IsoCacheStoreAbort(s);
+			return;
+		}
+	}
+	s->pos += len;
+}
+
+// md5 is the MD5 of the data, if the caller computed it, or NULL
+void IsoCacheStoreEnd(ISO_CACHE_STORE* s, const uint8_t* md5)
+{
+	char path[MAX_PATH], tmp[MAX_PATH];
+	ISO_CACHE_RECORD* r;
+	uint8_t* data;
+	FILETIME now;
+	BOOL on_disk = FALSE;
+	int i;
+
+	if (!s->active)
+		return;
+	if (s->pos != s->size) {
+		IsoCacheStoreAbort(s);
+		return;
+	}
+	hash_final[HASH_SHA256](&s->sha256_ctx);
+	if (s->handle != INVALID_HANDLE_VALUE) {
+		safe_closehandle(s->handle);
+		safe_sprintf(tmp, sizeof(tmp), "%s\\%s.tmp", cache.dir, cache.id);
+		blob_path(path, sizeof(path), s->sha256_ctx.buf);
+		if (MoveFileExU(tmp, path, 0)) {
+			cache.disk_used += s->size;
+			on_disk = TRUE;
+		} else {
+			// Identical data is already in the cache
+			DeleteFileU(tmp);
+			cache.deduped++;
+			GetSystemTimeAsFileTime(&now);
+			s->handle = CreateFileU(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+			if (s->handle != INVALID_HANDLE_VALUE) {
+				SetFileTime(s->handle, NULL, NULL, &now);
+				on_disk = TRUE;
+			}
+			safe_closehandle(s->handle);
+		}
+	}
+	if (s->ram_copy != NULL) {
+		data = s->ram_copy;
+		s->ram_copy = NULL;
+		ram_insert(s->sha256_ctx.buf, data, s->size);
+	}
+	// Replace the record of a file that was evicted or found corrupted
+	i = lookup_record(s->lsn, s->size);
+	r = (i >= 0) ? &cache.record[i] : add_record();
+	if (r != NULL) {
+		memset(r, 0, sizeof(ISO_CACHE_RECORD));
+		cache.dirty = TRUE;
+		r->lsn = s->lsn;
+		r->size = s->size;
+		memcpy(r->sha256, s->sha256_ctx.buf, SHA256_HASHSIZE);
+		if (!on_disk)
+			r->flags |= ISO_CACHE_RAM_ONLY;
+		if (md5 != NULL) {
+			memcpy(r->md5, md5, MD5_HASHSIZE);
+			r->flags |= ISO_CACHE_HAS_MD5;
+		}
+		cache.stored++;
+		cache.stored_bytes += s->size;
+	}
+	s->active = FALSE;
+}
+
+// Safe to call on an inactive or completed store
+void IsoCacheStoreAbort(ISO_CACHE_STORE* s)
+{
+	discard_tmp(s);
+	safe_free(s->ram_copy);
+	s->active = FALSE;
+}
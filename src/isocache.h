@@ -0,0 +1,83 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Cache of extracted ISO content
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <stdint.h>
+
+#include "rufus.h"
+
+#pragma once
+
+/*
+ * Keeps a copy of the files that get extracted from ISO images, so that extracting the
+ * same image again doesn't have to read (and hash) them from the image again.
+ * File data is stored under its SHA-256, so that identical files, from the same or
+ * from different images, are only stored once, and each image gets an index that maps
+ * the location and size of its files (which don't change for a given image) to the
+ * SHA-256 and MD5 of their content. Images are identified by their size, modification
+ * time and volume descriptors.
+ * Files that are read from disk are checked against their SHA-256 as they are read,
+ * and the ones that have been used the most recently are also kept in RAM, within a
+ * separate budget, for stations that keep rotating between the same few images.
+ */
+
+#define ISO_CACHE_DIR               "isocache"
+#define ISO_CACHE_DEFAULT_RAM_MB    256
+// Smaller files are only kept in RAM, as they can be read from the image just as fast
+#define ISO_CACHE_MIN_DISK_FILE     (64 * KB)
+
+typedef struct {
+	int index;                      // Index of the record
+	HANDLE handle;                  // Data file, or INVALID_HANDLE_VALUE if served from RAM
+	const uint8_t* data;            // RAM copy
+	uint8_t* ram_copy;              // Copy being made for the RAM cache
+	uint64_t size;
+	uint64_t pos;
+	BOOL want_md5;
+	HASH_CONTEXT sha256_ctx;
+	HASH_CONTEXT md5_ctx;
+	uint8_t md5[MD5_HASHSIZE];      // Set once all the data has been read, if want_md5 was set
+} ISO_CACHE_FILE;
+
+typedef struct {
+	BOOL active;
+	uint32_t lsn;
+	HANDLE handle;                  // Temporary data file, or INVALID_HANDLE_VALUE if RAM only
+	uint8_t* ram_copy;
+	uint64_t size;
+	uint64_t pos;
+	HASH_CONTEXT sha256_ctx;
+} ISO_CACHE_STORE;
+
+// Budgets, in MB. The cache is disabled if iso_cache_size is 0.
+extern uint32_t iso_cache_size, iso_cache_ram_size;
+
+BOOL IsoCacheParseSize(const char* str);
+BOOL IsoCacheOpen(const char* iso_path);
+void IsoCacheClose(void);
+void IsoCacheExit(void);
+// Files are looked up by their location (lsn) and size in the current image. An lsn of 0,
+// for files which location is unknown, bypasses the cache.
+BOOL IsoCacheOpenFile(ISO_CACHE_FILE* f, uint32_t lsn, uint64_t size, BOOL want_md5);
+int64_t IsoCacheReadFile(ISO_CACHE_FILE* f, uint8_t* buf, size_t len);
+void IsoCacheCloseFile(ISO_CACHE_FILE* f, BOOL discard);
+void IsoCacheStoreBegin(ISO_CACHE_STORE* s, uint32_t lsn, uint64_t size);
+void IsoCacheStoreWrite(ISO_CACHE_STORE* s, const uint8_t* buf, size_t len);
+void IsoCacheStoreEnd(ISO_CACHE_STORE* s, const uint8_t* md5);
+void IsoCacheStoreAbort(ISO_CACHE_STORE* s);
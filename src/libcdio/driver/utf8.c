@@ -47,6 +47,7 @@
 /* Windows requires some basic UTF-8 support outside of Joliet */
 #if defined(_WIN32)
 #include <windows.h>
+#include "transcode.h"
 
 #define wchar_to_utf8_no_alloc(wsrc, dest, dest_size) \
 	WideCharToMultiByte(CP_UTF8, 0, wsrc, -1, dest, dest_size, NULL, NULL)
@@ -317,6 +318,7 @@ bool cdio_charset_to_utf8(const char *src, size_t src_len, cdio_utf8_t **dst,
   int codepage = 0;
   wchar_t* wstr = NULL;
   int i, size = 0;
+  size_t dst_len;
 
   if (src == NULL || dst == NULL || src_charset == NULL)
     return false;
@@ -347,6 +349,19 @@ bool cdio_charset_to_utf8(const char *src, size_t src_len, cdio_utf8_t **dst,
       return false;
     }
 
+    /* Convert straight to UTF-8, into a buffer sized for the worst case. Names
+       with unpaired surrogates, which aren't valid UTF-16, are left to Windows.
+       As with the conversion below, a NUL in the name terminates the string. */
+    *dst = (char*)malloc(UTF8_MAX_FROM_UTF16(src_len) + 1);
+    cdio_assert(*dst != NULL);
+    dst_len = utf16be_to_utf8(src, src_len, *dst);
+    if (dst_len != TRANSCODE_INVALID) {
+      (*dst)[dst_len] = 0;
+      return true;
+    }
+    free(*dst);
+    *dst = NULL;
+
     /* Perform byte reversal */
     wstr = (wchar_t*)calloc(src_len+1, sizeof(wchar_t));
     cdio_assert(wstr != NULL);
@@ -32,11 +32,8 @@
 
 /* Useful defines */
 
-#define MIN(a, b) (a<b) ? (a) : (b)
-#define CEILING(x, y) ((x+(y-1))/y)
-
-#define	GETICB(offset)	\
-	&p_udf_fe->u.alloc_descs[offset]
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define CEILING(x, y) (((x) + ((y) - 1)) / (y))
 
 const char *
 udf_get_filename(const udf_dirent_t *p_udf_dirent)
@@ -104,122 +101,6 @@ udf_is_dir(const udf_dirent_t *p_udf_dirent)
   return p_udf_dirent->b_dir;
 }
 
-/*
- * Translate a file offset into a logical block and then into a physical
- * block.
- */
-static lba_t
-offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset,
-	      /*out*/ lba_t *pi_lba, /*out*/ uint32_t *pi_max_size)
-{
-  udf_t *p_udf = p_udf_dirent->p_udf;
-  const udf_file_entry_t *p_udf_fe = (udf_file_entry_t *)
-    &p_udf_dirent->fe;
-  const udf_icbtag_t *p_icb_tag = &p_udf_fe->icb_tag;
-  const uint16_t strat_type= uint16_from_le(p_icb_tag->strat_type);
-
-  if (i_offset < 0) {
-    cdio_warn("Negative offset value");
-    return CDIO_INVALID_LBA;
-  }
-
-  switch (strat_type) {
-  case 4096:
-    cdio_warn("Cannot deal with strategy4096 yet!");
-    return CDIO_INVALID_LBA;
-    break;
-  case ICBTAG_STRATEGY_TYPE_4:
-    {
-      off_t icblen = 0;
-      uint64_t lsector;
-      int ad_offset, ad_num = 0;
-      uint16_t addr_ilk = uint16_from_le(p_icb_tag->flags&ICBTAG_FLAG_AD_MASK);
-
-      switch (addr_ilk) {
-      case ICBTAG_FLAG_AD_SHORT:
-	{
-	  udf_short_ad_t *p_icb;
-	  /*
-	   * The allocation descriptor field is filled with short_ad's.
-	   * If the offset is beyond the current extent, look for the
-	   * next extent.
-	   */
-	  do {
-	    i_offset -= icblen;
-	    ad_offset = sizeof(udf_short_ad_t) * ad_num;
-	    if (ad_offset > uint32_from_le(p_udf_fe->u_alloc_descs)) {
-	      cdio_warn("File offset out of bounds");
-	      return CDIO_INVALID_LBA;
-	    }
-	    p_icb = (udf_short_ad_t *)
-	      GETICB( uint32_from_le(p_udf_fe->u_extended_attr)
-		      + ad_offset );
-	    icblen = p_icb->len;
-	    ad_num++;
-	  } while(i_offset >= icblen);
-
-	  lsector = (i_offset / UDF_BLOCKSIZE) + p_icb->pos;
-
-	  *pi_max_size = p_icb->len;
-	}
-	break;
-      case ICBTAG_FLAG_AD_LONG:
-	{
-	  /*
-	   * The allocation descriptor field is filled with long_ad's
-	   * If the i_offset is beyond the current extent, look for the
-	   * next extent.
-	   */
-	  udf_long_ad_t *p_icb;
-	  do {
-	    i_offset -= icblen;
-	    ad_offset = sizeof(udf_long_ad_t) * ad_num;
-	    if (ad_offset > uint32_from_le(p_udf_fe->u_alloc_descs)) {
-	      cdio_warn("File offset out of bounds");
-	      return CDIO_INVALID_LBA;
-	    }
-	    p_icb = (udf_long_ad_t *)
-	      GETICB( uint32_from_le(p_udf_fe->u_extended_attr)
-		      + ad_offset );
-	    icblen = p_icb->len;
-	    ad_num++;
-	  } while(i_offset >= icblen);
-
-	  lsector = (i_offset / UDF_BLOCKSIZE) +
-	    uint32_from_le(((udf_long_ad_t *)(p_icb))->loc.lba);
-
-	  *pi_max_size = p_icb->len;
-	}
-	break;
-      case ICBTAG_FLAG_AD_IN_ICB:
-	/*
-	 * This type means that the file *data* is stored in the
-	 * allocation descriptor field of the file entry.
-	 */
-	*pi_max_size = 0;
-	cdio_warn("Don't know how to data in ICB handle yet");
-	return CDIO_INVALID_LBA;
-      case ICBTAG_FLAG_AD_EXTENDED:
-	cdio_warn("Don't know how to handle extended addresses yet");
-	return CDIO_INVALID_LBA;
-      default:
-	cdio_warn("Unsupported allocation descriptor %d", addr_ilk);
-	return CDIO_INVALID_LBA;
-      }
-
-      *pi_lba = (lba_t)lsector + p_udf->i_part_start;
-      if (*pi_lba < 0) {
-	cdio_warn("Negative LBA value");
-	return CDIO_INVALID_LBA;
-      }
-      return *pi_lba;
-    }
-  default:
-    cdio_warn("Unknown strategy type %d", strat_type);
-    return DRIVER_OP_ERROR;
-  }
-}
-
 /**
   Attempts to read up to count bytes from UDF directory entry
   p_udf_dirent into the buffer starting at buf. buf should be a
@@ -232,36 +113,84 @@ offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset,
   It is the caller's responsibility to ensure that count is less
   than the number of blocks recorded via p_udf_dirent.
 
+  A read never crosses the end of the file extent that holds the
+  current position, so fewer bytes than requested may be returned and
+  the caller should loop until the data it needs has been read.
+
   If there is an error, cast the result to driver_return_code_t for
   the specific error code.
 */
 ssize_t
 udf_read_block(const udf_dirent_t *p_udf_dirent, void * buf, size_t count)
 {
+  driver_return_code_t ret;
+  udf_t *p_udf;
+  const udf_file_entry_t *p_udf_fe;
+  const udf_extent_t *p_ext;
+  uint64_t i_ext_offset, i_read_len;
+  uint32_t i, i_max_blocks;
+  int i_extents;
+
   if (count == 0) return 0;
-  else {
-    driver_return_code_t ret;
-    uint32_t i_max_size=0;
-    udf_t *p_udf = p_udf_dirent->p_udf;
-    lba_t i_lba = offset_to_lba(p_udf_dirent, p_udf->i_position, &i_lba,
-				&i_max_size);
-    if (i_lba != CDIO_INVALID_LBA) {
-      uint32_t i_max_blocks = CEILING(i_max_size, UDF_BLOCKSIZE);
-      if ( i_max_blocks < count ) {
-	  cdio_warn("read count %u is larger than %u extent size.",
-		  (unsigned int)count, i_max_blocks);
-	  cdio_warn("read count truncated to %u", i_max_blocks);
-	  count = i_max_blocks;
-      }
-      ret = udf_read_sectors(p_udf, buf, i_lba, count);
-      if (DRIVER_OP_SUCCESS == ret) {
-	ssize_t i_read_len = MIN(i_max_size, count * UDF_BLOCKSIZE);
-	p_udf->i_position += i_read_len;
-	return i_read_len;
-      }
-      return ret;
-    } else {
+  if (!p_udf_dirent) return DRIVER_OP_BAD_PARAMETER;
+
+  p_udf = p_udf_dirent->p_udf;
+  p_udf_fe = &p_udf_dirent->fe;
+  if (p_udf->i_position < 0)
+    return DRIVER_OP_BAD_PARAMETER;
+
+  i_extents = udf_get_extents(p_udf, p_udf_fe);
+  if (i_extents < 0)
+    return DRIVER_OP_ERROR;
+
+  if (i_extents == 0) {
+    /* File data is stored in the allocation descriptor field of the entry */
+    const uint32_t i_ea_len = uint32_from_le(p_udf_fe->u_extended_attr);
+    const uint32_t i_ad_len = uint32_from_le(p_udf_fe->u_alloc_descs);
+    if ((uint16_from_le(p_udf_fe->icb_tag.flags) & ICBTAG_FLAG_AD_MASK)
+	!= ICBTAG_FLAG_AD_IN_ICB || i_ea_len > sizeof(p_udf_fe->u) ||
+	i_ad_len > sizeof(p_udf_fe->u) - i_ea_len ||
+	(uint64_t)p_udf->i_position >= i_ad_len)
       return DRIVER_OP_ERROR;
-    }
+    i_read_len = MIN(i_ad_len - (uint64_t)p_udf->i_position,
+		     (uint64_t)count * UDF_BLOCKSIZE);
+    memcpy(buf, &p_udf_fe->u.ext_attr[i_ea_len + p_udf->i_position],
+	   (size_t)i_read_len);
+    p_udf->i_position += i_read_len;
+    return (ssize_t)i_read_len;
+  }
+
+  /* Find the extent holding the current position, starting with the last one used */
+  i = p_udf->i_extent;
+  if (i >= p_udf->i_extents ||
+      p_udf->extents[i].i_offset > (uint64_t)p_udf->i_position)
+    i = 0;
+  while (i < p_udf->i_extents && (uint64_t)p_udf->i_position >=
+	 p_udf->extents[i].i_offset + p_udf->extents[i].i_len)
+    i++;
+  if (i >= p_udf->i_extents) {
+    cdio_warn("File offset out of bounds");
+    return DRIVER_OP_ERROR;
+  }
+  p_udf->i_extent = i;
+  p_ext = &p_udf->extents[i];
+
+  /* Reads never cross an extent boundary: callers loop until done */
+  i_ext_offset = p_udf->i_position - p_ext->i_offset;
+  i_max_blocks = (uint32_t)CEILING(p_ext->i_len - i_ext_offset, UDF_BLOCKSIZE);
+  if (count > i_max_blocks)
+    count = i_max_blocks;
+
+  if (p_ext->i_lba == CDIO_INVALID_LBA) {
+    memset(buf, 0, count * UDF_BLOCKSIZE);
+  } else {
+    ret = udf_read_sectors(p_udf, buf,
+			   p_ext->i_lba + (lba_t)(i_ext_offset / UDF_BLOCKSIZE),
+			   (long)count);
+    if (DRIVER_OP_SUCCESS != ret)
+      return ret;
   }
+  i_read_len = MIN(p_ext->i_len - i_ext_offset, (uint64_t)count * UDF_BLOCKSIZE);
+  p_udf->i_position += i_read_len;
+  return (ssize_t)i_read_len;
 }
@@ -210,6 +210,197 @@ udf_get_lba(const udf_file_entry_t *p_udf_fe,
   return false;
 }
 
+/*
+  Read the File Entry located at partition relative block i_lba.
+  The File Entries of the children of a directory are usually recorded
+  next to one another, so rather than issuing a seek and a single block
+  read for each of them, we read a window of UDF_ICB_CACHE_BLOCKS sectors
+  and serve subsequent lookups from it.
+*/
+driver_return_code_t
+udf_read_icb(udf_t *p_udf, void *ptr, uint32_t i_lba)
+{
+  const lsn_t i_lsn = p_udf->i_part_start + i_lba;
+  long i_read;
+
+  if (i_lsn < 0)
+    return DRIVER_OP_BAD_PARAMETER;
+
+  /* The window is only used for streams, where we can tell how much was read */
+  if (!p_udf->b_stream)
+    return udf_read_sectors(p_udf, ptr, i_lsn, 1);
+
+  if (p_udf->icb_cache == NULL) {
+    p_udf->icb_cache = (uint8_t *) malloc(UDF_ICB_CACHE_BLOCKS * UDF_BLOCKSIZE);
+    if (p_udf->icb_cache == NULL)
+      return udf_read_sectors(p_udf, ptr, i_lsn, 1);
+    p_udf->icb_cache_len = 0;
+  }
+
+  if (i_lsn < p_udf->icb_cache_lsn ||
+      i_lsn >= p_udf->icb_cache_lsn + (lsn_t)p_udf->icb_cache_len) {
+    p_udf->icb_cache_len = 0;
+    if (cdio_stream_seek(p_udf->stream, ((off_t)i_lsn) * UDF_BLOCKSIZE,
+			 SEEK_SET) != DRIVER_OP_SUCCESS)
+      return DRIVER_OP_ERROR;
+    i_read = cdio_stream_read(p_udf->stream, p_udf->icb_cache, UDF_BLOCKSIZE,
+			      UDF_ICB_CACHE_BLOCKS);
+    if (i_read < UDF_BLOCKSIZE)
+      return DRIVER_OP_ERROR;
+    p_udf->icb_cache_lsn = i_lsn;
+    p_udf->icb_cache_len = (uint32_t)(i_read / UDF_BLOCKSIZE);
+  }
+
+  memcpy(ptr, &p_udf->icb_cache[(i_lsn - p_udf->icb_cache_lsn) * UDF_BLOCKSIZE],
+	 UDF_BLOCKSIZE);
+  return DRIVER_OP_SUCCESS;
+}
+
+/* Maximum number of Allocation Extent Descriptors we follow for a file */
+#define udf_MAX_AED_CHAIN 1024
+
+/*
+  Resolve the short or long allocation descriptors of a File Entry,
+  including the ones from chained Allocation Extent Descriptors, into a
+  list of extents. The list is kept in p_udf and reused for as long as
+  the same File Entry is being accessed, so that reading a large file
+  no longer walks the descriptors for each block. Recorded extents that
+  are physically adjacent are merged, so that they can be read with a
+  single request.
+  Returns the number of extents, or -1 on error. Embedded (in ICB) data
+  has no extent and returns 0.
+*/
+int
+udf_get_extents(udf_t *p_udf, const udf_file_entry_t *p_udf_fe)
+{
+  const uint16_t strat_type = uint16_from_le(p_udf_fe->icb_tag.strat_type);
+  const uint16_t addr_ilk =
+    uint16_from_le(p_udf_fe->icb_tag.flags) & ICBTAG_FLAG_AD_MASK;
+  const uint64_t i_info_len = uint64_from_le(p_udf_fe->info_len);
+  const uint32_t i_ea_len = uint32_from_le(p_udf_fe->u_extended_attr);
+  uint32_t i_ad_len = uint32_from_le(p_udf_fe->u_alloc_descs);
+  uint32_t i_ad_size, i_len, i_pos, i_type, i_max_extents = 0;
+  uint64_t i_offset = 0;
+  const uint8_t *p_ad;
+  uint8_t aed[UDF_BLOCKSIZE];
+  udf_extent_t *p_ext;
+  int i_aed = 0;
+
+  if (p_udf->extents != NULL &&
+      p_udf->extents_loc == uint32_from_le(p_udf_fe->tag.loc) &&
+      p_udf->extents_uid == uint64_from_le(p_udf_fe->unique_ID))
+    return (int)p_udf->i_extents;
+
+  p_udf->i_extents = 0;
+  p_udf->i_extent = 0;
+  p_udf->extents_loc = 0;
+  p_udf->extents_uid = 0;
+
+  if (strat_type != ICBTAG_STRATEGY_TYPE_4) {
+    cdio_warn("Unknown strategy type %d", strat_type);
+    return -1;
+  }
+
+  switch (addr_ilk) {
+  case ICBTAG_FLAG_AD_SHORT:
+    i_ad_size = sizeof(udf_short_ad_t);
+    break;
+  case ICBTAG_FLAG_AD_LONG:
+    i_ad_size = sizeof(udf_long_ad_t);
+    break;
+  case ICBTAG_FLAG_AD_IN_ICB:
+    return 0;
+  case ICBTAG_FLAG_AD_EXTENDED:
+    cdio_warn("Don't know how to handle extended addresses yet");
+    return -1;
+  default:
+    cdio_warn("Unsupported allocation descriptor %d", addr_ilk);
+    return -1;
+  }
+
+  if (i_ea_len > sizeof(p_udf_fe->u) ||
+      i_ad_len > sizeof(p_udf_fe->u) - i_ea_len) {
+    cdio_warn("Invalid allocation descriptors length");
+    return -1;
+  }
+  p_ad = &p_udf_fe->u.ext_attr[i_ea_len];
+
+  while (i_ad_len >= i_ad_size && i_offset < i_info_len) {
+    if (addr_ilk == ICBTAG_FLAG_AD_SHORT) {
+      i_len = uint32_from_le(((const udf_short_ad_t *)p_ad)->len);
+      i_pos = uint32_from_le(((const udf_short_ad_t *)p_ad)->pos);
+    } else {
+      i_len = uint32_from_le(((const udf_long_ad_t *)p_ad)->len);
+      i_pos = uint32_from_le(((const udf_long_ad_t *)p_ad)->loc.lba);
+    }
+    i_type = i_len >> 30;
+    i_len &= UDF_LENGTH_MASK;
+    if (i_len == 0)
+      break;
+
+    if (i_type == 3) {
+      /* The next descriptors are in an Allocation Extent Descriptor */
+      const struct allocExtDesc *p_aed = (const struct allocExtDesc *) aed;
+      if (++i_aed > udf_MAX_AED_CHAIN ||
+	  udf_read_sectors(p_udf, aed, p_udf->i_part_start + i_pos, 1)
+	  != DRIVER_OP_SUCCESS ||
+	  udf_checktag(&p_aed->tag, TAGID_AED)) {
+	cdio_warn("Invalid Allocation Extent Descriptor");
+	return -1;
+      }
+      i_ad_len = uint32_from_le(p_aed->u_alloc_descs);
+      if (i_ad_len > UDF_BLOCKSIZE - sizeof(struct allocExtDesc)) {
+	cdio_warn("Invalid allocation descriptors length");
+	return -1;
+      }
+      p_ad = &aed[sizeof(struct allocExtDesc)];
+      continue;
+    }
+
+    if (i_len > i_info_len - i_offset)
+      i_len = (uint32_t)(i_info_len - i_offset);
+
+    p_ext = (p_udf->i_extents == 0) ? NULL :
+      &p_udf->extents[p_udf->i_extents - 1];
+    if (i_type == 0 && p_ext != NULL && p_ext->i_lba != CDIO_INVALID_LBA &&
+	p_ext->i_len % UDF_BLOCKSIZE == 0 &&
+	p_ext->i_lba + (lba_t)(p_ext->i_len / UDF_BLOCKSIZE) ==
+	(lba_t)(p_udf->i_part_start + i_pos)) {
+      p_ext->i_len += i_len;
+    } else {
+      if (p_udf->i_extents >= i_max_extents) {
+	i_max_extents = (i_max_extents == 0) ? 8 : 2 * i_max_extents;
+	p_ext = (udf_extent_t *) realloc(p_udf->extents,
+					 i_max_extents * sizeof(udf_extent_t));
+	if (p_ext == NULL) {
+	  p_udf->i_extents = 0;
+	  return -1;
+	}
+	p_udf->extents = p_ext;
+      }
+      p_ext = &p_udf->extents[p_udf->i_extents++];
+      p_ext->i_offset = i_offset;
+      p_ext->i_len = i_len;
+      /* Allocated but unrecorded and unallocated extents read as zeroes */
+      p_ext->i_lba = (i_type == 0) ?
+	(lba_t)(p_udf->i_part_start + i_pos) : CDIO_INVALID_LBA;
+    }
+    i_offset += i_len;
+    p_ad += i_ad_size;
+    i_ad_len -= i_ad_size;
+  }
+
+  /* Ensure that we have a non NULL list even for empty files */
+  if (p_udf->extents == NULL) {
+    p_udf->extents = (udf_extent_t *) malloc(sizeof(udf_extent_t));
+    if (p_udf->extents == NULL)
+      return -1;
+  }
+  p_udf->extents_loc = uint32_from_le(p_udf_fe->tag.loc);
+  p_udf->extents_uid = uint64_from_le(p_udf_fe->unique_ID);
+  return (int)p_udf->i_extents;
+}
+
 #define udf_PATH_DELIMITERS "/\\"
 
 /* Searches p_udf_dirent for a directory entry called psz_token.
@@ -656,6 +847,9 @@ udf_close (udf_t *p_udf)
     cdio_destroy(p_udf->cdio);
   }
 
+  free_and_null(p_udf->extents);
+  free_and_null(p_udf->icb_cache);
+
   /* Get rid of root directory if allocated. */
 
   free_and_null(p_udf);
@@ -669,9 +863,10 @@ udf_opendir(const udf_dirent_t *p_udf_dirent)
     udf_t *p_udf = p_udf_dirent->p_udf;
     udf_file_entry_t udf_fe;
 
+    /* This File Entry was just looked up by udf_readdir(), so it is cached */
     driver_return_code_t i_ret =
-      udf_read_sectors(p_udf, &udf_fe, p_udf->i_part_start
-		       + p_udf_dirent->fid->icb.loc.lba, 1);
+      udf_read_icb(p_udf, &udf_fe,
+		   uint32_from_le(p_udf_dirent->fid->icb.loc.lba));
 
     if (DRIVER_OP_SUCCESS == i_ret
 	&& !udf_checktag(&udf_fe.tag, TAGID_FILE_ENTRY)) {
@@ -686,6 +881,9 @@ udf_opendir(const udf_dirent_t *p_udf_dirent)
   return NULL;
 }
 
+/* Largest directory we are willing to read in memory */
+#define udf_MAX_DIRLEN (64 * 1024 * 1024)
+
 udf_dirent_t *
 udf_readdir(udf_dirent_t *p_udf_dirent)
 {
@@ -713,17 +911,32 @@ udf_readdir(udf_dirent_t *p_udf_dirent)
   }
 
   if (!p_udf_dirent->fid) {
-    uint32_t i_sectors =
-      (p_udf_dirent->i_loc_end - p_udf_dirent->i_loc + 1);
-    uint32_t size = UDF_BLOCKSIZE * i_sectors;
-    driver_return_code_t i_ret;
-
+    /* Read the whole directory, across all its extents, in one go */
+    const uint64_t i_dir_len = p_udf_dirent->dir_left;
+    uint64_t i_ofs = 0;
+    ssize_t i_read;
+
+    if (i_dir_len > udf_MAX_DIRLEN) {
+      cdio_warn("Directory is too large");
+      udf_dirent_free(p_udf_dirent);
+      return NULL;
+    }
     if (!p_udf_dirent->sector)
-      p_udf_dirent->sector = (uint8_t*) malloc(size);
-    i_ret = udf_read_sectors(p_udf, p_udf_dirent->sector,
-			     p_udf_dirent->i_part_start+p_udf_dirent->i_loc,
-			     i_sectors);
-    if (DRIVER_OP_SUCCESS == i_ret)
+      p_udf_dirent->sector = (uint8_t*) malloc(UDF_BLOCKSIZE *
+	((i_dir_len + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE));
+    if (!p_udf_dirent->sector) {
+      udf_dirent_free(p_udf_dirent);
+      return NULL;
+    }
+    while (i_ofs < i_dir_len) {
+      i_read = udf_read_block(p_udf_dirent, &p_udf_dirent->sector[i_ofs],
+			      (i_dir_len - i_ofs + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+      if (i_read <= 0)
+	break;
+      i_ofs += i_read;
+    }
+    p_udf->i_position = 0;
+    if (i_ofs >= i_dir_len)
       p_udf_dirent->fid = (udf_fileid_desc_t *) p_udf_dirent->sector;
     else
       p_udf_dirent->fid = NULL;
@@ -744,8 +957,8 @@ udf_readdir(udf_dirent_t *p_udf_dirent)
       {
 	const unsigned int u_len = p_udf_dirent->fid->i_file_id;
 
-	if (DRIVER_OP_SUCCESS != udf_read_sectors(p_udf, &p_udf_dirent->fe, p_udf->i_part_start
-			 + uint32_from_le(p_udf_dirent->fid->icb.loc.lba), 1)) {
+	if (DRIVER_OP_SUCCESS != udf_read_icb(p_udf, &p_udf_dirent->fe,
+			 uint32_from_le(p_udf_dirent->fid->icb.loc.lba))) {
 		udf_dirent_free(p_udf_dirent);
 		return NULL;
 	}
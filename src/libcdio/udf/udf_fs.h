@@ -25,6 +25,18 @@
  */
 int udf_checktag(const udf_tag_t *p_tag, udf_Uint16_t tag_id);
 
+/**
+ * Read the File Entry located at partition relative block i_lba, through
+ * a read-ahead window kept in p_udf.
+ */
+driver_return_code_t udf_read_icb(udf_t *p_udf, void *ptr, uint32_t i_lba);
+
+/**
+ * Resolve the allocation descriptors of a File Entry into the extent list
+ * kept in p_udf. Return the number of extents or -1 on error.
+ */
+int udf_get_extents(udf_t *p_udf, const udf_file_entry_t *p_udf_fe);
+
 #endif /* CDIO_UDF_UDF_FS_H_ */
 
 
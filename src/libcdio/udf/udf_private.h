@@ -32,6 +32,17 @@
 #include <cdio/udf.h>
 #include "_cdio_stdio.h"
 
+/* Number of sectors read at once when looking up File Entries */
+#define UDF_ICB_CACHE_BLOCKS 32
+
+/* A run of file data, resolved from the File Entry allocation descriptors */
+typedef struct udf_extent_s {
+  uint64_t              i_offset;     /* Offset of the extent in the file */
+  uint64_t              i_len;        /* Length of the extent in bytes */
+  lba_t                 i_lba;        /* Absolute start sector, or
+                                         CDIO_INVALID_LBA if not recorded */
+} udf_extent_t;
+
 /* Implementation of opaque types */
 
 struct udf_s {
@@ -45,6 +56,14 @@ struct udf_s {
   uint32_t              i_part_start; /* start of Partition Descriptor */
   uint32_t              lvd_lba;      /* sector of Logical Volume Descriptor */
   uint32_t              fsd_offset;   /* lba of fileset descriptor */
+  udf_extent_t          *extents;     /* Extents of the file being read */
+  uint32_t              i_extents;    /* Number of extents */
+  uint32_t              i_extent;     /* Last extent accessed */
+  uint32_t              extents_loc;  /* Tag location of the extents' File Entry */
+  uint64_t              extents_uid;  /* Unique ID of the extents' File Entry */
+  uint8_t               *icb_cache;   /* Read-ahead window of File Entries */
+  lsn_t                 icb_cache_lsn;  /* First sector of the window */
+  uint32_t              icb_cache_len;  /* Number of sectors in the window */
 };
 
 #endif /* CDIO_UDF_UDF_PRIVATE_H_ */
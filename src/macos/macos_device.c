@@ -10,7 +10,11 @@
  */
 
 #include "macos_device.h"
+#include "ulog.h"
+#include "posix_io.h"
+#include "isobuild.h"
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -18,6 +22,7 @@
 #include <sys/disk.h>
 #include <sys/mount.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <time.h>
 #include <IOKit/IOBSD.h>
@@ -26,6 +31,7 @@
 #include <IOKit/storage/IODVDMedia.h>
 #include <IOKit/usb/USBSpec.h>
 #include <DiskArbitration/DiskArbitration.h>
+#include <CommonCrypto/CommonDigest.h>
 
 // Dodane makro debug – wyłączone domyślnie w buildzie Alpha
 #ifdef REMUS_DEBUG
@@ -45,6 +51,71 @@ static char* current_time_string(void) {
     return time_buffer;
 }
 
+/*
+ * Asynchronous log output: messages are formatted by the caller, and then timestamped
+ * and written to stdout, in batches, by the log thread, so that the write loop never
+ * waits on the console or on the GUI reading our output.
+ */
+static char log_batch[64 * 1024];
+static size_t log_batch_len = 0;
+
+static void macos_log_commit(void) {
+    if (log_batch_len == 0) return;
+    fwrite(log_batch, 1, log_batch_len, stdout);
+    fflush(stdout);
+    log_batch_len = 0;
+}
+
+static void macos_log_write(const char *str, size_t len, uint32_t flags, time_t ts) {
+    char prefix[32];
+    size_t prefix_len = 0;
+    struct tm tm_info;
+    
+    if ((flags & ULOG_TIMESTAMP) && localtime_r(&ts, &tm_info)) {
+        prefix_len = strftime(prefix, sizeof(prefix), "[%H:%M:%S] ", &tm_info);
+    }
+    if (log_batch_len + prefix_len + len > sizeof(log_batch)) {
+        macos_log_commit();
+    }
+    if (prefix_len + len > sizeof(log_batch)) {
+        fwrite(prefix, 1, prefix_len, stdout);
+        fwrite(str, 1, len, stdout);
+        return;
+    }
+    memcpy(&log_batch[log_batch_len], prefix, prefix_len);
+    memcpy(&log_batch[log_batch_len + prefix_len], str, len);
+    log_batch_len += prefix_len + len;
+}
+
+static const ulog_sink macos_log_sink = { macos_log_write, macos_log_commit };
+
+bool macos_log_start(void) {
+    return ulog_init(&macos_log_sink);
+}
+
+void macos_log_stop(void) {
+    ulog_exit();
+}
+
+/*
+ * Print a timestamped message, through the log thread if it is running
+ */
+static void timed_printf(const char *format, ...) {
+    va_list args;
+    bool queued;
+    
+    va_start(args, format);
+    queued = ulog_vprintf(ULOG_TIMESTAMP, format, args);
+    va_end(args);
+    if (!queued) {
+        printf("[%s] ", current_time_string());
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+        fflush(stdout);
+    }
+}
+
 /*
  * Helper function to check if path is a block device
  */
@@ -546,7 +617,7 @@ typedef struct {
     uint64_t total_size;
     uint64_t written_bytes;
     double progress;
-    bool cancelled;
+    volatile int cancelled;
 } rufus_progress_t;
 
 static rufus_progress_t g_rufus_progress = {0};
@@ -557,22 +628,14 @@ static void rufus_update_progress(uint64_t written, uint64_t total) {
     g_rufus_progress.total_size = total;
     g_rufus_progress.progress = total > 0 ? (double)written / total * 100.0 : 0.0;
     
-    printf("[%s] Writing image: %.1f%% (%llu/%llu bytes)\n", 
-           current_time_string(), g_rufus_progress.progress, written, total);
-    fflush(stdout); // Force immediate output for real-time progress in GUI
+    timed_printf("Writing image: %.1f%% (%llu/%llu bytes)\n", 
+           g_rufus_progress.progress, written, total);
 }
 
-// Emulacja CHECK_FOR_USER_CANCEL z Rufus
-#define CHECK_FOR_USER_CANCEL \
-    if (g_rufus_progress.cancelled) { \
-        printf("\n[%s] Operation cancelled by user\n", current_time_string()); \
-        goto out; \
-    }
-
 /*
  * Full Rufus WriteDrive implementation adapted for macOS
  * Based on format.c from Rufus project - maintains all advanced features:
- * - Multi-buffer asynchronous I/O pattern  
+ * - Multi-buffer I/O, through the shared POSIX write engine (posix_io.c)
  * - Sector-aligned buffer management
  * - Comprehensive retry logic with timeout
  * - Progress tracking with detailed reporting
@@ -583,23 +646,22 @@ bool macos_write_iso_to_device(const char *iso_path, const char *device_path) {
     setvbuf(stdout, NULL, _IONBF, 0);
     setvbuf(stderr, NULL, _IONBF, 0);
     
-    printf("[%s] Starting Rufus-style ISO write: %s -> %s\n", 
-           current_time_string(), iso_path, device_path);
+    timed_printf("Starting Rufus-style ISO write: %s -> %s\n", 
+           iso_path, device_path);
     
-    FILE* source_image = NULL;
-    FILE* physical_drive = NULL;
+    int source_image = -1;
+    int physical_drive = -1;
     bool ret = false;
-    uint64_t wb, target_size = 0;
-    uint32_t read_size[NUM_BUFFERS] = {0};
-    uint32_t write_size, buf_size;
-    uint8_t* buffer = NULL;
+    uint64_t target_size = 0;
+    struct stat st;
     char raw_device_path[512];
-    int read_bufnum = 0, proc_bufnum = 1;
     const char* device_name;
     char command[512];
+    pio_job job = { 0 };
+    int r;
     
     if (!iso_path || !device_path) {
-        printf("[%s] Error: NULL parameters\n", current_time_string());
+        timed_printf("Error: NULL parameters\n");
         return false;
     }
     
@@ -615,16 +677,13 @@ bool macos_write_iso_to_device(const char *iso_path, const char *device_path) {
     }
     
     // Unmount device like Rufus does - force unmount all partitions
-    printf("[%s] Unmounting device partitions...\n", current_time_string());
-    fflush(stdout);
+    timed_printf("Unmounting device partitions...\n");
     snprintf(command, sizeof(command), "diskutil unmountDisk force /dev/%s 2>&1", device_name);
     int unmount_result = system(command);
     if (unmount_result == 0) {
-        printf("[%s] Forced unmount of all volumes on %s was successful\n", current_time_string(), device_name);
-        fflush(stdout);
+        timed_printf("Forced unmount of all volumes on %s was successful\n", device_name);
     } else {
-        printf("[%s] Warning: Failed to unmount device (continuing anyway)\n", current_time_string());
-        fflush(stdout);
+        timed_printf("Warning: Failed to unmount device (continuing anyway)\n");
     }
     
     // Give time for unmounting to complete
@@ -638,158 +697,165 @@ bool macos_write_iso_to_device(const char *iso_path, const char *device_path) {
         raw_device_path[sizeof(raw_device_path) - 1] = '\0';
     }
     
-    printf("[%s] Using raw device: %s\n", current_time_string(), raw_device_path);
-    fflush(stdout);
+    timed_printf("Using raw device: %s\n", raw_device_path);
     
     // Open source image file
-    source_image = fopen(iso_path, "rb");
-    if (!source_image) {
-        printf("[%s] Could not open image '%s': %s\n", current_time_string(), iso_path, strerror(errno));
+    source_image = open(iso_path, O_RDONLY);
+    if (source_image < 0) {
+        timed_printf("Could not open image '%s': %s\n", iso_path, strerror(errno));
         goto out;
     }
     
     // Determine image size - like Rufus img_report.image_size
-    fseek(source_image, 0, SEEK_END);
-    target_size = ftell(source_image);
-    fseek(source_image, 0, SEEK_SET);
+    if (fstat(source_image, &st) == 0) {
+        target_size = (uint64_t)st.st_size;
+    }
     
-    if (target_size <= 0) {
-        printf("[%s] Invalid image size: %llu\n", current_time_string(), target_size);
+    if (target_size == 0) {
+        timed_printf("Invalid image size: %llu\n", target_size);
         goto out;
     }
     
-    printf("[%s] Image size: %.2f MB (%llu bytes)\n", 
-           current_time_string(), (double)target_size / (1024.0 * 1024.0), target_size);
-    fflush(stdout);
+    timed_printf("Image size: %.2f MB (%llu bytes)\n", 
+           (double)target_size / (1024.0 * 1024.0), target_size);
     
     // Open physical drive for writing
-    physical_drive = fopen(raw_device_path, "r+b");
-    if (!physical_drive) {
-        printf("[%s] Could not open device '%s': %s\n", current_time_string(), raw_device_path, strerror(errno));
-        printf("[%s] Note: Administrator privileges may be required\n", current_time_string());
+    physical_drive = open(raw_device_path, O_RDWR);
+    if (physical_drive < 0) {
+        timed_printf("Could not open device '%s': %s\n", raw_device_path, strerror(errno));
+        timed_printf("Note: Administrator privileges may be required\n");
         goto out;
     }
+    // Raw devices bypass the buffer cache already, but regular files used for testing don't
+    fcntl(physical_drive, F_NOCACHE, 1);
+    
+    // The write engine takes care of the sector aligned buffers, the padding of the last
+    // chunk and of keeping NUM_BUFFERS chunks in flight, like Rufus' WriteDrive() does
+    job.src_fd = source_image;
+    job.size = target_size;
+    job.dst_fd[0] = physical_drive;
+    job.num_targets = 1;
+    job.sector_size = 512;
+    job.chunk_size = DD_BUFFER_SIZE;
+    job.queue_depth = NUM_BUFFERS;
+    job.retries = WRITE_RETRIES - 1;
+    job.retry_delay_ms = WRITE_TIMEOUT;
+    job.cancel = &g_rufus_progress.cancelled;
+    job.progress = rufus_update_progress;
+    
+    timed_printf("Writing image with %d MB buffer:\n", 
+           (DD_BUFFER_SIZE * NUM_BUFFERS) / (1024*1024));
+    rufus_update_progress(0, target_size);
     
-    // Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
-    // Like Rufus: buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize
-    buf_size = ((DD_BUFFER_SIZE + 511) / 512) * 512;  // Align to 512-byte sectors
-    
-    // Allocate buffer for NUM_BUFFERS (Rufus multi-buffer system)
-    if (posix_memalign((void**)&buffer, 512, buf_size * NUM_BUFFERS) != 0) {
-        printf("[%s] Could not allocate disk write buffer\n", current_time_string());
+    r = pio_run(&job);
+    if (r == ECANCELED) {
+        timed_printf("Operation cancelled by user\n");
         goto out;
     }
-    
-    // Verify buffer alignment (Rufus assertion)
-    if ((uintptr_t)buffer % 512 != 0) {
-        printf("[%s] Error: Buffer not aligned to sector size\n", current_time_string());
+    if (r != 0) {
+        timed_printf("Write error at sector %llu (%s): %s\n", job.failed_offset / 512,
+               (job.failed_target < 0) ? "image" : "device", strerror(r));
         goto out;
     }
     
-    printf("[%s] Writing compressed image with %d MB buffer:\n", 
-           current_time_string(), (buf_size * NUM_BUFFERS) / (1024*1024));
-    fflush(stdout);
-    
-    // Start the initial read - Rufus asynchronous I/O pattern
-    size_t initial_read = fread(&buffer[read_bufnum * buf_size], 1, 
-                               (size_t)MIN(buf_size, target_size), source_image);
-    read_size[read_bufnum] = (uint32_t)initial_read;
-    
-    read_size[proc_bufnum] = 1; // To avoid early loop exit (Rufus pattern)
-    rufus_update_progress(0, target_size);
-    
-    // Main write loop - exact Rufus WriteDrive algorithm
-    for (wb = 0; read_size[proc_bufnum] != 0; wb += read_size[proc_bufnum]) {
-        // 0. Update the progress (Rufus UpdateProgressWithInfo)
-        rufus_update_progress(wb, target_size);
-        
-        if (wb >= target_size)
-            break;
-        
-        // 1. No need to wait for async read completion (we're using synchronous I/O)
-        // But we maintain the Rufus buffer switching pattern
-        
-        // 2. WriteFile fails unless the size is a multiple of sector size
-        if (read_size[read_bufnum] % 512 != 0) {
-            read_size[read_bufnum] = ((read_size[read_bufnum] + 511) / 512) * 512;
-        }
-        
-        // 3. Switch to the next reading buffer (Rufus pattern)
-        proc_bufnum = read_bufnum;
-        read_bufnum = (read_bufnum + 1) % NUM_BUFFERS;
-        
-        // 3. Launch the next read operation (Rufus async pattern adapted)
-        if (wb + read_size[proc_bufnum] < target_size) {
-            size_t next_read_size = MIN(buf_size, target_size - (wb + read_size[proc_bufnum]));
-            size_t next_read = fread(&buffer[read_bufnum * buf_size], 1, next_read_size, source_image);
-            read_size[read_bufnum] = (uint32_t)next_read;
-        } else {
-            read_size[read_bufnum] = 0; // End of data
-        }
-        
-        // 4. Synchronously write the current data buffer - Full Rufus retry logic
-        int i;
-        for (i = 1; i <= WRITE_RETRIES; i++) {
-            CHECK_FOR_USER_CANCEL;
-            
-            size_t written = fwrite(&buffer[proc_bufnum * buf_size], 1, read_size[proc_bufnum], physical_drive);
-            write_size = (uint32_t)written;
-            
-            if (written == read_size[proc_bufnum]) {
-                // Force write to disk (Rufus equivalent)
-                fflush(physical_drive);
-                fsync(fileno(physical_drive));
-                break;
-            }
-            
-            if (written > 0) {
-                printf("\r\n[%s] Write error: Wrote %d bytes, expected %d bytes\n", 
-                       current_time_string(), write_size, read_size[proc_bufnum]);
-                fflush(stdout);
-            } else {
-                printf("\r\n[%s] Write error at sector %llu: %s\n", 
-                       current_time_string(), wb / 512, strerror(errno));
-                fflush(stdout);
-            }
-            
-            if (i < WRITE_RETRIES) {
-                printf("[%s] Retrying in %d seconds...\n", current_time_string(), WRITE_TIMEOUT / 1000);
-                fflush(stdout);
-                usleep(WRITE_TIMEOUT * 1000); // WRITE_TIMEOUT is in ms
-                
-                // Reset file position (Rufus SetFilePointerEx equivalent)
-                if (fseek(physical_drive, wb, SEEK_SET) != 0) {
-                    printf("[%s] Write error: Could not reset position - %s\n", current_time_string(), strerror(errno));
-                    goto out;
-                }
-            } else {
-                printf("[%s] Write error after %d retries\n", current_time_string(), WRITE_RETRIES);
-                goto out;
-            }
-            
-            usleep(200000); // 200ms like Rufus
-        }
-        
-        if (i > WRITE_RETRIES)
-            goto out;
-    }
-    
     // Final flush and sync (Rufus equivalent)
-    fflush(physical_drive);
-    fsync(fileno(physical_drive));
+    fsync(physical_drive);
     
-    printf("\r\n[%s] ISO written successfully!\n", current_time_string());
-    fflush(stdout);
-    printf("[%s] Syncing filesystem...\n", current_time_string());
-    fflush(stdout);
+    timed_printf("ISO written successfully!\n");
+    timed_printf("Syncing filesystem...\n");
     system("sync");
     
     ret = true;
     
 out:
-    if (source_image) fclose(source_image);
-    if (physical_drive) fclose(physical_drive);
-    if (buffer) free(buffer);
+    if (source_image >= 0) close(source_image);
+    if (physical_drive >= 0) close(physical_drive);
+    // Our caller prints directly to stdout, so make sure our messages come first
+    ulog_flush();
     
     return ret;
 }
+
+static void iso_save_progress(uint64_t done, uint64_t total) {
+    timed_printf("Saving image: %.1f%% (%llu/%llu bytes)\n",
+           total > 0 ? (double)done / total * 100.0 : 0.0, done, total);
+}
+
+static void iso_save_hash(void *hash_ctx, const uint8_t *buf, size_t len) {
+    CC_SHA256_Update((CC_SHA256_CTX *)hash_ctx, buf, (CC_LONG)len);
+}
+
+/*
+ * Create a UDF image from the mounted volume of a device, like Rufus' IsoSaveImageThread()
+ */
+bool macos_save_device_to_iso(const char *device_path, const char *iso_path) {
+    struct statfs *mnt = NULL;
+    char mount_point[MNAMELEN] = "";
+    const char *label;
+    size_t dev_len;
+    isob_job job = { 0 };
+    CC_SHA256_CTX sha256;
+    uint8_t digest[CC_SHA256_DIGEST_LENGTH];
+    char hash_hex[2 * CC_SHA256_DIGEST_LENGTH + 1];
+    int i, n, r;
+
+    if (!device_path || !iso_path) {
+        timed_printf("Error: NULL parameters\n");
+        return false;
+    }
+
+    // Use the first mounted partition of the device (/dev/diskN or /dev/diskNsM)
+    dev_len = strlen(device_path);
+    n = getmntinfo(&mnt, MNT_NOWAIT);
+    for (i = 0; i < n; i++) {
+        if (strncmp(mnt[i].f_mntfromname, device_path, dev_len) == 0 &&
+            (mnt[i].f_mntfromname[dev_len] == '\0' || mnt[i].f_mntfromname[dev_len] == 's')) {
+            snprintf(mount_point, sizeof(mount_point), "%s", mnt[i].f_mntonname);
+            break;
+        }
+    }
+    if (mount_point[0] == '\0') {
+        timed_printf("Error: No mounted volume found on %s\n", device_path);
+        ulog_flush();
+        return false;
+    }
+    label = strrchr(mount_point, '/');
+    label = (label != NULL && label[1] != '\0') ? label + 1 : "NO_LABEL";
+
+    job.src_dir = mount_point;
+    job.image_path = iso_path;
+    job.label = label;
+    job.cancel = &g_rufus_progress.cancelled;
+    job.progress = iso_save_progress;
+    job.hash = iso_save_hash;
+    job.hash_ctx = &sha256;
+    CC_SHA256_Init(&sha256);
+
+    timed_printf("Creating UDF image of '%s' (%s) -> %s\n", mount_point, label, iso_path);
+    r = isob_run(&job);
+    if (r == ECANCELED) {
+        timed_printf("Operation cancelled by user\n");
+    } else if (r != 0) {
+        if (job.failed_path[0] != '\0')
+            timed_printf("Error: Failed to save image: %s: %s\n", job.failed_path, strerror(r));
+        else
+            timed_printf("Error: Failed to save image: %s\n", strerror(r));
+    } else {
+        CC_SHA256_Final(digest, &sha256);
+        for (i = 0; i < CC_SHA256_DIGEST_LENGTH; i++)
+            snprintf(&hash_hex[2 * i], sizeof(hash_hex) - 2 * i, "%02x", digest[i]);
+        timed_printf("Wrote %u files and %u directories (%.2f MB)\n", job.num_files, job.num_dirs,
+               (double)job.image_size / (1024.0 * 1024.0));
+        if (job.num_skipped != 0)
+            timed_printf("Warning: Skipped %u links, special files or files that are too large for UDF\n",
+                   job.num_skipped);
+        if (job.num_changed != 0)
+            timed_printf("Warning: %u files changed size while the image was being created\n", job.num_changed);
+        if (job.num_renamed != 0)
+            timed_printf("Warning: %u file names were truncated\n", job.num_renamed);
+        timed_printf("SHA-256: %s\n", hash_hex);
+    }
+    ulog_flush();
+
+    return (r == 0);
+}
@@ -68,5 +68,8 @@ bool macos_is_device_removable(const char *device_path);
 bool macos_unmount_device(const char *device_path);
 bool macos_format_device(const char *device_path, const char *fs_type, const char *label);
 bool macos_write_iso_to_device(const char *iso_path, const char *device_path);
+bool macos_save_device_to_iso(const char *device_path, const char *iso_path);
+bool macos_log_start(void);
+void macos_log_stop(void);
 
 #endif // MACOS_DEVICE_H
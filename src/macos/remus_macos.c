@@ -20,6 +20,8 @@
 #include <errno.h>
 #include <getopt.h>
 #include "macos/macos_device.h"
+#include "posix_holders.h"
+#include "trace.h"
 
 #ifdef REMUS_DEBUG
 #define DBG(fmt, ...) printf("DEBUG: " fmt, ##__VA_ARGS__)
@@ -29,6 +31,7 @@
 
 #define VERSION "v0.1.0-alpha"
 #define APPLICATION_NAME "Remus"
+#define MAX_HOLDERS 32
 
 static macos_remus_drive drives[MAX_DRIVES];
 static int num_drives = 0;
@@ -43,14 +46,17 @@ void print_usage(const char *progname) {
     printf("  -f, --filesystem TYPE   Filesystem type (FAT32, ExFAT, NTFS)\n");
     printf("  -n, --name LABEL        Volume label\n");
     printf("  -i, --iso IMAGE         ISO image to write to device\n");
+    printf("  -s, --save-iso IMAGE    Save the content of the device to a UDF ISO image\n");
     printf("  -v, --verbose           Verbose output\n");
     printf("  -y, --yes               Answer yes to all prompts\n");
+    printf("  -t, --trace FILE        Record a timeline of the operation to FILE (Chrome trace format)\n");
     printf("  -h, --help              Show this help message\n");
     printf("\nExample:\n");
     printf("  %s -l                                    # List USB devices\n", progname);
     printf("  %s -d disk2 -f FAT32 -n MY_USB          # Format disk2 as FAT32\n", progname);
     printf("  %s -d disk2 -f FAT32 -n MY_USB -y       # Format without prompts\n", progname);
     printf("  %s -d disk2 -i ubuntu.iso -y            # Write ISO to disk2\n", progname);
+    printf("  %s -d disk2 -s backup.iso               # Save disk2 to an ISO\n", progname);
     printf("\nWARNING: This will erase all data on the selected device!\n");
 }
 
@@ -98,6 +104,41 @@ macos_remus_drive *find_device_by_name(const char *device_name) {
     return NULL;
 }
 
+/*
+ * Report what is holding the device, using the scan that was started when the device
+ * was selected. Mounts and open files are taken care of by the forced unmount, but a
+ * process that has the device node open would make the write fail, so we stop there.
+ */
+static bool check_device_holders(ph_scan *scan, const char *device_path) {
+    ph_holder holders[MAX_HOLDERS];
+    bool blocked = false;
+
+    int n = ph_get(scan, holders, MAX_HOLDERS, 5000);
+    if (n < 0) {
+        printf("Warning: Could not check whether %s is in use\n", device_path);
+        return true;
+    }
+    for (int i = 0; i < n && i < MAX_HOLDERS; i++) {
+        if (holders[i].kind == PH_HOLDER_DEVICE) {
+            blocked = true;
+        }
+        if (holders[i].pid != 0) {
+            printf("%s: %s %s by %s (pid %d)\n", holders[i].kind == PH_HOLDER_DEVICE ? "Error" : "Note",
+                   holders[i].path, ph_kind_name(holders[i].kind), holders[i].name, holders[i].pid);
+        } else {
+            printf("Note: %s %s\n", holders[i].path, ph_kind_name(holders[i].kind));
+        }
+    }
+    if (n > MAX_HOLDERS) {
+        printf("Note: ...and %d more\n", n - MAX_HOLDERS);
+    }
+    if (blocked) {
+        printf("Error: %s is in use. Close the applications listed above and try again.\n", device_path);
+    }
+    fflush(stdout);
+    return !blocked;
+}
+
 bool format_device(const char *device_name, const char *fs_type, const char *label, bool auto_yes) {
     macos_remus_drive *drive = find_device_by_name(device_name);
     
@@ -105,6 +146,8 @@ bool format_device(const char *device_name, const char *fs_type, const char *lab
         printf("Error: Device '%s' not found or not a USB device\n", device_name);
         return false;
     }
+    // Look for what is holding the device while the user makes up their mind
+    ph_scan *scan = ph_start(drive->device_path, PH_DEFAULT_CPU_PERCENT);
     
     printf("\nWarning: This will erase all data on device '%s'\n", drive->display_name);
     printf("Device: %s\n", drive->device_path);
@@ -120,12 +163,19 @@ bool format_device(const char *device_name, const char *fs_type, const char *lab
         if (!fgets(response, sizeof(response), stdin) || 
             (response[0] != 'y' && response[0] != 'Y')) {
             printf("Operation cancelled.\n");
+            ph_stop(scan);
             return false;
         }
     } else {
         printf("\nProceeding automatically (--yes flag used)...\n");
     }
     
+    bool ready = check_device_holders(scan, drive->device_path);
+    ph_stop(scan);
+    if (!ready) {
+        return false;
+    }
+    
     printf("\nFormatting device...\n");
     if (!macos_format_device(drive->device_path, fs_type, label)) {
         printf("Error: Failed to format device\n");
@@ -150,6 +200,8 @@ bool write_iso_to_device(const char *device_name, const char *iso_path, bool aut
         printf("Error: Cannot open ISO file '%s': %s\n", iso_path, strerror(errno));
         return false;
     }
+    // Look for what is holding the device while the user makes up their mind
+    ph_scan *scan = ph_start(drive->device_path, PH_DEFAULT_CPU_PERCENT);
     fseek(iso_f, 0, SEEK_END);
     long iso_size = ftell(iso_f);
     fclose(iso_f);
@@ -162,6 +214,7 @@ bool write_iso_to_device(const char *device_name, const char *iso_path, bool aut
         printf("Error: ISO file (%.2f MB) is larger than device (%.2f GB)\n",
                (double)iso_size / (1024.0 * 1024.0),
                (double)drive->size / (1024.0 * 1024.0 * 1024.0));
+        ph_stop(scan);
         return false;
     }
     if (!auto_yes) {
@@ -170,11 +223,17 @@ bool write_iso_to_device(const char *device_name, const char *iso_path, bool aut
         char response[10];
         if (!fgets(response, sizeof(response), stdin) || (response[0] != 'y' && response[0] != 'Y')) {
             printf("Operation cancelled.\n");
+            ph_stop(scan);
             return false;
         }
     } else {
         printf("\nProceeding automatically (--yes flag used)...\n");
     }
+    bool ready = check_device_holders(scan, drive->device_path);
+    ph_stop(scan);
+    if (!ready) {
+        return false;
+    }
     printf("\nWriting ISO to device...\n");
     fflush(stdout);
     if (!macos_write_iso_to_device(iso_path, drive->device_path)) {
@@ -186,6 +245,35 @@ bool write_iso_to_device(const char *device_name, const char *iso_path, bool aut
     return true;
 }
 
+bool save_device_to_iso(const char *device_name, const char *iso_path) {
+    macos_remus_drive *drive = find_device_by_name(device_name);
+    if (!drive) {
+        printf("Error: Device '%s' not found or not a USB device\n", device_name);
+        return false;
+    }
+    printf("\nDevice: %s\n", drive->device_path);
+    printf("ISO File: %s\n", iso_path);
+    printf("\nSaving device to ISO...\n");
+    if (!macos_save_device_to_iso(drive->device_path, iso_path)) {
+        printf("Error: Failed to save device to ISO\n");
+        return false;
+    }
+    printf("ISO saved successfully!\n");
+    return true;
+}
+
+/*
+ * Write the recorded timeline, if requested
+ */
+static void dump_trace(const char *trace_file) {
+    if (!trace_file) return;
+    if (trace_dump(trace_file)) {
+        printf("Trace written to %s\n", trace_file);
+    } else {
+        printf("Error: Could not write trace to '%s': %s\n", trace_file, strerror(errno));
+    }
+}
+
 void cleanup_drives() {
     for (int i = 0; i < num_drives; i++) {
         if (drives[i].device_path) free(drives[i].device_path);
@@ -206,6 +294,8 @@ int main(int argc, char *argv[]) {
     char *fs_type = "FAT32";  // Default filesystem
     char *label = NULL;
     char *iso_file = NULL;
+    char *save_iso_file = NULL;
+    char *trace_file = NULL;
     
     static struct option long_options[] = {
         {"list", no_argument, 0, 'l'},
@@ -213,8 +303,10 @@ int main(int argc, char *argv[]) {
         {"filesystem", required_argument, 0, 'f'},
         {"name", required_argument, 0, 'n'},
         {"iso", required_argument, 0, 'i'},
+        {"save-iso", required_argument, 0, 's'},
         {"verbose", no_argument, 0, 'v'},
         {"yes", no_argument, 0, 'y'},  // New yes flag
+        {"trace", required_argument, 0, 't'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
@@ -233,6 +325,11 @@ int main(int argc, char *argv[]) {
     printf("Copyright © 2025 Maciej Wałoszczyk\n\n");
     fflush(stdout);
     
+    // Timestamped progress messages go through the log thread
+    if (macos_log_start()) {
+        atexit(macos_log_stop);
+    }
+    
     if (argc == 1) {
         list_devices = true;
     }
@@ -246,6 +343,12 @@ int main(int argc, char *argv[]) {
         } else if ((strcmp(arg, "--iso") == 0 || strcmp(arg, "-i") == 0) && i + 1 < argc) {
             iso_file = argv[++i];
             DBG("iso_file set to %s\n", iso_file);
+        } else if ((strcmp(arg, "--save-iso") == 0 || strcmp(arg, "-s") == 0) && i + 1 < argc) {
+            save_iso_file = argv[++i];
+            DBG("save_iso_file set to %s\n", save_iso_file);
+        } else if ((strcmp(arg, "--trace") == 0 || strcmp(arg, "-t") == 0) && i + 1 < argc) {
+            trace_file = argv[++i];
+            DBG("trace_file set to %s\n", trace_file);
         } else if (strcmp(arg, "--yes") == 0 || strcmp(arg, "-y") == 0) {
             auto_yes = true;
             DBG("auto_yes enabled\n");
@@ -262,6 +365,10 @@ int main(int argc, char *argv[]) {
         list_devices = true;
     }
     
+    if (trace_file) {
+        trace_start();
+    }
+    
     // List devices
     if (list_devices) {
         list_usb_devices();
@@ -271,10 +378,18 @@ int main(int argc, char *argv[]) {
     
     // Format device if specified
     if (device_name) {
+        // Saving the device to an image leaves it untouched
+        if (save_iso_file) {
+            bool success = save_device_to_iso(device_name, save_iso_file);
+            dump_trace(trace_file);
+            cleanup_drives();
+            return success ? 0 : 1;
+        }
         // Check if ISO writing is requested
         if (iso_file) {
             printf("Writing ISO to device (formatting will be skipped)\n");
             bool success = write_iso_to_device(device_name, iso_file, auto_yes);
+            dump_trace(trace_file);
             cleanup_drives();
             return success ? 0 : 1;
         } else {
@@ -286,13 +401,14 @@ int main(int argc, char *argv[]) {
                 return 1;
             }
             bool success = format_device(device_name, fs_type, label, auto_yes);
+            dump_trace(trace_file);
             cleanup_drives();
             return success ? 0 : 1;
         }
     }
     
     // Handle ISO writing without device specified
-    if (iso_file && !device_name) {
+    if ((iso_file || save_iso_file) && !device_name) {
         printf("Error: ISO file specified but no target device selected\n");
         printf("Use -d DEVICE to specify target device\n");
         cleanup_drives();
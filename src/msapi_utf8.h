@@ -41,6 +41,8 @@
 #include <sys/stat.h>
 #include <psapi.h>
 
+#include "transcode.h"
+
 #pragma once
 #if defined(_MSC_VER)
 // disable VS2012 Code Analysis warnings that are intentional
@@ -93,6 +95,7 @@ extern "C" {
 static __inline char* wchar_to_utf8(const wchar_t* wstr)
 {
 	int size = 0;
+	size_t len;
 	char* str = NULL;
 
 	if (wstr == NULL)
@@ -102,6 +105,18 @@ static __inline char* wchar_to_utf8(const wchar_t* wstr)
 	if (wstr[0] == 0)
 		return (char*)calloc(1, 1);
 
+	// Allocate for the worst case, so that we only need to go through the string once
+	len = wcslen(wstr);
+	if ((str = (char*)malloc(UTF8_MAX_FROM_UTF16(len) + 1)) == NULL)
+		return NULL;
+	len = utf16le_to_utf8((const uint16_t*)wstr, len, str);
+	if (len != TRANSCODE_INVALID) {
+		str[len] = 0;
+		return str;
+	}
+	// Unpaired surrogates are left for Windows to replace
+	sfree(str);
+
 	// Find out the size we need to allocate for our converted string
 	size = WideCharToMultiByte(CP_UTF8, 0, wstr, -1, NULL, 0, NULL, NULL);
 	if (size <= 1)	// An empty string would be size 1
@@ -125,6 +140,7 @@ static __inline char* wchar_to_utf8(const wchar_t* wstr)
 static __inline wchar_t* utf8_to_wchar(const char* str)
 {
 	int size = 0;
+	size_t len;
 	wchar_t* wstr = NULL;
 
 	if (str == NULL)
@@ -134,6 +150,18 @@ static __inline wchar_t* utf8_to_wchar(const char* str)
 	if (str[0] == 0)
 		return (wchar_t*)calloc(1, sizeof(wchar_t));
 
+	// Allocate for the worst case, so that we only need to go through the string once
+	len = strlen(str);
+	if ((wstr = (wchar_t*)malloc((UTF16_MAX_FROM_UTF8(len) + 1) * sizeof(wchar_t))) == NULL)
+		return NULL;
+	len = utf8_to_utf16le(str, len, (uint16_t*)wstr);
+	if (len != TRANSCODE_INVALID) {
+		wstr[len] = 0;
+		return wstr;
+	}
+	// Invalid sequences are left for Windows to replace
+	sfree(wstr);
+
 	// Find out the size we need to allocate for our converted string
 	size = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
 	if (size <= 1)	// An empty string would be size 1
@@ -1428,6 +1456,26 @@ static __inline BOOL GetVolumeInformationU(LPCSTR lpRootPathName, LPSTR lpVolume
 	return ret;
 }
 
+static __inline BOOL GetVolumePathNameU(LPCSTR lpszFileName, LPSTR lpszVolumePathName, DWORD cchBufferLength)
+{
+	BOOL ret = FALSE;
+	DWORD err = ERROR_INVALID_DATA;
+	wconvert(lpszFileName);
+	// coverity[returned_null]
+	walloc(lpszVolumePathName, cchBufferLength);
+
+	ret = GetVolumePathNameW(wlpszFileName, wlpszVolumePathName, cchBufferLength);
+	err = GetLastError();
+	if ((ret) && (wchar_to_utf8_no_alloc(wlpszVolumePathName, lpszVolumePathName, cchBufferLength) == 0)) {
+		err = GetLastError();
+		ret = FALSE;
+	}
+	wfree(lpszVolumePathName);
+	wfree(lpszFileName);
+	SetLastError(err);
+	return ret;
+}
+
 #ifdef __cplusplus
 }
 #endif
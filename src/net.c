@@ -791,6 +791,7 @@ static DWORD WINAPI DownloadISOThread(LPVOID param)
 	HANDLE hFile, hPipe;
 	DWORD dwExitCode = 99, dwCompressedSize, dwSize, dwAvail, dwPipeSize = 4096;
 	GUID guid;
+	bled_ctx* ctx;
 
 	dialog_showing++;
 	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
@@ -834,10 +835,10 @@ static DWORD WINAPI DownloadISOThread(LPVOID param)
 		free(sig);
 		uprintf("Download signature is valid ✓");
 		uncompressed_size = *((uint64_t*)&compressed[5]);
-		if ((uncompressed_size < 1 * MB) && (bled_init(0, uprintf, NULL, NULL, NULL, NULL, &ErrorStatus) >= 0)) {
+		if ((uncompressed_size < 1 * MB) && ((ctx = bled_ctx_new(0, uprintf, NULL, NULL, NULL, NULL, &ErrorStatus)) != NULL)) {
 			fido_script = malloc((size_t)uncompressed_size);
-			size = bled_uncompress_from_buffer_to_buffer(compressed, dwCompressedSize, fido_script, (size_t)uncompressed_size, BLED_COMPRESSION_LZMA);
-			bled_exit();
+			size = bled_ctx_uncompress_from_buffer_to_buffer(ctx, compressed, dwCompressedSize, fido_script, (size_t)uncompressed_size, BLED_COMPRESSION_LZMA);
+			bled_ctx_free(ctx);
 		}
 		safe_free(compressed);
 		if (size != uncompressed_size) {
@@ -676,6 +676,32 @@ out:
 	return ret;
 }
 
+/*
+ * Copy the temporary file we processed in text mode back to its final destination,
+ * in blocks, removing CRs if requested. 'size' is the size of a character (2 for
+ * UTF-16, 1 otherwise).
+ */
+static void copy_processed_file(FILE* fd_in, FILE* fd_out, size_t size, BOOL dos2unix)
+{
+	uint8_t buf[16 * KB];
+	size_t i, j, n;
+
+	while ((n = fread(buf, size, sizeof(buf) / size, fd_in)) != 0) {
+		if (dos2unix) {
+			for (i = 0, j = 0; i < n; i++) {
+				if ((buf[i * size] == 0x0D) && (size == 1 || buf[i * size + 1] == 0))
+					continue;
+				if (j != i)
+					memcpy(&buf[j * size], &buf[i * size], size);
+				j++;
+			}
+			n = j;
+		}
+		if (fwrite(buf, size, n, fd_out) != n)
+			break;
+	}
+}
+
 /*
  * replace or add 'data' for token 'token' in config file 'filename'
  */
@@ -685,9 +711,9 @@ char* set_token_data_file(const char* token, const char* data, const char* filen
 	wchar_t *wtoken = NULL, *wfilename = NULL, *wtmpname = NULL, *wdata = NULL, bom = 0;
 	wchar_t buf[1024];
 	FILE *fd_in = NULL, *fd_out = NULL;
-	size_t i, size;
+	size_t i;
 	int mode = 0;
-	char *ret = NULL, tmp[2];
+	char *ret = NULL;
 
 	if ((filename == NULL) || (token == NULL) || (data == NULL))
 		return NULL;
@@ -814,9 +840,7 @@ out:
 		fd_out = _wfopen(wfilename, L"wb");
 		// Don't check fds
 		if ((fd_in != NULL) && (fd_out != NULL)) {
-			size = (mode==2)?2:1;
-			while(fread(tmp, size, 1, fd_in) == 1)
-				fwrite(tmp, size, 1, fd_out);
+			copy_processed_file(fd_in, fd_out, (mode==2)?2:1, FALSE);
 			fclose(fd_in);
 			fclose(fd_out);
 		} else {
@@ -971,9 +995,9 @@ char* insert_section_data(const char* filename, const char* section, const char*
 	wchar_t *wsection = NULL, *wfilename = NULL, *wtmpname = NULL, *wdata = NULL, bom = 0;
 	wchar_t buf[1024];
 	FILE *fd_in = NULL, *fd_out = NULL;
-	size_t i, size;
+	size_t i;
 	int mode = 0;
-	char *ret = NULL, tmp[2];
+	char *ret = NULL;
 
 	if ((filename == NULL) || (section == NULL) || (data == NULL))
 		return NULL;
@@ -1068,11 +1092,7 @@ out:
 		fd_out = _wfopen(wfilename, L"wb");
 		// Don't check fds
 		if ((fd_in != NULL) && (fd_out != NULL)) {
-			size = (mode==2)?2:1;
-			while(fread(tmp, size, 1, fd_in) == 1) {
-				if ((!dos2unix) || (tmp[0] != 0x0D))
-					fwrite(tmp, size, 1, fd_out);
-			}
+			copy_processed_file(fd_in, fd_out, (mode==2)?2:1, dos2unix);
 			fclose(fd_in);
 			fclose(fd_out);
 		} else {
@@ -1106,9 +1126,9 @@ char* replace_in_token_data(const char* filename, const char* token, const char*
 	wchar_t *wtoken = NULL, *wfilename = NULL, *wtmpname = NULL, *wsrc = NULL, *wrep = NULL, bom = 0;
 	wchar_t buf[1024], *torep[MAX_OCCURRENCES + 1] = { NULL };
 	FILE *fd_in = NULL, *fd_out = NULL;
-	size_t i, j, p[MAX_OCCURRENCES + 1] = { 0 }, ns, size;
+	size_t i, j, p[MAX_OCCURRENCES + 1] = { 0 }, ns;
 	int mode = 0;
-	char *ret = NULL, tmp[2];
+	char *ret = NULL;
 
 	if ((filename == NULL) || (token == NULL) || (src == NULL) || (rep == NULL))
 		return NULL;
@@ -1245,11 +1265,7 @@ out:
 		fd_out = _wfopen(wfilename, L"wb");
 		// Don't check fds
 		if ((fd_in != NULL) && (fd_out != NULL)) {
-			size = (mode==2)?2:1;
-			while(fread(tmp, size, 1, fd_in) == 1) {
-				if ((!dos2unix) || (tmp[0] != 0x0D))
-					fwrite(tmp, size, 1, fd_out);
-			}
+			copy_processed_file(fd_in, fd_out, (mode==2)?2:1, dos2unix);
 			fclose(fd_in);
 			fclose(fd_out);
 		} else {
@@ -0,0 +1,851 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Device holder detection for the POSIX ports
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#elif defined(__APPLE__)
+#include <libproc.h>
+#include <sys/mount.h>
+#include <sys/param.h>
+#endif
+
+#include "posix_holders.h"
+#include "trace.h"
+
+#define PH_MAX_DEVS             64
+#define PH_MAX_HOLDERS          256
+// Don't report more than that many files per process
+#define PH_MAX_FILES_PER_PID    4
+// Check the CPU budget every that many processes
+#define PH_BATCH_SIZE           16
+#define PH_MAX_SLEEP_MS         250
+
+struct ph_scan {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned cpu_percent;
+	bool stop;
+	int waiters;                    // Callers of ph_get(), which lift the CPU budget
+	uint64_t started;               // Number of scans started
+	uint64_t done;                  // Number of scans completed
+	// The device and its partitions (and, on Linux, the devices stacked on top of them)
+	char disk_name[64];
+	dev_t devs[PH_MAX_DEVS];
+	int num_devs;
+	// Processes that have been inspected already, as an open addressing hash set
+	int* seen;
+	size_t seen_size;
+	size_t seen_count;
+#if defined(__linux__)
+	// Mount namespaces whose mounts have been inspected already
+	unsigned long mnt_ns[64];
+	int num_mnt_ns;
+	struct stat root;               // Our own root, which most processes share
+#endif
+	// Owned by the scan thread
+	ph_holder work[PH_MAX_HOLDERS];
+	int num_work;
+	// Result of the last complete scan, protected by lock
+	ph_holder result[PH_MAX_HOLDERS];
+	int num_result;
+};
+
+const char* ph_kind_name(ph_holder_kind kind)
+{
+	switch (kind) {
+	case PH_HOLDER_MOUNT:
+		return "mounted";
+	case PH_HOLDER_STACK:
+		return "in use by";
+	case PH_HOLDER_DEVICE:
+		return "device open";
+	case PH_HOLDER_FILE:
+		return "file open";
+	default:
+		return "unknown";
+	}
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool has_dev(const ph_scan* s, dev_t dev)
+{
+	int i;
+
+	for (i = 0; i < s->num_devs; i++) {
+		if (s->devs[i] == dev)
+			return true;
+	}
+	return false;
+}
+
+static void add_dev(ph_scan* s, dev_t dev)
+{
+	if (s->num_devs < PH_MAX_DEVS && !has_dev(s, dev))
+		s->devs[s->num_devs++] = dev;
+}
+
+static void add_holder(ph_scan* s, ph_holder_kind kind, int pid, const char* name, const char* path)
+{
+	ph_holder* h;
+	int i;
+
+	for (i = 0; i < s->num_work; i++) {
+		if (s->work[i].kind == kind && s->work[i].pid == pid && strcmp(s->work[i].path, path) == 0)
+			return;
+	}
+	if (s->num_work >= PH_MAX_HOLDERS)
+		return;
+	h = &s->work[s->num_work++];
+	h->kind = kind;
+	h->pid = pid;
+	snprintf(h->name, sizeof(h->name), "%s", (name != NULL) ? name : "");
+	snprintf(h->path, sizeof(h->path), "%s", path);
+}
+
+/*
+ * Set of the processes that have been inspected already
+ */
+static bool seen_insert(ph_scan* s, int pid)
+{
+	size_t i, j, new_size;
+	int* new_seen;
+
+	if (2 * (s->seen_count + 1) > s->seen_size) {
+		new_size = (s->seen_size == 0) ? 1024 : 2 * s->seen_size;
+		new_seen = calloc(new_size, sizeof(int));
+		if (new_seen == NULL)
+			return true;
+		for (i = 0; i < s->seen_size; i++) {
+			if (s->seen[i] == 0)
+				continue;
+			for (j = (size_t)s->seen[i] & (new_size - 1); new_seen[j] != 0; j = (j + 1) & (new_size - 1));
+			new_seen[j] = s->seen[i];
+		}
+		free(s->seen);
+		s->seen = new_seen;
+		s->seen_size = new_size;
+	}
+	for (i = (size_t)pid & (s->seen_size - 1); s->seen[i] != 0; i = (i + 1) & (s->seen_size - 1)) {
+		if (s->seen[i] == pid)
+			return false;
+	}
+	s->seen[i] = pid;
+	s->seen_count++;
+	return true;
+}
+
+#if defined(__linux__)
+/*
+ * Linux: the device and its partitions come from sysfs, as do the devices that are
+ * stacked on top of them, and processes are inspected through procfs.
+ */
+static dev_t read_sysfs_dev(const char* path)
+{
+	unsigned int maj, min;
+	FILE* f = fopen(path, "r");
+	int n;
+
+	if (f == NULL)
+		return 0;
+	n = fscanf(f, "%u:%u", &maj, &min);
+	fclose(f);
+	return (n == 2) ? makedev(maj, min) : 0;
+}
+
+static void scan_stack(ph_scan* s, const char* sys_dir)
+{
+	char path[PATH_MAX], dev_path[PATH_MAX];
+	struct dirent* de;
+	DIR* dir;
+	dev_t dev;
+
+	snprintf(path, sizeof(path), "%s/holders", sys_dir);
+	dir = opendir(path);
+	if (dir == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(dev_path, sizeof(dev_path), "/dev/%s", de->d_name);
+		add_holder(s, PH_HOLDER_STACK, 0, NULL, dev_path);
+		// Processes and mounts using the stacked device hold ours too
+		snprintf(path, sizeof(path), "/sys/class/block/%s/dev", de->d_name);
+		dev = read_sysfs_dev(path);
+		if (dev != 0)
+			add_dev(s, dev);
+	}
+	closedir(dir);
+}
+
+static bool setup_devs(ph_scan* s, const char* device_path)
+{
+	char path[PATH_MAX], sys_dir[sizeof("/sys/class/block/") + sizeof(s->disk_name)];
+	struct dirent* de;
+	struct stat st;
+	const char* p;
+	DIR* dir;
+	dev_t dev;
+
+	if (realpath(device_path, path) == NULL || stat(path, &st) != 0 || !S_ISBLK(st.st_mode))
+		return false;
+	if (stat("/", &s->root) != 0)
+		return false;
+	p = strrchr(path, '/');
+	p = (p != NULL) ? p + 1 : path;
+	if (strlen(p) >= sizeof(s->disk_name))
+		return false;
+	memcpy(s->disk_name, p, strlen(p) + 1);
+	add_dev(s, st.st_rdev);
+	// The partitions are the subdirectories of the disk that have a 'dev' attribute
+	snprintf(sys_dir, sizeof(sys_dir), "/sys/class/block/%s", s->disk_name);
+	dir = opendir(sys_dir);
+	if (dir == NULL)
+		return true;
+	while ((de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, s->disk_name, strlen(s->disk_name)) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s/dev", sys_dir, de->d_name);
+		dev = read_sysfs_dev(path);
+		if (dev != 0)
+			add_dev(s, dev);
+	}
+	closedir(dir);
+	return true;
+}
+
+// Done on each scan, since stacked devices can come and go
+static void scan_stacks(ph_scan* s)
+{
+	char path[PATH_MAX];
+	struct dirent* de;
+	DIR* dir;
+
+	snprintf(path, sizeof(path), "/sys/class/block/%s", s->disk_name);
+	scan_stack(s, path);
+	dir = opendir(path);
+	if (dir == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, s->disk_name, strlen(s->disk_name)) != 0)
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/block/%s/%s", s->disk_name, de->d_name);
+		scan_stack(s, path);
+	}
+	closedir(dir);
+}
+
+// Mount points in mountinfo have their spaces, tabs, newlines and backslashes escaped in octal
+static void unescape_mountinfo(char* str)
+{
+	char *src = str, *dst = str;
+
+	while (*src != '\0') {
+		if (src[0] == '\\' && src[1] >= '0' && src[1] <= '3' && src[2] >= '0' && src[2] <= '7' &&
+			src[3] >= '0' && src[3] <= '7') {
+			*dst++ = (char)(((src[1] - '0') << 6) | ((src[2] - '0') << 3) | (src[3] - '0'));
+			src += 4;
+		} else {
+			*dst++ = *src++;
+		}
+	}
+	*dst = '\0';
+}
+
+static void scan_mountinfo(ph_scan* s, const char* mountinfo, int pid, const char* name)
+{
+	char line[2 * PATH_MAX], mount_point[PATH_MAX];
+	unsigned int maj, min;
+	FILE* f = fopen(mountinfo, "r");
+
+	if (f == NULL)
+		return;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "%*u %*u %u:%u %*s %4095s", &maj, &min, mount_point) != 3)
+			continue;
+		if (!has_dev(s, makedev(maj, min)))
+			continue;
+		unescape_mountinfo(mount_point);
+		add_holder(s, PH_HOLDER_MOUNT, pid, name, mount_point);
+	}
+	fclose(f);
+}
+
+static void scan_mounts(ph_scan* s)
+{
+	scan_stacks(s);
+	scan_mountinfo(s, "/proc/self/mountinfo", 0, NULL);
+}
+
+static unsigned long mount_ns(int pid)
+{
+	char path[64], link[64];
+	unsigned long ns = 0;
+	ssize_t r;
+
+	snprintf(path, sizeof(path), "/proc/%d/ns/mnt", pid);
+	r = readlink(path, link, sizeof(link) - 1);
+	if (r <= 0)
+		return 0;
+	link[r] = '\0';
+	sscanf(link, "mnt:[%lu]", &ns);
+	return ns;
+}
+
+static void check_path(ph_scan* s, int pid, const char* name, const char* proc_path, int* num_files)
+{
+	char target[PATH_MAX];
+	struct stat st;
+	ssize_t r;
+
+	if (stat(proc_path, &st) != 0)
+		return;
+	if ((S_ISBLK(st.st_mode) && has_dev(s, st.st_rdev)) || has_dev(s, st.st_dev)) {
+		if (!S_ISBLK(st.st_mode) && (*num_files)++ >= PH_MAX_FILES_PER_PID)
+			return;
+		r = readlink(proc_path, target, sizeof(target) - 1);
+		if (r < 0)
+			return;
+		target[r] = '\0';
+		add_holder(s, S_ISBLK(st.st_mode) ? PH_HOLDER_DEVICE : PH_HOLDER_FILE, pid, name, target);
+	}
+}
+
+static bool pid_name(int pid, char* name, size_t size)
+{
+	char path[64];
+	FILE* f;
+
+	snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return false;
+	if (fgets(name, (int)size, f) != NULL)
+		name[strcspn(name, "\n")] = '\0';
+	fclose(f);
+	return true;
+}
+
+// Kernel threads have no command line, and are kthreadd (pid 2) or children of it.
+// Their current directory is '/', which must not make them holders of the root mount.
+static bool is_kernel_thread(int pid)
+{
+	char path[64], line[512], *p;
+	int c, ppid = -1;
+	FILE* f;
+
+	if (pid == 2)
+		return true;
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return false;
+	c = fgetc(f);
+	fclose(f);
+	if (c == EOF)
+		return true;
+	// The process name, in parentheses, can contain anything, so look for the last one
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return false;
+	if (fgets(line, sizeof(line), f) != NULL && (p = strrchr(line, ')')) != NULL)
+		sscanf(p + 1, " %*c %d", &ppid);
+	fclose(f);
+	return (ppid == 2);
+}
+
+static void scan_pid(ph_scan* s, int pid, bool is_new)
+{
+	char path[PATH_MAX], name[32] = "";
+	struct dirent* de;
+	struct stat st;
+	unsigned long ns;
+	int i, num_files = 0;
+	DIR* dir;
+
+	if (is_kernel_thread(pid) || !pid_name(pid, name, sizeof(name)))
+		return;
+
+	snprintf(path, sizeof(path), "/proc/%d/cwd", pid);
+	check_path(s, pid, name, path, &num_files);
+	snprintf(path, sizeof(path), "/proc/%d/root", pid);
+	if (stat(path, &st) == 0 && (st.st_dev != s->root.st_dev || st.st_ino != s->root.st_ino))
+		check_path(s, pid, name, path, &num_files);
+	snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+	dir = opendir(path);
+	if (dir != NULL) {
+		while ((de = readdir(dir)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "/proc/%d/fd/%s", pid, de->d_name);
+			check_path(s, pid, name, path, &num_files);
+		}
+		closedir(dir);
+	}
+
+	// Mounts that only exist in other mount namespaces (containers, sandboxed services)
+	if (!is_new)
+		return;
+	ns = mount_ns(pid);
+	if (ns == 0 || s->num_mnt_ns >= (int)(sizeof(s->mnt_ns) / sizeof(s->mnt_ns[0])))
+		return;
+	for (i = 0; i < s->num_mnt_ns; i++) {
+		if (s->mnt_ns[i] == ns)
+			return;
+	}
+	s->mnt_ns[s->num_mnt_ns++] = ns;
+	if (ns == mount_ns(getpid()))
+		return;
+	snprintf(path, sizeof(path), "/proc/%d/mountinfo", pid);
+	scan_mountinfo(s, path, pid, name);
+}
+
+// Only look for the device nodes, which is all we need for the processes we have seen already
+static void scan_pid_devices(ph_scan* s, int pid)
+{
+	char path[PATH_MAX], target[PATH_MAX], name[32] = "";
+	struct dirent* de;
+	struct stat st;
+	ssize_t r;
+	DIR* dir;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+	dir = opendir(path);
+	if (dir == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/fd/%s", pid, de->d_name);
+		if (stat(path, &st) != 0 || !S_ISBLK(st.st_mode) || !has_dev(s, st.st_rdev))
+			continue;
+		r = readlink(path, target, sizeof(target) - 1);
+		if (r < 0)
+			continue;
+		target[r] = '\0';
+		if (name[0] == '\0')
+			pid_name(pid, name, sizeof(name));
+		add_holder(s, PH_HOLDER_DEVICE, pid, name, target);
+	}
+	closedir(dir);
+}
+
+typedef struct {
+	DIR* dir;
+} pid_iter;
+
+static bool pid_iter_start(pid_iter* it)
+{
+	it->dir = opendir("/proc");
+	return (it->dir != NULL);
+}
+
+static int pid_iter_next(pid_iter* it)
+{
+	struct dirent* de;
+	char* end;
+	long pid;
+
+	while ((de = readdir(it->dir)) != NULL) {
+		pid = strtol(de->d_name, &end, 10);
+		if (*end == '\0' && pid > 0 && pid <= INT_MAX)
+			return (int)pid;
+	}
+	return 0;
+}
+
+static void pid_iter_end(pid_iter* it)
+{
+	closedir(it->dir);
+}
+
+#elif defined(__APPLE__)
+/*
+ * macOS: the device and its partitions are the /dev/diskN[sM] and /dev/rdiskN[sM] nodes,
+ * and processes are inspected through libproc.
+ */
+static bool is_disk_node(const ph_scan* s, const char* name)
+{
+	size_t len = strlen(s->disk_name);
+
+	if (name[0] == 'r')
+		name++;
+	return (strncmp(name, s->disk_name, len) == 0) && (name[len] == '\0' || name[len] == 's');
+}
+
+static bool setup_devs(ph_scan* s, const char* device_path)
+{
+	char path[PATH_MAX];
+	struct dirent* de;
+	struct stat st;
+	const char* p;
+	DIR* dir;
+
+	p = strrchr(device_path, '/');
+	p = (p != NULL) ? p + 1 : device_path;
+	if (p[0] == 'r')
+		p++;
+	snprintf(s->disk_name, sizeof(s->disk_name), "%s", p);
+	dir = opendir("/dev");
+	if (dir == NULL)
+		return false;
+	while ((de = readdir(dir)) != NULL) {
+		if (!is_disk_node(s, de->d_name))
+			continue;
+		snprintf(path, sizeof(path), "/dev/%s", de->d_name);
+		if (stat(path, &st) == 0 && (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)))
+			add_dev(s, st.st_rdev);
+	}
+	closedir(dir);
+	return (s->num_devs != 0);
+}
+
+static void scan_mounts(ph_scan* s)
+{
+	struct statfs* mnt = NULL;
+	const char* p;
+	int i, n;
+
+	n = getmntinfo(&mnt, MNT_NOWAIT);
+	for (i = 0; i < n; i++) {
+		p = strrchr(mnt[i].f_mntfromname, '/');
+		if (p != NULL && is_disk_node(s, p + 1))
+			add_holder(s, PH_HOLDER_MOUNT, 0, NULL, mnt[i].f_mntonname);
+	}
+}
+
+static void check_vnode(ph_scan* s, int pid, const char* name, const struct vinfo_stat* st, const char* path,
+	int* num_files)
+{
+	bool is_dev = S_ISBLK(st->vst_mode) || S_ISCHR(st->vst_mode);
+
+	if (is_dev && has_dev(s, (dev_t)st->vst_rdev))
+		add_holder(s, PH_HOLDER_DEVICE, pid, name, path);
+	else if (!is_dev && has_dev(s, (dev_t)st->vst_dev) && (*num_files)++ < PH_MAX_FILES_PER_PID)
+		add_holder(s, PH_HOLDER_FILE, pid, name, path);
+}
+
+static void scan_pid(ph_scan* s, int pid, bool is_new)
+{
+	struct proc_vnodepathinfo vpi;
+	struct vnode_fdinfowithpath vi;
+	struct proc_fdinfo* fds = NULL;
+	char name[32] = "";
+	int i, size, num_files = 0;
+
+	(void)is_new;
+	if (proc_name(pid, name, sizeof(name)) <= 0)
+		return;
+	if (proc_pidinfo(pid, PROC_PIDVNODEPATHINFO, 0, &vpi, sizeof(vpi)) == sizeof(vpi)) {
+		check_vnode(s, pid, name, &vpi.pvi_cdir.vip_vi.vi_stat, vpi.pvi_cdir.vip_path, &num_files);
+		if (vpi.pvi_rdir.vip_path[0] != '\0')
+			check_vnode(s, pid, name, &vpi.pvi_rdir.vip_vi.vi_stat, vpi.pvi_rdir.vip_path, &num_files);
+	}
+	size = proc_pidinfo(pid, PROC_PIDLISTFDS, 0, NULL, 0);
+	if (size <= 0)
+		return;
+	// Leave some room for the descriptors that get opened in the meantime
+	size += 16 * PROC_PIDLISTFD_SIZE;
+	fds = malloc(size);
+	if (fds == NULL)
+		return;
+	size = proc_pidinfo(pid, PROC_PIDLISTFDS, 0, fds, size);
+	for (i = 0; i < size / (int)PROC_PIDLISTFD_SIZE; i++) {
+		if (fds[i].proc_fdtype != PROX_FDTYPE_VNODE)
+			continue;
+		if (proc_pidfdinfo(pid, fds[i].proc_fd, PROC_PIDFDVNODEPATHINFO, &vi, PROC_PIDFDVNODEPATHINFO_SIZE) !=
+			PROC_PIDFDVNODEPATHINFO_SIZE)
+			continue;
+		check_vnode(s, pid, name, &vi.pvip.vip_vi.vi_stat, vi.pvip.vip_path, &num_files);
+	}
+	free(fds);
+}
+
+// Only look for the device nodes, which is all we need for the processes we have seen already
+static void scan_pid_devices(ph_scan* s, int pid)
+{
+	struct vnode_fdinfowithpath vi;
+	struct proc_fdinfo* fds = NULL;
+	char name[32] = "";
+	int i, size;
+	bool is_dev;
+
+	size = proc_pidinfo(pid, PROC_PIDLISTFDS, 0, NULL, 0);
+	if (size <= 0)
+		return;
+	size += 16 * PROC_PIDLISTFD_SIZE;
+	fds = malloc(size);
+	if (fds == NULL)
+		return;
+	size = proc_pidinfo(pid, PROC_PIDLISTFDS, 0, fds, size);
+	for (i = 0; i < size / (int)PROC_PIDLISTFD_SIZE; i++) {
+		if (fds[i].proc_fdtype != PROX_FDTYPE_VNODE)
+			continue;
+		if (proc_pidfdinfo(pid, fds[i].proc_fd, PROC_PIDFDVNODEPATHINFO, &vi, PROC_PIDFDVNODEPATHINFO_SIZE) !=
+			PROC_PIDFDVNODEPATHINFO_SIZE)
+			continue;
+		is_dev = S_ISBLK(vi.pvip.vip_vi.vi_stat.vst_mode) || S_ISCHR(vi.pvip.vip_vi.vi_stat.vst_mode);
+		if (!is_dev || !has_dev(s, (dev_t)vi.pvip.vip_vi.vi_stat.vst_rdev))
+			continue;
+		if (name[0] == '\0')
+			proc_name(pid, name, sizeof(name));
+		add_holder(s, PH_HOLDER_DEVICE, pid, name, vi.pvip.vip_path);
+	}
+	free(fds);
+}
+
+typedef struct {
+	pid_t* pids;
+	int num;
+	int pos;
+} pid_iter;
+
+static bool pid_iter_start(pid_iter* it)
+{
+	int n = proc_listallpids(NULL, 0);
+
+	it->pos = 0;
+	it->num = 0;
+	if (n <= 0)
+		return false;
+	// The process list can grow in between the calls
+	n += 64;
+	it->pids = malloc(n * sizeof(pid_t));
+	if (it->pids == NULL)
+		return false;
+	it->num = proc_listallpids(it->pids, n * sizeof(pid_t));
+	if (it->num <= 0) {
+		free(it->pids);
+		return false;
+	}
+	return true;
+}
+
+static int pid_iter_next(pid_iter* it)
+{
+	while (it->pos < it->num) {
+		if (it->pids[it->pos] > 0)
+			return it->pids[it->pos++];
+		it->pos++;
+	}
+	return 0;
+}
+
+static void pid_iter_end(pid_iter* it)
+{
+	free(it->pids);
+}
+
+#else
+#error Device holder detection is not implemented for this platform
+#endif
+
+/*
+ * Sleep long enough for the CPU time used since the last call to stay within budget.
+ * Returns false if the scan should stop.
+ */
+static bool throttle(ph_scan* s, uint64_t* cpu_start)
+{
+	uint64_t cpu = thread_cpu_ns() - *cpu_start, sleep_ns;
+	struct timespec ts;
+	bool stop;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->waiters == 0 && !s->stop) {
+		sleep_ns = cpu * (100 - s->cpu_percent) / s->cpu_percent;
+		if (sleep_ns > PH_MAX_SLEEP_MS * 1000000ULL)
+			sleep_ns = PH_MAX_SLEEP_MS * 1000000ULL;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += (time_t)((ts.tv_nsec + sleep_ns) / 1000000000ULL);
+		ts.tv_nsec = (long)((ts.tv_nsec + sleep_ns) % 1000000000ULL);
+		// A caller of ph_get() or ph_stop() wakes us up
+		pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+	}
+	stop = s->stop;
+	pthread_mutex_unlock(&s->lock);
+	*cpu_start = thread_cpu_ns();
+	return !stop;
+}
+
+static void* scan_thread(void* param)
+{
+	ph_scan* s = (ph_scan*)param;
+	ph_holder prev[PH_MAX_HOLDERS];
+	int i, j, pid, num_prev, batch, self = (int)getpid();
+	uint64_t t, cpu_start;
+	struct timespec ts;
+	pid_iter it;
+	bool running = true, full;
+
+	while (running) {
+		pthread_mutex_lock(&s->lock);
+		s->started++;
+		// A scan that someone is waiting on must also catch the processes that we have
+		// seen already, but that opened the device since
+		full = (s->waiters != 0);
+		pthread_mutex_unlock(&s->lock);
+		t = TRACE_BEGIN();
+		cpu_start = thread_cpu_ns();
+
+		// The processes that were holding the device are inspected again each time, to
+		// find out if they let go of it, and the ones we haven't seen yet for the first time
+		num_prev = s->num_work;
+		memcpy(prev, s->work, num_prev * sizeof(ph_holder));
+		s->num_work = 0;
+		scan_mounts(s);
+		for (i = 0; i < num_prev; i++) {
+			if (prev[i].kind < PH_HOLDER_DEVICE && prev[i].pid == 0)
+				continue;
+			for (j = 0; j < i && prev[j].pid != prev[i].pid; j++);
+			if (j == i)
+				scan_pid(s, prev[i].pid, false);
+		}
+		if (pid_iter_start(&it)) {
+			for (batch = 0; running && (pid = pid_iter_next(&it)) != 0; ) {
+				if (pid == self)
+					continue;
+				if (seen_insert(s, pid))
+					scan_pid(s, pid, true);
+				else if (full)
+					scan_pid_devices(s, pid);
+				else
+					continue;
+				if (++batch % PH_BATCH_SIZE == 0)
+					running = throttle(s, &cpu_start);
+			}
+			pid_iter_end(&it);
+		}
+		TRACE_END("holder scan", t);
+
+		pthread_mutex_lock(&s->lock);
+		if (running) {
+			memcpy(s->result, s->work, s->num_work * sizeof(ph_holder));
+			s->num_result = s->num_work;
+			s->done++;
+			pthread_cond_broadcast(&s->cond);
+			if (s->waiters == 0 && !s->stop) {
+				clock_gettime(CLOCK_REALTIME, &ts);
+				ts.tv_sec += PH_RESCAN_INTERVAL_MS / 1000;
+				ts.tv_nsec += (PH_RESCAN_INTERVAL_MS % 1000) * 1000000L;
+				if (ts.tv_nsec >= 1000000000L) {
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000L;
+				}
+				pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+			}
+		}
+		running = !s->stop;
+		pthread_mutex_unlock(&s->lock);
+	}
+	return NULL;
+}
+
+ph_scan* ph_start(const char* device_path, unsigned cpu_percent)
+{
+	ph_scan* s = calloc(1, sizeof(ph_scan));
+
+	if (s == NULL)
+		return NULL;
+	s->cpu_percent = (cpu_percent == 0 || cpu_percent > 100) ? PH_DEFAULT_CPU_PERCENT : cpu_percent;
+	if (!setup_devs(s, device_path)) {
+		free(s);
+		return NULL;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	if (pthread_create(&s->thread, NULL, scan_thread, s) != 0) {
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+int ph_get(ph_scan* s, ph_holder* holders, int max, uint32_t timeout_ms)
+{
+	struct timespec ts;
+	uint64_t target;
+	int r = 0, n;
+
+	if (s == NULL)
+		return -1;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&s->lock);
+	// A scan that is in progress may have gone past a process before it opened the device,
+	// so we wait for the next one, which, since we are waiting on it, checks all processes
+	target = s->started + 1;
+	s->waiters++;
+	pthread_cond_broadcast(&s->cond);
+	while (s->done < target && r != ETIMEDOUT)
+		r = pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+	s->waiters--;
+	if (s->done < target) {
+		n = -1;
+	} else {
+		n = s->num_result;
+		memcpy(holders, s->result, ((n < max) ? n : max) * sizeof(ph_holder));
+	}
+	pthread_mutex_unlock(&s->lock);
+	return n;
+}
+
+void ph_stop(ph_scan* s)
+{
+	if (s == NULL)
+		return;
+	pthread_mutex_lock(&s->lock);
+	s->stop = true;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread, NULL);
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s->seen);
+	free(s);
+}
@@ -0,0 +1,68 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Device holder detection for the POSIX ports
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#pragma once
+
+/*
+ * Finds out what is holding a device (or any of its partitions): mounts, processes that
+ * have the device node open, or that have files open (or their current directory) on a
+ * mounted partition, and, on Linux, devices stacked on top of it (device-mapper, md).
+ * This is the POSIX counterpart of SearchProcess() on Windows, but rather than going
+ * through every handle of the system each time, a background thread only inspects the
+ * processes it hasn't seen yet, along with the ones that were found holding the device,
+ * and keeps its CPU usage under a budget, so that it can be started as soon as a device
+ * is selected and be done by the time the user has confirmed the operation. The scan
+ * that ph_get() waits for also checks whether any of the processes that were seen
+ * already has since opened the device node (but not files on its partitions).
+ * On Linux, processes are inspected through /proc/<pid>/fd and, for those that live in
+ * another mount namespace, /proc/<pid>/mountinfo. On macOS, through libproc.
+ * Unless running as root, only the processes of the current user can be inspected.
+ */
+
+#define PH_DEFAULT_CPU_PERCENT  10
+#define PH_RESCAN_INTERVAL_MS   1000
+
+typedef enum {
+	PH_HOLDER_MOUNT = 0,            // A partition is mounted on path (pid is set for other mount namespaces)
+	PH_HOLDER_STACK,                // Another device (path) is built on top of the device
+	PH_HOLDER_DEVICE,               // Process pid has the device node path open
+	PH_HOLDER_FILE,                 // Process pid has path, on a mounted partition, open
+} ph_holder_kind;
+
+typedef struct {
+	ph_holder_kind kind;
+	int pid;
+	char name[32];                  // Process name
+	char path[256];
+} ph_holder;
+
+typedef struct ph_scan ph_scan;
+
+// Start looking for the holders of device_path (e.g. "/dev/sdb" or "/dev/disk4") in the
+// background, using at most cpu_percent of a CPU (0 for the default). Returns NULL on error.
+extern ph_scan* ph_start(const char* device_path, unsigned cpu_percent);
+// Wait for a scan that started after this call to complete, lifting the CPU budget while
+// doing so, and copy up to max of the holders that were found. Returns the number of
+// holders, or -1 if no scan could complete within timeout_ms.
+extern int ph_get(ph_scan* s, ph_holder* holders, int max, uint32_t timeout_ms);
+extern void ph_stop(ph_scan* s);
+extern const char* ph_kind_name(ph_holder_kind kind);
@@ -0,0 +1,634 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Image write and verify engine for the POSIX ports
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_OFF_SQ_RING)
+#define PIO_HAS_URING
+#endif
+#endif
+
+#include "posix_io.h"
+#include "trace.h"
+
+#ifndef MIN
+#define MIN(a, b)               (((a) < (b)) ? (a) : (b))
+#endif
+
+#define atomic_load(p)          __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define atomic_store(p, v)      __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define atomic_add(p, v)        __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+
+// How often the thread pool reports progress
+#define PIO_PROGRESS_INTERVAL   50
+
+typedef struct {
+	uint32_t sector_size;
+	uint32_t chunk_size;
+	uint32_t queue_depth;
+	uint32_t num_vbufs;             // Number of verification buffers per chunk
+	uint8_t* buffers;               // queue_depth * (1 + num_vbufs) chunks
+} pio_setup;
+
+/* Record the first error of a job. Returns the error, for convenience. */
+static int pio_fail(pio_job* job, int* err, int e, int target, uint64_t offset)
+{
+	if (*err == 0) {
+		*err = e;
+		job->failed_target = target;
+		job->failed_offset = offset;
+	}
+	return e;
+}
+
+static __inline bool pio_cancelled(const pio_job* job)
+{
+	return (job->cancel != NULL) && (*job->cancel != 0);
+}
+
+static __inline uint8_t* chunk_buf(const pio_setup* s, uint32_t slot)
+{
+	return &s->buffers[(size_t)slot * s->chunk_size];
+}
+
+static __inline uint8_t* verify_buf(const pio_setup* s, uint32_t slot, uint32_t target)
+{
+	return &s->buffers[((size_t)s->queue_depth + (size_t)slot * s->num_vbufs + target) * s->chunk_size];
+}
+
+static __inline uint32_t round_to_sector(const pio_setup* s, uint32_t len)
+{
+	return ((len + s->sector_size - 1) / s->sector_size) * s->sector_size;
+}
+
+/*
+ * Thread pool backend: each worker claims the next chunk, reads it, writes it to each
+ * target and reads it back, while the calling thread reports the progress.
+ */
+typedef struct {
+	pio_job* job;
+	const pio_setup* setup;
+	uint64_t next;
+	uint64_t done;
+	uint32_t running;
+	int err;
+	pthread_mutex_t lock;
+} pio_pool;
+
+typedef struct {
+	pio_pool* pool;
+	uint32_t id;
+} pio_worker_arg;
+
+static int pread_full(int fd, uint8_t* buf, uint32_t len, uint64_t offset, uint32_t* got)
+{
+	ssize_t r;
+
+	*got = 0;
+	while (*got < len) {
+		r = pread(fd, &buf[*got], len - *got, (off_t)(offset + *got));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return errno;
+		if (r == 0)
+			break;
+		*got += (uint32_t)r;
+	}
+	return 0;
+}
+
+static int pwrite_full(int fd, const uint8_t* buf, uint32_t len, uint64_t offset)
+{
+	uint32_t done = 0;
+	ssize_t r;
+
+	while (done < len) {
+		r = pwrite(fd, &buf[done], len - done, (off_t)(offset + done));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return errno;
+		if (r == 0)
+			return EIO;
+		done += (uint32_t)r;
+	}
+	return 0;
+}
+
+static void pool_fail(pio_pool* pool, int e, int target, uint64_t offset)
+{
+	pthread_mutex_lock(&pool->lock);
+	pio_fail(pool->job, &pool->err, e, target, offset);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void* pio_worker(void* param)
+{
+	pio_worker_arg* arg = (pio_worker_arg*)param;
+	pio_pool* pool = arg->pool;
+	pio_job* job = pool->job;
+	const pio_setup* s = pool->setup;
+	uint8_t *buf = chunk_buf(s, arg->id), *vbuf;
+	uint64_t offset;
+	uint32_t len, io_len, got, t, i;
+	int e;
+
+	while (atomic_load(&pool->err) == 0) {
+		if (pio_cancelled(job)) {
+			pool_fail(pool, ECANCELED, -1, 0);
+			break;
+		}
+		offset = atomic_add(&pool->next, s->chunk_size);
+		if (offset >= job->size)
+			break;
+		len = (uint32_t)MIN(s->chunk_size, job->size - offset);
+		uint64_t tr = TRACE_BEGIN();
+		e = pread_full(job->src_fd, buf, len, offset, &got);
+		TRACE_END_BYTES("image read", tr, got);
+		if (e == 0 && got != len)
+			e = EIO;
+		if (e != 0) {
+			pool_fail(pool, e, -1, offset);
+			break;
+		}
+		io_len = round_to_sector(s, len);
+		memset(&buf[len], 0, io_len - len);
+		for (t = 0; t < job->num_targets && e == 0; t++) {
+			for (i = 0; ; i++) {
+				tr = TRACE_BEGIN();
+				e = pwrite_full(job->dst_fd[t], buf, io_len, offset);
+				TRACE_END_BYTES("device write", tr, (e == 0) ? io_len : 0);
+				if (e == 0 || i >= job->retries || atomic_load(&pool->err) != 0)
+					break;
+				usleep(job->retry_delay_ms * 1000);
+			}
+			if (e != 0) {
+				pool_fail(pool, e, (int)t, offset);
+				break;
+			}
+			if (!job->verify)
+				continue;
+			vbuf = verify_buf(s, arg->id, 0);
+			tr = TRACE_BEGIN();
+			e = pread_full(job->dst_fd[t], vbuf, io_len, offset, &got);
+			TRACE_END_BYTES("device verify", tr, got);
+			if (e == 0 && (got != io_len || memcmp(vbuf, buf, io_len) != 0))
+				e = EBADMSG;
+			if (e != 0)
+				pool_fail(pool, e, (int)t, offset);
+		}
+		if (e != 0)
+			break;
+		atomic_add(&pool->done, len);
+	}
+	atomic_add(&pool->running, (uint32_t)-1);
+	return NULL;
+}
+
+static int pio_run_threads(pio_job* job, const pio_setup* s)
+{
+	pthread_t thread[PIO_DEFAULT_QUEUE_DEPTH * 8];
+	pio_worker_arg arg[PIO_DEFAULT_QUEUE_DEPTH * 8];
+	pio_pool pool = { 0 };
+	uint64_t done, reported = UINT64_MAX;
+	uint32_t i, n = 0;
+
+	pool.job = job;
+	pool.setup = s;
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.running = s->queue_depth;
+	for (i = 0; i < s->queue_depth; i++) {
+		arg[i].pool = &pool;
+		arg[i].id = i;
+		if (pthread_create(&thread[n], NULL, pio_worker, &arg[i]) == 0)
+			n++;
+		else
+			atomic_add(&pool.running, (uint32_t)-1);
+	}
+	if (n == 0)
+		pio_fail(job, &pool.err, EAGAIN, -1, 0);
+	// Only whoever called us gets to report progress
+	while (atomic_load(&pool.running) != 0) {
+		done = atomic_load(&pool.done);
+		if (done != reported && job->progress != NULL)
+			job->progress(done, job->size);
+		reported = done;
+		usleep(PIO_PROGRESS_INTERVAL * 1000);
+	}
+	for (i = 0; i < n; i++)
+		pthread_join(thread[i], NULL);
+	if (pool.err == 0 && job->progress != NULL)
+		job->progress(job->size, job->size);
+	pthread_mutex_destroy(&pool.lock);
+	return pool.err;
+}
+
+#if defined(PIO_HAS_URING)
+/*
+ * io_uring backend, using the raw syscalls so that we don't depend on liburing.
+ * A chunk goes through a read from the source, then one write per target and, if
+ * requested, one verification read per target. All the operations that become ready
+ * as completions are reaped are queued, and the whole batch is submitted with the
+ * same io_uring_enter() call that waits for the next completions.
+ */
+typedef struct {
+	int fd;
+	uint32_t sq_entries;
+	uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+	uint32_t *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	uint32_t sq_pending;
+} pio_ring;
+
+enum { SLOT_FREE = 0, SLOT_READ, SLOT_WRITE, SLOT_VERIFY };
+enum { OP_READ = 0, OP_WRITE, OP_VERIFY };
+
+typedef struct {
+	uint32_t state;
+	uint32_t pending;               // Operations in flight for this chunk
+	uint64_t offset;
+	uint32_t len;                   // Bytes of data
+	uint32_t io_len;                // Bytes written, once padded to the sector size
+	uint32_t done[PIO_MAX_TARGETS + 1];     // Per operation progress, for short transfers
+	uint32_t tries[PIO_MAX_TARGETS];
+} pio_slot;
+
+// Operations are identified by slot, target (or the source for reads) and type
+#define OP_DATA(slot, target, op)       (((uint64_t)(slot) << 32) | ((uint64_t)(target) << 16) | (op))
+#define OP_SLOT(data)                   ((uint32_t)((data) >> 32))
+#define OP_TARGET(data)                 ((uint32_t)(((data) >> 16) & 0xffff))
+#define OP_TYPE(data)                   ((uint32_t)((data) & 0xffff))
+
+static int ring_setup(pio_ring* r, uint32_t entries)
+{
+	struct io_uring_params p = { 0 };
+	uint8_t *sq, *cq;
+
+	memset(r, 0, sizeof(*r));
+	r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return errno;
+	r->sq_entries = p.sq_entries;
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = 0;
+	}
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto fail;
+	if (r->cq_ring_size == 0) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			r->cq_ring = NULL;
+			goto fail;
+		}
+	}
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+	sq = (uint8_t*)r->sq_ring;
+	cq = (uint8_t*)r->cq_ring;
+	r->sq_head = (uint32_t*)&sq[p.sq_off.head];
+	r->sq_tail = (uint32_t*)&sq[p.sq_off.tail];
+	r->sq_mask = (uint32_t*)&sq[p.sq_off.ring_mask];
+	r->sq_array = (uint32_t*)&sq[p.sq_off.array];
+	r->cq_head = (uint32_t*)&cq[p.cq_off.head];
+	r->cq_tail = (uint32_t*)&cq[p.cq_off.tail];
+	r->cq_mask = (uint32_t*)&cq[p.cq_off.ring_mask];
+	r->cqes = (struct io_uring_cqe*)&cq[p.cq_off.cqes];
+	return 0;
+
+fail:
+	if (r->sq_ring == MAP_FAILED)
+		r->sq_ring = NULL;
+	return errno;
+}
+
+static void ring_close(pio_ring* r)
+{
+	if (r->sqes != NULL)
+		munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+	if (r->cq_ring != NULL && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring != NULL)
+		munmap(r->sq_ring, r->sq_ring_size);
+	if (r->fd >= 0)
+		close(r->fd);
+	r->fd = -1;
+}
+
+/* Queue an operation. Nothing reaches the kernel until ring_submit_and_wait(). */
+static void ring_queue(pio_ring* r, uint8_t opcode, uint32_t file_index, uint8_t* buf,
+	uint32_t len, uint64_t offset, uint32_t buf_index, uint64_t data)
+{
+	uint32_t tail = *r->sq_tail, index = tail & *r->sq_mask;
+	struct io_uring_sqe* sqe = &r->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = (int32_t)file_index;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->buf_index = (uint16_t)buf_index;
+	sqe->user_data = data;
+	r->sq_array[index] = index;
+	atomic_store(r->sq_tail, tail + 1);
+	r->sq_pending++;
+}
+
+static int ring_submit_and_wait(pio_ring* r, uint32_t wait_nr)
+{
+	int ret;
+
+	do {
+		ret = (int)syscall(__NR_io_uring_enter, r->fd, r->sq_pending, wait_nr,
+			(wait_nr != 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return errno;
+	r->sq_pending -= MIN((uint32_t)ret, r->sq_pending);
+	return 0;
+}
+
+typedef struct {
+	pio_job* job;
+	const pio_setup* s;
+	pio_ring ring;
+	pio_slot* slot;
+	uint32_t inflight;
+	int err;
+} pio_uring;
+
+static void uring_queue_io(pio_uring* u, uint32_t i, uint32_t op, uint32_t t)
+{
+	pio_slot* sl = &u->slot[i];
+	const pio_setup* s = u->s;
+	uint32_t k = (op == OP_READ) ? PIO_MAX_TARGETS : t, want = (op == OP_READ) ? sl->len : sl->io_len;
+	uint8_t* buf;
+	uint32_t buf_index;
+
+	if (op == OP_VERIFY) {
+		buf = verify_buf(s, i, t);
+		buf_index = s->queue_depth + i * s->num_vbufs + t;
+	} else {
+		buf = chunk_buf(s, i);
+		buf_index = i;
+	}
+	ring_queue(&u->ring, (op == OP_WRITE) ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED,
+		(op == OP_READ) ? 0 : t + 1, &buf[sl->done[k]], want - sl->done[k],
+		sl->offset + sl->done[k], buf_index, OP_DATA(i, t, op));
+	sl->pending++;
+	u->inflight++;
+}
+
+static void uring_start_targets(pio_uring* u, uint32_t i, uint32_t op, uint32_t state)
+{
+	pio_slot* sl = &u->slot[i];
+	uint32_t t;
+
+	sl->state = state;
+	for (t = 0; t < u->job->num_targets; t++) {
+		sl->done[t] = 0;
+		uring_queue_io(u, i, op, t);
+	}
+}
+
+/* Process a completion. Returns the number of bytes of image data that are now complete. */
+static uint32_t uring_complete(pio_uring* u, uint64_t data, int32_t res)
+{
+	pio_job* job = u->job;
+	uint32_t i = OP_SLOT(data), t = OP_TARGET(data), op = OP_TYPE(data), len;
+	pio_slot* sl = &u->slot[i];
+	uint32_t k = (op == OP_READ) ? PIO_MAX_TARGETS : t, want = (op == OP_READ) ? sl->len : sl->io_len;
+
+	sl->pending--;
+	u->inflight--;
+	// Once a job has failed, we only wait for what's in flight to drain
+	if (u->err != 0)
+		return 0;
+	if (res == 0)
+		res = -EIO;
+	if (res < 0) {
+		if (op == OP_WRITE && sl->tries[t] < job->retries) {
+			sl->tries[t]++;
+			usleep(job->retry_delay_ms * 1000);
+			uring_queue_io(u, i, op, t);
+		} else {
+			pio_fail(job, &u->err, -res, (op == OP_READ) ? -1 : (int)t, sl->offset);
+		}
+		return 0;
+	}
+	sl->done[k] += (uint32_t)res;
+	if (sl->done[k] < want) {
+		uring_queue_io(u, i, op, t);
+		return 0;
+	}
+	if (op == OP_VERIFY && memcmp(verify_buf(u->s, i, t), chunk_buf(u->s, i), sl->io_len) != 0) {
+		pio_fail(job, &u->err, EBADMSG, (int)t, sl->offset);
+		return 0;
+	}
+	if (sl->pending != 0)
+		return 0;
+	switch (op) {
+	case OP_READ:
+		memset(&chunk_buf(u->s, i)[sl->len], 0, sl->io_len - sl->len);
+		uring_start_targets(u, i, OP_WRITE, SLOT_WRITE);
+		return 0;
+	case OP_WRITE:
+		if (job->verify) {
+			uring_start_targets(u, i, OP_VERIFY, SLOT_VERIFY);
+			return 0;
+		}
+		// Fall through
+	default:
+		len = sl->len;
+		sl->state = SLOT_FREE;
+		return len;
+	}
+}
+
+static int pio_run_uring(pio_job* job, const pio_setup* s)
+{
+	pio_uring u = { 0 };
+	struct iovec* iov = NULL;
+	int files[PIO_MAX_TARGETS + 1];
+	uint32_t i, n, head, tail, num_bufs = s->queue_depth * (1 + s->num_vbufs);
+	uint64_t next = 0, done = 0, t0 = 0;
+	int r;
+
+	u.job = job;
+	u.s = s;
+	u.ring.fd = -1;
+	u.slot = calloc(s->queue_depth, sizeof(pio_slot));
+	iov = calloc(num_bufs, sizeof(struct iovec));
+	if (u.slot == NULL || iov == NULL) {
+		r = ENOMEM;
+		goto out;
+	}
+	// Every chunk may have one operation in flight per target
+	r = ring_setup(&u.ring, s->queue_depth * job->num_targets);
+	if (r != 0)
+		goto out;
+	for (i = 0; i < num_bufs; i++) {
+		iov[i].iov_base = &s->buffers[(size_t)i * s->chunk_size];
+		iov[i].iov_len = s->chunk_size;
+	}
+	files[0] = job->src_fd;
+	for (i = 0; i < job->num_targets; i++)
+		files[i + 1] = job->dst_fd[i];
+	if (syscall(__NR_io_uring_register, u.ring.fd, IORING_REGISTER_BUFFERS, iov, num_bufs) < 0 ||
+		syscall(__NR_io_uring_register, u.ring.fd, IORING_REGISTER_FILES, files, job->num_targets + 1) < 0) {
+		r = errno;
+		goto out;
+	}
+	job->backend = PIO_BACKEND_URING;
+
+	while ((done < job->size && u.err == 0) || u.inflight != 0) {
+		if (u.err == 0 && pio_cancelled(job))
+			pio_fail(job, &u.err, ECANCELED, -1, done);
+		// Start reading into all the free slots
+		for (i = 0; i < s->queue_depth && next < job->size && u.err == 0; i++) {
+			if (u.slot[i].state != SLOT_FREE)
+				continue;
+			memset(&u.slot[i], 0, sizeof(pio_slot));
+			u.slot[i].state = SLOT_READ;
+			u.slot[i].offset = next;
+			u.slot[i].len = (uint32_t)MIN(s->chunk_size, job->size - next);
+			u.slot[i].io_len = round_to_sector(s, u.slot[i].len);
+			next += u.slot[i].len;
+			uring_queue_io(&u, i, OP_READ, 0);
+		}
+		if (u.inflight == 0)
+			break;
+		t0 = TRACE_BEGIN();
+		r = ring_submit_and_wait(&u.ring, 1);
+		TRACE_END("uring wait", t0);
+		if (r != 0) {
+			pio_fail(job, &u.err, r, -1, done);
+			// We can't know what made it to the kernel, so we can't wait for it either
+			break;
+		}
+		// Reap everything that has completed
+		n = 0;
+		head = *u.ring.cq_head;
+		tail = atomic_load(u.ring.cq_tail);
+		for (; head != tail; head++) {
+			struct io_uring_cqe* cqe = &u.ring.cqes[head & *u.ring.cq_mask];
+			n += uring_complete(&u, cqe->user_data, cqe->res);
+		}
+		atomic_store(u.ring.cq_head, head);
+		if (n != 0) {
+			done += n;
+			if (job->progress != NULL)
+				job->progress(done, job->size);
+		}
+	}
+	r = u.err;
+
+out:
+	// Closing the ring also drops the registered buffers and descriptors
+	if (u.ring.fd >= 0 || u.ring.sq_ring != NULL)
+		ring_close(&u.ring);
+	free(iov);
+	free(u.slot);
+	return r;
+}
+#endif
+
+const char* pio_backend_name(pio_backend backend)
+{
+	switch (backend) {
+	case PIO_BACKEND_URING:
+		return "io_uring";
+	case PIO_BACKEND_THREADS:
+		return "thread pool";
+	default:
+		return "auto";
+	}
+}
+
+int pio_run(pio_job* job)
+{
+	pio_setup s = { 0 };
+	pio_backend requested = job->backend;
+	int r;
+
+	job->failed_target = -1;
+	job->failed_offset = 0;
+	if (job->num_targets == 0 || job->num_targets > PIO_MAX_TARGETS || job->size == 0)
+		return EINVAL;
+	s.sector_size = (job->sector_size == 0) ? 512 : job->sector_size;
+	s.chunk_size = (job->chunk_size == 0) ? PIO_DEFAULT_CHUNK_SIZE : job->chunk_size;
+	s.queue_depth = (job->queue_depth == 0) ? PIO_DEFAULT_QUEUE_DEPTH : job->queue_depth;
+	if (s.queue_depth > PIO_DEFAULT_QUEUE_DEPTH * 8)
+		s.queue_depth = PIO_DEFAULT_QUEUE_DEPTH * 8;
+	if (s.chunk_size % s.sector_size != 0 || s.chunk_size % PIO_BUFFER_ALIGNMENT != 0)
+		return EINVAL;
+	s.num_vbufs = job->verify ? job->num_targets : 0;
+	if (posix_memalign((void**)&s.buffers, PIO_BUFFER_ALIGNMENT,
+		(size_t)s.queue_depth * (1 + s.num_vbufs) * s.chunk_size) != 0)
+		return ENOMEM;
+
+	r = ENOSYS;
+#if defined(PIO_HAS_URING)
+	if (requested != PIO_BACKEND_THREADS) {
+		job->backend = PIO_BACKEND_AUTO;
+		r = pio_run_uring(job, &s);
+		// Only fall back if we failed before any I/O was issued
+		if (job->backend == PIO_BACKEND_URING || requested == PIO_BACKEND_URING)
+			goto out;
+	}
+#else
+	if (requested == PIO_BACKEND_URING)
+		goto out;
+#endif
+	job->backend = PIO_BACKEND_THREADS;
+	r = pio_run_threads(job, &s);
+
+out:
+	free(s.buffers);
+	return r;
+}
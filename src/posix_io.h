@@ -0,0 +1,74 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Image write and verify engine for the POSIX ports
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#pragma once
+
+/*
+ * A job copies an image, chunk by chunk, to one or more targets, and can read each
+ * chunk back from each target to check it. The source is read once, whatever the
+ * number of targets.
+ * On Linux, the I/O goes through io_uring: the chunk buffers and the descriptors are
+ * registered with the kernel once and for all, and every read, write or verification
+ * read that is ready is submitted, and every completion reaped, with a single syscall.
+ * Elsewhere, or when io_uring can't be used (old kernel, disabled by policy, locked
+ * memory limit too low to register the buffers), a pool of threads issues positioned
+ * reads and writes instead.
+ * For verification to mean anything, the targets should be opened with O_DIRECT (or
+ * be raw devices on macOS), so that the data is read back from the media.
+ */
+
+#define PIO_MAX_TARGETS         16
+#define PIO_DEFAULT_CHUNK_SIZE  (1024 * 1024)
+#define PIO_DEFAULT_QUEUE_DEPTH 8
+// Buffers are aligned to this, which is enough for O_DIRECT on any device
+#define PIO_BUFFER_ALIGNMENT    4096
+
+typedef enum {
+	PIO_BACKEND_AUTO = 0,
+	PIO_BACKEND_URING,
+	PIO_BACKEND_THREADS,
+} pio_backend;
+
+typedef struct {
+	int src_fd;
+	uint64_t size;                  // Number of bytes to copy from src_fd
+	int dst_fd[PIO_MAX_TARGETS];
+	uint32_t num_targets;
+	uint32_t sector_size;           // The last chunk is zero padded to this. 0 for 512.
+	uint32_t chunk_size;            // Must be a multiple of sector_size. 0 for the default.
+	uint32_t queue_depth;           // Number of chunks in flight. 0 for the default.
+	uint32_t retries;               // Number of times a failed write is retried
+	uint32_t retry_delay_ms;
+	bool verify;
+	pio_backend backend;            // Set to the backend that was used on return
+	volatile int* cancel;           // Abort with ECANCELED when non zero. May be NULL.
+	// Called from the calling thread with the number of bytes that have been written
+	// (and verified, if requested) to all the targets. May be NULL.
+	void (*progress)(uint64_t done, uint64_t total);
+	// Set on failure: the target that failed (-1 for the source), and where
+	int failed_target;
+	uint64_t failed_offset;
+} pio_job;
+
+// Returns 0 on success, or an errno value. EBADMSG means that verification failed.
+extern int pio_run(pio_job* job);
+extern const char* pio_backend_name(pio_backend backend);
@@ -53,6 +53,9 @@
 #include "cregex.h"
 #include "settings.h"
 #include "darkmode.h"
+#include "trace.h"
+#include "devcache.h"
+#include "isocache.h"
 #include "bled/bled.h"
 #include "cdio/logging.h"
 #include "../res/grub/grub_version.h"
@@ -132,11 +135,11 @@ BOOL usb_debug, use_fake_units, preserve_timestamps = FALSE, fast_zeroing = FALS
 BOOL zero_drive = FALSE, list_non_usb_removable_drives = FALSE, enable_file_indexing, large_drive = FALSE;
 BOOL write_as_image = FALSE, write_as_esp = FALSE, use_vds = FALSE, ignore_boot_marker = FALSE, save_image = FALSE;
 BOOL appstore_version = FALSE, is_vds_available = TRUE, persistent_log = FALSE, has_ffu_support = FALSE;
-BOOL expert_mode = FALSE, use_rufus_mbr = TRUE;
+BOOL expert_mode = FALSE, use_rufus_mbr = TRUE, mass_flash = FALSE;
 float fScale = 1.0f;
 int dialog_showing = 0, selection_default = BT_IMAGE, persistence_unit_selection = -1, imop_win_sel = 0;
 int default_fs, fs_type, boot_type, partition_type, target_type;
-int force_update = 0, default_thread_priority = THREAD_PRIORITY_ABOVE_NORMAL;
+int force_update = 0, default_thread_priority = THREAD_PRIORITY_ABOVE_NORMAL, device_cache_mode = DEVCACHE_OFF;
 char szFolderPath[MAX_PATH], app_dir[MAX_PATH], system_dir[MAX_PATH], temp_dir[MAX_PATH], sysnative_dir[MAX_PATH];
 char app_data_dir[MAX_PATH], user_dir[MAX_PATH], cur_dir[MAX_PATH];
 char embedded_sl_version_str[2][12] = { "?.??", "?.??" };
@@ -1009,6 +1012,7 @@ BOOL CALLBACK LogCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 			SetWindowTextA(hLog, "");
 			return TRUE;
 		case IDC_LOG_SAVE:
+			FlushLog();
 			log_size = GetWindowTextLengthU(hLog);
 			if (log_size <= 0)
 				break;
@@ -1041,6 +1045,15 @@ BOOL CALLBACK LogCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 		ResizeButtonHeight(hDlg, IDC_LOG_SAVE);
 		ResizeButtonHeight(hDlg, IDC_LOG_CLEAR);
 		return TRUE;
+	case UM_LOG_APPEND:
+		// Batch of messages from the log thread, which we must free
+		if (lParam == 0)
+			return TRUE;
+		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
+		Edit_ReplaceSel(hLog, (wchar_t*)lParam);
+		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
+		free((void*)lParam);
+		return TRUE;
 	}
 	return FALSE;
 }
@@ -2315,6 +2328,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			}
 
 			// Save or append the current log to %LocalAppData%\Rufus\rufus.log
+			FlushLog();
 			log_size = GetWindowTextLengthU(hLog);
 			if ((!user_deleted_rufus_dir) && (log_size > 0) && ((log_buffer = (char*)malloc(log_size + 2)) != NULL)) {
 				log_size = GetDlgItemTextU(hLogDialog, IDC_LOG_EDIT, log_buffer, log_size);
@@ -3201,22 +3215,77 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 	return (INT_PTR)FALSE;
 }
 
+/*
+ * Unattended extraction of the ISO selected with -i to an already formatted volume,
+ * in a single walk of the image. Returns the process exit code.
+ */
+static int ExtractImageToDir(const char* dir)
+{
+	char dest_dir[MAX_PATH], root[MAX_PATH], fs_name[32];
+	int i;
+
+	if (image_path == NULL) {
+		printf("An image must be selected with -i to use -e\n");
+		return 1;
+	}
+	if ((GetFullPathNameU(dir, sizeof(dest_dir), dest_dir, NULL) == 0) || (dest_dir[1] != ':')) {
+		printf("Invalid extraction directory '%s'\n", dir);
+		return 1;
+	}
+	// The target file system and label drive the WIM split and the config file patches. Use the
+	// volume the directory is actually on, which, with mount points, need not be the drive's.
+	if (!GetVolumePathNameU(dest_dir, root, sizeof(root))) {
+		uprintf("Could not get the volume of '%s': %s", dest_dir, WindowsErrorString());
+		return 1;
+	}
+	if (!GetVolumeInformationU(root, img_report.usb_label, ARRAYSIZE(img_report.usb_label),
+		NULL, NULL, NULL, fs_name, ARRAYSIZE(fs_name))) {
+		uprintf("Could not get volume information for '%s': %s", root, WindowsErrorString());
+		return 1;
+	}
+	fs_type = FS_UNKNOWN;
+	for (i = 0; i < FS_MAX; i++) {
+		if (strcmp(fs_name, FileSystemLabel[i]) == 0)
+			fs_type = i;
+	}
+	uprintf("Extracting '%s' to '%s' (%s)", image_path, dest_dir, fs_name);
+	if (IS_FAT(fs_type))
+		uprintf("A WIM larger than 4 GB will be split, as the target is %s", fs_name);
+	if (!ScanAndExtractISO(image_path, dest_dir, IS_FAT(fs_type))) {
+		uprintf("Extraction failed: %s", StrError(ErrorStatus, FALSE));
+		return 1;
+	}
+	return 0;
+}
+
 static void PrintUsage(char* appname)
 {
 	char fname[_MAX_FNAME];
 
 	_splitpath(appname, NULL, NULL, fname, NULL);
-	printf("\nUsage: %s [-x] [-g] [-h] [-f FILESYSTEM] [-i PATH] [-l LOCALE] [-w TIMEOUT]\n", fname);
+	printf("\nUsage: %s [-x] [-g] [-h] [-b DIR] [-c MODE] [-e DIR] [-f FILESYSTEM] [-i PATH] [-k SIZE] [-l LOCALE] [-t PATH] [-w TIMEOUT]\n", fname);
 	printf("  -x, --extra-devs\n");
 	printf("     List extra devices, such as USB HDDs\n");
 	printf("  -g, --gui\n");
 	printf("     Start in GUI mode (disable the 'rufus.com' commandline hogger)\n");
 	printf("  -i PATH, --iso=PATH\n");
 	printf("     Select the ISO image pointed by PATH to be used on startup\n");
+	printf("  -k SIZE[,RAM], --iso-cache=SIZE[,RAM]\n");
+	printf("     Cache the content extracted from ISO images, using up to SIZE MB of disk and RAM MB\n");
+	printf("     of memory (default %d), so that extracting the same images again is faster\n", ISO_CACHE_DEFAULT_RAM_MB);
 	printf("  -l LOCALE, --locale=LOCALE\n");
 	printf("     Select the locale to be used on startup\n");
 	printf("  -f FILESYSTEM, --filesystem=FILESYSTEM\n");
 	printf("     Preselect the file system to be preferred when formatting\n");
+	printf("  -b DIR, --bench=DIR\n");
+	printf("     Run the codec and hash benchmarks, compare them against DIR\\baseline.txt and exit\n");
+	printf("  -c MODE, --device-cache=MODE\n");
+	printf("     Enable the write cache of the target device while writing, then restore it. MODE is\n");
+	printf("     'auto' (use the SCSI Caching mode page), 'on' (also try ATA commands) or 'off' (default)\n");
+	printf("  -e DIR, --extract=DIR\n");
+	printf("     Extract the ISO image selected with -i to DIR, on an already formatted volume, and exit\n");
+	printf("  -t PATH, --trace=PATH\n");
+	printf("     Record a timeline of the I/O operations, in Chrome Trace Event format, to PATH\n");
 	printf("  -w TIMEOUT, --wait=TIMEOUT\n");
 	printf("     Wait TIMEOUT tens of seconds for the global application mutex to be released.\n");
 	printf("     Used when launching a newer version of " APPLICATION_NAME " from a running application.\n");
@@ -3296,7 +3365,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 {
 	const char* rufus_loc = "rufus.loc";
 	int i, opt, option_index = 0, argc = 0, si = 0, lcid = GetUserDefaultUILanguage();
-	int wait_for_mutex = 0, forced_windows_version = 0;
+	int wait_for_mutex = 0, forced_windows_version = 0, exit_code = 0;
 	uint32_t wue_options;
 	FILE* fd;
 	BOOL attached_console = FALSE, external_loc_file = FALSE, lgp_set = FALSE, automount = TRUE;
@@ -3305,7 +3374,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 	BYTE *loc_data;
 	DWORD loc_size, u = 0, size = sizeof(u);
 	char tmp_path[MAX_PATH] = "", loc_file[MAX_PATH] = "", ini_path[MAX_PATH] = "", ini_flags[] = "rb";
-	char *tmp, *locale_name = NULL, **argv = NULL;
+	char *tmp, *locale_name = NULL, *trace_path = NULL, *bench_dir = NULL, *extract_dir = NULL, **argv = NULL;
 	wchar_t **wenv, **wargv;
 	PF_TYPE_DECL(CDECL, int, __wgetmainargs, (int*, wchar_t***, wchar_t***, int, int*));
 	HANDLE mutex = NULL, hogmutex = NULL, hFile = NULL;
@@ -3313,13 +3382,18 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 	HDC hDC;
 	MSG msg;
 	struct option long_options[] = {
-		{"extra-devs", no_argument,       NULL, 'x'},
-		{"gui",        no_argument,       NULL, 'g'},
-		{"help",       no_argument,       NULL, 'h'},
-		{"iso",        required_argument, NULL, 'i'},
-		{"locale",     required_argument, NULL, 'l'},
-		{"filesystem", required_argument, NULL, 'f'},
-		{"wait",       required_argument, NULL, 'w'},
+		{"bench",        required_argument, NULL, 'b'},
+		{"device-cache", required_argument, NULL, 'c'},
+		{"extract",      required_argument, NULL, 'e'},
+		{"extra-devs",   no_argument,       NULL, 'x'},
+		{"gui",          no_argument,       NULL, 'g'},
+		{"help",         no_argument,       NULL, 'h'},
+		{"iso",          required_argument, NULL, 'i'},
+		{"iso-cache",    required_argument, NULL, 'k'},
+		{"locale",       required_argument, NULL, 'l'},
+		{"filesystem",   required_argument, NULL, 'f'},
+		{"trace",        required_argument, NULL, 't'},
+		{"wait",         required_argument, NULL, 'w'},
 		{0, 0, NULL, 0}
 	};
 
@@ -3350,6 +3424,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 	// current directories.
 	SetDefaultDllDirectories(LOAD_LIBRARY_SEARCH_SYSTEM32);
 
+	StartLogThread();
 	uprintf("*** " APPLICATION_NAME " init ***\n");
 	its_a_me_mario = GetUserNameA((char*)(uintptr_t)&u, &size) && (u == 7104878);
 	// coverity[pointless_string_compare]
@@ -3508,7 +3583,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 				}
 			}
 
-			while ((opt = getopt_long(argc, argv, "ghxf:i:l:w:z:", long_options, &option_index)) != EOF) {
+			while ((opt = getopt_long(argc, argv, "ghxb:c:e:f:i:k:l:t:w:z:", long_options, &option_index)) != EOF) {
 				switch (opt) {
 				case 'x':
 					enable_HDDs = TRUE;
@@ -3555,6 +3630,27 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 						preselected_fs = FS_UNKNOWN;
 					selected_fs = preselected_fs;
 					break;
+				case 'c':
+					if (!devcache_parse_mode(optarg, &device_cache_mode))
+						printf("Invalid device cache mode '%s' (must be 'auto', 'on' or 'off')\n", optarg);
+					break;
+				case 'k':
+					if (!IsoCacheParseSize(optarg))
+						printf("Invalid ISO cache size '%s' (must be SIZE[,RAM], in MB)\n", optarg);
+					break;
+				case 'e':
+					safe_free(extract_dir);
+					extract_dir = safe_strdup(optarg);
+					break;
+				case 'b':
+					safe_free(bench_dir);
+					bench_dir = safe_strdup(optarg);
+					break;
+				case 't':
+					safe_free(trace_path);
+					trace_path = safe_strdup(optarg);
+					trace_start();
+					break;
 				case 'w':
 					wait_for_mutex = atoi(optarg);
 					break;
@@ -3637,6 +3733,7 @@ skip_args_processing:
 	expert_mode = ReadSettingBool(SETTING_EXPERT_MODE);
 	ignore_boot_marker = ReadSettingBool(SETTING_IGNORE_BOOT_MARKER);
 	persistent_log = ReadSettingBool(SETTING_PERSISTENT_LOG);
+	mass_flash = ReadSettingBool(SETTING_MASS_FLASH);
 	save_image_type = ReadSettingStr(SETTING_PREFERRED_SAVE_IMAGE_TYPE);
 	// This restores the Windows User Experience/unattend.xml mask from the saved user
 	// settings, and is designed to work even if we add new options later.
@@ -3783,6 +3880,12 @@ skip_args_processing:
 	static_sprintf(tmp_path, "%s\\dism\\FfuProvider.dll", sysnative_dir);
 	has_ffu_support = (_accessU(tmp_path, 0) == 0);
 
+	// Run the benchmarks and exit, with the number of failures and regressions as exit code
+	if (bench_dir != NULL) {
+		exit_code = RunBenchmarks(bench_dir);
+		goto out;
+	}
+
 relaunch:
 	ubprintf("Localization set to '%s'", selected_locale->txt[0]);
 	right_to_left_mode = ((selected_locale->ctrl_id) & LOC_RIGHT_TO_LEFT);
@@ -3795,6 +3898,12 @@ relaunch:
 	if (get_loc_data_file(loc_file, selected_locale))
 		WriteSettingStr(SETTING_LOCALE, selected_locale->txt[0]);
 
+	// Extract the image and exit, now that the messages it may report are available
+	if (extract_dir != NULL) {
+		exit_code = ExtractImageToDir(extract_dir);
+		goto out;
+	}
+
 	if (!vc) {
 		if (MessageBoxExU(NULL, lmprintf(MSG_296), lmprintf(MSG_295),
 			MB_YESNO | MB_ICONWARNING | MB_IS_RTL | MB_SYSTEMMODAL, selected_langid) != IDYES)
@@ -4176,6 +4285,18 @@ extern int TestHashes(void);
 				continue;
 			}
 
+			// Ctrl-Alt-M => Mass flash mode: build the drive content once into a master image
+			// in the temp directory, and replicate that image to each drive that follows.
+			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'M') &&
+				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
+				mass_flash = !mass_flash;
+				WriteSettingBool(SETTING_MASS_FLASH, mass_flash);
+				PrintStatusTimeout(lmprintf(MSG_358), mass_flash);
+				if (!mass_flash)
+					DeleteMasterImage();
+				continue;
+			}
+
 			// Ctrl-Alt-Y => Force update check to be successful and ignore timestamp errors
 			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'Y') &&
 				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
@@ -4225,10 +4346,17 @@ out:
 		if (!DeleteFileU(loc_file))
 			uprintf("Could not delete '%s': %s", loc_file, WindowsErrorString());
 	}
+	DeleteMasterImage();
 	DestroyAllTooltips();
 	DestroyDarkModeGDIObjects();
 	ClrAlertPromptHook();
 	exit_localization();
+	IsoCacheExit();
+	if ((trace_path != NULL) && !trace_dump(trace_path))
+		uprintf("Could not write trace to '%s'", trace_path);
+	safe_free(trace_path);
+	safe_free(bench_dir);
+	safe_free(extract_dir);
 	safe_free(image_path);
 	safe_free(archive_path);
 	safe_free(locale_name);
@@ -4262,11 +4390,12 @@ out:
 	CLOSE_OPENED_LIBRARIES;
 	safe_closehandle(mutex);
 	uprintf("*** " APPLICATION_NAME " exit ***\n");
+	StopLogThread();
 #ifdef _CRTDBG_MAP_ALLOC
 	_CrtDumpMemoryLeaks();
 #endif
 
-	return 0;
+	return exit_code;
 }
 
 /*
@@ -117,6 +117,7 @@
 #define DD_BUFFER_SIZE              (32 * MB)	// Minimum size of buffer to use for DD operations
 #define UBUFFER_SIZE                4096
 #define ISO_BUFFER_SIZE             (64 * KB)	// Buffer size used for ISO data extraction
+#define UDF_BUFFER_SIZE             (1 * MB)	// Buffer size used for UDF data extraction (read per extent)
 #define RSA_SIGNATURE_SIZE          256
 #define CBN_SELCHANGE_INTERNAL      (CBN_SELCHANGE + 256)
 #if defined(RUFUS_TEST)
@@ -135,15 +136,6 @@
 #define DISKCOPY_SIZE               0x16ee00
 #define DISKCOPY_IMAGE_OFFSET       0x66d8
 #define DISKCOPY_IMAGE_SIZE         0x168000
-#if defined(_M_AMD64)
-#define OSCDIMG_URL                 "https://msdl.microsoft.com/download/symbols/oscdimg.exe/688CABB065000/oscdimg.exe"
-#elif defined(_M_IX86)
-#define OSCDIMG_URL                 "https://msdl.microsoft.com/download/symbols/oscdimg.exe/704FD1B760000/oscdimg.exe"
-#elif defined(_M_ARM64)
-#define OSCDIMG_URL                 "https://msdl.microsoft.com/download/symbols/oscdimg.exe/02633D8D66000/oscdimg.exe"
-#elif defined(_M_ARM)
-#define OSCDIMG_URL                 "https://msdl.microsoft.com/download/symbols/oscdimg.exe/9CD825745F000/oscdimg.exe"
-#endif
 #define SYMBOL_SERVER_USER_AGENT    "Microsoft-Symbol-Server/10.0.22621.755"
 #define DEFAULT_ESP_MOUNT_POINT     "S:\\"
 #define IS_POWER_OF_2(x)            ((x != 0) && (((x) & ((x) - 1)) == 0))
@@ -195,8 +187,10 @@ static __inline void safe_strcp(char* dst, const size_t dst_max, const char* src
 #define safe_strdup(str) ((((char*)(str))==NULL) ? NULL : _strdup(str))
 #if defined(_MSC_VER)
 #define safe_vsnprintf(buf, size, format, arg) _vsnprintf_s(buf, size, _TRUNCATE, format, arg)
+#define THREAD_LOCAL __declspec(thread)
 #else
 #define safe_vsnprintf vsnprintf
+#define THREAD_LOCAL __thread
 #endif
 #define safe_strtolower(str) do { if (str != NULL) CharLowerA(str); } while(0)
 #define safe_strtoupper(str) do { if (str != NULL) CharUpperA(str); } while(0)
@@ -212,6 +206,9 @@ extern void uprintf(const char *format, ...);
 extern void uprintfs(const char *str);
 extern void wuprintf(const wchar_t* format, ...);
 extern void uprint_progress(uint64_t cur_value, uint64_t max_value);
+extern BOOL StartLogThread(void);
+extern void StopLogThread(void);
+extern void FlushLog(void);
 #define vuprintf(...) do { if (verbose) uprintf(__VA_ARGS__); } while(0)
 #define vvuprintf(...) do { if (verbose > 1) uprintf(__VA_ARGS__); } while(0)
 #define suprintf(...) do { if (!bSilent) uprintf(__VA_ARGS__); } while(0)
@@ -239,6 +236,7 @@ enum user_message_type {
 	UM_SELECT_ISO,
 	UM_TIMER_START,
 	UM_FORMAT_START,
+	UM_LOG_APPEND,
 	// Start of the WM IDs for the language menu items
 	UM_LANGUAGE_MENU = WM_APP + 0x100
 };
@@ -813,6 +811,7 @@ extern SIZE GetTextSize(HWND hCtrl, char* txt);
 extern BOOL ExtractAppIcon(const char* filename, BOOL bSilent);
 extern BOOL ExtractDOS(const char* path);
 extern BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan);
+extern BOOL ScanAndExtractISO(const char* src_iso, const char* dest_dir, BOOL split_wim);
 extern BOOL ExtractZip(const char* src_zip, const char* dest_dir);
 extern int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_file, DWORD attributes);
 extern uint32_t ReadISOFileToBuffer(const char* iso, const char* iso_file, uint8_t** buf);
@@ -861,6 +860,9 @@ extern void parse_update(char* buf, size_t len);
 extern void* get_data_from_asn1(const uint8_t* buf, size_t buf_len, const char* oid_str, uint8_t asn1_type, size_t* data_len);
 extern int sanitize_label(char* label);
 extern int IsHDD(DWORD DriveIndex, uint16_t vid, uint16_t pid, const char* strid);
+extern const char* SptStrerr(int errcode);
+extern int ScsiWriteSame(HANDLE hPhysical, uint64_t Lba, uint32_t NumBlocks, void* Block, uint32_t BlockSize,
+	BOOL Unmap, uint32_t Timeout);
 extern char* GetSignatureName(const char* path, const char* country_code, uint8_t* thumbprint, BOOL bSilent);
 extern int GetIssuerCertificateInfo(uint8_t* cert, cert_info_t* info);
 extern uint64_t GetSignatureTimeStamp(const char* path);
@@ -884,6 +886,7 @@ extern BOOL IsFileInDB(const char* path);
 extern BOOL IsSignedBySecureBootAuthority(uint8_t* buf, uint32_t len);
 extern int IsBootloaderRevoked(uint8_t* buf, uint32_t len);
 extern BOOL IsBufferInDB(const unsigned char* buf, const size_t len);
+extern int RunBenchmarks(const char* dir);
 #define printbits(x) _printbits(sizeof(x), &x, 0)
 #define printbitslz(x) _printbits(sizeof(x), &x, 1)
 extern char* _printbits(size_t const size, void const * const ptr, int leading_zeroes);
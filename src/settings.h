@@ -51,6 +51,7 @@ extern char* ini_file;
 #define SETTING_INCLUDE_BETAS               "CheckForBetas"
 #define SETTING_LAST_UPDATE                 "LastUpdateCheck"
 #define SETTING_LOCALE                      "Locale"
+#define SETTING_MASS_FLASH                  "MassFlash"
 #define SETTING_UPDATE_INTERVAL             "UpdateCheckInterval"
 #define SETTING_USE_EXT_VERSION             "UseExtVersion"
 #define SETTING_USE_PROPER_SIZE_UNITS       "UseProperSizeUnits"
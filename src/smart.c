@@ -28,6 +28,7 @@
 #include <windows.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <ctype.h>
 #include <stddef.h>
 
@@ -37,10 +38,11 @@
 
 #include "drive.h"
 #include "smart.h"
+#include "devcache.h"
 #include "hdd_vs_ufd.h"
 
-#if defined(RUFUS_TEST)
 /* Helper functions */
+#if defined(RUFUS_TEST)
 static uint8_t GetAtaDirection(uint8_t AtaCmd, uint8_t Features) {
 	// Far from complete -- only the commands we *may* use.
 
@@ -62,6 +64,7 @@ static uint8_t GetAtaDirection(uint8_t AtaCmd, uint8_t Features) {
 		return ATA_PASSTHROUGH_DATA_NONE;
 	}
 }
+#endif
 
 const char* SptStrerr(int errcode)
 {
@@ -167,7 +170,312 @@ BOOL ScsiPassthroughDirect(HANDLE hPhysical, uint8_t* Cdb, size_t CdbLen, uint8_
 	return FALSE;
 }
 
+/*
+ * Issue a SCSI WRITE SAME (16) for NumBlocks blocks starting at Lba, replicating the
+ * single block of data provided. If Unmap is set, the device is allowed to deallocate
+ * the blocks instead of writing them, provided that they then read back as the data.
+ * Block must be aligned to 16 bytes and BlockSize must be the logical block size.
+ *
+ * Returns SPT_SUCCESS on success, or one of the ScsiPassthroughDirect() errors.
+ */
+int ScsiWriteSame(HANDLE hPhysical, uint64_t Lba, uint32_t NumBlocks, void* Block, uint32_t BlockSize,
+	BOOL Unmap, uint32_t Timeout)
+{
+	uint8_t Cdb[16] = { 0 };
+	int i;
+
+	Cdb[0] = SCSI_WRITE_SAME_16;
+	Cdb[1] = Unmap ? 0x08 : 0x00;
+	for (i = 0; i < 8; i++)
+		Cdb[2 + i] = (uint8_t)(Lba >> (56 - 8 * i));
+	for (i = 0; i < 4; i++)
+		Cdb[10 + i] = (uint8_t)(NumBlocks >> (24 - 8 * i));
+
+	return ScsiPassthroughDirect(hPhysical, Cdb, sizeof(Cdb), SCSI_IOCTL_DATA_OUT, Block, BlockSize, Timeout);
+}
+
+static uint32_t get_be32(const uint8_t* p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int ScsiInquiryVpd(HANDLE hPhysical, uint8_t Page, uint8_t* Buf, uint16_t BufLen)
+{
+	uint8_t Cdb[6] = { SCSI_INQUIRY, 0x01, Page, (uint8_t)(BufLen >> 8), (uint8_t)BufLen, 0 };
+	int r;
+
+	memset(Buf, 0, BufLen);
+	r = ScsiPassthroughDirect(hPhysical, Cdb, sizeof(Cdb), SCSI_IOCTL_DATA_IN, Buf, BufLen, SPT_TIMEOUT_VALUE);
+	// Some devices return the standard INQUIRY data for pages they don't know about
+	if ((r == SPT_SUCCESS) && (Buf[1] != Page))
+		r = SPT_ERROR_CHECK_STATUS;
+	return r;
+}
+
+/*
+ * Probe the transfer and provisioning limits of a device, so that we can size, align and
+ * choose our I/O requests accordingly. The storage stack provides the sector geometry and
+ * adapter limits, and, if the device talks SCSI, we refine these with READ CAPACITY (16),
+ * the Block Limits and Logical Block Provisioning VPD pages, as well as the ATA IDENTIFY
+ * data that SAT bridges report in the ATA Information VPD page.
+ * Since some USB bridges don't take well to commands they don't know, the SCSI queries are
+ * only sent to devices that sit on a native SCSI, ATA or NVMe bus. For the others, we use
+ * the provisioning limits that the class driver already obtained from the device.
+ * hPhysical must have been opened with read/write access. Always fills Limits with at
+ * least the sector sizes, and returns TRUE if the device answered the SCSI queries.
+ */
+BOOL GetDeviceLimits(HANDLE hPhysical, DEVICE_LIMITS* Limits)
+{
+	STORAGE_PROPERTY_QUERY query = { 0 };
+	STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR alignment = { 0 };
+	STORAGE_ADAPTER_DESCRIPTOR adapter = { 0 };
+	STORAGE_DEVICE_DESCRIPTOR device = { 0 };
+	DEVICE_TRIM_DESCRIPTOR trim = { 0 };
+	DEVICE_LB_PROVISIONING_DESCRIPTOR provisioning = { 0 };
+	STORAGE_BUS_TYPE bus_type = BusTypeUnknown;
+	uint8_t Cdb[16] = { 0 }, *buf = NULL, *page, *ident;
+	uint16_t* word;
+	uint32_t block_size;
+	BOOL has_page[256] = { FALSE }, ret = FALSE;
+	DWORD i, size;
+
+	memset(Limits, 0, sizeof(DEVICE_LIMITS));
+	Limits->LogicalBlockSize = Limits->PhysicalBlockSize = SelectedDrive.SectorSize;
+
+	query.QueryType = PropertyStandardQuery;
+	query.PropertyId = StorageAccessAlignmentProperty;
+	if (DeviceIoControl(hPhysical, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&alignment, sizeof(alignment), &size, NULL) && (size >= sizeof(alignment))) {
+		Limits->LogicalBlockSize = alignment.BytesPerLogicalSector;
+		Limits->PhysicalBlockSize = alignment.BytesPerPhysicalSector;
+		Limits->AlignmentOffset = alignment.BytesOffsetForSectorAlignment;
+	}
+	query.PropertyId = StorageAdapterProperty;
+	if (DeviceIoControl(hPhysical, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&adapter, sizeof(adapter), &size, NULL) && (size >= offsetof(STORAGE_ADAPTER_DESCRIPTOR, MaximumPhysicalPages)))
+		Limits->MaxTransferLength = adapter.MaximumTransferLength;
+	query.PropertyId = StorageDeviceProperty;
+	if (DeviceIoControl(hPhysical, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&device, sizeof(device), &size, NULL) && (size >= offsetof(STORAGE_DEVICE_DESCRIPTOR, RawPropertiesLength)))
+		bus_type = device.BusType;
+	query.PropertyId = StorageDeviceTrimProperty;
+	if (DeviceIoControl(hPhysical, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&trim, sizeof(trim), &size, NULL) && (size >= sizeof(trim)))
+		Limits->CanUnmap = trim.TrimEnabled;
+	// Note that the class driver reports the unmap granularity and alignment in bytes
+	query.PropertyId = StorageDeviceLBProvisioningProperty;
+	if (DeviceIoControl(hPhysical, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&provisioning, sizeof(provisioning), &size, NULL) &&
+		(size >= offsetof(DEVICE_LB_PROVISIONING_DESCRIPTOR, MaxUnmapLbaCount)) &&
+		provisioning.ThinProvisioningEnabled && (Limits->LogicalBlockSize != 0)) {
+		Limits->CanUnmap = TRUE;
+		Limits->ReadsZeroesAfterUnmap = provisioning.ThinProvisioningReadZeros;
+		Limits->UnmapGranularity = (uint32_t)(provisioning.OptimalUnmapGranularity / Limits->LogicalBlockSize);
+		if (provisioning.UnmapGranularityAlignmentValid)
+			Limits->UnmapAlignment = (uint32_t)(provisioning.UnmapGranularityAlignment / Limits->LogicalBlockSize);
+		if (size >= sizeof(provisioning))
+			Limits->MaxUnmapLength = provisioning.MaxUnmapLbaCount;
+	}
+
+	switch (bus_type) {
+	case BusTypeScsi:
+	case BusTypeAta:
+	case BusTypeSata:
+	case BusTypeSas:
+	case BusTypeFibre:
+	case BusTypeiScsi:
+	case BusTypeNvme:
+		break;
+	default:
+		goto out;
+	}
+	buf = (uint8_t*)_mm_malloc(VPD_BUFFER_SIZE, 0x10);
+	if (buf == NULL)
+		goto out;
+
+	Cdb[0] = SCSI_SERVICE_ACTION_IN_16;
+	Cdb[1] = SAI_READ_CAPACITY_16;
+	Cdb[13] = 32;
+	memset(buf, 0, 32);
+	if (ScsiPassthroughDirect(hPhysical, Cdb, sizeof(Cdb), SCSI_IOCTL_DATA_IN, buf, 32, SPT_TIMEOUT_VALUE) == SPT_SUCCESS) {
+		block_size = get_be32(&buf[8]);
+		if ((block_size >= 512) && IS_POWER_OF_2(block_size)) {
+			Limits->LogicalBlockSize = block_size;
+			Limits->PhysicalBlockSize = block_size << (buf[13] & 0x0f);
+			Limits->AlignmentOffset = (((buf[14] & 0x3f) << 8) | buf[15]) * block_size;
+			if (buf[14] & 0x80)
+				Limits->ProvisioningReported = TRUE;
+			if (buf[14] & 0x40)
+				Limits->ReadsZeroesAfterUnmap = TRUE;
+		}
+		ret = TRUE;
+	}
+	block_size = Limits->LogicalBlockSize;
+
+	if (ScsiInquiryVpd(hPhysical, VPD_SUPPORTED_PAGES, buf, 0xff) != SPT_SUCCESS)
+		goto out;
+	ret = TRUE;
+	for (i = 0; i < buf[3]; i++)
+		has_page[buf[4 + i]] = TRUE;
+
+	if (has_page[VPD_BLOCK_LIMITS] && (ScsiInquiryVpd(hPhysical, VPD_BLOCK_LIMITS, buf, 0x40) == SPT_SUCCESS)) {
+		page = buf;
+		// Only keep the device limit if it's stricter than the adapter's
+		if ((get_be32(&page[8]) != 0) && ((Limits->MaxTransferLength == 0) ||
+			((uint64_t)get_be32(&page[8]) * block_size < Limits->MaxTransferLength)))
+			Limits->MaxTransferLength = (uint32_t)min((uint64_t)get_be32(&page[8]) * block_size, UINT32_MAX);
+		Limits->OptimalTransferLength = (uint32_t)min((uint64_t)get_be32(&page[12]) * block_size, UINT32_MAX);
+		Limits->MaxUnmapLength = get_be32(&page[20]);
+		Limits->UnmapGranularity = get_be32(&page[28]);
+		if (page[32] & 0x80)
+			Limits->UnmapAlignment = get_be32(&page[32]) & 0x7fffffff;
+		Limits->MaxWriteSameLength = ((uint64_t)get_be32(&page[36]) << 32) | get_be32(&page[40]);
+	}
+
+	if (has_page[VPD_LOGICAL_BLOCK_PROVISIONING] &&
+		(ScsiInquiryVpd(hPhysical, VPD_LOGICAL_BLOCK_PROVISIONING, buf, 0x40) == SPT_SUCCESS)) {
+		page = buf;
+		Limits->ProvisioningReported = TRUE;
+		Limits->CanUnmap = (page[5] & 0x80) ? TRUE : FALSE;
+		Limits->CanWriteSameUnmap = (page[5] & 0x40) ? TRUE : FALSE;
+		if (page[5] & 0x1c)
+			Limits->ReadsZeroesAfterUnmap = TRUE;
+	}
+
+	if (has_page[VPD_ATA_INFORMATION] &&
+		(ScsiInquiryVpd(hPhysical, VPD_ATA_INFORMATION, buf, VPD_BUFFER_SIZE) == SPT_SUCCESS) &&
+		(((buf[2] << 8) | buf[3]) >= VPD_ATA_IDENTIFY_OFFSET + 512 - 4)) {
+		ident = &buf[VPD_ATA_IDENTIFY_OFFSET];
+		word = (uint16_t*)ident;
+		Limits->IsAta = TRUE;
+		// Word 106: Physical/logical sector size, valid if bit 14 is set and bit 15 is clear
+		if ((word[106] & 0xc000) == 0x4000) {
+			if (word[106] & 0x1000)
+				Limits->LogicalBlockSize = 2 * (word[117] | ((uint32_t)word[118] << 16));
+			if (word[106] & 0x2000)
+				Limits->PhysicalBlockSize = Limits->LogicalBlockSize << (word[106] & 0x0f);
+		}
+		// Word 169 bit 0: TRIM supported, word 69 bit 5: zeroes returned after TRIM
+		if (word[169] & 0x0001)
+			Limits->CanUnmap = TRUE;
+		if ((word[169] & 0x0001) && (word[69] & 0x4020) == 0x4020)
+			Limits->ReadsZeroesAfterUnmap = TRUE;
+		// TRIM applies to individual logical sectors
+		if ((word[169] & 0x0001) && (Limits->UnmapGranularity == 0))
+			Limits->UnmapGranularity = 1;
+	}
 
+out:
+	uprintf("Device limits: %d/%d bytes blocks (offset %d), max transfer %s, optimal transfer %s, %s%s",
+		Limits->LogicalBlockSize, Limits->PhysicalBlockSize, Limits->AlignmentOffset,
+		(Limits->MaxTransferLength == 0) ? "unknown" : SizeToHumanReadable(Limits->MaxTransferLength, FALSE, FALSE),
+		(Limits->OptimalTransferLength == 0) ? "unknown" : SizeToHumanReadable(Limits->OptimalTransferLength, FALSE, FALSE),
+		Limits->CanUnmap ? "unmap" : "no unmap", Limits->ReadsZeroesAfterUnmap ? " (reads zeroes)" : "");
+	_mm_free(buf);
+	return ret;
+}
+
+/*
+ * Device write cache management (see devcache.c), with the commands going
+ * through IOCTL_SCSI_PASS_THROUGH_DIRECT.
+ */
+static devcache_state dc_state = { 0 };
+
+static int DevCacheScsi(void* ctx, const uint8_t* cdb, size_t cdb_len, int dir, void* buf, size_t len, uint32_t timeout)
+{
+	uint8_t Cdb[SPT_CDB_LENGTH], *DataBuffer = NULL;
+	int r;
+
+	if (cdb_len > sizeof(Cdb))
+		return SPT_ERROR_CDB_LENGTH;
+	memcpy(Cdb, cdb, cdb_len);
+	// ScsiPassthroughDirect() needs an aligned buffer
+	if (len != 0) {
+		DataBuffer = (uint8_t*)_mm_malloc(len, 0x10);
+		if (DataBuffer == NULL)
+			return SPT_ERROR_BUFFER;
+		if (dir == DEVCACHE_DATA_OUT)
+			memcpy(DataBuffer, buf, len);
+		else
+			memset(DataBuffer, 0, len);
+	}
+	r = ScsiPassthroughDirect((HANDLE)ctx, Cdb, cdb_len, (uint8_t)dir, DataBuffer, len, timeout);
+	if ((r == SPT_SUCCESS) && (dir == DEVCACHE_DATA_IN))
+		memcpy(buf, DataBuffer, len);
+	_mm_free(DataBuffer);
+	return r;
+}
+
+/*
+ * Enable the write cache of the device for the duration of the current job,
+ * according to Mode (one of DEVCACHE_###). Must be paired with a call to
+ * RestoreDeviceWriteCache(), which will also restore the original setting.
+ */
+BOOL SetDeviceWriteCache(HANDLE hPhysical, int Mode)
+{
+	int r;
+
+	if (Mode == DEVCACHE_OFF)
+		return TRUE;
+	r = devcache_begin(&dc_state, Mode, DevCacheScsi, hPhysical);
+	if (r == 0 && dc_state.changed) {
+		uprintf("Enabled device write cache (%s)", devcache_method_name(dc_state.method));
+	} else if (r == 0) {
+		uprintf("Device write cache is already enabled");
+	} else if (r == ENOTSUP) {
+		uprintf("%sDevice write cache is disabled and can't be enabled%s", (Mode == DEVCACHE_ON) ? "WARNING: " : "",
+			(Mode == DEVCACHE_AUTO) ? " through the Caching mode page" : "");
+	} else {
+		uprintf("WARNING: Could not enable device write cache: %s", SptStrerr(dc_state.last_status));
+	}
+	return (r == 0);
+}
+
+BOOL FlushDeviceWriteCache(HANDLE hPhysical)
+{
+	if (!dc_state.enabled)
+		return TRUE;
+	dc_state.ctx = hPhysical;
+	if (devcache_flush(&dc_state) != 0) {
+		uprintf("WARNING: Could not flush device write cache: %s", SptStrerr(dc_state.last_status));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Flush the write cache and restore its original setting. This is also called on error or
+ * cancellation, possibly after the handle we started with was closed, in which case we
+ * reopen the drive.
+ */
+BOOL RestoreDeviceWriteCache(HANDLE hPhysical, DWORD DriveIndex)
+{
+	HANDLE hDrive = hPhysical;
+	BOOL ret, changed = dc_state.changed;
+
+	if (!dc_state.enabled && !changed)
+		return TRUE;
+	if ((hDrive == INVALID_HANDLE_VALUE) || (hDrive == NULL))
+		hDrive = GetPhysicalHandle(DriveIndex, FALSE, TRUE, TRUE);
+	if (hDrive == INVALID_HANDLE_VALUE) {
+		uprintf("WARNING: Could not restore device write cache setting");
+		dc_state.enabled = dc_state.changed = FALSE;
+		return FALSE;
+	}
+	dc_state.ctx = hDrive;
+	ret = (devcache_end(&dc_state) == 0);
+	if (!ret)
+		uprintf("WARNING: Could not %s device write cache: %s", changed ? "restore" : "flush",
+			SptStrerr(dc_state.last_status));
+	else if (changed)
+		uprintf("Restored device write cache setting");
+	dc_state.enabled = dc_state.changed = FALSE;
+	if (hDrive != hPhysical)
+		CloseHandle(hDrive);
+	return ret;
+}
+
+#if defined(RUFUS_TEST)
 /* See ftp://ftp.t10.org/t10/document.04/04-262r8.pdf, http://www.scsitoolbox.com/pdfs/UsingSAT.pdf,
  * as well as http://nevar.pl/pliki/ATA8-ACS-3.pdf‎ */
 static int SatAtaPassthrough(HANDLE hPhysical, ATA_PASSTHROUGH_CMD* Command, void* DataBuffer, size_t BufLen, uint32_t Timeout)
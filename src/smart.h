@@ -36,6 +36,19 @@
 #define ATA_SET_FEATURES                0xef
 #define ATA_STANDBY_IMMEDIATE           0xe0
 #define SAT_ATA_PASSTHROUGH_12          0xa1
+#define SCSI_WRITE_SAME_16              0x93
+#define SCSI_INQUIRY                    0x12
+#define SCSI_SERVICE_ACTION_IN_16       0x9e
+#define SAI_READ_CAPACITY_16            0x10
+
+// SCSI Vital Product Data pages
+#define VPD_SUPPORTED_PAGES             0x00
+#define VPD_ATA_INFORMATION             0x89
+#define VPD_BLOCK_LIMITS                0xb0
+#define VPD_LOGICAL_BLOCK_PROVISIONING  0xb2
+#define VPD_BUFFER_SIZE                 1024
+#define VPD_ATA_IDENTIFY_OFFSET         60	// Offset of the IDENTIFY DEVICE data in the ATA Information page
+
 // Non official pseudo commands
 #define USB_CYPRESS_ATA_PASSTHROUGH     0x24
 #define USB_JMICRON_ATA_PASSTHROUGH     0xdf
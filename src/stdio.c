@@ -41,6 +41,7 @@
 #include "resource.h"
 #include "msapi_utf8.h"
 #include "localization.h"
+#include "ulog.h"
 #include "bled/bled.h"
 
 #define FACILITY_WIM            322
@@ -55,6 +56,8 @@ HWND hStatus;
 size_t ubuffer_pos = 0;
 char ubuffer[UBUFFER_SIZE];	// Buffer for ubpushf() messages we don't log right away
 static uint64_t archive_size;
+static wchar_t* log_pending = NULL;
+static size_t log_pending_len = 0, log_pending_size = 0;
 
 #pragma pack(push, 1)
 typedef struct {
@@ -65,9 +68,92 @@ typedef struct {
 } debug_info_t;
 #pragma pack(pop)
 
+/*
+ * Log output. When the log thread is running, messages are appended to its ring, and
+ * the thread takes care of sending them to the debug facility and, in batches, to the
+ * log window, so that logging from an I/O thread doesn't wait on either of these.
+ */
+static void log_output(const wchar_t* wstr)
+{
+	// Send output to Windows debug facility
+	// coverity[dont_call]
+	OutputDebugStringW(wstr);
+	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
+		// Send output to our log Window
+		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
+		Edit_ReplaceSel(hLog, wstr);
+		// Make sure the message scrolls into view
+		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
+	}
+}
+
+static void log_write(const char* str, size_t len, uint32_t flags, time_t ts)
+{
+	wchar_t *wstr = utf8_to_wchar(str), *new_pending;
+	size_t wlen, new_size;
+
+	if (wstr == NULL)
+		return;
+	// coverity[dont_call]
+	OutputDebugStringW(wstr);
+	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
+		wlen = wcslen(wstr);
+		if (log_pending_len + wlen + 1 > log_pending_size) {
+			new_size = log_pending_len + wlen + 1 + 4096;
+			new_pending = (wchar_t*)realloc(log_pending, new_size * sizeof(wchar_t));
+			if (new_pending == NULL) {
+				free(wstr);
+				return;
+			}
+			log_pending = new_pending;
+			log_pending_size = new_size;
+		}
+		memcpy(&log_pending[log_pending_len], wstr, (wlen + 1) * sizeof(wchar_t));
+		log_pending_len += wlen;
+	}
+	free(wstr);
+}
+
+static void log_commit(void)
+{
+	if (log_pending == NULL)
+		return;
+	// The log window frees the buffer once it has appended it
+	if (!PostMessage(hLogDialog, UM_LOG_APPEND, 0, (LPARAM)log_pending))
+		free(log_pending);
+	log_pending = NULL;
+	log_pending_len = 0;
+	log_pending_size = 0;
+}
+
+static const ulog_sink log_sink = { log_write, log_commit };
+
+BOOL StartLogThread(void)
+{
+	return ulog_init(&log_sink);
+}
+
+void StopLogThread(void)
+{
+	ulog_exit();
+}
+
+/*
+ * Wait for all the messages logged so far to have been processed and, when
+ * called from the GUI thread, for them to have been added to the log window.
+ */
+void FlushLog(void)
+{
+	MSG msg;
+
+	ulog_flush();
+	while (PeekMessage(&msg, hLogDialog, UM_LOG_APPEND, UM_LOG_APPEND, PM_REMOVE))
+		DispatchMessage(&msg);
+}
+
 void uprintf(const char *format, ...)
 {
-	static char buf[4096];
+	char buf[4096];
 	char* p = buf;
 	wchar_t* wbuf;
 	va_list args;
@@ -86,24 +172,18 @@ void uprintf(const char *format, ...)
 	*p++ = '\n';
 	*p   = '\0';
 
+	if (ulog_write(0, buf, (size_t)(p - buf)))
+		return;
 	wbuf = utf8_to_wchar(buf);
-	// Send output to Windows debug facility
-	// coverity[dont_call]
-	OutputDebugStringW(wbuf);
-	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
-		// Send output to our log Window
-		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
-		Edit_ReplaceSel(hLog, wbuf);
-		// Make sure the message scrolls into view
-		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
-	}
+	log_output(wbuf);
 	free(wbuf);
 }
 
 void wuprintf(const wchar_t* format, ...)
 {
-	static wchar_t wbuf[4096];
+	wchar_t wbuf[4096];
 	wchar_t* p = wbuf;
+	char* buf;
 	va_list args;
 	int n;
 
@@ -119,26 +199,23 @@ void wuprintf(const wchar_t* format, ...)
 		*p = L'\0';
 	}
 
-	// coverity[dont_call]
-	OutputDebugStringW(wbuf);
-	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
-		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
-		Edit_ReplaceSel(hLog, wbuf);
-		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
+	buf = wchar_to_utf8(wbuf);
+	if ((buf != NULL) && ulog_write(0, buf, strlen(buf))) {
+		free(buf);
+		return;
 	}
+	free(buf);
+	log_output(wbuf);
 }
 
 void uprintfs(const char* str)
 {
 	wchar_t* wstr;
+
+	if (ulog_write(0, str, strlen(str)))
+		return;
 	wstr = utf8_to_wchar(str);
-	// coverity[dont_call]
-	OutputDebugStringW(wstr);
-	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
-		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
-		Edit_ReplaceSel(hLog, wstr);
-		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
-	}
+	log_output(wstr);
 	free(wstr);
 }
 
@@ -272,7 +349,7 @@ void DumpBufferHex(void *buf, size_t size)
 // handle FORMAT_MESSAGE_FROM_HMODULE automatically according to the facility...
 const char *WindowsErrorString(void)
 {
-	static char err_string[256] = { 0 };
+	static THREAD_LOCAL char err_string[256] = { 0 };
 
 	DWORD size, presize;
 	DWORD error_code, _error_code, format_error;
@@ -395,7 +472,7 @@ static __inline uint16_t upo2(uint16_t v)
 char* SizeToHumanReadable(uint64_t size, BOOL copy_to_log, BOOL fake_units)
 {
 	int suffix;
-	static char str_size[32];
+	static THREAD_LOCAL char str_size[32];
 	const char* dir = ((right_to_left_mode) && (!copy_to_log)) ? LEFT_TO_RIGHT_MARK : "";
 	double hr_size = (double)size;
 	double t;
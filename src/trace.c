@@ -0,0 +1,217 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Timeline tracing of the I/O pipeline stages
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Memory leaks detection - define _CRTDBG_MAP_ALLOC as preprocessor macro */
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include "msapi_utf8.h"
+#else
+#include <time.h>
+#include <pthread.h>
+#endif
+
+#include "trace.h"
+
+#if defined(_MSC_VER)
+#define TRACE_TLS __declspec(thread)
+#else
+#define TRACE_TLS __thread
+#endif
+
+typedef struct {
+	const char* name;
+	uint64_t start;
+	uint64_t end;
+	uint64_t bytes;
+} trace_record;
+
+typedef struct trace_ring {
+	struct trace_ring* next;
+	uint64_t tid;
+	// Total number of events recorded. Only ever written by the owner thread.
+	uint32_t count;
+	trace_record rec[TRACE_RING_SIZE];
+} trace_ring;
+
+int trace_enabled = 0;
+static uint64_t trace_origin;
+static trace_ring* volatile trace_rings = NULL;
+// Incremented whenever the rings are released, so that threads know to allocate a new one
+static uint32_t trace_generation = 1;
+static TRACE_TLS trace_ring* trace_local = NULL;
+static TRACE_TLS uint32_t trace_local_generation = 0;
+
+uint64_t trace_now(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER li;
+	QueryPerformanceCounter(&li);
+	return (uint64_t)li.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* Number of trace_now() ticks per microsecond */
+static double trace_ticks_per_us(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER li;
+	QueryPerformanceFrequency(&li);
+	return (double)li.QuadPart / 1000000.0;
+#else
+	return 1000.0;
+#endif
+}
+
+static uint64_t trace_thread_id(void)
+{
+#if defined(_WIN32)
+	return (uint64_t)GetCurrentThreadId();
+#elif defined(__APPLE__)
+	uint64_t tid = 0;
+	pthread_threadid_np(NULL, &tid);
+	return tid;
+#else
+	return (uint64_t)(uintptr_t)pthread_self();
+#endif
+}
+
+/* Register a new ring with the global list, without taking a lock */
+static trace_ring* trace_new_ring(void)
+{
+	trace_ring* ring = (trace_ring*)calloc(1, sizeof(trace_ring));
+
+	if (ring == NULL)
+		return NULL;
+	ring->tid = trace_thread_id();
+#if defined(_WIN32)
+	do {
+		ring->next = trace_rings;
+	} while (InterlockedCompareExchangePointer((PVOID volatile*)&trace_rings, ring, ring->next) != ring->next);
+#else
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+#endif
+	return ring;
+}
+
+void trace_event(const char* name, uint64_t start, uint64_t bytes)
+{
+	trace_ring* ring = trace_local;
+	trace_record* rec;
+
+	// Tracing was enabled between the start and the end of the event
+	if (start == 0)
+		return;
+	if ((ring == NULL) || (trace_local_generation != trace_generation)) {
+		ring = trace_new_ring();
+		if (ring == NULL)
+			return;
+		trace_local = ring;
+		trace_local_generation = trace_generation;
+	}
+	rec = &ring->rec[ring->count & (TRACE_RING_SIZE - 1)];
+	rec->name = name;
+	rec->start = start;
+	rec->end = trace_now();
+	rec->bytes = bytes;
+	// Publish the record before the count
+#if defined(_WIN32)
+	InterlockedExchange((volatile LONG*)&ring->count, (LONG)(ring->count + 1));
+#else
+	__atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+#endif
+}
+
+bool trace_start(void)
+{
+	trace_origin = trace_now();
+	trace_enabled = 1;
+	return true;
+}
+
+/*
+ * Stop tracing and write all the recorded events to 'path', in Chrome Trace Event format.
+ * This must only be called once the traced operations have completed.
+ */
+bool trace_dump(const char* path)
+{
+	FILE* fd;
+	trace_ring *ring, *next;
+	trace_record* rec;
+	uint32_t i, count;
+	double tpu = trace_ticks_per_us();
+	bool first = true;
+
+	if (!trace_enabled)
+		return false;
+	trace_enabled = 0;
+
+#if defined(_WIN32)
+	fd = fopenU(path, "w");
+#else
+	fd = fopen(path, "w");
+#endif
+	if (fd != NULL) {
+		fprintf(fd, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		for (ring = trace_rings; ring != NULL; ring = ring->next) {
+#if defined(_WIN32)
+			count = (uint32_t)InterlockedCompareExchange((volatile LONG*)&ring->count, 0, 0);
+#else
+			count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+#endif
+			// Older events have been overwritten if the ring wrapped around
+			for (i = (count > TRACE_RING_SIZE) ? count - TRACE_RING_SIZE : 0; i < count; i++) {
+				rec = &ring->rec[i & (TRACE_RING_SIZE - 1)];
+				if (rec->start < trace_origin)
+					continue;
+				fprintf(fd, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%" PRIu64 ",\"ts\":%.3f,\"dur\":%.3f",
+					first ? "" : ",\n", rec->name, ring->tid, (double)(rec->start - trace_origin) / tpu,
+					(double)(rec->end - rec->start) / tpu);
+				if (rec->bytes != 0)
+					fprintf(fd, ",\"args\":{\"bytes\":%" PRIu64 "}", rec->bytes);
+				fprintf(fd, "}");
+				first = false;
+			}
+		}
+		fprintf(fd, "\n]}\n");
+		fclose(fd);
+	}
+
+	// Threads that are still alive will allocate a new ring if tracing is restarted
+	trace_generation++;
+	for (ring = trace_rings; ring != NULL; ring = next) {
+		next = ring->next;
+		free(ring);
+	}
+	trace_rings = NULL;
+	return (fd != NULL);
+}
@@ -0,0 +1,52 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Timeline tracing of the I/O pipeline stages
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#pragma once
+
+/*
+ * Trace points record complete events (a name, a start and an end time, and an optional
+ * byte count) into a ring buffer owned by the calling thread, so that recording requires
+ * neither locking nor any shared write. The rings are exported, once all the work is done,
+ * in the Chrome Trace Event format, which can be loaded in chrome://tracing or Perfetto.
+ * When tracing is disabled, a trace point costs a single, well predicted, branch.
+ *
+ * Usage:
+ *   uint64_t t = TRACE_BEGIN();
+ *   ...
+ *   TRACE_END_BYTES("write", t, size);
+ *
+ * Event names must be static strings that don't require JSON escaping.
+ */
+
+// Number of events kept per thread. Must be a power of 2.
+#define TRACE_RING_SIZE         (1 << 15)
+
+extern int trace_enabled;
+
+extern uint64_t trace_now(void);
+extern void trace_event(const char* name, uint64_t start, uint64_t bytes);
+extern bool trace_start(void);
+extern bool trace_dump(const char* path);
+
+#define TRACE_BEGIN()                       (trace_enabled ? trace_now() : 0)
+#define TRACE_END(name, start)              do { if (trace_enabled) trace_event(name, start, 0); } while (0)
+#define TRACE_END_BYTES(name, start, bytes) do { if (trace_enabled) trace_event(name, start, (uint64_t)(bytes)); } while (0)
@@ -0,0 +1,609 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * UTF-8/UTF-16 transcoding
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "transcode.h"
+
+/*
+ * SIMD support, as determined at compile time. SSE2 and NEON are part of the x86-64
+ * and ARM64 baselines, and AVX2 is detected at runtime. Define TRANSCODE_NO_INTRINSICS
+ * to only use the scalar code.
+ */
+#if !defined(TRANSCODE_NO_INTRINSICS)
+#if defined(__SSE2__) || defined(_M_AMD64) || (defined(_M_IX86) && defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define TRANSCODE_SSE2
+#define TRANSCODE_AVX2
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define TRANSCODE_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#define RUFUS_ENABLE_GCC_ARCH(arch)
+#else
+#define RUFUS_ENABLE_GCC_ARCH(arch) __attribute__ ((target (arch)))
+#endif
+
+// Number of code units that are converted one code point at a time, whenever a
+// vector contains anything else than ASCII, before trying the vector code again.
+#define SCALAR_RUN                32
+
+bool transcode_use_simd = true;
+
+static __inline uint32_t load_unit(const uint8_t* src, size_t i, bool be)
+{
+	return be ? (((uint32_t)src[2 * i] << 8) | src[2 * i + 1]) : (((uint32_t)src[2 * i + 1] << 8) | src[2 * i]);
+}
+
+static __inline void store_unit(uint16_t* dst, size_t i, uint32_t c, bool be)
+{
+	dst[i] = (uint16_t)(be ? (((c & 0xff) << 8) | (c >> 8)) : c);
+}
+
+/*
+ * Scalar versions of the vectorized primitives.
+ * The *_ascii_run() calls convert the leading ASCII characters of the input and
+ * return how many were converted, but may stop short of the first non ASCII one.
+ */
+static size_t utf16_ascii_run_c(const uint8_t* src, size_t len, char* dst, bool be)
+{
+	size_t i;
+	uint32_t c;
+
+	for (i = 0; i < len; i++) {
+		c = load_unit(src, i, be);
+		if (c >= 0x80)
+			break;
+		dst[i] = (char)c;
+	}
+	return i;
+}
+
+static size_t utf8_ascii_run_c(const uint8_t* src, size_t len, uint16_t* dst, bool be)
+{
+	size_t i;
+
+	for (i = 0; (i < len) && (src[i] < 0x80); i++) {
+		if (dst != NULL)
+			store_unit(dst, i, src[i], be);
+	}
+	return i;
+}
+
+static size_t utf8_length_from_utf16_c(const uint16_t* src, size_t len)
+{
+	size_t i, n = 0;
+
+	// Surrogates are 2 bytes each, so that a pair is 4 bytes
+	for (i = 0; i < len; i++)
+		n += 1 + (src[i] >= 0x80) + ((src[i] >= 0x800) && ((src[i] & 0xf800) != 0xd800));
+	return n;
+}
+
+static size_t utf16_length_from_utf8_c(const uint8_t* src, size_t len)
+{
+	size_t i, n = 0;
+
+	// One unit per leading byte, and one more for the 4-byte sequences
+	for (i = 0; i < len; i++)
+		n += ((src[i] & 0xc0) != 0x80) + (src[i] >= 0xf0);
+	return n;
+}
+
+#if defined(TRANSCODE_SSE2)
+static int has_avx2 = -1;
+
+/*
+ * Detect if the processor and the OS support AVX2. Unlike SSE, the OS needs to save
+ * the YMM registers on context switch, which Windows only does since 7 SP1.
+ */
+static bool DetectAVX2(void)
+{
+#if defined(_MSC_VER)
+	int regs0[4] = { 0,0,0,0 }, regs1[4] = { 0,0,0,0 }, regs7[4] = { 0,0,0,0 };
+	const int OSXSAVE_AVX_BITS = (1 << 27) | (1 << 28); /* Function 1, Bits 27 and 28 of ECX */
+	const int AVX2_BIT = 1 << 5; /* Function 7, Bit 5 of EBX */
+
+	__cpuid(regs0, 0);
+	if (regs0[0] < 0x07)
+		return false;
+	__cpuidex(regs1, 1, 0);
+	if ((regs1[2] & OSXSAVE_AVX_BITS) != OSXSAVE_AVX_BITS)
+		return false;
+	// XMM and YMM state must be enabled in XCR0
+	if ((_xgetbv(0) & 0x06) != 0x06)
+		return false;
+	__cpuidex(regs7, 7, 0);
+	return (regs7[1] & AVX2_BIT) != 0;
+#elif defined(__GNUC__) || defined(__clang__)
+	/* __builtin_cpu_supports also checks for OS support */
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") != 0;
+#else
+	return false;
+#endif
+}
+
+static __inline bool use_avx2(void)
+{
+	// Racing threads will all come up with the same answer
+	if (has_avx2 < 0)
+		has_avx2 = DetectAVX2() ? 1 : 0;
+	return transcode_use_simd && (has_avx2 != 0);
+}
+
+static __inline __m128i swap_units_sse2(__m128i v)
+{
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static size_t utf16_ascii_run_sse2(const uint8_t* src, size_t len, char* dst, bool be)
+{
+	const __m128i mask = _mm_set1_epi16((short)0xff80), zero = _mm_setzero_si128();
+	__m128i v;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		v = _mm_loadu_si128((const __m128i*)&src[2 * i]);
+		if (be)
+			v = swap_units_sse2(v);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, mask), zero)) != 0xffff)
+			return i;
+		_mm_storel_epi64((__m128i*)&dst[i], _mm_packus_epi16(v, v));
+	}
+	return i + utf16_ascii_run_c(&src[2 * i], len - i, &dst[i], be);
+}
+
+static size_t utf8_ascii_run_sse2(const uint8_t* src, size_t len, uint16_t* dst, bool be)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i*)&src[i]);
+		if (_mm_movemask_epi8(v) != 0)
+			return i;
+		if (dst == NULL)
+			continue;
+		// Interleaving with zeroes before or after each byte gives BE or LE units
+		_mm_storeu_si128((__m128i*)&dst[i], be ? _mm_unpacklo_epi8(zero, v) : _mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128((__m128i*)&dst[i + 8], be ? _mm_unpackhi_epi8(zero, v) : _mm_unpackhi_epi8(v, zero));
+	}
+	return i + utf8_ascii_run_c(&src[i], len - i, (dst == NULL) ? NULL : &dst[i], be);
+}
+
+static __inline uint32_t hsum_epi32_sse2(__m128i v)
+{
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+static size_t utf8_length_from_utf16_sse2(const uint16_t* src, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1);
+	const __m128i m80 = _mm_set1_epi16((short)0xff80), m800 = _mm_set1_epi16((short)0xf800);
+	const __m128i surrogate = _mm_set1_epi16((short)0xd800);
+	__m128i v, hi, acc;
+	size_t i = 0, j, n = 0;
+
+	// Each unit is 3 bytes, minus 1 if < 0x80, minus 1 if < 0x800 or a surrogate.
+	// The comparisons give -1 for true, which we accumulate for up to 4096 vectors,
+	// i.e. no more than -8192 per 16-bit lane.
+	while (i + 8 <= len) {
+		acc = zero;
+		for (j = 0; (j < 4096) && (i + 8 <= len); j++, i += 8) {
+			v = _mm_loadu_si128((const __m128i*)&src[i]);
+			hi = _mm_and_si128(v, m800);
+			acc = _mm_add_epi16(acc, _mm_cmpeq_epi16(_mm_and_si128(v, m80), zero));
+			acc = _mm_add_epi16(acc, _mm_cmpeq_epi16(hi, zero));
+			acc = _mm_add_epi16(acc, _mm_cmpeq_epi16(hi, surrogate));
+		}
+		n += (size_t)((int64_t)(3 * 8 * j) + (int32_t)hsum_epi32_sse2(_mm_madd_epi16(acc, ones)));
+	}
+	return n + utf8_length_from_utf16_c(&src[i], len - i);
+}
+
+static size_t utf16_length_from_utf8_sse2(const uint8_t* src, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi8(1);
+	const __m128i cont = _mm_set1_epi8(-64), lead4 = _mm_set1_epi8((char)0xf0);
+	__m128i v, acc, sum;
+	size_t i = 0, j, n = 0;
+
+	// Each byte is 1 unit, minus 1 if a continuation byte (signed < -64), plus 1 if
+	// the leading byte of a 4-byte sequence (unsigned >= 0xf0), so at most 2 units
+	// per byte, which we can accumulate for up to 127 vectors in 8-bit lanes.
+	while (i + 16 <= len) {
+		acc = zero;
+		for (j = 0; (j < 127) && (i + 16 <= len); j++, i += 16) {
+			v = _mm_loadu_si128((const __m128i*)&src[i]);
+			acc = _mm_add_epi8(acc, _mm_add_epi8(ones, _mm_cmplt_epi8(v, cont)));
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_max_epu8(v, lead4), v));
+		}
+		sum = _mm_sad_epu8(acc, zero);
+		n += (size_t)_mm_cvtsi128_si32(sum) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+	}
+	return n + utf16_length_from_utf8_c(&src[i], len - i);
+}
+
+RUFUS_ENABLE_GCC_ARCH("avx2")
+static size_t utf16_ascii_run_avx2(const uint8_t* src, size_t len, char* dst, bool be)
+{
+	const __m256i mask = _mm256_set1_epi16((short)0xff80);
+	__m256i v;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm256_loadu_si256((const __m256i*)&src[2 * i]);
+		if (be)
+			v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+		if (!_mm256_testz_si256(v, mask))
+			return i;
+		// Packing is per 128-bit lane, so the 64-bit halves must be put back in order
+		v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), _MM_SHUFFLE(3, 1, 2, 0));
+		_mm_storeu_si128((__m128i*)&dst[i], _mm256_castsi256_si128(v));
+	}
+	return i + utf16_ascii_run_sse2(&src[2 * i], len - i, &dst[i], be);
+}
+
+RUFUS_ENABLE_GCC_ARCH("avx2")
+static size_t utf8_ascii_run_avx2(const uint8_t* src, size_t len, uint16_t* dst, bool be)
+{
+	__m256i v, lo, hi;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i*)&src[i]);
+		if (_mm256_movemask_epi8(v) != 0)
+			return i;
+		if (dst == NULL)
+			continue;
+		lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v));
+		hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1));
+		if (be) {
+			lo = _mm256_slli_epi16(lo, 8);
+			hi = _mm256_slli_epi16(hi, 8);
+		}
+		_mm256_storeu_si256((__m256i*)&dst[i], lo);
+		_mm256_storeu_si256((__m256i*)&dst[i + 16], hi);
+	}
+	return i + utf8_ascii_run_sse2(&src[i], len - i, (dst == NULL) ? NULL : &dst[i], be);
+}
+
+RUFUS_ENABLE_GCC_ARCH("avx2")
+static size_t utf8_length_from_utf16_avx2(const uint16_t* src, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi16(1);
+	const __m256i m80 = _mm256_set1_epi16((short)0xff80), m800 = _mm256_set1_epi16((short)0xf800);
+	const __m256i surrogate = _mm256_set1_epi16((short)0xd800);
+	__m256i v, hi, acc;
+	__m128i sum;
+	size_t i = 0, j, n = 0;
+
+	// See utf8_length_from_utf16_sse2()
+	while (i + 16 <= len) {
+		acc = zero;
+		for (j = 0; (j < 4096) && (i + 16 <= len); j++, i += 16) {
+			v = _mm256_loadu_si256((const __m256i*)&src[i]);
+			hi = _mm256_and_si256(v, m800);
+			acc = _mm256_add_epi16(acc, _mm256_cmpeq_epi16(_mm256_and_si256(v, m80), zero));
+			acc = _mm256_add_epi16(acc, _mm256_cmpeq_epi16(hi, zero));
+			acc = _mm256_add_epi16(acc, _mm256_cmpeq_epi16(hi, surrogate));
+		}
+		acc = _mm256_madd_epi16(acc, ones);
+		sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+		n += (size_t)((int64_t)(3 * 16 * j) + (int32_t)hsum_epi32_sse2(sum));
+	}
+	return n + utf8_length_from_utf16_sse2(&src[i], len - i);
+}
+
+RUFUS_ENABLE_GCC_ARCH("avx2")
+static size_t utf16_length_from_utf8_avx2(const uint8_t* src, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi8(1);
+	const __m256i cont = _mm256_set1_epi8(-64), lead4 = _mm256_set1_epi8((char)0xf0);
+	__m256i v, acc, sum;
+	__m128i sum128;
+	size_t i = 0, j, n = 0;
+
+	// See utf16_length_from_utf8_sse2()
+	while (i + 32 <= len) {
+		acc = zero;
+		for (j = 0; (j < 127) && (i + 32 <= len); j++, i += 32) {
+			v = _mm256_loadu_si256((const __m256i*)&src[i]);
+			acc = _mm256_add_epi8(acc, _mm256_add_epi8(ones, _mm256_cmpgt_epi8(cont, v)));
+			acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_max_epu8(v, lead4), v));
+		}
+		sum = _mm256_sad_epu8(acc, zero);
+		// Each of the 64-bit sums fits in 32 bits
+		sum128 = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+		n += (size_t)_mm_cvtsi128_si32(sum128) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(sum128, 8));
+	}
+	return n + utf16_length_from_utf8_sse2(&src[i], len - i);
+}
+
+#define utf16_ascii_run(s, l, d, be) (use_avx2() ? utf16_ascii_run_avx2(s, l, d, be) : \
+	(transcode_use_simd ? utf16_ascii_run_sse2(s, l, d, be) : utf16_ascii_run_c(s, l, d, be)))
+#define utf8_ascii_run(s, l, d, be) (use_avx2() ? utf8_ascii_run_avx2(s, l, d, be) : \
+	(transcode_use_simd ? utf8_ascii_run_sse2(s, l, d, be) : utf8_ascii_run_c(s, l, d, be)))
+#define utf8_length_from_utf16_simd(s, l) (use_avx2() ? utf8_length_from_utf16_avx2(s, l) : \
+	(transcode_use_simd ? utf8_length_from_utf16_sse2(s, l) : utf8_length_from_utf16_c(s, l)))
+#define utf16_length_from_utf8_simd(s, l) (use_avx2() ? utf16_length_from_utf8_avx2(s, l) : \
+	(transcode_use_simd ? utf16_length_from_utf8_sse2(s, l) : utf16_length_from_utf8_c(s, l)))
+
+#elif defined(TRANSCODE_NEON)
+
+static size_t utf16_ascii_run_neon(const uint8_t* src, size_t len, char* dst, bool be)
+{
+	uint8x16_t b;
+	uint16x8_t v;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		b = vld1q_u8(&src[2 * i]);
+		v = vreinterpretq_u16_u8(be ? vrev16q_u8(b) : b);
+		if (vmaxvq_u16(v) >= 0x80)
+			return i;
+		vst1_u8((uint8_t*)&dst[i], vmovn_u16(v));
+	}
+	return i + utf16_ascii_run_c(&src[2 * i], len - i, &dst[i], be);
+}
+
+static size_t utf8_ascii_run_neon(const uint8_t* src, size_t len, uint16_t* dst, bool be)
+{
+	uint8x16_t v;
+	uint16x8_t lo, hi;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = vld1q_u8(&src[i]);
+		if (vmaxvq_u8(v) >= 0x80)
+			return i;
+		if (dst == NULL)
+			continue;
+		lo = vmovl_u8(vget_low_u8(v));
+		hi = vmovl_high_u8(v);
+		if (be) {
+			lo = vshlq_n_u16(lo, 8);
+			hi = vshlq_n_u16(hi, 8);
+		}
+		vst1q_u16(&dst[i], lo);
+		vst1q_u16(&dst[i + 8], hi);
+	}
+	return i + utf8_ascii_run_c(&src[i], len - i, (dst == NULL) ? NULL : &dst[i], be);
+}
+
+static size_t utf8_length_from_utf16_neon(const uint16_t* src, size_t len)
+{
+	const uint16x8_t m80 = vdupq_n_u16(0xff80), m800 = vdupq_n_u16(0xf800);
+	const uint16x8_t zero = vdupq_n_u16(0), surrogate = vdupq_n_u16(0xd800);
+	uint16x8_t v, hi, acc;
+	size_t i = 0, j, n = 0;
+
+	// Same as the SSE2 version: comparisons give 0xffff (-1) for true
+	while (i + 8 <= len) {
+		acc = zero;
+		for (j = 0; (j < 4096) && (i + 8 <= len); j++, i += 8) {
+			v = vld1q_u16(&src[i]);
+			hi = vandq_u16(v, m800);
+			acc = vaddq_u16(acc, vceqq_u16(vandq_u16(v, m80), zero));
+			acc = vaddq_u16(acc, vceqq_u16(hi, zero));
+			acc = vaddq_u16(acc, vceqq_u16(hi, surrogate));
+		}
+		n += (size_t)((int64_t)(3 * 8 * j) + vaddlvq_s16(vreinterpretq_s16_u16(acc)));
+	}
+	return n + utf8_length_from_utf16_c(&src[i], len - i);
+}
+
+static size_t utf16_length_from_utf8_neon(const uint8_t* src, size_t len)
+{
+	const uint8x16_t ones = vdupq_n_u8(1), lead4 = vdupq_n_u8(0xf0);
+	const int8x16_t cont = vdupq_n_s8(-64);
+	uint8x16_t v, acc;
+	size_t i = 0, j, n = 0;
+
+	// Same as the SSE2 version
+	while (i + 16 <= len) {
+		acc = vdupq_n_u8(0);
+		for (j = 0; (j < 127) && (i + 16 <= len); j++, i += 16) {
+			v = vld1q_u8(&src[i]);
+			acc = vaddq_u8(acc, vaddq_u8(ones, vcltq_s8(vreinterpretq_s8_u8(v), cont)));
+			acc = vsubq_u8(acc, vcgeq_u8(v, lead4));
+		}
+		n += vaddlvq_u8(acc);
+	}
+	return n + utf16_length_from_utf8_c(&src[i], len - i);
+}
+
+#define utf16_ascii_run(s, l, d, be) (transcode_use_simd ? utf16_ascii_run_neon(s, l, d, be) : \
+	utf16_ascii_run_c(s, l, d, be))
+#define utf8_ascii_run(s, l, d, be) (transcode_use_simd ? utf8_ascii_run_neon(s, l, d, be) : \
+	utf8_ascii_run_c(s, l, d, be))
+#define utf8_length_from_utf16_simd(s, l) (transcode_use_simd ? utf8_length_from_utf16_neon(s, l) : \
+	utf8_length_from_utf16_c(s, l))
+#define utf16_length_from_utf8_simd(s, l) (transcode_use_simd ? utf16_length_from_utf8_neon(s, l) : \
+	utf16_length_from_utf8_c(s, l))
+
+#else
+
+#define utf16_ascii_run utf16_ascii_run_c
+#define utf8_ascii_run utf8_ascii_run_c
+#define utf8_length_from_utf16_simd utf8_length_from_utf16_c
+#define utf16_length_from_utf8_simd utf16_length_from_utf8_c
+
+#endif
+
+static size_t utf16_to_utf8(const uint8_t* src, size_t len, char* dst, bool be)
+{
+	size_t i = 0, o = 0, n, end;
+	uint32_t c, c2;
+
+	while (i < len) {
+		n = utf16_ascii_run(&src[2 * i], len - i, &dst[o], be);
+		i += n;
+		o += n;
+		for (end = i + SCALAR_RUN; (i < len) && (i < end); ) {
+			c = load_unit(src, i++, be);
+			if (c < 0x80) {
+				dst[o++] = (char)c;
+			} else if (c < 0x800) {
+				dst[o++] = (char)(0xc0 | (c >> 6));
+				dst[o++] = (char)(0x80 | (c & 0x3f));
+			} else if ((c & 0xf800) != 0xd800) {
+				dst[o++] = (char)(0xe0 | (c >> 12));
+				dst[o++] = (char)(0x80 | ((c >> 6) & 0x3f));
+				dst[o++] = (char)(0x80 | (c & 0x3f));
+			} else {
+				// A high surrogate, followed by a low one
+				if ((c >= 0xdc00) || (i >= len))
+					return TRANSCODE_INVALID;
+				c2 = load_unit(src, i++, be);
+				if ((c2 & 0xfc00) != 0xdc00)
+					return TRANSCODE_INVALID;
+				c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+				dst[o++] = (char)(0xf0 | (c >> 18));
+				dst[o++] = (char)(0x80 | ((c >> 12) & 0x3f));
+				dst[o++] = (char)(0x80 | ((c >> 6) & 0x3f));
+				dst[o++] = (char)(0x80 | (c & 0x3f));
+			}
+		}
+	}
+	return o;
+}
+
+// dst can be NULL, to only validate the input and count the units
+static size_t utf8_to_utf16(const uint8_t* src, size_t len, uint16_t* dst, bool be)
+{
+	size_t i = 0, o = 0, n, end;
+	uint32_t c;
+	uint8_t lo, hi;
+
+	while (i < len) {
+		n = utf8_ascii_run(&src[i], len - i, (dst == NULL) ? NULL : &dst[o], be);
+		i += n;
+		o += n;
+		for (end = i + SCALAR_RUN; (i < len) && (i < end); ) {
+			c = src[i++];
+			if (c >= 0x80) {
+				// Valid ranges for the first continuation byte are from the Unicode
+				// Standard (Table 3-7), which excludes overlong forms and surrogates.
+				lo = 0x80;
+				hi = 0xbf;
+				if (c < 0xc2) {
+					return TRANSCODE_INVALID;
+				} else if (c < 0xe0) {
+					n = 1;
+					c &= 0x1f;
+				} else if (c < 0xf0) {
+					n = 2;
+					if (c == 0xe0)
+						lo = 0xa0;
+					else if (c == 0xed)
+						hi = 0x9f;
+					c &= 0x0f;
+				} else if (c < 0xf5) {
+					n = 3;
+					if (c == 0xf0)
+						lo = 0x90;
+					else if (c == 0xf4)
+						hi = 0x8f;
+					c &= 0x07;
+				} else {
+					return TRANSCODE_INVALID;
+				}
+				if ((n > len - i) || (src[i] < lo) || (src[i] > hi))
+					return TRANSCODE_INVALID;
+				for (; n > 0; n--) {
+					if ((src[i] & 0xc0) != 0x80)
+						return TRANSCODE_INVALID;
+					c = (c << 6) | (src[i++] & 0x3f);
+				}
+			}
+			if (c >= 0x10000) {
+				if (dst != NULL) {
+					store_unit(dst, o, 0xd800 + ((c - 0x10000) >> 10), be);
+					store_unit(dst, o + 1, 0xdc00 + (c & 0x3ff), be);
+				}
+				o += 2;
+			} else {
+				if (dst != NULL)
+					store_unit(dst, o, c, be);
+				o++;
+			}
+		}
+	}
+	return o;
+}
+
+size_t utf8_length_from_utf16(const uint16_t* src, size_t len)
+{
+	return utf8_length_from_utf16_simd(src, len);
+}
+
+size_t utf16_length_from_utf8(const char* src, size_t len)
+{
+	return utf16_length_from_utf8_simd((const uint8_t*)src, len);
+}
+
+bool utf8_validate(const char* src, size_t len)
+{
+	return (utf8_to_utf16((const uint8_t*)src, len, NULL, false) != TRANSCODE_INVALID);
+}
+
+size_t utf16le_to_utf8(const uint16_t* src, size_t len, char* dst)
+{
+	return utf16_to_utf8((const uint8_t*)src, len, dst, false);
+}
+
+size_t utf16be_to_utf8(const void* src, size_t len, char* dst)
+{
+	return utf16_to_utf8((const uint8_t*)src, len, dst, true);
+}
+
+size_t utf8_to_utf16le(const char* src, size_t len, uint16_t* dst)
+{
+	return utf8_to_utf16((const uint8_t*)src, len, dst, false);
+}
+
+size_t utf8_to_utf16be(const char* src, size_t len, uint16_t* dst)
+{
+	return utf8_to_utf16((const uint8_t*)src, len, dst, true);
+}
+
+const char* transcode_simd_name(void)
+{
+#if defined(TRANSCODE_SSE2)
+	return use_avx2() ? "avx2" : (transcode_use_simd ? "sse2" : "none");
+#elif defined(TRANSCODE_NEON)
+	return transcode_use_simd ? "neon" : "none";
+#else
+	return "none";
+#endif
+}
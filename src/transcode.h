@@ -0,0 +1,58 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * UTF-8/UTF-16 transcoding
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#pragma once
+
+/*
+ * Conversions between UTF-8 and UTF-16 (little or big endian), with validation.
+ * Runs of ASCII, which is what most of the file names and config data we deal with
+ * are made of, are converted with SSE2/AVX2 on x86 and NEON on ARM64, and the rest
+ * one code point at a time.
+ * Lengths are in code units (bytes for UTF-8, 16-bit words for UTF-16), the input
+ * doesn't need to be NUL terminated, and no NUL terminator is written.
+ * The conversions return the number of code units written, or TRANSCODE_INVALID if
+ * the input is not well formed (unpaired surrogate, overlong or truncated sequence,
+ * etc.), in which case the content of the output buffer is undefined.
+ */
+
+#define TRANSCODE_INVALID         ((size_t)-1)
+
+// Upper bounds of the output size of a conversion, so that the output buffer can
+// be allocated without going through the input beforehand.
+#define UTF8_MAX_FROM_UTF16(len)  ((len) * 3)
+#define UTF16_MAX_FROM_UTF8(len)  (len)
+
+// Set to false to only use the scalar code (for benchmarking)
+extern bool transcode_use_simd;
+
+// Exact output sizes, for valid input
+extern size_t utf8_length_from_utf16(const uint16_t* src, size_t len);
+extern size_t utf16_length_from_utf8(const char* src, size_t len);
+
+extern bool utf8_validate(const char* src, size_t len);
+extern size_t utf16le_to_utf8(const uint16_t* src, size_t len, char* dst);
+// Big endian UTF-16 (as used by Joliet and UDF) need not be aligned
+extern size_t utf16be_to_utf8(const void* src, size_t len, char* dst);
+extern size_t utf8_to_utf16le(const char* src, size_t len, uint16_t* dst);
+extern size_t utf8_to_utf16be(const char* src, size_t len, uint16_t* dst);
+extern const char* transcode_simd_name(void);
@@ -0,0 +1,316 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Asynchronous log backend
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Memory leaks detection - define _CRTDBG_MAP_ALLOC as preprocessor macro */
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+#include "ulog.h"
+
+// How long the log thread sleeps when idle, in case a wake up was missed
+#define ULOG_IDLE_TIMEOUT       100
+
+#if defined(_WIN32)
+#define atomic_load64(p)        ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0))
+#define atomic_store64(p, v)    InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+#define atomic_cas64(p, o, n)   (InterlockedCompareExchange64((volatile LONG64*)(p), (LONG64)(n), (LONG64)(o)) == (LONG64)(o))
+#define atomic_load32(p)        InterlockedCompareExchange((volatile LONG*)(p), 0, 0)
+#define atomic_store32(p, v)    InterlockedExchange((volatile LONG*)(p), (LONG)(v))
+#define atomic_inc32(p)         InterlockedIncrement((volatile LONG*)(p))
+#define atomic_dec32(p)         InterlockedDecrement((volatile LONG*)(p))
+#define ulog_yield()            SwitchToThread()
+#define ulog_sleep_ms(ms)       Sleep(ms)
+#else
+#define atomic_load64(p)        __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define atomic_store64(p, v)    __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define atomic_cas64(p, o, n)   ({ uint64_t _o = (o); __atomic_compare_exchange_n(p, &_o, n, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); })
+#define atomic_load32(p)        __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define atomic_store32(p, v)    __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define atomic_inc32(p)         __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec32(p)         __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST)
+#define ulog_yield()            sched_yield()
+#define ulog_sleep_ms(ms)       usleep((ms) * 1000)
+#endif
+
+typedef struct {
+	// Sequence number, as per Dmitry Vyukov's bounded queue: equal to the position the
+	// record can next be claimed at when free, and to that position + 1 once published.
+	uint64_t seq;
+	uint32_t flags;
+	uint32_t len;
+	time_t ts;
+	char* ext;
+	char text[ULOG_INLINE_SIZE];
+} ulog_record;
+
+static ulog_record* ring = NULL;
+static const ulog_sink* log_sink = NULL;
+static uint64_t enqueue_pos, dequeue_pos, committed_pos;
+static int32_t running = 0, stopping = 0, waiting = 0;
+// Producers currently inside ulog_write(), which the ring must not be freed under
+static int32_t writers = 0;
+#if defined(_WIN32)
+static HANDLE log_thread = NULL, log_event = NULL;
+#else
+static pthread_t log_thread;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+static void ulog_wake(void)
+{
+#if defined(_WIN32)
+	SetEvent(log_event);
+#else
+	pthread_mutex_lock(&log_mutex);
+	pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_mutex);
+#endif
+}
+
+static __inline bool ulog_pending(void)
+{
+	return (atomic_load64(&ring[dequeue_pos & (ULOG_RING_SIZE - 1)].seq) == dequeue_pos + 1);
+}
+
+/*
+ * The waiting flag is raised before the ring is checked one last time, and producers
+ * check the flag after they have published their record, so that at least one of
+ * the two sides sees the other. The timeout is only there as a safety net.
+ */
+static void ulog_wait(void)
+{
+#if defined(_WIN32)
+	atomic_store32(&waiting, 1);
+	if (!ulog_pending() && !atomic_load32(&stopping))
+		WaitForSingleObject(log_event, ULOG_IDLE_TIMEOUT);
+	atomic_store32(&waiting, 0);
+#else
+	struct timeval now;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&log_mutex);
+	atomic_store32(&waiting, 1);
+	if (!ulog_pending() && !atomic_load32(&stopping)) {
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec + (now.tv_usec / 1000 + ULOG_IDLE_TIMEOUT) / 1000;
+		deadline.tv_nsec = ((now.tv_usec / 1000 + ULOG_IDLE_TIMEOUT) % 1000) * 1000000;
+		pthread_cond_timedwait(&log_cond, &log_mutex, &deadline);
+	}
+	atomic_store32(&waiting, 0);
+	pthread_mutex_unlock(&log_mutex);
+#endif
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI ulog_thread(LPVOID param)
+#else
+static void* ulog_thread(void* param)
+#endif
+{
+	ulog_record* rec;
+	uint64_t start;
+
+	(void)param;
+	while (1) {
+		start = dequeue_pos;
+		while (ulog_pending()) {
+			rec = &ring[dequeue_pos & (ULOG_RING_SIZE - 1)];
+			log_sink->write((rec->ext != NULL) ? rec->ext : rec->text, rec->len, rec->flags, rec->ts);
+			free(rec->ext);
+			rec->ext = NULL;
+			atomic_store64(&rec->seq, dequeue_pos + ULOG_RING_SIZE);
+			atomic_store64(&dequeue_pos, dequeue_pos + 1);
+		}
+		if (dequeue_pos != start) {
+			if (log_sink->commit != NULL)
+				log_sink->commit();
+			atomic_store64(&committed_pos, dequeue_pos);
+		}
+		// Producers that claimed a record before we stopped must be waited for
+		if (atomic_load32(&stopping) && (atomic_load64(&enqueue_pos) == dequeue_pos))
+			break;
+		ulog_wait();
+	}
+#if defined(_WIN32)
+	return 0;
+#else
+	return NULL;
+#endif
+}
+
+bool ulog_init(const ulog_sink* sink)
+{
+	uint64_t i;
+
+	if ((sink == NULL) || (sink->write == NULL) || running)
+		return false;
+	ring = (ulog_record*)calloc(ULOG_RING_SIZE, sizeof(ulog_record));
+	if (ring == NULL)
+		return false;
+	for (i = 0; i < ULOG_RING_SIZE; i++)
+		ring[i].seq = i;
+	enqueue_pos = dequeue_pos = committed_pos = 0;
+	stopping = waiting = 0;
+	log_sink = sink;
+#if defined(_WIN32)
+	log_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (log_event != NULL)
+		log_thread = CreateThread(NULL, 0, ulog_thread, NULL, 0, NULL);
+	if (log_thread == NULL) {
+		if (log_event != NULL)
+			CloseHandle(log_event);
+		log_event = NULL;
+#else
+	if (pthread_create(&log_thread, NULL, ulog_thread, NULL) != 0) {
+#endif
+		free(ring);
+		ring = NULL;
+		return false;
+	}
+	atomic_store32(&running, 1);
+	return true;
+}
+
+/*
+ * Stop accepting new records, then wait for the log thread to write everything out.
+ * Producers that got past the running check before it was cleared are still writing
+ * to the ring, so they must be done before we can tell the thread to stop.
+ */
+void ulog_exit(void)
+{
+	if (!atomic_load32(&running))
+		return;
+	atomic_store32(&running, 0);
+	while (atomic_load32(&writers) != 0)
+		ulog_yield();
+	atomic_store32(&stopping, 1);
+	ulog_wake();
+#if defined(_WIN32)
+	WaitForSingleObject(log_thread, INFINITE);
+	CloseHandle(log_thread);
+	CloseHandle(log_event);
+	log_thread = NULL;
+	log_event = NULL;
+#else
+	pthread_join(log_thread, NULL);
+#endif
+	free(ring);
+	ring = NULL;
+}
+
+/*
+ * Append a record to the ring. Returns false if the log thread isn't running,
+ * in which case it is up to the caller to output the message synchronously.
+ */
+bool ulog_write(uint32_t flags, const char* str, size_t len)
+{
+	ulog_record* rec;
+	uint64_t pos, seq;
+
+	// Announce ourselves before checking, so that ulog_exit() either waits for us or
+	// has already cleared the flag by the time we look at it
+	atomic_inc32(&writers);
+	if (!atomic_load32(&running)) {
+		atomic_dec32(&writers);
+		return false;
+	}
+
+	pos = atomic_load64(&enqueue_pos);
+	while (1) {
+		rec = &ring[pos & (ULOG_RING_SIZE - 1)];
+		seq = atomic_load64(&rec->seq);
+		if (seq == pos) {
+			if (atomic_cas64(&enqueue_pos, pos, pos + 1))
+				break;
+		} else if ((int64_t)(seq - pos) < 0) {
+			// The ring is full
+			ulog_wake();
+			ulog_yield();
+		}
+		pos = atomic_load64(&enqueue_pos);
+	}
+
+	if (len >= ULOG_INLINE_SIZE) {
+		rec->ext = (char*)malloc(len + 1);
+		if (rec->ext == NULL)
+			len = ULOG_INLINE_SIZE - 1;
+	}
+	memcpy((rec->ext != NULL) ? rec->ext : rec->text, str, len);
+	((rec->ext != NULL) ? rec->ext : rec->text)[len] = 0;
+	rec->len = (uint32_t)len;
+	rec->flags = flags;
+	rec->ts = time(NULL);
+	atomic_store64(&rec->seq, pos + 1);
+
+	if (atomic_load32(&waiting))
+		ulog_wake();
+	atomic_dec32(&writers);
+	return true;
+}
+
+bool ulog_vprintf(uint32_t flags, const char* format, va_list args)
+{
+	char buf[ULOG_MAX_SIZE];
+	int n = vsnprintf(buf, sizeof(buf), format, args);
+
+	if (n < 0)
+		return false;
+	return ulog_write(flags, buf, ((size_t)n >= sizeof(buf)) ? sizeof(buf) - 1 : (size_t)n);
+}
+
+bool ulog_printf(uint32_t flags, const char* format, ...)
+{
+	va_list args;
+	bool r;
+
+	va_start(args, format);
+	r = ulog_vprintf(flags, format, args);
+	va_end(args);
+	return r;
+}
+
+/* Wait until everything that was appended so far has been handed over to the sink */
+void ulog_flush(void)
+{
+	uint64_t target;
+
+	if (!atomic_load32(&running))
+		return;
+	target = atomic_load64(&enqueue_pos);
+	ulog_wake();
+	while (atomic_load64(&committed_pos) < target)
+		ulog_sleep_ms(1);
+}
@@ -0,0 +1,59 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Asynchronous log backend
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <time.h>
+
+#pragma once
+
+/*
+ * Producers append preformatted records to a bounded multi-producer, single-consumer
+ * ring, and a background thread hands them over to a sink, which takes care of the
+ * timestamping, conversion and actual output (console, log file, GUI, ...).
+ * As a result, the only work a producer ever does is a copy and an atomic increment,
+ * unless the ring is full, in which case the producer yields until there is space, as
+ * we'd rather slow an I/O thread down than lose part of a log.
+ */
+
+// Number of records in the ring. Must be a power of 2.
+#define ULOG_RING_SIZE          2048
+// Records that are longer than this are stored out of line.
+#define ULOG_INLINE_SIZE        240
+// Maximum size of a formatted message.
+#define ULOG_MAX_SIZE           4096
+
+// Record flags
+#define ULOG_TIMESTAMP          0x0001	// Ask the sink to prefix the record with its timestamp
+
+typedef struct {
+	// Called, from the log thread, for each record, in the order they were appended
+	void (*write)(const char* str, size_t len, uint32_t flags, time_t ts);
+	// Called, from the log thread, once a batch of records has been written. May be NULL.
+	void (*commit)(void);
+} ulog_sink;
+
+extern bool ulog_init(const ulog_sink* sink);
+extern void ulog_exit(void);
+extern bool ulog_write(uint32_t flags, const char* str, size_t len);
+extern bool ulog_vprintf(uint32_t flags, const char* format, va_list args);
+extern bool ulog_printf(uint32_t flags, const char* format, ...);
+extern void ulog_flush(void);
@@ -71,6 +71,7 @@ static comp_assoc file_assoc[] = {
 	{ ".xz", BLED_COMPRESSION_XZ },
 	{ ".vtsi", BLED_COMPRESSION_VTSI },
 	{ ".zst", BLED_COMPRESSION_ZSTD },
+	{ ".7z", BLED_COMPRESSION_7ZIP },
 	{ ".ffu", BLED_COMPRESSION_MAX },
 	{ ".vhd", BLED_COMPRESSION_MAX + 1 },
 	{ ".vhdx", BLED_COMPRESSION_MAX + 2 },
@@ -98,9 +99,10 @@ static int8_t IsCompressedBootableImage(const char* path)
 				return 0;
 			ErrorStatus = 0;
 			if (img_report.compression_type < BLED_COMPRESSION_MAX) {
-				bled_init(0, uprintf, NULL, NULL, NULL, NULL, &ErrorStatus);
-				dc = bled_uncompress_to_buffer(path, (char*)buf, MBR_SIZE, file_assoc[i].type);
-				bled_exit();
+				// Use a context of our own, as a compressed image may be written at the same time
+				bled_ctx* ctx = bled_ctx_new(0, uprintf, NULL, NULL, NULL, NULL, &ErrorStatus);
+				dc = bled_ctx_uncompress_to_buffer(ctx, path, (char*)buf, MBR_SIZE, file_assoc[i].type);
+				bled_ctx_free(ctx);
 			} else if (img_report.compression_type == BLED_COMPRESSION_MAX) {
 				// Dism, through FfuProvider.dll, can mount a .ffu as a physicaldrive, which we
 				// could then use to poke the MBR as we do for VHD... Except Microsoft did design
@@ -274,6 +276,45 @@ static enum wimlib_progress_status WimProgressFunc(enum wimlib_progress_msg msg_
 	return WIMLIB_PROGRESS_STATUS_CONTINUE;
 }
 
+// WIM capture progress callback
+static enum wimlib_progress_status WimCaptureProgressFunc(enum wimlib_progress_msg msg_type,
+	union wimlib_progress_info* info, void* progctx)
+{
+	static BOOL init = FALSE;
+
+	if IS_ERROR(ErrorStatus)
+		return WIMLIB_PROGRESS_STATUS_ABORT;
+
+	switch (msg_type) {
+	case WIMLIB_PROGRESS_MSG_SCAN_BEGIN:
+		init = FALSE;
+		uprintf("Scanning '%S'...", info->scan.source);
+		break;
+	case WIMLIB_PROGRESS_MSG_SCAN_END:
+		uprintf("Found %llu directories and %llu files (%s)", info->scan.num_dirs_scanned,
+			info->scan.num_nondirs_scanned, SizeToHumanReadable(info->scan.num_bytes_scanned, FALSE, FALSE));
+		break;
+	case WIMLIB_PROGRESS_MSG_WRITE_STREAMS:
+		if (!init) {
+			uprintf("Compressing file data (%d thread%s)...", info->write_streams.num_threads,
+				(info->write_streams.num_threads == 1) ? "" : "s");
+			init = TRUE;
+			uprint_progress(0, 0);
+		}
+		// The total decreases as duplicated data is found
+		UpdateProgressWithInfo(OP_FORMAT, MSG_261, info->write_streams.completed_bytes, info->write_streams.total_bytes);
+		uprint_progress(info->write_streams.completed_bytes, info->write_streams.total_bytes);
+		break;
+	case WIMLIB_PROGRESS_MSG_WRITE_METADATA_BEGIN:
+		uprintf("\nWriting metadata...");
+		break;
+	default:
+		break;
+	}
+
+	return WIMLIB_PROGRESS_STATUS_CONTINUE;
+}
+
 // Return the WIM version of an image
 uint32_t GetWimVersion(const char* image)
 {
@@ -462,6 +503,193 @@ out:
 	physical_path[0] = 0;
 }
 
+// Create a sparse (dynamic) VHD of the requested size and mount it read/write, so
+// that it can stand in for a physical drive of the same geometry.
+// Returns the physical path of the mounted image or NULL on error.
+char* VhdCreateSparseImage(const char* path, uint64_t disk_size)
+{
+	VIRTUAL_STORAGE_TYPE vtype = { VIRTUAL_STORAGE_TYPE_DEVICE_VHD, VIRTUAL_STORAGE_TYPE_VENDOR_MICROSOFT };
+	STOPGAP_CREATE_VIRTUAL_DISK_PARAMETERS vparams = { 0 };
+	ATTACH_VIRTUAL_DISK_PARAMETERS aparams = { 0 };
+	DWORD r;
+	wchar_t wtmp[128];
+	ULONG size = ARRAYSIZE(wtmp);
+	wconvert(path);
+	char* ret = NULL;
+
+	if (wpath == NULL)
+		return NULL;
+
+	if ((mounted_handle != NULL) && (mounted_handle != INVALID_HANDLE_VALUE))
+		VhdUnmountImage();
+
+	// VHDs only support 512-byte logical sectors, which is also what we require
+	// of the drives the image gets replicated to.
+	vparams.Version = CREATE_VIRTUAL_DISK_VERSION_2;
+	vparams.Version2.UniqueId = GUID_NULL;
+	vparams.Version2.MaximumSize = disk_size;
+	vparams.Version2.BlockSizeInBytes = CREATE_VIRTUAL_DISK_PARAMETERS_DEFAULT_BLOCK_SIZE;
+	vparams.Version2.SectorSizeInBytes = 512;
+	vparams.Version2.PhysicalSectorSizeInBytes = 512;
+
+	// CreateVirtualDisk() does not have an overwrite flag...
+	DeleteFileW(wpath);
+
+	// No CREATE_VIRTUAL_DISK_FLAG_FULL_PHYSICAL_ALLOCATION => dynamic disk
+	r = CreateVirtualDisk(&vtype, wpath, VIRTUAL_DISK_ACCESS_NONE, NULL, CREATE_VIRTUAL_DISK_FLAG_NONE,
+		0, (PCREATE_VIRTUAL_DISK_PARAMETERS)&vparams, NULL, &mounted_handle);
+	if (r != ERROR_SUCCESS) {
+		SetLastError(r);
+		uprintf("Could not create image '%s': %s", path, WindowsErrorString());
+		goto out;
+	}
+
+	aparams.Version = ATTACH_VIRTUAL_DISK_VERSION_1;
+	r = AttachVirtualDisk(mounted_handle, NULL, ATTACH_VIRTUAL_DISK_FLAG_NONE, 0, &aparams, NULL);
+	if (r != ERROR_SUCCESS) {
+		SetLastError(r);
+		uprintf("Could not mount image '%s': %s", path, WindowsErrorString());
+		goto out;
+	}
+
+	r = GetVirtualDiskPhysicalPath(mounted_handle, &size, wtmp);
+	if (r != ERROR_SUCCESS) {
+		SetLastError(r);
+		uprintf("Could not obtain physical path for mounted image '%s': %s", path, WindowsErrorString());
+		goto out;
+	}
+	wchar_to_utf8_no_alloc(wtmp, physical_path, sizeof(physical_path));
+	ret = physical_path;
+
+out:
+	if (ret == NULL) {
+		VhdUnmountImage();
+		DeleteFileW(wpath);
+	}
+	wfree(path);
+	return ret;
+}
+
+// Write a dynamic VHD, such as the one produced by VhdCreateSparseImage(), to a
+// physical drive. Only the blocks that were allocated in the image get copied,
+// with consecutive blocks coalesced so that the drive sees large sequential writes.
+// Blocks that were never written to the image are skipped, rather than zeroed.
+// The caller is responsible for refreshing the drive layout once done.
+BOOL VhdWriteSparseImage(HANDLE hPhysicalDrive, const char* path)
+{
+	BOOL ret = FALSE;
+	HANDLE hImage = INVALID_HANDLE_VALUE;
+	vhd_footer footer;
+	vhd_dynamic_header header;
+	uint8_t* buffer = NULL;
+	uint32_t *bat = NULL, i, n, block_size, bitmap_size, nb_entries, nb_allocated = 0, nb_written = 0;
+	uint64_t disk_size, offset, length;
+	LARGE_INTEGER li;
+	DWORD size;
+
+	hImage = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hImage == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open image '%s': %s", path, WindowsErrorString());
+		ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
+		goto out;
+	}
+
+	// Dynamic VHDs have a copy of the footer at the beginning of the file
+	if (!ReadFile(hImage, &footer, sizeof(footer), &size, NULL) || (size != sizeof(footer)) ||
+		(memcmp(footer.cookie, VHD_FOOTER_COOKIE, sizeof(footer.cookie)) != 0) ||
+		(bswap_uint32(footer.disk_type) != VHD_DISK_TYPE_DYNAMIC)) {
+		uprintf("'%s' is not a dynamic VHD", path);
+		ErrorStatus = RUFUS_ERROR(ERROR_BAD_FORMAT);
+		goto out;
+	}
+	disk_size = bswap_uint64(footer.current_size);
+
+	li.QuadPart = bswap_uint64(footer.data_offset);
+	if (!SetFilePointerEx(hImage, li, NULL, FILE_BEGIN) ||
+		!ReadFile(hImage, &header, sizeof(header), &size, NULL) || (size != sizeof(header)) ||
+		(memcmp(header.cookie, VHD_DYNAMIC_COOKIE, sizeof(header.cookie)) != 0)) {
+		uprintf("Could not read dynamic header from '%s'", path);
+		ErrorStatus = RUFUS_ERROR(ERROR_BAD_FORMAT);
+		goto out;
+	}
+	block_size = bswap_uint32(header.block_size);
+	nb_entries = bswap_uint32(header.max_table_entries);
+	if ((block_size == 0) || (block_size % 512 != 0) || (block_size > DD_BUFFER_SIZE) ||
+		((uint64_t)nb_entries * block_size < disk_size)) {
+		uprintf("Unsupported dynamic VHD layout (block size: %d, blocks: %d)", block_size, nb_entries);
+		ErrorStatus = RUFUS_ERROR(ERROR_BAD_FORMAT);
+		goto out;
+	}
+	// Each block is prefixed by a sector bitmap, padded to a 512-byte boundary
+	bitmap_size = ((block_size / 512 / 8) + 511) & ~511;
+
+	bat = (uint32_t*)malloc((size_t)nb_entries * sizeof(uint32_t));
+	buffer = (uint8_t*)_mm_malloc(DD_BUFFER_SIZE, SelectedDrive.SectorSize);
+	if ((bat == NULL) || (buffer == NULL)) {
+		ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		goto out;
+	}
+	li.QuadPart = bswap_uint64(header.table_offset);
+	if (!SetFilePointerEx(hImage, li, NULL, FILE_BEGIN) ||
+		!ReadFile(hImage, bat, nb_entries * sizeof(uint32_t), &size, NULL) ||
+		(size != nb_entries * sizeof(uint32_t))) {
+		uprintf("Could not read block allocation table from '%s': %s", path, WindowsErrorString());
+		ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+		goto out;
+	}
+	for (i = 0; i < nb_entries; i++) {
+		bat[i] = bswap_uint32(bat[i]);
+		if (bat[i] != VHD_BAT_UNUSED)
+			nb_allocated++;
+	}
+	uprintf("Writing sparse image: %s allocated out of %s",
+		SizeToHumanReadable((uint64_t)nb_allocated * block_size, FALSE, FALSE),
+		SizeToHumanReadable(disk_size, FALSE, FALSE));
+
+	for (i = 0; i < nb_entries; i += n) {
+		CHECK_FOR_USER_CANCEL;
+		if (bat[i] == VHD_BAT_UNUSED) {
+			n = 1;
+			continue;
+		}
+		// Coalesce a run of allocated blocks, as large as the buffer allows
+		for (n = 0; (i + n < nb_entries) && (bat[i + n] != VHD_BAT_UNUSED) &&
+			((n + 1) * block_size <= DD_BUFFER_SIZE); n++) {
+			li.QuadPart = (uint64_t)bat[i + n] * 512 + bitmap_size;
+			if (!SetFilePointerEx(hImage, li, NULL, FILE_BEGIN) ||
+				!ReadFile(hImage, &buffer[n * block_size], block_size, &size, NULL) || (size != block_size)) {
+				uprintf("Read error on block %d: %s", i + n, WindowsErrorString());
+				ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+				goto out;
+			}
+		}
+		offset = (uint64_t)i * block_size;
+		if (offset >= disk_size)
+			break;
+		length = min((uint64_t)n * block_size, disk_size - offset);
+		li.QuadPart = offset;
+		if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+			uprintf("Could not set position on target: %s", WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(ERROR_SEEK);
+			goto out;
+		}
+		if (!WriteFileWithRetry(hPhysicalDrive, buffer, (DWORD)length, NULL, WRITE_RETRIES)) {
+			if (!IS_ERROR(ErrorStatus))
+				ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+			goto out;
+		}
+		nb_written += n;
+		UpdateProgressWithInfo(OP_FORMAT, MSG_261, nb_written, nb_allocated);
+	}
+	ret = TRUE;
+
+out:
+	safe_mm_free(buffer);
+	safe_free(bat);
+	safe_closehandle(hImage);
+	return ret;
+}
+
 // Since we no longer have to deal with Windows 7, we can call on CreateVirtualDisk()
 // to backup a physical disk to VHD/VHDX. Now if this could also be used to create an
 // ISO from optical media that would be swell, but no matter what I tried, it didn't
@@ -586,17 +814,132 @@ static DWORD WINAPI FfuSaveImageThread(void* param)
 	ExitThread(r);
 }
 
+// Capture the file system of the selected drive into a WIM (LZX) or an ESD (solid LZMS)
+// image. Compression is spread over all the cores, and since wimlib stores file data as
+// blobs that are indexed by their SHA-1, duplicated files only get stored once. If the
+// target is an existing image of the same kind, the drive is appended to it, so that
+// successive revisions of a golden image only add the data that changed. Any other
+// existing file is only replaced once the new image has been written in full.
+static DWORD WINAPI WimSaveImageThread(void* param)
+{
+	DWORD r = ERROR_WRITE_FAULT;
+	IMG_SAVE* img_save = (IMG_SAVE*)param;
+	BOOL esd = (img_save->Type == VIRTUAL_STORAGE_TYPE_DEVICE_ESD), append = FALSE, replace = FALSE, created = FALSE;
+	enum wimlib_compression_type ctype = esd ? WIMLIB_COMPRESSION_TYPE_LZMS : WIMLIB_COMPRESSION_TYPE_LZX;
+	int i, wr = 0, write_flags = 0;
+	WIMStruct* wim = NULL;
+	struct wimlib_wim_info info = { 0 };
+	char src[4], name[64], desc[128], letters[27], *label, *write_path = img_save->ImagePath;
+	char tmp_path[MAX_PATH + 8];
+
+	wimlib_global_init(0);
+	wimlib_set_print_errors(true);
+	if (!GetDriveLabel(SelectedDrive.DeviceNumber, letters, &label, TRUE) || letters[0] == '\0') {
+		uprintf("Could not find a mounted volume to capture");
+		r = ERROR_NOT_FOUND;
+		goto out;
+	}
+	static_sprintf(src, "%c:\\", letters[0]);
+	static_strcpy(name, label);
+	static_sprintf(desc, "Created by %s (%s)", APPLICATION_NAME, RUFUS_URL);
+
+	if (PathFileExistsU(img_save->ImagePath)) {
+		if (wimlib_open_wimU(img_save->ImagePath, WIMLIB_OPEN_FLAG_WRITE_ACCESS, &wim) == 0) {
+			wimlib_get_wim_info(wim, &info);
+			if (info.compression_type == ctype) {
+				append = TRUE;
+				uprintf("Appending to existing image '%s' (%d image%s)", img_save->ImagePath,
+					info.image_count, (info.image_count == 1) ? "" : "s");
+				// Image names must be unique
+				for (i = info.image_count + 1; ; i++) {
+					static_sprintf(name, "%s (%d)", label, i);
+					if (!wimlib_image_name_in_useU(wim, name))
+						break;
+				}
+			} else {
+				uprintf("Replacing existing image '%s', which uses %S compression", img_save->ImagePath,
+					wimlib_get_compression_type_string(info.compression_type));
+				wimlib_free(wim);
+				wim = NULL;
+			}
+		} else {
+			uprintf("Replacing existing file '%s'", img_save->ImagePath);
+		}
+		if (!append) {
+			// Keep the existing file until we have something to replace it with
+			replace = TRUE;
+			static_sprintf(tmp_path, "%s.tmp", img_save->ImagePath);
+			write_path = tmp_path;
+		}
+	}
+	if (wim == NULL) {
+		wr = wimlib_create_new_wim(ctype, &wim);
+		if (wr != 0)
+			goto out;
+	}
+	wimlib_register_progress_function(wim, WimCaptureProgressFunc, NULL);
+	if (esd) {
+		wimlib_set_output_pack_compression_type(wim, WIMLIB_COMPRESSION_TYPE_LZMS);
+		write_flags |= WIMLIB_WRITE_FLAG_SOLID;
+	}
+
+	UpdateProgressWithInfoInit(NULL, FALSE);
+	// WIMLIB_ADD_FLAG_WINCONFIG excludes the page file, recycle bin, 'System Volume Information', etc.
+	wr = wimlib_add_imageU(wim, src, (name[0] == '\0') ? NULL : name, NULL, WIMLIB_ADD_FLAG_WINCONFIG);
+	if (wr != 0)
+		goto out;
+	wimlib_get_wim_info(wim, &info);
+	wimlib_set_image_descriptonU(wim, info.image_count, desc);
+
+	// A thread count of 0 has wimlib use all the available cores
+	if (append) {
+		wr = wimlib_overwrite(wim, write_flags, 0);
+	} else {
+		created = TRUE;
+		wr = wimlib_writeU(wim, write_path, WIMLIB_ALL_IMAGES, write_flags, 0);
+	}
+	if ((wr == 0) && replace && !MoveFileExU(write_path, img_save->ImagePath, MOVEFILE_REPLACE_EXISTING))
+		uprintf("Could not replace '%s': %s", img_save->ImagePath, WindowsErrorString());
+	else if (wr == 0)
+		r = 0;
+
+out:
+	if (wim != NULL)
+		wimlib_free(wim);
+	wimlib_global_cleanup();
+	if (r != 0) {
+		if (wr != 0)
+			uprintf("Failed to capture %s image: %S", esd ? "ESD" : "WIM", wimlib_get_error_string(wr));
+		// A failed append leaves the original image as it was, and we only ever
+		// delete a file that we created
+		if (created)
+			DeleteFileU(write_path);
+		if (!IS_ERROR(ErrorStatus))
+			ErrorStatus = RUFUS_ERROR(r);
+	} else {
+		uprintf("Saved '%s'", img_save->ImagePath);
+	}
+	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)TRUE, 0);
+	safe_free(img_save->DevicePath);
+	safe_free(img_save->ImagePath);
+	ExitThread(r);
+}
+
 BOOL SaveImage(void)
 {
-	UINT i;
+	UINT i, j;
 	static IMG_SAVE img_save;
 	char filename[128], letters[27], path[MAX_PATH];
 	int DriveIndex = ComboBox_GetCurSel(hDeviceList);
-	enum { image_type_vhd = 1, image_type_vhdx = 2, image_type_ffu = 3, image_type_iso = 4 };
+	enum { image_type_vhd = 1, image_type_vhdx, image_type_ffu, image_type_iso, image_type_wim, image_type_esd };
+	UINT img_type[] = { image_type_vhd, image_type_vhdx, image_type_ffu, image_type_iso, image_type_wim, image_type_esd };
 	// Add a non-printable zero-width space to UDF *.iso extension to differentiate it from ISO-9660
-	static EXT_DECL(img_ext, filename, __VA_GROUP__("*.vhd", "*.vhdx", "*.ffu", "*.iso"),
-		__VA_GROUP__(lmprintf(MSG_343), lmprintf(MSG_342), lmprintf(MSG_344), lmprintf(MSG_355)));
+	// Not static, since entries get moved around according to what the drive supports
+	EXT_DECL(img_ext, filename, __VA_GROUP__("*.vhd", "*.vhdx", "*.ffu", "*.iso", "*.wim", "*.esd"),
+		__VA_GROUP__(lmprintf(MSG_343), lmprintf(MSG_342), lmprintf(MSG_344), lmprintf(MSG_355),
+		lmprintf(MSG_356), lmprintf(MSG_357)));
 	ULARGE_INTEGER free_space;
+	LPTHREAD_START_ROUTINE save_thread;
 
 	memset(&img_save, 0, sizeof(IMG_SAVE));
 	if ((DriveIndex < 0) || (format_thread != NULL))
@@ -610,13 +953,16 @@ BOOL SaveImage(void)
 	if (has_ffu_support && SelectedDrive.PartitionStyle == PARTITION_STYLE_GPT) {
 		img_ext.count += 1;
 	} else {
-		// Move the ISO extension one place down
-		img_ext.extension[2] = img_ext.extension[3];
-		img_ext.description[2] = img_ext.description[3];
+		// Move the file system based extensions one place down
+		for (j = 2; j < ARRAYSIZE(img_type) - 1; j++) {
+			img_ext.extension[j] = img_ext.extension[j + 1];
+			img_ext.description[j] = img_ext.description[j + 1];
+			img_type[j] = img_type[j + 1];
+		}
 	}
-	// ISO support requires a mounted file system
+	// ISO, WIM and ESD support require a mounted file system
 	if (GetDriveLetters(SelectedDrive.DeviceNumber, letters) && letters[0] != '\0')
-		img_ext.count += 1;
+		img_ext.count += 3;
 	for (i = 1; i <= (UINT)img_ext.count && (safe_strcmp(save_image_type, &img_ext.extension[i - 1][2]) != '\0'); i++);
 	if (i > (UINT)img_ext.count)
 		i = image_type_vhdx;
@@ -631,6 +977,7 @@ BOOL SaveImage(void)
 	} else {
 		save_image_type = (char*)&img_ext.extension[i - 1][2];
 		WriteSettingStr(SETTING_PREFERRED_SAVE_IMAGE_TYPE, save_image_type);
+		i = img_type[i - 1];
 	}
 	switch (i) {
 	case image_type_vhd:
@@ -640,19 +987,14 @@ BOOL SaveImage(void)
 		img_save.Type = VIRTUAL_STORAGE_TYPE_DEVICE_FFU;
 		break;
 	case image_type_iso:
-		// ISO requires oscdimg.exe. If not already present, attempt to download it.
-		static_sprintf(path, "%s\\%s\\oscdimg.exe", app_data_dir, FILES_DIR);
-		if (!PathFileExistsU(path)) {
-			if (MessageBoxExU(hMainDialog, lmprintf(MSG_337, "oscdimg.exe"), lmprintf(MSG_115),
-				MB_YESNO | MB_ICONWARNING | MB_IS_RTL, selected_langid) != IDYES)
-				goto out;
-			IGNORE_RETVAL(_chdirU(app_data_dir));
-			IGNORE_RETVAL(_mkdir(FILES_DIR));
-			if (DownloadToFileOrBufferEx(OSCDIMG_URL, path, SYMBOL_SERVER_USER_AGENT, NULL, hMainDialog, FALSE) < 64 * KB)
-				goto out;
-		}
 		img_save.Type = VIRTUAL_STORAGE_TYPE_DEVICE_ISO;
 		break;
+	case image_type_wim:
+		img_save.Type = VIRTUAL_STORAGE_TYPE_DEVICE_WIM;
+		break;
+	case image_type_esd:
+		img_save.Type = VIRTUAL_STORAGE_TYPE_DEVICE_ESD;
+		break;
 	default:
 		img_save.Type = VIRTUAL_STORAGE_TYPE_DEVICE_VHDX;
 		break;
@@ -678,9 +1020,22 @@ BOOL SaveImage(void)
 		EnableControls(FALSE, FALSE);
 		ErrorStatus = 0;
 		InitProgress(TRUE);
-		format_thread = CreateThread(NULL, 0, img_save.Type == VIRTUAL_STORAGE_TYPE_DEVICE_FFU ?
-			FfuSaveImageThread : (img_save.Type == VIRTUAL_STORAGE_TYPE_DEVICE_ISO ? IsoSaveImageThread : VhdSaveImageThread),
-			&img_save, 0, NULL);
+		switch (img_save.Type) {
+		case VIRTUAL_STORAGE_TYPE_DEVICE_FFU:
+			save_thread = FfuSaveImageThread;
+			break;
+		case VIRTUAL_STORAGE_TYPE_DEVICE_ISO:
+			save_thread = IsoSaveImageThread;
+			break;
+		case VIRTUAL_STORAGE_TYPE_DEVICE_WIM:
+		case VIRTUAL_STORAGE_TYPE_DEVICE_ESD:
+			save_thread = WimSaveImageThread;
+			break;
+		default:
+			save_thread = VhdSaveImageThread;
+			break;
+		}
+		format_thread = CreateThread(NULL, 0, save_thread, &img_save, 0, NULL);
 		if (format_thread != NULL) {
 			uprintf("\r\nSave to image operation started");
 			PrintInfo(0, -1);
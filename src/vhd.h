@@ -37,6 +37,8 @@
 #define MBR_SIZE							512	// Might need to review this once we see bootable 4k systems
 
 #define VIRTUAL_STORAGE_TYPE_DEVICE_FFU                    99
+#define VIRTUAL_STORAGE_TYPE_DEVICE_WIM                    100
+#define VIRTUAL_STORAGE_TYPE_DEVICE_ESD                    101
 #define CREATE_VIRTUAL_DISK_VERSION_2                       2
 #define CREATE_VIRTUAL_DISK_FLAG_CREATE_BACKING_STORAGE     8
 
@@ -79,6 +81,50 @@ typedef struct
 	};
 } STOPGAP_CREATE_VIRTUAL_DISK_PARAMETERS;
 
+// VHD footer and dynamic disk header, as per Microsoft's "Virtual Hard Disk Image
+// Format Specification". Note that all the fields are stored in big-endian order.
+#define VHD_FOOTER_COOKIE                   "conectix"
+#define VHD_DYNAMIC_COOKIE                  "cxsparse"
+#define VHD_DISK_TYPE_DYNAMIC               3
+#define VHD_BAT_UNUSED                      0xFFFFFFFF
+
+#pragma pack(push, 1)
+typedef struct {
+	char     cookie[8];
+	uint32_t features;
+	uint32_t file_format_version;
+	uint64_t data_offset;
+	uint32_t timestamp;
+	char     creator_app[4];
+	uint32_t creator_version;
+	uint32_t creator_host_os;
+	uint64_t original_size;
+	uint64_t current_size;
+	uint32_t disk_geometry;
+	uint32_t disk_type;
+	uint32_t checksum;
+	uint8_t  unique_id[16];
+	uint8_t  saved_state;
+	uint8_t  reserved[427];
+} vhd_footer;
+
+typedef struct {
+	char     cookie[8];
+	uint64_t data_offset;
+	uint64_t table_offset;
+	uint32_t header_version;
+	uint32_t max_table_entries;
+	uint32_t block_size;
+	uint32_t checksum;
+	uint8_t  parent_unique_id[16];
+	uint32_t parent_timestamp;
+	uint32_t reserved1;
+	uint16_t parent_unicode_name[256];
+	uint8_t  parent_locator_entry[8][24];
+	uint8_t  reserved2[256];
+} vhd_dynamic_header;
+#pragma pack(pop)
+
 // From https://docs.microsoft.com/en-us/previous-versions/msdn10/dd834960(v=msdn.10)
 // as well as https://msfn.org/board/topic/150700-wimgapi-wimmountimage-progressbar/
 enum WIMMessage {
@@ -111,6 +157,8 @@ extern int8_t IsBootableImage(const char* path);
 extern char* VhdMountImageAndGetSize(const char* path, uint64_t* disksize);
 #define VhdMountImage(path) VhdMountImageAndGetSize(path, NULL)
 extern void VhdUnmountImage(void);
+extern char* VhdCreateSparseImage(const char* path, uint64_t disk_size);
+extern BOOL VhdWriteSparseImage(HANDLE hPhysicalDrive, const char* path);
 extern BOOL SaveImage(void);
 extern void OpticalDiscSaveImage(void);
 extern DWORD WINAPI IsoSaveImageThread(void* param);
@@ -0,0 +1,273 @@
+/*
+ * arena.c - bulk allocation of the in-memory metadata of a WIM image
+ *
+ * A Windows installation image contains several hundred thousand files, and
+ * loading its metadata resource used to mean as many separate allocations of
+ * dentries, inodes and names, followed by as many frees when the image was
+ * unloaded.  Instead, read_metadata_resource() now creates an arena for the
+ * image, and everything that is read from the metadata resource is carved out
+ * of large chunks, in the order in which it is read.  File names and stream
+ * names are also interned, since the same names occur over and over again in a
+ * Windows image (hard links between WinSxS and System32, language directories,
+ * short names, etc.).
+ */
+
+/*
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include "wimlib/arena.h"
+#include "wimlib/util.h"
+
+/* Alignment of the allocations made with arena_alloc().  This is enough for
+ * any of the in-memory metadata structures.  */
+#define ARENA_ALIGNMENT		8
+
+/* Bounds on the size of the chunks the arena is carved out of.  The actual
+ * size depends on the size of the metadata resource.  */
+#define ARENA_MIN_CHUNK_SIZE	(64 << 10)
+#define ARENA_MAX_CHUNK_SIZE	(4 << 20)
+
+/* Initial number of slots in the name table.  Must be a power of 2.  */
+#define ARENA_INITIAL_NAMES	4096
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	PRAGMA_ALIGN(u8 data[], ARENA_ALIGNMENT);
+};
+
+struct arena_name {
+	const utf16lechar *name;
+	u32 hash;
+	u32 nbytes;
+};
+
+struct wim_arena {
+	/* Chunk that allocations are currently made from, at the head of the
+	 * list of all the chunks.  */
+	struct arena_chunk *chunks;
+	u8 *next;
+	u8 *end;
+	size_t chunk_size;
+
+	/* Open addressing hash table of the interned names, which are
+	 * themselves stored in the chunks.  */
+	struct arena_name *names;
+	size_t num_names;
+	size_t names_mask;
+};
+
+struct wim_arena *
+new_arena(size_t size_hint)
+{
+	struct wim_arena *arena;
+
+	arena = CALLOC(1, sizeof(*arena));
+	if (!arena)
+		return NULL;
+
+	/* The in-memory structures take up about as much space as the
+	 * uncompressed metadata resource, so aim for a few dozen chunks.  */
+	arena->chunk_size = ALIGN(size_hint / 32, ARENA_ALIGNMENT);
+	if (arena->chunk_size < ARENA_MIN_CHUNK_SIZE)
+		arena->chunk_size = ARENA_MIN_CHUNK_SIZE;
+	if (arena->chunk_size > ARENA_MAX_CHUNK_SIZE)
+		arena->chunk_size = ARENA_MAX_CHUNK_SIZE;
+
+	arena->names = CALLOC(ARENA_INITIAL_NAMES, sizeof(arena->names[0]));
+	if (!arena->names) {
+		FREE(arena);
+		return NULL;
+	}
+	arena->names_mask = ARENA_INITIAL_NAMES - 1;
+	return arena;
+}
+
+void
+free_arena(struct wim_arena *arena)
+{
+	struct arena_chunk *chunk, *next;
+
+	if (!arena)
+		return;
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		FREE(chunk);
+	}
+	FREE(arena->names);
+	FREE(arena);
+}
+
+static struct arena_chunk *
+new_chunk(size_t size)
+{
+	struct arena_chunk *chunk;
+
+	chunk = MALLOC(sizeof(*chunk) + size);
+	if (chunk)
+		chunk->size = size;
+	return chunk;
+}
+
+static void *
+arena_alloc_aligned(struct wim_arena *arena, size_t size, size_t alignment)
+{
+	struct arena_chunk *chunk;
+	u8 *p;
+
+	p = (u8 *)ALIGN((uintptr_t)arena->next, alignment);
+	if (likely(arena->next && size <= (size_t)(arena->end - p))) {
+		arena->next = p + size;
+		return p;
+	}
+
+	/* Allocations that would waste too much of a fresh chunk get one of
+	 * their own, which is linked behind the current chunk so that the
+	 * space left in the latter can still be used.  */
+	if (size > arena->chunk_size / 8) {
+		chunk = new_chunk(size);
+		if (!chunk)
+			return NULL;
+		if (arena->chunks) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = NULL;
+			arena->chunks = chunk;
+			arena->next = chunk->data + size;
+			arena->end = arena->next;
+		}
+		return chunk->data;
+	}
+
+	chunk = new_chunk(arena->chunk_size);
+	if (!chunk)
+		return NULL;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->next = chunk->data + size;
+	arena->end = chunk->data + chunk->size;
+	return chunk->data;
+}
+
+/* Allocate @size bytes from the arena.  The memory is released by
+ * free_arena().  */
+void *
+arena_alloc(struct wim_arena *arena, size_t size)
+{
+	return arena_alloc_aligned(arena, ALIGN(size, ARENA_ALIGNMENT),
+				   ARENA_ALIGNMENT);
+}
+
+/* Like arena_alloc(), but zero the memory.  */
+void *
+arena_calloc(struct wim_arena *arena, size_t size)
+{
+	void *p = arena_alloc(arena, size);
+
+	if (p)
+		memset(p, 0, size);
+	return p;
+}
+
+static u32
+hash_name(const u8 *name, size_t nbytes)
+{
+	u32 hash = 2166136261U;
+
+	for (size_t i = 0; i < nbytes; i++)
+		hash = (hash ^ name[i]) * 16777619U;
+	return hash;
+}
+
+static bool
+grow_names(struct wim_arena *arena)
+{
+	size_t new_mask = (arena->names_mask << 1) | 1;
+	struct arena_name *new_names;
+
+	new_names = CALLOC(new_mask + 1, sizeof(new_names[0]));
+	if (!new_names)
+		return false;
+	for (size_t i = 0; i <= arena->names_mask; i++) {
+		struct arena_name *ent = &arena->names[i];
+		size_t j;
+
+		if (!ent->name)
+			continue;
+		for (j = ent->hash & new_mask; new_names[j].name;
+		     j = (j + 1) & new_mask)
+			;
+		new_names[j] = *ent;
+	}
+	FREE(arena->names);
+	arena->names = new_names;
+	arena->names_mask = new_mask;
+	return true;
+}
+
+/*
+ * Return a null-terminated copy of the UTF-16LE name @name, which is
+ * @name_nbytes bytes long, excluding the (absent) null terminator.  Identical
+ * names share the same copy, so the returned string must be treated as
+ * read-only.  Returns NULL if out of memory.
+ */
+utf16lechar *
+arena_intern_utf16le(struct wim_arena *arena, const void *name,
+		     size_t name_nbytes)
+{
+	u32 hash = hash_name(name, name_nbytes);
+	struct arena_name *ent;
+	utf16lechar *dup;
+	size_t i;
+
+	for (i = hash & arena->names_mask; arena->names[i].name;
+	     i = (i + 1) & arena->names_mask)
+	{
+		ent = &arena->names[i];
+		if (ent->hash == hash && ent->nbytes == name_nbytes &&
+		    !memcmp(ent->name, name, name_nbytes))
+			return (utf16lechar *)ent->name;
+	}
+
+	dup = arena_alloc_aligned(arena, name_nbytes + sizeof(utf16lechar),
+				  sizeof(utf16lechar));
+	if (!dup)
+		return NULL;
+	memcpy(dup, name, name_nbytes);
+	dup[name_nbytes / sizeof(utf16lechar)] = 0;
+
+	/* Keep the load factor at or below 1/2.  If the table can't be grown,
+	 * the name is still valid; it just won't be shared.  */
+	if ((arena->num_names + 1) * 2 > arena->names_mask + 1) {
+		if (!grow_names(arena))
+			return dup;
+		for (i = hash & arena->names_mask; arena->names[i].name;
+		     i = (i + 1) & arena->names_mask)
+			;
+	}
+	ent = &arena->names[i];
+	ent->name = dup;
+	ent->hash = hash;
+	ent->nbytes = name_nbytes;
+	arena->num_names++;
+	return dup;
+}
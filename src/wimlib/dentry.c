@@ -61,6 +61,7 @@
 
 #include <errno.h>
 
+#include "wimlib/arena.h"
 #include "wimlib/assert.h"
 #include "wimlib/dentry.h"
 #include "wimlib/inode.h"
@@ -228,13 +229,17 @@ static void
 do_dentry_set_name(struct wim_dentry *dentry, utf16lechar *name,
 		   size_t name_nbytes)
 {
-	FREE(dentry->d_name);
+	if (!dentry->d_name_in_arena)
+		FREE(dentry->d_name);
 	dentry->d_name = name;
 	dentry->d_name_nbytes = name_nbytes;
+	dentry->d_name_in_arena = 0;
 
 	if (dentry_has_short_name(dentry)) {
-		FREE(dentry->d_short_name);
+		if (!dentry->d_short_name_in_arena)
+			FREE(dentry->d_short_name);
 		dentry->d_short_name = NULL;
+		dentry->d_short_name_in_arena = 0;
 		dentry->d_short_name_nbytes = 0;
 	}
 }
@@ -961,10 +966,13 @@ free_dentry(struct wim_dentry *dentry)
 {
 	if (dentry) {
 		d_disassociate(dentry);
-		FREE(dentry->d_name);
-		FREE(dentry->d_short_name);
+		if (!dentry->d_name_in_arena)
+			FREE(dentry->d_name);
+		if (!dentry->d_short_name_in_arena)
+			FREE(dentry->d_short_name);
 		FREE(dentry->d_full_path);
-		FREE(dentry);
+		if (!dentry->d_in_arena)
+			FREE(dentry);
 	}
 }
 
@@ -1114,16 +1122,19 @@ unlink_dentry(struct wim_dentry *dentry)
 }
 
 static int
-read_extra_data(const u8 *p, const u8 *end, struct wim_inode *inode)
+read_extra_data(const u8 *p, const u8 *end, struct wim_inode *inode,
+		struct wim_arena *arena)
 {
 	while (((uintptr_t)p & 7) && p < end)
 		p++;
 
 	if (unlikely(p < end)) {
-		inode->i_extra = MALLOC(sizeof(struct wim_inode_extra) +
-					end - p);
+		inode->i_extra = arena_alloc(arena,
+					     sizeof(struct wim_inode_extra) +
+						end - p);
 		if (!inode->i_extra)
 			return WIMLIB_ERR_NOMEM;
+		inode->i_extra_in_arena = 1;
 		inode->i_extra->size = end - p;
 		memcpy(inode->i_extra->data, p, end - p);
 	}
@@ -1227,17 +1238,18 @@ assign_stream_types_unencrypted(struct wim_inode *inode)
 static int
 setup_inode_streams(const u8 *p, const u8 *end, struct wim_inode *inode,
 		    unsigned num_extra_streams, const u8 *main_hash,
-		    u64 *offset_p)
+		    u64 *offset_p, struct wim_arena *arena)
 {
 	const u8 *orig_p = p;
 
 	inode->i_num_streams = 1 + num_extra_streams;
 
 	if (unlikely(inode->i_num_streams > ARRAY_LEN(inode->i_embedded_streams))) {
-		inode->i_streams = CALLOC(inode->i_num_streams,
-					  sizeof(inode->i_streams[0]));
+		inode->i_streams = arena_calloc(arena, inode->i_num_streams *
+						sizeof(inode->i_streams[0]));
 		if (!inode->i_streams)
 			return WIMLIB_ERR_NOMEM;
+		inode->i_streams_in_arena = 1;
 	}
 
 	/* Use main_hash for the first stream. */
@@ -1294,10 +1306,12 @@ setup_inode_streams(const u8 *p, const u8 *end, struct wim_inode *inode,
 			    name_nbytes > length)
 				return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
 
-			strm->stream_name = utf16le_dupz(disk_strm->name,
-							 name_nbytes);
+			strm->stream_name = arena_intern_utf16le(arena,
+								 disk_strm->name,
+								 name_nbytes);
 			if (!strm->stream_name)
 				return WIMLIB_ERR_NOMEM;
+			strm->stream_name_in_arena = 1;
 		} else {
 			strm->stream_name = (utf16lechar *)NO_STREAM_NAME;
 		}
@@ -1323,10 +1337,11 @@ setup_inode_streams(const u8 *p, const u8 *end, struct wim_inode *inode,
 }
 
 /* Read a dentry, including all extra stream entries that follow it, from an
- * uncompressed metadata resource buffer.  */
+ * uncompressed metadata resource buffer.  The dentry, its inode and everything
+ * they point to are allocated from @arena.  */
 static int
-read_dentry(const u8 * restrict buf, size_t buf_len,
-	    u64 *offset_p, struct wim_dentry **dentry_ret)
+read_dentry(const u8 * restrict buf, size_t buf_len, u64 *offset_p,
+	    struct wim_arena *arena, struct wim_dentry **dentry_ret)
 {
 	u64 offset = *offset_p;
 	u64 length;
@@ -1373,11 +1388,17 @@ read_dentry(const u8 * restrict buf, size_t buf_len,
 		return WIMLIB_ERR_INVALID_METADATA_RESOURCE;
 
 	/* Allocate new dentry structure, along with a preliminary inode.  */
-	ret = new_dentry_with_new_inode(NULL, false, &dentry);
-	if (ret)
-		return ret;
+	dentry = arena_calloc(arena, sizeof(struct wim_dentry));
+	if (!dentry)
+		return WIMLIB_ERR_NOMEM;
+	dentry->d_in_arena = 1;
+	dentry->d_parent = dentry;
 
-	inode = dentry->d_inode;
+	inode = new_arena_inode(dentry, arena);
+	if (!inode) {
+		free_dentry(dentry);
+		return WIMLIB_ERR_NOMEM;
+	}
 
 	/* Read more fields: some into the dentry, and some into the inode.  */
 	inode->i_attributes = le32_to_cpu(disk_dentry->attributes);
@@ -1425,30 +1446,33 @@ read_dentry(const u8 * restrict buf, size_t buf_len,
 	/* Read the filename if present.  Note: if the filename is empty, there
 	 * is no null terminator following it.  */
 	if (name_nbytes) {
-		dentry->d_name = utf16le_dupz(p, name_nbytes);
+		dentry->d_name = arena_intern_utf16le(arena, p, name_nbytes);
 		if (unlikely(!dentry->d_name)) {
 			ret = WIMLIB_ERR_NOMEM;
 			goto err_free_dentry;
 		}
 		dentry->d_name_nbytes = name_nbytes;
+		dentry->d_name_in_arena = 1;
 		p += (u32)name_nbytes + 2;
 	}
 
 	/* Read the short filename if present.  Note: if there is no short
 	 * filename, there is no null terminator following it. */
 	if (short_name_nbytes) {
-		dentry->d_short_name = utf16le_dupz(p, short_name_nbytes);
+		dentry->d_short_name = arena_intern_utf16le(arena, p,
+							    short_name_nbytes);
 		if (unlikely(!dentry->d_short_name)) {
 			ret = WIMLIB_ERR_NOMEM;
 			goto err_free_dentry;
 		}
 		dentry->d_short_name_nbytes = short_name_nbytes;
+		dentry->d_short_name_in_arena = 1;
 		p += (u32)short_name_nbytes + 2;
 	}
 
 	/* Read extra data at end of dentry (but before extra stream entries).
 	 * This may contain tagged metadata items.  */
-	ret = read_extra_data(p, &buf[offset + length], inode);
+	ret = read_extra_data(p, &buf[offset + length], inode, arena);
 	if (ret)
 		goto err_free_dentry;
 
@@ -1460,7 +1484,7 @@ read_dentry(const u8 * restrict buf, size_t buf_len,
 				  inode,
 				  le16_to_cpu(disk_dentry->num_extra_streams),
 				  disk_dentry->main_hash,
-				  &offset);
+				  &offset, arena);
 	if (ret)
 		goto err_free_dentry;
 
@@ -1531,7 +1555,8 @@ should_ignore_dentry(struct wim_dentry *dir, const struct wim_dentry *dentry)
 
 static int
 read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
-			   struct wim_dentry * restrict dir, unsigned depth)
+			   struct wim_dentry * restrict dir,
+			   struct wim_arena *arena, unsigned depth)
 {
 	u64 cur_offset = dir->d_subdir_offset;
 
@@ -1547,7 +1572,7 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
 		int ret;
 
 		/* Read next child of @dir.  */
-		ret = read_dentry(buf, buf_len, &cur_offset, &child);
+		ret = read_dentry(buf, buf_len, &cur_offset, arena, &child);
 		if (ret)
 			return ret;
 
@@ -1582,6 +1607,7 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
 				ret = read_dentry_tree_recursive(buf,
 								 buf_len,
 								 child,
+								 arena,
 								 depth + 1);
 				if (ret)
 					return ret;
@@ -1606,6 +1632,10 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
  * @root_offset
  *	Offset in the metadata resource of the root of the dentry tree.
  *
+ * @arena:
+ *	Metadata arena of the image, from which the dentries, inodes and names
+ *	are allocated.  It must outlive the dentry tree.
+ *
  * @root_ret:
  *	On success, either NULL or a pointer to the root dentry is written to
  *	this location.  The former case only occurs in the unexpected case that
@@ -1617,13 +1647,13 @@ read_dentry_tree_recursive(const u8 * restrict buf, size_t buf_len,
  *	WIMLIB_ERR_NOMEM
  */
 int
-read_dentry_tree(const u8 *buf, size_t buf_len,
-		 u64 root_offset, struct wim_dentry **root_ret)
+read_dentry_tree(const u8 *buf, size_t buf_len, u64 root_offset,
+		 struct wim_arena *arena, struct wim_dentry **root_ret)
 {
 	int ret;
 	struct wim_dentry *root;
 
-	ret = read_dentry(buf, buf_len, &root_offset, &root);
+	ret = read_dentry(buf, buf_len, &root_offset, arena, &root);
 	if (ret)
 		return ret;
 
@@ -1643,7 +1673,8 @@ read_dentry_tree(const u8 *buf, size_t buf_len,
 		}
 
 		if (likely(root->d_subdir_offset != 0)) {
-			ret = read_dentry_tree_recursive(buf, buf_len, root, 0);
+			ret = read_dentry_tree_recursive(buf, buf_len, root,
+							 arena, 0);
 			if (ret)
 				goto err_free_dentry_tree;
 		}
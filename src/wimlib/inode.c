@@ -30,6 +30,7 @@
 
 #include <errno.h>
 
+#include "wimlib/arena.h"
 #include "wimlib/assert.h"
 #include "wimlib/blob_table.h"
 #include "wimlib/dentry.h"
@@ -44,16 +45,10 @@
  */
 const utf16lechar NO_STREAM_NAME[1];
 
-/* Allocate a new inode and associate the specified dentry with it.  */
-struct wim_inode *
-new_inode(struct wim_dentry *dentry, bool set_timestamps)
+static void
+init_inode(struct wim_inode *inode, struct wim_dentry *dentry,
+	   bool set_timestamps)
 {
-	struct wim_inode *inode;
-
-	inode = CALLOC(1, sizeof(struct wim_inode));
-	if (!inode)
-		return NULL;
-
 	inode->i_security_id = -1;
 	/*inode->i_nlink = 0;*/
 	inode->i_rp_flags = WIM_RP_FLAG_NOT_FIXED;
@@ -66,13 +61,40 @@ new_inode(struct wim_dentry *dentry, bool set_timestamps)
 		inode->i_last_write_time = now;
 	}
 	d_associate(dentry, inode);
+}
+
+/* Allocate a new inode and associate the specified dentry with it.  */
+struct wim_inode *
+new_inode(struct wim_dentry *dentry, bool set_timestamps)
+{
+	struct wim_inode *inode;
+
+	inode = CALLOC(1, sizeof(struct wim_inode));
+	if (!inode)
+		return NULL;
+	init_inode(inode, dentry, set_timestamps);
+	return inode;
+}
+
+/* Like new_inode(), but allocate the inode from a metadata arena and leave the
+ * timestamps at 0.  */
+struct wim_inode *
+new_arena_inode(struct wim_dentry *dentry, struct wim_arena *arena)
+{
+	struct wim_inode *inode;
+
+	inode = arena_calloc(arena, sizeof(struct wim_inode));
+	if (!inode)
+		return NULL;
+	inode->i_in_arena = 1;
+	init_inode(inode, dentry, false);
 	return inode;
 }
 
 static inline void
 destroy_stream(struct wim_inode_stream *strm)
 {
-	if (strm->stream_name != NO_STREAM_NAME)
+	if (strm->stream_name != NO_STREAM_NAME && !strm->stream_name_in_arena)
 		FREE(strm->stream_name);
 }
 
@@ -81,13 +103,15 @@ free_inode(struct wim_inode *inode)
 {
 	for (unsigned i = 0; i < inode->i_num_streams; i++)
 		destroy_stream(&inode->i_streams[i]);
-	if (inode->i_streams != inode->i_embedded_streams)
+	if (inode->i_streams != inode->i_embedded_streams &&
+	    !inode->i_streams_in_arena)
 		FREE(inode->i_streams);
-	if (inode->i_extra)
+	if (inode->i_extra && !inode->i_extra_in_arena)
 		FREE(inode->i_extra);
 	if (!hlist_unhashed(&inode->i_hlist_node))
 		hlist_del(&inode->i_hlist_node);
-	FREE(inode);
+	if (!inode->i_in_arena)
+		FREE(inode);
 }
 
 static inline void
@@ -275,10 +299,14 @@ inode_add_stream(struct wim_inode *inode, int stream_type,
 	struct wim_inode_stream *streams;
 	struct wim_inode_stream *new_strm;
 
-	if (inode->i_streams == inode->i_embedded_streams) {
-		if (inode->i_num_streams < ARRAY_LEN(inode->i_embedded_streams)) {
+	if (inode->i_streams == inode->i_embedded_streams ||
+	    inode->i_streams_in_arena) {
+		if (inode->i_streams == inode->i_embedded_streams &&
+		    inode->i_num_streams < ARRAY_LEN(inode->i_embedded_streams)) {
 			streams = inode->i_embedded_streams;
 		} else {
+			/* An array from the metadata arena can't be resized
+			 * in place, so move it to the heap.  */
 			streams = MALLOC((inode->i_num_streams + 1) *
 						sizeof(inode->i_streams[0]));
 			if (!streams)
@@ -287,6 +315,7 @@ inode_add_stream(struct wim_inode *inode, int stream_type,
 			       (inode->i_num_streams *
 					sizeof(inode->i_streams[0])));
 			inode->i_streams = streams;
+			inode->i_streams_in_arena = 0;
 		}
 	} else {
 		streams = REALLOC(inode->i_streams,
@@ -109,9 +109,19 @@ inode_add_tagged_item(struct wim_inode *inode, u32 tag, u32 len)
 
 	wimlib_assert(oldsize % 8 == 0);
 
-	extra = REALLOC(inode->i_extra, sizeof(*extra) + newsize);
-	if (!extra)
-		return NULL;
+	if (inode->i_extra_in_arena) {
+		/* Extra data from the metadata arena can't be resized in
+		 * place, so move it to the heap.  */
+		extra = MALLOC(sizeof(*extra) + newsize);
+		if (!extra)
+			return NULL;
+		memcpy(extra, inode->i_extra, sizeof(*extra) + oldsize);
+		inode->i_extra_in_arena = 0;
+	} else {
+		extra = REALLOC(inode->i_extra, sizeof(*extra) + newsize);
+		if (!extra)
+			return NULL;
+	}
 	inode->i_extra = extra;
 	extra->size = newsize;
 	hdr = (struct tagged_item_header *)&extra->data[oldsize];
@@ -106,6 +106,11 @@ struct update_primitive {
 
 			/* The old name.  */
 			utf16lechar *old_name;
+
+			/* Whether the old name is interned in the metadata
+			 * arena of the image, and therefore must not be freed
+			 * when the change is committed.  */
+			bool old_name_in_arena;
 		} name;
 	};
 };
@@ -318,11 +323,15 @@ rollback_update_primitive(const struct update_primitive *prim,
 		rollback_name_change(prim->name.old_name,
 				     &prim->name.subject->d_name,
 				     &prim->name.subject->d_name_nbytes);
+		prim->name.subject->d_name_in_arena =
+			prim->name.old_name_in_arena;
 		break;
 	case CHANGE_SHORT_NAME:
 		rollback_name_change(prim->name.old_name,
 				     &prim->name.subject->d_short_name,
 				     &prim->name.subject->d_short_name_nbytes);
+		prim->name.subject->d_short_name_in_arena =
+			prim->name.old_name_in_arena;
 		break;
 	}
 }
@@ -422,6 +431,7 @@ journaled_change_name(struct update_command_journal *j,
 	prim.type = CHANGE_FILE_NAME;
 	prim.name.subject = dentry;
 	prim.name.old_name = dentry->d_name;
+	prim.name.old_name_in_arena = dentry->d_name_in_arena;
 	ret = record_update_primitive(j, prim);
 	if (ret) {
 		FREE(new_name);
@@ -430,17 +440,20 @@ journaled_change_name(struct update_command_journal *j,
 
 	dentry->d_name = new_name;
 	dentry->d_name_nbytes = new_name_nbytes;
+	dentry->d_name_in_arena = 0;
 
 	/* Clear the short name.  */
 	prim.type = CHANGE_SHORT_NAME;
 	prim.name.subject = dentry;
 	prim.name.old_name = dentry->d_short_name;
+	prim.name.old_name_in_arena = dentry->d_short_name_in_arena;
 	ret = record_update_primitive(j, prim);
 	if (ret)
 		return ret;
 
 	dentry->d_short_name = NULL;
 	dentry->d_short_name_nbytes = 0;
+	dentry->d_short_name_in_arena = 0;
 	return 0;
 }
 
@@ -457,8 +470,9 @@ commit_update(struct update_command_journal *j)
 	{
 		for (size_t k = 0; k < j->cmd_prims[i].num_entries; k++)
 		{
-			if (j->cmd_prims[i].entries[k].type == CHANGE_FILE_NAME ||
-			    j->cmd_prims[i].entries[k].type == CHANGE_SHORT_NAME)
+			if ((j->cmd_prims[i].entries[k].type == CHANGE_FILE_NAME ||
+			     j->cmd_prims[i].entries[k].type == CHANGE_SHORT_NAME) &&
+			    !j->cmd_prims[i].entries[k].name.old_name_in_arena)
 			{
 				FREE(j->cmd_prims[i].entries[k].name.old_name);
 			}
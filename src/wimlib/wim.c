@@ -31,6 +31,7 @@
 #include <unistd.h>
 
 #include "wimlib.h"
+#include "wimlib/arena.h"
 #include "wimlib/assert.h"
 #include "wimlib/blob_table.h"
 #include "wimlib/cpu_features.h"
@@ -203,6 +204,8 @@ unload_image_metadata(struct wim_image_metadata *imd)
 {
 	free_dentry_tree(imd->root_dentry, NULL);
 	imd->root_dentry = NULL;
+	free_arena(imd->arena);
+	imd->arena = NULL;
 	free_wim_security_data(imd->security_data);
 	imd->security_data = NULL;
 	INIT_HLIST_HEAD(&imd->inode_list);
@@ -2727,6 +2727,26 @@ wimlib_add_image(WIMStruct *wim,
 		 const wimlib_tchar *config_file,
 		 int add_flags);
 
+#ifdef _RUFUS
+static __inline int
+wimlib_add_imageU(WIMStruct *wim,
+		 const char *source,
+		 const char *name,
+		 const char *config_file,
+		 int add_flags)
+{
+	int r;
+	wconvert(source);
+	wconvert(name);
+	wconvert(config_file);
+	r = wimlib_add_image(wim, wsource, wname, wconfig_file, add_flags);
+	wfree(source);
+	wfree(name);
+	wfree(config_file);
+	return r;
+}
+#endif
+
 /**
  * @ingroup G_modifying_wims
  *
@@ -3478,6 +3498,17 @@ wimlib_global_cleanup(void);
 WIMLIBAPI bool
 wimlib_image_name_in_use(const WIMStruct *wim, const wimlib_tchar *name);
 
+#ifdef _RUFUS
+static __inline bool
+wimlib_image_name_in_useU(const WIMStruct *wim, const char *name)
+{
+	wconvert(name);
+	bool r = wimlib_image_name_in_use(wim, wname);
+	wfree(name);
+	return r;
+}
+#endif
+
 /**
  * @ingroup G_wim_information
  *
@@ -4175,6 +4206,18 @@ WIMLIBAPI int
 wimlib_set_image_descripton(WIMStruct *wim, int image,
 			    const wimlib_tchar *description);
 
+#ifdef _RUFUS
+static __inline int
+wimlib_set_image_descriptonU(WIMStruct *wim, int image,
+			    const char *description)
+{
+	wconvert(description);
+	int r = wimlib_set_image_descripton(wim, image, wdescription);
+	wfree(description);
+	return r;
+}
+#endif
+
 /**
  * @ingroup G_modifying_wims
  *
@@ -4703,6 +4746,21 @@ wimlib_write(WIMStruct *wim,
 	     int write_flags,
 	     unsigned num_threads);
 
+#ifdef _RUFUS
+static __inline int
+wimlib_writeU(WIMStruct *wim,
+	     const char *path,
+	     int image,
+	     int write_flags,
+	     unsigned num_threads)
+{
+	wconvert(path);
+	int r = wimlib_write(wim, wpath, image, write_flags, num_threads);
+	wfree(path);
+	return r;
+}
+#endif
+
 /**
  * @ingroup G_writing_and_overwriting_wims
  *
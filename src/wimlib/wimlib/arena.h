@@ -0,0 +1,36 @@
+/*
+ * arena.h - bulk allocation of the in-memory metadata of a WIM image
+ */
+
+#ifndef _WIMLIB_ARENA_H
+#define _WIMLIB_ARENA_H
+
+#include "wimlib/types.h"
+
+/*
+ * A metadata arena owns the dentries, inodes, stream arrays, extra data and
+ * names that are created when a metadata resource is read.  These are carved
+ * out of large chunks, so that the structures for an image end up packed
+ * together in memory, and they are all released at once when the image is
+ * unloaded.  Memory obtained from an arena must never be passed to FREE(); the
+ * structures that may point into an arena carry a flag that says so.
+ */
+struct wim_arena;
+
+struct wim_arena *
+new_arena(size_t size_hint);
+
+void
+free_arena(struct wim_arena *arena);
+
+void *
+arena_alloc(struct wim_arena *arena, size_t size);
+
+void *
+arena_calloc(struct wim_arena *arena, size_t size);
+
+utf16lechar *
+arena_intern_utf16le(struct wim_arena *arena, const void *name,
+		     size_t name_nbytes);
+
+#endif /* _WIMLIB_ARENA_H */
@@ -9,6 +9,7 @@
 #include "wimlib/types.h"
 
 struct wim_inode;
+struct wim_arena;
 struct blob_table;
 
 /* Base size of a WIM dentry in the on-disk format, up to and including the file
@@ -51,12 +52,14 @@ struct wim_dentry {
 	 * its inode (d_inode) */
 	struct hlist_node d_alias_node;
 
-	/* Pointer to the UTF-16LE filename (malloc()ed buffer), or NULL if this
-	 * dentry has no filename.  */
+	/* Pointer to the UTF-16LE filename (malloc()ed buffer, or interned in
+	 * the image's metadata arena if d_name_in_arena is set), or NULL if
+	 * this dentry has no filename.  */
 	utf16lechar *d_name;
 
-	/* Pointer to the UTF-16LE short filename (malloc()ed buffer), or NULL
-	 * if this dentry has no short name.  */
+	/* Pointer to the UTF-16LE short filename (malloc()ed buffer, or
+	 * interned in the image's metadata arena if d_short_name_in_arena is
+	 * set), or NULL if this dentry has no short name.  */
 	utf16lechar *d_short_name;
 
 	/* Length of 'd_name' in bytes, excluding the terminating null  */
@@ -81,6 +84,12 @@ struct wim_dentry {
 	/* Used by wimlib_update_image()  */
 	u16 d_is_orphan : 1;
 
+	/* Set if the dentry itself, its name or its short name were allocated
+	 * from the metadata arena of the image, rather than with MALLOC().  */
+	u16 d_in_arena : 1;
+	u16 d_name_in_arena : 1;
+	u16 d_short_name_in_arena : 1;
+
 	union {
 		/* The subdir offset is only used while reading and writing this
 		 * dentry.  See the corresponding field in `struct
@@ -241,8 +250,8 @@ rename_wim_path(WIMStruct *wim, const tchar *from, const tchar *to,
 
 
 int
-read_dentry_tree(const u8 *buf, size_t buf_len,
-		 u64 root_offset, struct wim_dentry **root_ret);
+read_dentry_tree(const u8 *buf, size_t buf_len, u64 root_offset,
+		 struct wim_arena *arena, struct wim_dentry **root_ret);
 
 u8 *
 write_dentry_tree(struct wim_dentry *root, u8 *p);
@@ -9,6 +9,7 @@
 struct avl_tree_node;
 struct blob_descriptor;
 struct blob_table;
+struct wim_arena;
 struct wim_dentry;
 struct wim_inode_extra;
 struct wim_security_data;
@@ -79,7 +80,10 @@ struct wim_inode_stream {
 
 	/* A unique identifier for this stream within the context of its inode.
 	 * This stays constant even if the streams array is reallocated.  */
-	u32 stream_id : 28;
+	u32 stream_id : 27;
+
+	/* Set if 'stream_name' is interned in the image's metadata arena.  */
+	u32 stream_name_in_arena : 1;
 
 	/* The type of this stream as one of the STREAM_TYPE_* values  */
 	u32 stream_type : 3;
@@ -122,7 +126,14 @@ struct wim_inode {
 	struct hlist_node i_hlist_node;
 
 	/* Number of dentries that are aliases for this inode.  */
-	u32 i_nlink : 30;
+	u32 i_nlink : 27;
+
+	/* Set if the inode itself, its 'i_streams' array or its 'i_extra' data
+	 * were allocated from the metadata arena of the image, rather than
+	 * with MALLOC().  */
+	u32 i_in_arena : 1;
+	u32 i_streams_in_arena : 1;
+	u32 i_extra_in_arena : 1;
 
 	/* Flag used by some code to mark this inode as visited.  It will be 0
 	 * by default, and it always must be cleared after use.  */
@@ -267,6 +278,9 @@ struct wim_inode_extra {
 struct wim_inode *
 new_inode(struct wim_dentry *dentry, bool set_timestamps);
 
+struct wim_inode *
+new_arena_inode(struct wim_dentry *dentry, struct wim_arena *arena);
+
 /* Iterate through each alias of the specified inode.  */
 #define inode_for_each_dentry(dentry, inode) \
 	hlist_for_each_entry((dentry), &(inode)->i_alias_list, d_alias_node)
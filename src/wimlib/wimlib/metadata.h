@@ -51,6 +51,12 @@ struct wim_image_metadata {
 	 * if this image is completely empty or is not currently loaded.  */
 	struct hlist_head inode_list;
 
+	/* Arena from which the dentries, inodes and names that were read from
+	 * the metadata resource were allocated, or NULL if the image is not
+	 * loaded from a metadata resource.  It is released, after the dentry
+	 * tree, when the image is unloaded.  */
+	struct wim_arena *arena;
+
 	/* Linked list of 'struct blob_descriptor's for blobs that are
 	 * referenced by this image's dentry tree, but have not had their SHA-1
 	 * message digests calculated yet and therefore have not been inserted
@@ -419,24 +419,19 @@ out:
 /// <summary>
 /// Populate the img_report Window version from an install[.wim|.esd] XML index
 /// </summary>
-/// <param name="xml">The index XML data.</param>
-/// <param name="xml_len">The length of the index XML data.</param>
+/// <param name="xml">The root tag of the index XML data.</param>
 /// <param name="index">The index of the occurrence to look for.</param>
-static void PopulateWindowsVersionFromXml(const wchar_t* xml, size_t xml_len, int index)
+static void PopulateWindowsVersionFromXml(const ezxml_span_t* xml, int index)
 {
-	char* val;
-	ezxml_t pxml = ezxml_parse_str((char*)xml, xml_len);
-	if (pxml == NULL)
-		return;
-
-	val = ezxml_get_val(pxml, "IMAGE", index, "WINDOWS", 0, "VERSION", 0, "MAJOR", -1);
-	img_report.win_version.major = (uint16_t)safe_atoi(val);
-	val = ezxml_get_val(pxml, "IMAGE", index, "WINDOWS", 0, "VERSION", 0, "MINOR", -1);
-	img_report.win_version.minor = (uint16_t)safe_atoi(val);
-	val = ezxml_get_val(pxml, "IMAGE", index, "WINDOWS", 0, "VERSION", 0, "BUILD", -1);
-	img_report.win_version.build = (uint16_t)safe_atoi(val);
-	val = ezxml_get_val(pxml, "IMAGE", index, "WINDOWS", 0, "VERSION", 0, "SPBUILD", -1);
-	img_report.win_version.revision = (uint16_t)safe_atoi(val);
+	char val[16];
+	ezxml_span_t version = { 0 };
+
+	// Missing elements leave the version span empty, which yields a zero value
+	ezxml_scan_get(xml, &version, "IMAGE", index, "WINDOWS", 0, "VERSION", -1);
+	img_report.win_version.major = (uint16_t)safe_atoi(ezxml_scan_get_val(&version, val, sizeof(val), "MAJOR", -1));
+	img_report.win_version.minor = (uint16_t)safe_atoi(ezxml_scan_get_val(&version, val, sizeof(val), "MINOR", -1));
+	img_report.win_version.build = (uint16_t)safe_atoi(ezxml_scan_get_val(&version, val, sizeof(val), "BUILD", -1));
+	img_report.win_version.revision = (uint16_t)safe_atoi(ezxml_scan_get_val(&version, val, sizeof(val), "SPBUILD", -1));
 	// Adjust versions so that we produce a more accurate report in the log
 	// (and yeah, I know we won't properly report Server, but I don't care)
 	if (img_report.win_version.major <= 5) {
@@ -464,7 +459,6 @@ static void PopulateWindowsVersionFromXml(const wchar_t* xml, size_t xml_len, in
 		if (img_report.win_version.build > 20000)
 			img_report.win_version.major = 11;
 	}
-	ezxml_free(pxml);
 }
 
 /// <summary>
@@ -475,10 +469,12 @@ static void PopulateWindowsVersionFromXml(const wchar_t* xml, size_t xml_len, in
 BOOL PopulateWindowsVersion(void)
 {
 	int r;
-	char wim_path[4 * MAX_PATH] = "";
+	char wim_path[4 * MAX_PATH] = "", *utf8 = NULL;
+	const char* data;
 	wchar_t* xml = NULL;
 	size_t xml_len;
 	WIMStruct* wim = NULL;
+	ezxml_span_t root;
 
 	memset(&img_report.win_version, 0, sizeof(img_report.win_version));
 
@@ -502,9 +498,15 @@ BOOL PopulateWindowsVersion(void)
 		goto out;
 	}
 
-	PopulateWindowsVersionFromXml(xml, xml_len, 0);
+	data = ezxml_scan_utf8((char*)xml, &xml_len, &utf8);
+	if (data == NULL || !ezxml_scan_root(&root, data, xml_len)) {
+		uprintf("Could not parse WIM XML index");
+		goto out;
+	}
+	PopulateWindowsVersionFromXml(&root, 0);
 
 out:
+	free(utf8);
 	free(xml);
 	wimlib_free(wim);
 
@@ -548,10 +550,12 @@ int SetWinToGoIndex(void)
 	WIMStruct* wim = NULL;
 	char* install_names[MAX_WININST];
 	wchar_t wim_path[4 * MAX_PATH] = L"", *xml = NULL;
+	char val[256], *utf8 = NULL;
+	const char* data;
 	size_t xml_len;
 	StrArray version_name = { 0 }, version_index = { 0 };
 	BOOL bNonStandard = FALSE;
-	ezxml_t index = NULL, image = NULL;
+	ezxml_span_t root, image = { 0 };
 
 	// Sanity checks
 	wintogo_index = -1;
@@ -592,19 +596,19 @@ int SetWinToGoIndex(void)
 
 	StrArrayCreate(&version_name, 16);
 	StrArrayCreate(&version_index, 16);
-	index = ezxml_parse_str((char*)xml, xml_len);
-	if (index == NULL) {
+	// The XML index is only tokenized as we go through it, and the values we need decoded on demand
+	data = ezxml_scan_utf8((char*)xml, &xml_len, &utf8);
+	if (data == NULL || !ezxml_scan_root(&root, data, xml_len)) {
 		uprintf("Could not parse WIM XML");
 		goto out;
 	}
 
-	for (i = 0, image = ezxml_child(index, "IMAGE");
-		StrArrayAdd(&version_index, ezxml_attr(image, "INDEX"), TRUE) >= 0;
-		image = image->next, i++) {
+	for (i = 0; ezxml_scan_child(&root, "IMAGE", &image) &&
+		StrArrayAdd(&version_index, ezxml_scan_attr(&image, "INDEX", val, sizeof(val)), TRUE) >= 0; i++) {
 		// Some people are apparently creating *unofficial* Windows ISOs that don't have DISPLAYNAME elements.
 		// If we are parsing such an ISO, try to fall back to using DESCRIPTION.
-		if (StrArrayAdd(&version_name, ezxml_child_val(image, "DISPLAYNAME"), TRUE) < 0) {
-			if (StrArrayAdd(&version_name, ezxml_child_val(image, "DESCRIPTION"), TRUE) < 0) {
+		if (StrArrayAdd(&version_name, ezxml_scan_get_val(&image, val, sizeof(val), "DISPLAYNAME", -1), TRUE) < 0) {
+			if (StrArrayAdd(&version_name, ezxml_scan_get_val(&image, val, sizeof(val), "DESCRIPTION", -1), TRUE) < 0) {
 				uprintf("WARNING: Could not find a description for image index %d", i + 1);
 				StrArrayAdd(&version_name, "Unknown Windows Version", TRUE);
 			}
@@ -625,7 +629,7 @@ int SetWinToGoIndex(void)
 		wintogo_index = atoi(version_index.String[i - 1]);
 	if (i > 0) {
 		// re-populate the version data from the selected XML index
-		PopulateWindowsVersionFromXml(xml, xml_len, i - 1);
+		PopulateWindowsVersionFromXml(&root, i - 1);
 		// If we couldn't obtain the major and build, we have a problem
 		if (img_report.win_version.major == 0 || img_report.win_version.build == 0)
 			uprintf("WARNING: Could not obtain version information from XML index (Nonstandard Windows image?)");
@@ -649,8 +653,8 @@ int SetWinToGoIndex(void)
 out:
 	StrArrayDestroy(&version_name);
 	StrArrayDestroy(&version_index);
+	free(utf8);
 	free(xml);
-	ezxml_free(index);
 	wimlib_free(wim);
 	return wintogo_index;
 }
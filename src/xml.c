@@ -33,6 +33,7 @@
 #include <sys/stat.h>
 #include "xml.h"
 #include "rufus.h"
+#include "transcode.h"
 #include "msapi_utf8.h"
 
 /* Memory leaks detection - define _CRTDBG_MAP_ALLOC as preprocessor macro */
@@ -1059,6 +1060,311 @@ ezxml_t ezxml_cut(ezxml_t xml)
     return xml;
 }
 
+#define EZXML_SCAN_OTHER 0 // comment, processing instruction, cdata or doctype
+#define EZXML_SCAN_OPEN  1 // opening tag
+#define EZXML_SCAN_CLOSE 2 // closing tag
+#define EZXML_SCAN_EMPTY 3 // self closing tag
+
+const char *ezxml_scan_utf8(const char *s, size_t *len, char **u)
+{
+    size_t l;
+    int be = (*len >= 2 && s[0] == '\xFE' && s[1] == '\xFF') ? 1 :
+             (*len >= 2 && s[0] == '\xFF' && s[1] == '\xFE') ? 0 : -1;
+
+    *u = NULL;
+    if (be == -1) return s; // not UTF-16
+
+    l = (*len - 2) / 2;
+    if (! (*u = malloc(UTF8_MAX_FROM_UTF16(l) + 1))) return NULL;
+    l = (be) ? utf16be_to_utf8(s + 2, l, *u)
+             : utf16le_to_utf8((const uint16_t *)(s + 2), l, *u);
+    if (l == TRANSCODE_INVALID) {
+        free(*u);
+        return *u = NULL;
+    }
+    *len = l;
+    return *u;
+}
+
+// returns the first occurrence of str in [s, e) or NULL if not found
+static const char *ezxml_scan_find(const char *s, const char *e,
+                                   const char *str)
+{
+    size_t l = strlen(str);
+
+    for (; (size_t)(e - s) >= l; s++) {
+        if (! (s = memchr(s, *str, e - s - l + 1))) return NULL;
+        if (! memcmp(s, str, l)) return s;
+    }
+    return NULL;
+}
+
+// skips the markup starting at p, which must be a '<', and sets type to the
+// kind of markup. Returns a pointer past its end, or NULL if it isn't
+// terminated before e.
+static const char *ezxml_scan_markup(const char *p, const char *e, int *type)
+{
+    int d = 0;
+
+    *type = EZXML_SCAN_OTHER;
+    if (e - p >= 4 && ! memcmp(p, "<!--", 4)) {
+        p = ezxml_scan_find(p + 4, e, "-->");
+        return (p) ? p + 3 : NULL;
+    }
+    if (e - p >= 9 && ! memcmp(p, "<![CDATA[", 9)) {
+        p = ezxml_scan_find(p + 9, e, "]]>");
+        return (p) ? p + 3 : NULL;
+    }
+    if (e - p >= 2 && p[1] == '?') {
+        p = ezxml_scan_find(p + 2, e, "?>");
+        return (p) ? p + 2 : NULL;
+    }
+    if (e - p >= 2 && p[1] == '!') { // doctype, with an optional internal subset
+        for (p += 2; p < e; p++) {
+            if (*p == '[') d++;
+            else if (*p == ']') d--;
+            else if (*p == '>' && d <= 0) return p + 1;
+        }
+        return NULL;
+    }
+
+    *type = (e - p >= 2 && p[1] == '/') ? EZXML_SCAN_CLOSE : EZXML_SCAN_OPEN;
+    for (p++; p < e; p++) {
+        if (*p == '"' || *p == '\'') { // attribute values may contain '>'
+            if (! (p = memchr(p + 1, *p, e - p - 1))) return NULL;
+        }
+        else if (*p == '>') {
+            if (*type == EZXML_SCAN_OPEN && p[-1] == '/') *type = EZXML_SCAN_EMPTY;
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+// returns non-zero if the tag starting at p has the given name
+static int ezxml_scan_name(const char *p, const char *name)
+{
+    size_t l = strlen(name);
+
+    // the tag is terminated by a '>', so this can't go past it
+    return ! strncmp(p + 1, name, l) && p[l + 1] &&
+           strchr(EZXML_WS "/>", p[l + 1]);
+}
+
+// fills r for the tag that starts at p, with t pointing past its opening tag
+// of the given type. Returns non-zero if the tag is closed before e.
+static int ezxml_scan_tag(const char *p, const char *t, int type,
+                          const char *e, ezxml_span_t *r)
+{
+    const char *n;
+    int d = 0, k;
+
+    r->tag = p;
+    r->s = r->e = r->end = t;
+    if (type == EZXML_SCAN_EMPTY) return 1;
+
+    for (p = t; (p = memchr(p, '<', e - p)); p = n) {
+        if (! (n = ezxml_scan_markup(p, e, &k))) return 0;
+        if (k == EZXML_SCAN_OPEN) d++;
+        else if (k == EZXML_SCAN_CLOSE && d-- == 0) {
+            r->e = p;
+            r->end = n;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int ezxml_scan_child(const ezxml_span_t *xml, const char *name,
+                     ezxml_span_t *child)
+{
+    const char *p, *n;
+    ezxml_span_t skip;
+    int k;
+
+    if (! xml || ! xml->s) return 0;
+    p = (child->tag) ? child->end : xml->s;
+    for (; (p = memchr(p, '<', xml->e - p)); p = n) {
+        if (! (n = ezxml_scan_markup(p, xml->e, &k)) || k == EZXML_SCAN_CLOSE)
+            return 0;
+        if (k == EZXML_SCAN_OTHER) continue;
+        if (! name || ezxml_scan_name(p, name))
+            return ezxml_scan_tag(p, n, k, xml->e, child);
+        if (! ezxml_scan_tag(p, n, k, xml->e, &skip)) return 0;
+        n = skip.end;
+    }
+    return 0;
+}
+
+int ezxml_scan_root(ezxml_span_t *root, const char *s, size_t len)
+{
+    ezxml_span_t doc = { NULL, s, s + len, s + len };
+
+    memset(root, 0, sizeof(*root));
+    return ezxml_scan_child(&doc, NULL, root);
+}
+
+// same as ezxml_scan_get but takes an already initialized va_list
+static int ezxml_scan_vget(const ezxml_span_t *xml, ezxml_span_t *r,
+                           va_list ap)
+{
+    ezxml_span_t cur;
+    const char *name;
+    int idx, k;
+
+    for (*r = *xml; (name = va_arg(ap, const char *)) && *name; ) {
+        idx = va_arg(ap, int);
+        cur = *r;
+        memset(r, 0, sizeof(*r));
+        for (k = idx; ; k--) {
+            if (! ezxml_scan_child(&cur, name, r)) {
+                memset(r, 0, sizeof(*r));
+                return 0;
+            }
+            if (k <= 0) break;
+        }
+        if (idx < 0) break;
+    }
+    return 1;
+}
+
+int ezxml_scan_get(const ezxml_span_t *xml, ezxml_span_t *r, ...)
+{
+    va_list ap;
+    int found;
+
+    va_start(ap, r);
+    found = ezxml_scan_vget(xml, r, ap);
+    va_end(ap);
+    return found;
+}
+
+// decodes the entity or character reference at *p into u, and moves p past
+// it. Returns the number of bytes written to u, or 0 if not a reference.
+static int ezxml_scan_ent(const char **p, const char *e, char *u)
+{
+    static const char *ent[] = { "lt;", "<", "gt;", ">", "amp;", "&",
+                                 "apos;", "'", "quot;", "\"", NULL };
+    const char *s = *p + 1;
+    unsigned long c = 0;
+    int i, b, base = 10;
+
+    if (s < e && *s == '#') { // character reference
+        if (++s < e && *s == 'x') { base = 16; s++; }
+        for (i = 0; s < e && isxdigit((uint8_t)*s) && i < 8; s++, i++) {
+            if (base == 10 && ! isdigit((uint8_t)*s)) return 0;
+            c = c * base + (isdigit((uint8_t)*s) ? *s - '0' : (tolower(*s) - 'a' + 10));
+        }
+        if (! i || s >= e || *s != ';' || ! c || c > 0x10FFFF) return 0;
+        *p = s + 1;
+        if (c < 0x80) { *u = (char)c; return 1; } // US-ASCII subset
+        b = (c < 0x800) ? 1 : (c < 0x10000) ? 2 : 3; // bytes in payload
+        *(u++) = (char)(0xFF << (7 - b)) | (char)(c >> (6 * b)); // head
+        for (i = b; i; ) *(u++) = 0x80 | ((c >> (6 * --i)) & 0x3F); // payload
+        return b + 1;
+    }
+    for (i = 0; ent[i]; i += 2) {
+        b = (int)strlen(ent[i]);
+        if (e - s >= b && ! memcmp(s, ent[i], b)) {
+            *p = s + b;
+            *u = *ent[i + 1];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// decodes [p, e) into buf, normalizing line endings, and, if attr is set,
+// whitespaces. Child tags, comments and processing instructions are skipped.
+// Returns buf or NULL if it doesn't fit.
+static char *ezxml_scan_decode(const char *p, const char *e, char *buf,
+                               size_t size, int attr)
+{
+    const char *n, *c;
+    ezxml_span_t skip;
+    char u[4];
+    size_t l = 0;
+    int i, k;
+
+    while (p < e) {
+        if (*p == '<' && ! attr) {
+            if (! (n = ezxml_scan_markup(p, e, &k))) break;
+            if (k == EZXML_SCAN_OTHER && ! strncmp(p, "<![CDATA[", 9)) {
+                c = n - 3; // copy cdata content as is
+                if ((size_t)(c - p - 9) >= size - l) return NULL;
+                memcpy(&buf[l], p + 9, c - p - 9);
+                l += c - p - 9;
+            }
+            else if (k == EZXML_SCAN_OPEN) {
+                if (! ezxml_scan_tag(p, n, k, e, &skip)) break;
+                n = skip.end;
+            }
+            p = n;
+            continue;
+        }
+        if (*p == '&' && (k = ezxml_scan_ent(&p, e, u))) {
+            for (i = 0; i < k; i++) {
+                if (l + 1 >= size) return NULL;
+                buf[l++] = u[i];
+            }
+            continue;
+        }
+        if (l + 1 >= size) return NULL;
+        if (*p == '\r') { // normalize line endings
+            buf[l++] = (attr) ? ' ' : '\n';
+            if (++p < e && *p == '\n') p++;
+            continue;
+        }
+        buf[l++] = (attr && isspace((uint8_t)*p)) ? ' ' : *p;
+        p++;
+    }
+    if (l >= size) return NULL;
+    buf[l] = '\0';
+    return buf;
+}
+
+char *ezxml_scan_txt(const ezxml_span_t *xml, char *buf, size_t size)
+{
+    if (! xml || ! xml->s || ! size) return NULL;
+    return ezxml_scan_decode(xml->s, xml->e, buf, size, 0);
+}
+
+char *ezxml_scan_get_val(const ezxml_span_t *xml, char *buf, size_t size, ...)
+{
+    va_list ap;
+    ezxml_span_t r;
+    int found;
+
+    va_start(ap, size);
+    found = ezxml_scan_vget(xml, &r, ap);
+    va_end(ap);
+    return (found) ? ezxml_scan_txt(&r, buf, size) : NULL;
+}
+
+char *ezxml_scan_attr(const ezxml_span_t *xml, const char *attr, char *buf,
+                      size_t size)
+{
+    const char *a, *p, *n, *v, *e;
+    size_t l = strlen(attr);
+
+    if (! xml || ! xml->tag || ! size) return NULL;
+    e = xml->s; // end of the opening tag
+    p = xml->tag + 1 + strcspn(xml->tag + 1, EZXML_WS "/>"); // skip tag name
+    for (;;) {
+        while (p < e && strchr(EZXML_WS, *p)) p++;
+        if (p >= e || *p == '/' || *p == '>') return NULL;
+        for (a = n = p; n < e && ! strchr(EZXML_WS "=/>", *n); n++);
+        for (v = n; v < e && strchr(EZXML_WS, *v); v++);
+        if (v >= e || *v != '=') return NULL;
+        for (v++; v < e && strchr(EZXML_WS, *v); v++);
+        if (v >= e || (*v != '"' && *v != '\'')) return NULL;
+        if (! (p = memchr(v + 1, *v, e - v - 1))) return NULL;
+        if ((size_t)(n - a) == l && ! memcmp(a, attr, l))
+            return ezxml_scan_decode(v + 1, p, buf, size, 1);
+        p++;
+    }
+}
+
 #ifdef EZXML_TEST // test harness
 int main(int argc, char **argv)
 {
@@ -167,6 +167,52 @@ ezxml_t ezxml_insert(ezxml_t xml, ezxml_t dest, size_t off);
 // removes a tag along with all its subtags
 #define ezxml_remove(xml) ezxml_free(ezxml_cut(xml))
 
+// In-situ reader: rather than building a tree, the xml data is tokenized on
+// demand, as queries are made, without being copied, modified or allocated
+// for. Tags are returned as spans of the original data, and text values only
+// get decoded, into a buffer provided by the caller, when requested. The data
+// must be UTF-8 (see ezxml_scan_utf8()). Default attributes from a DTD and
+// entities other than the predefined ones are not supported.
+typedef struct ezxml_span {
+    const char *tag; // start of the opening tag
+    const char *s;   // start of the character content
+    const char *e;   // end of the character content (start of the closing tag)
+    const char *end; // end of the tag (past the closing tag)
+} ezxml_span_t;
+
+// Returns UTF-8 xml data from s, which may be UTF-16 (with a BOM), converting
+// it into a new string, that is returned in u and must be freed, if needed.
+// len is updated with the length of the UTF-8 data. Returns NULL on error.
+const char *ezxml_scan_utf8(const char *s, size_t *len, char **u);
+
+// finds the root tag of the given xml data. Returns non-zero on success.
+int ezxml_scan_root(ezxml_span_t *root, const char *s, size_t len);
+
+// finds the next child tag of xml with the given name (or any name if NULL),
+// after the one in child. child must be zeroed for the first call. Returns
+// non-zero if found. Example:
+// ezxml_span_t book = { 0 };
+// while (ezxml_scan_child(&shelf, "book", &book)) { ... }
+int ezxml_scan_child(const ezxml_span_t *xml, const char *name,
+                     ezxml_span_t *child);
+
+// Same as ezxml_get() but looks for the subtag in the span of xml and copies
+// it into r. Returns non-zero if found, otherwise r is zeroed.
+int ezxml_scan_get(const ezxml_span_t *xml, ezxml_span_t *r, ...);
+
+// Decodes the character content of the tag into buf. Returns buf or NULL if
+// the content (and a NUL terminator) doesn't fit in size.
+char *ezxml_scan_txt(const ezxml_span_t *xml, char *buf, size_t size);
+
+// Same as ezxml_scan_get() but decodes the text value of the subtag into buf.
+// Returns buf or NULL if not found or if it doesn't fit.
+char *ezxml_scan_get_val(const ezxml_span_t *xml, char *buf, size_t size, ...);
+
+// Decodes the value of the requested tag attribute into buf. Returns buf or
+// NULL if not found or if it doesn't fit.
+char *ezxml_scan_attr(const ezxml_span_t *xml, const char *attr, char *buf,
+                      size_t size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,39 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Minimal unit test helpers
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#pragma once
+
+static int test_checks = 0, test_failures = 0;
+
+#define CHECK(cond) do {                                                        \
+	test_checks++;                                                              \
+	if (!(cond)) {                                                              \
+		test_failures++;                                                        \
+		fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__,    \
+			__func__, #cond);                                                   \
+	}                                                                           \
+} while (0)
+
+static inline int test_report(const char* name)
+{
+	printf("%s: %d checks, %d failed\n", name, test_checks, test_failures);
+	return (test_failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,239 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Device write cache management tests
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs the Caching mode page logic of devcache.c against a mocked SCSI transport,
+ * which behaves like a device with a write cache, and can be told to act like the
+ * misbehaving bridges that devcache.c has to deal with.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "devcache.h"
+#include "test.h"
+
+#define CHECK_CONDITION     0x02
+
+typedef struct {
+	bool wce;               // Current write cache setting
+	bool changeable;        // Whether the Caching mode page reports WCE as changeable
+	bool only_10;           // Reject MODE SENSE/SELECT (6)
+	bool ignore_dbd;        // Return block descriptors even if asked not to
+	bool ignore_select;     // Accept MODE SELECT and do nothing with it
+	bool short_sense;       // Cut MODE SENSE data in the middle of the Caching page
+	int senses, selects, syncs, ata;
+	bool bad_select;        // A MODE SELECT parameter list was malformed
+} mock_device;
+
+static int mock_mode_sense(mock_device* d, const uint8_t* cdb, uint8_t* buf, size_t len)
+{
+	bool is_10 = (cdb[0] == 0x5a);
+	size_t hdr_len = is_10 ? 8 : 4, bd_len = (d->ignore_dbd) ? 8 : 0, off = hdr_len + bd_len;
+	size_t data_len = off + 20;
+	uint8_t pc = cdb[2] & 0xc0;
+
+	d->senses++;
+	if ((cdb[2] & 0x3f) != 0x08)
+		return CHECK_CONDITION;
+	memset(buf, 0, len);
+	buf[off] = 0x80 | 0x08;	// PS set, as devices report it
+	buf[off + 1] = 18;
+	if (pc == 0x00)
+		buf[off + 2] = d->wce ? 0x04 : 0x00;
+	else if (pc == 0x40)
+		buf[off + 2] = d->changeable ? 0x04 : 0x00;
+	if (d->short_sense)
+		data_len = off + 2;
+	if (is_10) {
+		buf[0] = (uint8_t)((data_len - 2) >> 8);
+		buf[1] = (uint8_t)(data_len - 2);
+		buf[7] = (uint8_t)bd_len;
+	} else {
+		buf[0] = (uint8_t)(data_len - 1);
+		buf[3] = (uint8_t)bd_len;
+	}
+	return 0;
+}
+
+static int mock_mode_select(mock_device* d, const uint8_t* cdb, const uint8_t* buf, size_t len)
+{
+	bool is_10 = (cdb[0] == 0x55);
+	size_t i, hdr_len = is_10 ? 8 : 4;
+	size_t param_len = is_10 ? ((cdb[7] << 8) | cdb[8]) : cdb[4];
+
+	d->selects++;
+	// PF set, SP clear, a zeroed header, no block descriptors and a single Caching page with PS clear
+	if (cdb[1] != 0x10 || param_len != len || len != hdr_len + 20 || buf[hdr_len] != 0x08 || buf[hdr_len + 1] != 18)
+		d->bad_select = true;
+	for (i = 0; i < hdr_len; i++)
+		if (buf[i] != 0)
+			d->bad_select = true;
+	if (!d->ignore_select)
+		d->wce = (buf[hdr_len + 2] & 0x04) != 0;
+	return 0;
+}
+
+static int mock_scsi(void* ctx, const uint8_t* cdb, size_t cdb_len, int dir, void* buf, size_t len, uint32_t timeout)
+{
+	mock_device* d = (mock_device*)ctx;
+
+	(void)timeout;
+	switch (cdb[0]) {
+	case 0x1a:
+	case 0x15:
+		if (d->only_10)
+			return CHECK_CONDITION;
+		if (cdb_len != 6)
+			return -1;
+		break;
+	case 0x5a:
+	case 0x55:
+		if (cdb_len != 10)
+			return -1;
+		break;
+	}
+	switch (cdb[0]) {
+	case 0x1a:
+	case 0x5a:
+		return (dir == DEVCACHE_DATA_IN) ? mock_mode_sense(d, cdb, buf, len) : -1;
+	case 0x15:
+	case 0x55:
+		return (dir == DEVCACHE_DATA_OUT) ? mock_mode_select(d, cdb, buf, len) : -1;
+	case 0x35:
+		d->syncs++;
+		return 0;
+	case 0x85:
+		d->ata++;
+		return CHECK_CONDITION;
+	default:
+		return CHECK_CONDITION;
+	}
+}
+
+static void test_enable_restore(bool only_10, bool ignore_dbd)
+{
+	mock_device d = { .changeable = true, .only_10 = only_10, .ignore_dbd = ignore_dbd };
+	devcache_state s;
+
+	CHECK(devcache_begin(&s, DEVCACHE_AUTO, mock_scsi, &d) == 0);
+	CHECK(s.method == DEVCACHE_METHOD_MODE_PAGE);
+	CHECK(s.use_10 == only_10);
+	CHECK(!s.was_enabled && s.enabled && s.changed);
+	CHECK(d.wce);
+	CHECK(devcache_flush(&s) == 0);
+	CHECK(d.syncs == 1);
+	CHECK(devcache_end(&s) == 0);
+	CHECK(!d.wce && !s.enabled && !s.changed);
+	CHECK(d.syncs == 2);
+	CHECK(d.selects == 2);
+	CHECK(!d.bad_select);
+	// A second call must not touch the device setting again
+	CHECK(devcache_end(&s) == 0);
+	CHECK(d.selects == 2);
+	CHECK(d.ata == 0);
+}
+
+static void test_already_enabled(void)
+{
+	mock_device d = { .wce = true, .changeable = true };
+	devcache_state s;
+
+	CHECK(devcache_begin(&s, DEVCACHE_AUTO, mock_scsi, &d) == 0);
+	CHECK(s.was_enabled && s.enabled && !s.changed);
+	CHECK(devcache_end(&s) == 0);
+	CHECK(d.wce);
+	CHECK(d.selects == 0);
+	CHECK(d.syncs == 1);
+}
+
+static void test_ignored_select(void)
+{
+	mock_device d = { .changeable = true, .ignore_select = true };
+	devcache_state s;
+
+	CHECK(devcache_begin(&s, DEVCACHE_AUTO, mock_scsi, &d) == EIO);
+	CHECK(!s.enabled && !s.changed);
+	CHECK(d.selects == 1);
+	// Nothing to flush or restore
+	CHECK(devcache_end(&s) == 0);
+	CHECK(d.syncs == 0);
+	CHECK(d.selects == 1);
+	CHECK(!d.wce);
+}
+
+static void test_short_sense(void)
+{
+	mock_device d = { .wce = true, .changeable = true, .short_sense = true };
+	devcache_state s;
+
+	// Both the 6 and 10 byte variants must be tried, and the truncated page never used
+	CHECK(devcache_begin(&s, DEVCACHE_AUTO, mock_scsi, &d) == ENOTSUP);
+	CHECK(s.method == DEVCACHE_METHOD_NONE);
+	CHECK(!s.enabled && !s.changed);
+	CHECK(d.senses == 4);
+	CHECK(d.selects == 0);
+	CHECK(devcache_end(&s) == 0);
+	CHECK(d.syncs == 0);
+}
+
+static void test_not_changeable(void)
+{
+	mock_device d = { .changeable = false };
+	devcache_state s;
+
+	CHECK(devcache_begin(&s, DEVCACHE_AUTO, mock_scsi, &d) == ENOTSUP);
+	CHECK(d.selects == 0);
+	CHECK(d.ata == 0);
+
+	// A device that has its cache enabled, but won't let us change it, still gets flushed
+	memset(&d, 0, sizeof(d));
+	d.wce = true;
+	CHECK(devcache_begin(&s, DEVCACHE_AUTO, mock_scsi, &d) == 0);
+	CHECK(s.enabled && !s.changed);
+	CHECK(devcache_end(&s) == 0);
+	CHECK(d.syncs == 1);
+	CHECK(d.selects == 0);
+}
+
+static void test_off(void)
+{
+	mock_device d = { .changeable = true };
+	devcache_state s;
+
+	CHECK(devcache_begin(&s, DEVCACHE_OFF, mock_scsi, &d) == 0);
+	CHECK(devcache_flush(&s) == 0);
+	CHECK(devcache_end(&s) == 0);
+	CHECK(d.senses == 0 && d.selects == 0 && d.syncs == 0);
+}
+
+int main(void)
+{
+	test_enable_restore(false, false);
+	test_enable_restore(false, true);
+	test_enable_restore(true, false);
+	test_enable_restore(true, true);
+	test_already_enabled();
+	test_ignored_select();
+	test_short_sense();
+	test_not_changeable();
+	test_off();
+	return test_report("devcache");
+}
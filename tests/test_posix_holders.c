@@ -0,0 +1,187 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Device holder detection tests
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Looks for the holders of the device that the current directory lives on, while a
+ * child process keeps a file open on it (our own process is never reported), and
+ * checks that the child is reported as holding it, and that kernel threads aren't.
+ * This needs the current directory to be on a block device, which isn't the case in
+ * most containers, where the test is skipped.
+ */
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
+
+#include "posix_holders.h"
+#include "test.h"
+
+#define MAX_HOLDERS     256
+
+#if defined(__linux__)
+// Find the /dev node of the block device that path lives on
+static bool find_device(const char* path, char* dev_path, size_t size)
+{
+	char sys_path[64], line[128];
+	struct stat st;
+	bool found = false;
+	FILE* f;
+
+	if (stat(path, &st) != 0)
+		return false;
+	snprintf(sys_path, sizeof(sys_path), "/sys/dev/block/%u:%u/uevent", major(st.st_dev), minor(st.st_dev));
+	f = fopen(sys_path, "r");
+	if (f == NULL)
+		return false;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "DEVNAME=", 8) == 0) {
+			line[strcspn(line, "\n")] = '\0';
+			snprintf(dev_path, size, "/dev/%s", &line[8]);
+			found = (stat(dev_path, &st) == 0 && S_ISBLK(st.st_mode));
+			break;
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+// Independent of what posix_holders.c does: kthreadd and its children
+static bool is_kernel_thread(int pid)
+{
+	char path[64], line[512], *p;
+	int ppid = -1;
+	FILE* f;
+
+	if (pid == 2)
+		return true;
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return false;
+	if (fgets(line, sizeof(line), f) != NULL && (p = strrchr(line, ')')) != NULL)
+		sscanf(p + 1, " %*c %d", &ppid);
+	fclose(f);
+	return (ppid == 2);
+}
+#elif defined(__APPLE__)
+static bool find_device(const char* path, char* dev_path, size_t size)
+{
+	struct stat st;
+
+	if (stat(path, &st) != 0 || devname(st.st_dev, S_IFBLK) == NULL)
+		return false;
+	snprintf(dev_path, size, "/dev/%s", devname(st.st_dev, S_IFBLK));
+	return true;
+}
+
+static bool is_kernel_thread(int pid)
+{
+	return (pid == 0);
+}
+#endif
+
+static void test_invalid(void)
+{
+	CHECK(ph_start("/nonexistent/device", 0) == NULL);
+	CHECK(ph_start("/dev/null", 0) == NULL);
+	CHECK(strcmp(ph_kind_name(PH_HOLDER_FILE), "file open") == 0);
+	CHECK(strcmp(ph_kind_name((ph_holder_kind)42), "unknown") == 0);
+}
+
+static void test_holders(const char* dev_path, const char* file)
+{
+	static ph_holder holders[MAX_HOLDERS];
+	bool found_child = false, found_mount = false;
+	int i, n, fd, status, ready[2];
+	ph_scan* s;
+	pid_t child;
+	char c;
+
+	CHECK(pipe(ready) == 0);
+	child = fork();
+	if (child == 0) {
+		fd = open(file, O_RDONLY);
+		c = (fd >= 0) ? 1 : 0;
+		if (write(ready[1], &c, 1) != 1 || fd < 0)
+			_exit(1);
+		pause();
+		_exit(0);
+	}
+	CHECK(child > 0);
+	if (child <= 0)
+		return;
+	CHECK(read(ready[0], &c, 1) == 1 && c == 1);
+	close(ready[0]);
+	close(ready[1]);
+
+	s = ph_start(dev_path, 0);
+	CHECK(s != NULL);
+	if (s != NULL) {
+		n = ph_get(s, holders, MAX_HOLDERS, 30000);
+		CHECK(n > 0);
+		for (i = 0; i < n; i++) {
+			if (holders[i].kind == PH_HOLDER_FILE && holders[i].pid == child)
+				found_child = true;
+			if (holders[i].kind == PH_HOLDER_MOUNT)
+				found_mount = true;
+			if (holders[i].pid != 0 && is_kernel_thread(holders[i].pid)) {
+				fprintf(stderr, "kernel thread reported as holder: %d (%s) %s %s\n", holders[i].pid,
+					holders[i].name, ph_kind_name(holders[i].kind), holders[i].path);
+				CHECK(!is_kernel_thread(holders[i].pid));
+			}
+		}
+		CHECK(found_child);
+		CHECK(found_mount);
+	}
+
+	// Once the child is gone, it must no longer be reported on the next scan
+	kill(child, SIGKILL);
+	waitpid(child, &status, 0);
+	if (s != NULL) {
+		n = ph_get(s, holders, MAX_HOLDERS, 30000);
+		CHECK(n >= 0);
+		for (i = 0; i < n; i++)
+			CHECK(holders[i].pid != child);
+		ph_stop(s);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	char dev_path[PATH_MAX];
+
+	(void)argc;
+	test_invalid();
+	if (find_device(".", dev_path, sizeof(dev_path)) && access(dev_path, F_OK) == 0)
+		test_holders(dev_path, argv[0]);
+	else
+		printf("posix_holders: current directory is not on a block device, skipping holder scan\n");
+	return test_report("posix_holders");
+}
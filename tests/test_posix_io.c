@@ -0,0 +1,261 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Image write and verify engine tests
+ * Copyright © 2025 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Copies and verifies images of boundary sizes to one or more temporary files, with
+ * each of the backends, and checks the content of the targets, the zero padding of
+ * the last sector, and the error paths. The io_uring backend is skipped where the
+ * kernel doesn't let us use it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "posix_io.h"
+#include "test.h"
+
+#define SECTOR_SIZE     512
+#define CHUNK_SIZE      (4 * PIO_BUFFER_ALIGNMENT)
+#define QUEUE_DEPTH     4
+// Filler of the targets, to check what was written past the image
+#define FILLER          0xa5
+
+static char tmp_dir[] = "/tmp/rufus_pio_XXXXXX";
+static uint64_t last_done, last_total;
+static bool progress_backwards;
+
+static void progress(uint64_t done, uint64_t total)
+{
+	if (done < last_done)
+		progress_backwards = true;
+	last_done = done;
+	last_total = total;
+}
+
+static int create_file(const char* name, const uint8_t* data, size_t len, int flags)
+{
+	char path[64];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", tmp_dir, name);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -1;
+	if (len != 0 && write(fd, data, len) != (ssize_t)len) {
+		close(fd);
+		return -1;
+	}
+	if (flags != O_RDWR) {
+		close(fd);
+		fd = open(path, flags);
+	}
+	unlink(path);
+	return fd;
+}
+
+static uint8_t* make_image(size_t size)
+{
+	uint8_t* buf = malloc(size + 1);
+	uint32_t x = (uint32_t)size * 2654435761U + 1;
+	size_t i;
+
+	for (i = 0; buf != NULL && i < size; i++) {
+		x = x * 1103515245 + 12345;
+		buf[i] = (uint8_t)(x >> 16);
+	}
+	return buf;
+}
+
+static bool check_target(int fd, const uint8_t* image, uint64_t size, size_t target_size)
+{
+	uint8_t* buf = malloc(target_size);
+	uint64_t padded = (size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE, i;
+	bool ok;
+
+	if (buf == NULL)
+		return false;
+	ok = (pread(fd, buf, target_size, 0) == (ssize_t)target_size) && (memcmp(buf, image, size) == 0);
+	for (i = size; ok && i < padded; i++)
+		ok = (buf[i] == 0);
+	for (i = padded; ok && i < target_size; i++)
+		ok = (buf[i] == FILLER);
+	free(buf);
+	return ok;
+}
+
+// Returns false if the backend can't be used on this system
+static bool test_copy(pio_backend backend, uint64_t size, uint32_t num_targets, uint32_t chunk_size)
+{
+	size_t target_size = (size_t)size + 2 * SECTOR_SIZE;
+	uint8_t *image = make_image((size_t)size), *filler = malloc(target_size);
+	pio_job job = { 0 };
+	uint32_t t;
+	int r;
+
+	CHECK(image != NULL && filler != NULL);
+	if (image == NULL || filler == NULL)
+		goto out;
+	memset(filler, FILLER, target_size);
+	job.src_fd = create_file("src", image, (size_t)size, O_RDONLY);
+	CHECK(job.src_fd >= 0);
+	for (t = 0; t < num_targets; t++) {
+		job.dst_fd[t] = create_file("dst", filler, target_size, O_RDWR);
+		CHECK(job.dst_fd[t] >= 0);
+	}
+	job.size = size;
+	job.num_targets = num_targets;
+	job.sector_size = SECTOR_SIZE;
+	job.chunk_size = chunk_size;
+	job.queue_depth = QUEUE_DEPTH;
+	job.verify = true;
+	job.backend = backend;
+	job.progress = progress;
+	last_done = last_total = 0;
+	progress_backwards = false;
+
+	r = pio_run(&job);
+	if (r != 0 && backend == PIO_BACKEND_URING && job.backend != PIO_BACKEND_URING) {
+		// Failed before any I/O was issued: no io_uring here
+		free(image);
+		image = NULL;
+		goto out;
+	}
+	if (r != 0)
+		fprintf(stderr, "%s, size %llu, %u target(s): %s (target %d, offset %llu)\n", pio_backend_name(backend),
+			(unsigned long long)size, num_targets, strerror(r), job.failed_target, (unsigned long long)job.failed_offset);
+	CHECK(r == 0);
+	CHECK(job.backend == backend);
+	CHECK(job.failed_target == -1);
+	CHECK(last_done == size && last_total == size);
+	CHECK(!progress_backwards);
+	for (t = 0; t < num_targets; t++)
+		CHECK(check_target(job.dst_fd[t], image, size, target_size));
+
+out:
+	if (job.src_fd > 0)
+		close(job.src_fd);
+	for (t = 0; t < num_targets; t++) {
+		if (job.dst_fd[t] > 0)
+			close(job.dst_fd[t]);
+	}
+	free(filler);
+	if (image == NULL)
+		return false;
+	free(image);
+	return true;
+}
+
+static void test_errors(pio_backend backend)
+{
+	uint8_t* image = make_image(3 * CHUNK_SIZE);
+	volatile int cancel = 1;
+	pio_job job = { 0 };
+	int r;
+
+	CHECK(image != NULL);
+	if (image == NULL)
+		return;
+	job.src_fd = create_file("src", image, 3 * CHUNK_SIZE, O_RDONLY);
+	job.dst_fd[0] = create_file("dst0", NULL, 0, O_RDWR);
+	job.dst_fd[1] = create_file("dst1", NULL, 0, O_RDONLY);
+	CHECK(job.src_fd >= 0 && job.dst_fd[0] >= 0 && job.dst_fd[1] >= 0);
+	job.chunk_size = CHUNK_SIZE;
+	job.queue_depth = QUEUE_DEPTH;
+	job.verify = true;
+
+	// An empty image, no target or a chunk size that can't be used for O_DIRECT are rejected
+	job.backend = backend;
+	job.num_targets = 1;
+	job.size = 0;
+	CHECK(pio_run(&job) == EINVAL);
+	CHECK(job.failed_target == -1);
+	job.size = CHUNK_SIZE;
+	job.num_targets = 0;
+	CHECK(pio_run(&job) == EINVAL);
+	job.num_targets = PIO_MAX_TARGETS + 1;
+	CHECK(pio_run(&job) == EINVAL);
+	job.num_targets = 1;
+	job.chunk_size = CHUNK_SIZE + SECTOR_SIZE;
+	CHECK(pio_run(&job) == EINVAL);
+	job.chunk_size = CHUNK_SIZE;
+
+	// A source that is shorter than the image size
+	job.backend = backend;
+	job.size = 4 * CHUNK_SIZE;
+	r = pio_run(&job);
+	CHECK(r == EIO);
+	CHECK(job.failed_target == -1);
+	CHECK(job.failed_offset == 3 * CHUNK_SIZE);
+
+	// A target that can't be written to
+	job.backend = backend;
+	job.size = 3 * CHUNK_SIZE;
+	job.num_targets = 2;
+	r = pio_run(&job);
+	CHECK(r == EBADF);
+	CHECK(job.failed_target == 1);
+
+	// Cancellation
+	job.backend = backend;
+	job.num_targets = 1;
+	job.cancel = &cancel;
+	CHECK(pio_run(&job) == ECANCELED);
+
+	close(job.src_fd);
+	close(job.dst_fd[0]);
+	close(job.dst_fd[1]);
+	free(image);
+}
+
+static void test_backend(pio_backend backend)
+{
+	static const uint64_t sizes[] = { 1, SECTOR_SIZE - 1, SECTOR_SIZE, SECTOR_SIZE + 1, CHUNK_SIZE - 1,
+		CHUNK_SIZE, CHUNK_SIZE + 1, (QUEUE_DEPTH + 1) * CHUNK_SIZE + 777, 3 * CHUNK_SIZE };
+	static const uint32_t targets[] = { 1, 3 };
+	size_t i, j;
+
+	if (!test_copy(backend, SECTOR_SIZE, 1, CHUNK_SIZE)) {
+		printf("posix_io: %s backend not available, skipped\n", pio_backend_name(backend));
+		return;
+	}
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (j = 0; j < sizeof(targets) / sizeof(targets[0]); j++)
+			test_copy(backend, sizes[i], targets[j], CHUNK_SIZE);
+	}
+	test_copy(backend, 2 * CHUNK_SIZE + 1, PIO_MAX_TARGETS, CHUNK_SIZE);
+	// Default chunk size and queue depth, with a tail in a partial chunk
+	test_copy(backend, 3 * PIO_DEFAULT_CHUNK_SIZE + 123, 2, 0);
+	test_errors(backend);
+}
+
+int main(void)
+{
+	if (mkdtemp(tmp_dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	test_backend(PIO_BACKEND_THREADS);
+	test_backend(PIO_BACKEND_URING);
+	rmdir(tmp_dir);
+	return test_report("posix_io");
+}